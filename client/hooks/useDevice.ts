@@ -126,7 +126,8 @@ export function useDevice(deviceId: string): UseDeviceResult {
     socket.onmessage = (event: MessageEvent) => {
       try {
         const parsed = JSON.parse(event.data) as WsStateMessage;
-        if (parsed.type === "state") {
+        // "state" is a full snapshot, "patch" carries only changed fields
+        if (parsed.type === "state" || parsed.type === "patch") {
           setLiveState((prev) => {
             const base = prev ?? deviceQuery.data?.state ?? null;
             if (!base) return prev;
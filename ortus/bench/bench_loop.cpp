@@ -0,0 +1,1652 @@
+// Loop-latency benchmark for OrtusSystem on the host.
+//
+// Build and run with `pio run -e native -t exec` (or `pio run -e native` and
+// execute .pio/build/native/program). Pass an iteration count as the first
+// argument to override the default. The program exits non-zero if a
+// zero-allocation path regresses.
+//
+// All numbers are for the simulation: wall-clock figures are host CPU time,
+// "virtual" figures are time the firmware spent on the simulated clock
+// (e.g. a blocking sensor conversion) and reflect device behaviour. Like on
+// the device, the simulated millis() is 32 bits wide, which the timer wrap
+// checks rely on.
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <WebSocketsServer.h>
+#include "ortus.h"
+#include "command_parser.h"
+#include "binary_protocol.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    constexpr uint64_t DEFAULT_ITERATIONS = 2000000;
+    constexpr uint64_t LOOP_STEP_US = 100;
+    constexpr int COMMAND_SAMPLES = 20000;
+    // No loop() pass may block on the simulated clock (e.g. waiting for a
+    // sensor conversion) for longer than this.
+    constexpr uint64_t LOOP_VIRTUAL_BUDGET_US = 1000;
+
+    OrtusSystem ortus;
+
+    // Sample storage is reserved untracked up front and lives until exit so
+    // the bench's own bookkeeping never shows up in the heap figures.
+    std::vector<uint64_t> wallSamples;
+    std::vector<uint64_t> virtualSamples;
+
+    void reserveSamples(uint64_t count)
+    {
+        sim::heapAccounting = false;
+        wallSamples.reserve(count);
+        virtualSamples.reserve(count);
+        sim::heapAccounting = true;
+    }
+
+    uint64_t nanosSince(Clock::time_point start)
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+
+    struct Summary
+    {
+        double mean;
+        uint64_t p50;
+        uint64_t p99;
+        uint64_t max;
+    };
+
+    Summary summarize(std::vector<uint64_t> &samples)
+    {
+        Summary s = {0, 0, 0, 0};
+        if (samples.empty())
+            return s;
+        std::sort(samples.begin(), samples.end());
+        long double total = 0;
+        for (uint64_t v : samples)
+            total += v;
+        s.mean = (double)(total / samples.size());
+        s.p50 = samples[samples.size() / 2];
+        s.p99 = samples[(samples.size() * 99) / 100];
+        s.max = samples.back();
+        return s;
+    }
+
+    void printSummary(const char *label, const char *unit, std::vector<uint64_t> &samples)
+    {
+        Summary s = summarize(samples);
+        printf("  %-28s mean %10.1f  p50 %8llu  p99 %8llu  max %10llu %s\n", label, s.mean,
+               (unsigned long long)s.p50, (unsigned long long)s.p99, (unsigned long long)s.max, unit);
+    }
+
+    bool benchLoop(uint64_t iterations)
+    {
+        std::vector<uint64_t> &wall = wallSamples;
+        std::vector<uint64_t> &virt = virtualSamples;
+        wall.clear();
+        virt.clear();
+
+        sim::HeapStats before = sim::heapStats();
+        uint32_t publishesBefore = sim::mqttPublishes;
+
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            // Wiggle the probe now and then so the sensor paths broadcast.
+            if (i % 50000 == 0)
+                sim::temperatureC[0] = 20.0f + (float)((i / 50000) % 7);
+
+            uint64_t virtualStart = sim::clockMicros;
+            Clock::time_point start = Clock::now();
+            ortus.loop();
+            wall.push_back(nanosSince(start));
+            virt.push_back(sim::clockMicros - virtualStart);
+            sim::advanceMicros(LOOP_STEP_US);
+        }
+
+        sim::HeapStats after = sim::heapStats();
+        printf("loop() x %llu (virtual step %llu us)\n", (unsigned long long)iterations, (unsigned long long)LOOP_STEP_US);
+        printSummary("iteration wall", "ns", wall);
+        printSummary("iteration virtual", "us", virt);
+        printf("  %-28s %.4f allocs/iter, %llu bytes total\n", "heap churn",
+               (double)(after.allocations - before.allocations) / iterations,
+               (unsigned long long)(after.bytes - before.bytes));
+        printf("  %-28s %u\n", "mqtt publishes", sim::mqttPublishes - publishesBefore);
+
+        // printSummary() sorted the samples
+        if (!virt.empty() && virt.back() > LOOP_VIRTUAL_BUDGET_US)
+        {
+            printf("  FAIL: a loop() pass blocked for %llu us\n", (unsigned long long)virt.back());
+            return false;
+        }
+        return true;
+    }
+
+    void benchCommands(const char *label, bool viaMqtt)
+    {
+        std::vector<uint64_t> &wall = wallSamples;
+        wall.clear();
+        char payload[64];
+        uint64_t allocations = 0;
+        uint32_t writesBefore = sim::nvsWrites;
+
+        for (int i = 0; i < COMMAND_SAMPLES; i++)
+        {
+            int brightness = (i % 2) ? 90 : 10;
+            int length = snprintf(payload, sizeof(payload), "{\"type\":\"setBrightness\",\"value\":%d,\"transition\":0}", brightness);
+            uint32_t expectedDuty = ActuatorEngine::pwmDuty(brightness);
+
+            if (viaMqtt)
+                sim::deliverMqtt("ortus/24:58:7C:00:00:01/command", (const uint8_t *)payload, length);
+
+            sim::HeapStats before = sim::heapStats();
+            Clock::time_point start = Clock::now();
+            if (!viaMqtt)
+                sim::deliverWebSocket(0, WStype_TEXT, (const uint8_t *)payload, length);
+            // Commands are queued by the network side and applied by the
+            // control loop, both inside loop() on the host.
+            for (int spins = 0; spins < 100 && sim::ledcDuty[0] != expectedDuty; spins++)
+                ortus.loop();
+            wall.push_back(nanosSince(start));
+            allocations += sim::heapStats().allocations - before.allocations;
+
+            if (sim::ledcDuty[0] != expectedDuty)
+            {
+                printf("  %s: command did not reach the actuator (duty %u, expected %u)\n", label,
+                       sim::ledcDuty[0], expectedDuty);
+                return;
+            }
+            sim::advanceMicros(LOOP_STEP_US);
+        }
+
+        printf("command -> actuator (%s) x %d\n", label, COMMAND_SAMPLES);
+        printSummary("latency wall", "ns", wall);
+        printf("  %-28s %.2f allocs/command\n", "heap churn", (double)allocations / COMMAND_SAMPLES);
+        printf("  %-28s %u\n", "flash writes", sim::nvsWrites - writesBefore);
+    }
+
+    // Every command type must parse without a single heap allocation.
+    bool checkParserAllocations()
+    {
+        static const char *const payloads[] = {
+            "{\"type\":\"setBrightness\",\"value\":42}",
+            "{\"type\":\"setBrightness\",\"value\":42,\"transition\":1500}",
+            "{\"type\":\"triggerIrrigation\",\"value\":30}",
+            "{\"type\":\"triggerIrrigation\"}",
+            "{\"type\":\"irrigationCycle\",\"value\":\"on:120,off:600\"}",
+            "{\"type\":\"lightCycle\",\"value\":\"on:57600,off:28800\"}",
+            "{\"type\":\"otaUpdate\",\"value\":\"https://updates.example.com/ortus/firmware-1.2.3.bin\"}",
+            "{\"type\":\"setLanToken\",\"value\":\"k3Jx-9QmT_v2Lp8R\"}",
+            "{\"type\":\"unknown\",\"value\":1}",
+            "{\"type\":\"setBrightness\"",
+        };
+        constexpr int ROUNDS = 1000;
+
+        static CommandParser parser;
+        bool ok = true;
+        printf("command parser heap check\n");
+        for (const char *payload : payloads)
+        {
+            sim::HeapStats before = sim::heapStats();
+            Clock::time_point start = Clock::now();
+            for (int i = 0; i < ROUNDS; i++)
+            {
+                DeviceCommand cmd;
+                parser.parse((const uint8_t *)payload, strlen(payload), cmd);
+            }
+            uint64_t nanos = nanosSince(start) / ROUNDS;
+            uint64_t allocations = sim::heapStats().allocations - before.allocations;
+            printf("  %-60.60s %6llu ns  %llu allocs\n", payload, (unsigned long long)nanos, (unsigned long long)allocations);
+            ok = ok && allocations == 0;
+        }
+        if (!ok)
+            printf("  FAIL: command parsing allocated on the heap\n");
+        return ok;
+    }
+
+    // Same commands as binary frames (see binary_protocol.h).
+    bool checkBinaryDecode()
+    {
+        struct Frame
+        {
+            const char *name;
+            uint8_t bytes[12];
+            size_t length;
+        };
+        static const Frame frames[] = {
+            {"setBrightness 42", {BINARY_PROTOCOL_VERSION, 0, 42}, 3},
+            {"setBrightness 42, 1.5 s fade", {BINARY_PROTOCOL_VERSION, 0, 42, CommandTrailer::Transition, 0xDC, 0x05}, 6},
+            {"triggerIrrigation 30", {BINARY_PROTOCOL_VERSION, 1, 30, 0, 0, 0}, 6},
+            {"irrigationCycle 120/600", {BINARY_PROTOCOL_VERSION, 2, 120, 0, 0, 0, 0x58, 0x02, 0, 0}, 10},
+            {"setWireFormat binary", {BINARY_PROTOCOL_VERSION, 5, 1}, 3},
+            {"truncated", {BINARY_PROTOCOL_VERSION, 2, 120}, 3},
+        };
+        constexpr int ROUNDS = 1000;
+
+        bool ok = true;
+        printf("binary command decode\n");
+        for (const Frame &frame : frames)
+        {
+            sim::HeapStats before = sim::heapStats();
+            Clock::time_point start = Clock::now();
+            for (int i = 0; i < ROUNDS; i++)
+            {
+                DeviceCommand cmd;
+                decodeBinaryCommand(frame.bytes, frame.length, cmd);
+            }
+            uint64_t nanos = nanosSince(start) / ROUNDS;
+            uint64_t allocations = sim::heapStats().allocations - before.allocations;
+            printf("  %-40s %2u bytes %6llu ns  %llu allocs\n", frame.name, (unsigned)frame.length,
+                   (unsigned long long)nanos, (unsigned long long)allocations);
+            ok = ok && allocations == 0;
+        }
+
+        // The trailer's flags say which fields follow
+        auto decode = [](std::initializer_list<uint8_t> bytes, DeviceCommand &cmd) {
+            cmd = DeviceCommand();
+            return decodeBinaryCommand(bytes.begin(), bytes.size(), cmd);
+        };
+        DeviceCommand cmd;
+        bool trailer = decode({BINARY_PROTOCOL_VERSION, 1, 30, 0, 0, 0, CommandTrailer::Channel, 1}, cmd) && cmd.channel == 1;
+        trailer = trailer && decode({BINARY_PROTOCOL_VERSION, 0, 42}, cmd) && cmd.channel == DEFAULT_CHANNEL;
+        trailer = trailer && !decode({BINARY_PROTOCOL_VERSION, 0, 42, 0x80}, cmd) &&
+                  !decode({BINARY_PROTOCOL_VERSION, 0, 42, CommandTrailer::Channel}, cmd) &&
+                  !decode({BINARY_PROTOCOL_VERSION, 0, 42, 0, 7}, cmd) &&
+                  !decode({BINARY_PROTOCOL_VERSION, 0, 42, CommandTrailer::Channel, DEFAULT_CHANNEL}, cmd);
+        // An id needs no channel before it; with one, it comes after it
+        trailer = trailer && decode({BINARY_PROTOCOL_VERSION, 0, 42, CommandTrailer::Id, 0x39, 0x30, 0, 0}, cmd) &&
+                  strcmp(cmd.id, "12345") == 0 && cmd.channel == DEFAULT_CHANNEL;
+        trailer = trailer &&
+                  decode({BINARY_PROTOCOL_VERSION, 0, 42, CommandTrailer::Channel | CommandTrailer::Id, 1, 7, 0, 0, 0}, cmd) &&
+                  strcmp(cmd.id, "7") == 0 && cmd.channel == 1;
+        printf("  %-40s %s\n", "trailer flags", trailer ? "ok" : "FAIL");
+        if (!ok)
+            printf("  FAIL: binary decoding allocated on the heap\n");
+        return ok && trailer;
+    }
+
+    void sendCommand(const char *json)
+    {
+        sim::deliverWebSocket(0, WStype_TEXT, (const uint8_t *)json, strlen(json));
+    }
+
+    // Runs loop() in fixed virtual steps until `done` holds or `limitMs`
+    // passes. Returns the virtual milliseconds that took.
+    template <typename Done>
+    uint64_t runUntil(Done done, uint64_t stepMs, uint64_t limitMs, OrtusSystem &device = ortus)
+    {
+        uint64_t start = sim::clockMicros;
+        while (!done() && sim::clockMicros - start < limitMs * 1000)
+        {
+            device.loop();
+            sim::advanceMillis(stepMs);
+        }
+        return (sim::clockMicros - start) / 1000;
+    }
+
+    bool expectElapsed(const char *label, uint64_t elapsedMs, uint64_t minMs, uint64_t maxMs)
+    {
+        bool ok = elapsedMs >= minMs && elapsedMs <= maxMs;
+        printf("  %-44s %10llu ms  %s\n", label, (unsigned long long)elapsedMs, ok ? "ok" : "FAIL");
+        return ok;
+    }
+
+    // A slider drag is a burst of brightness commands; it must reach flash
+    // as a single write once the burst is over, and a cycle toggling or a
+    // repeated command must not write at all.
+    bool checkStateCoalescing()
+    {
+        bool ok = true;
+        printf("state persistence\n");
+        runUntil([] { return false; }, 100, 10000); // Settle earlier writes
+
+        uint32_t before = sim::nvsWrites;
+        char payload[64];
+        for (int level = 1; level <= 50; level++)
+        {
+            snprintf(payload, sizeof(payload), "{\"type\":\"setBrightness\",\"value\":%d}", level);
+            sendCommand(payload);
+            runUntil([] { return false; }, 1, 20);
+        }
+        uint32_t duringBurst = sim::nvsWrites - before;
+        runUntil([] { return false; }, 100, STATE_SAVE_DELAY_MS + 1000);
+        uint32_t afterBurst = sim::nvsWrites - before;
+        printf("  %-44s %u during, %u after\n", "50 brightness commands in 1 s", duringBurst, afterBurst);
+        ok = ok && duringBurst == 0 && afterBurst == 1;
+
+        before = sim::nvsWrites;
+        sendCommand("{\"type\":\"setBrightness\",\"value\":50}");
+        sendCommand("{\"type\":\"lightCycle\",\"value\":\"on:1,off:1\"}");
+        runUntil([] { return false; }, 100, STATE_SAVE_DELAY_MS + 1000);
+        uint32_t cycleWrites = sim::nvsWrites - before;
+        runUntil([] { return false; }, 100, 60000);
+        uint32_t toggleWrites = sim::nvsWrites - before - cycleWrites;
+        printf("  %-44s %u writes, then %u over 60 s of toggles\n", "repeat + light cycle", cycleWrites, toggleWrites);
+        ok = ok && cycleWrites == 1 && toggleWrites == 0;
+
+        if (!ok)
+            printf("  FAIL: state writes were not coalesced\n");
+        return ok;
+    }
+
+    // Timers must keep working across the 32-bit millis() wrap (~49.7 days)
+    // and for durations whose millisecond count does not fit in 32 bits.
+    bool checkTimerWrap()
+    {
+        constexpr uint64_t WRAP_MS = 1ULL << 32;
+        auto pumpOn = [] { return sim::pinLevel[PIN_RELAY_IRRIGATION] == HIGH; };
+        auto pumpOff = [] { return sim::pinLevel[PIN_RELAY_IRRIGATION] == LOW; };
+        auto lightOff = [] { return sim::ledcDuty[0] == 0; };
+        auto lightOn = [] { return sim::ledcDuty[0] == ActuatorEngine::pwmDuty(100); };
+        bool ok = true;
+        printf("timer wrap\n");
+
+        // 60 s pump run that straddles the wrap
+        sim::clockMicros = (WRAP_MS - 20000) * 1000;
+        sendCommand("{\"type\":\"triggerIrrigation\",\"value\":60}");
+        runUntil(pumpOn, 1, 100);
+        ok = expectElapsed("60 s irrigation across the wrap", runUntil(pumpOff, 100, 120000), 59900, 60100) && ok;
+
+        // Light cycle toggling on both sides of the wrap
+        sim::clockMicros = (2 * WRAP_MS - 45000) * 1000;
+        sendCommand("{\"type\":\"lightCycle\",\"value\":\"on:30,off:30\"}");
+        runUntil(lightOn, 1, 100);
+        ok = expectElapsed("light cycle on phase (30 s)", runUntil(lightOff, 100, 120000), 29900, 30100) && ok;
+        ok = expectElapsed("light cycle off phase across the wrap", runUntil(lightOn, 100, 120000), 29900, 30100) && ok;
+
+        // 5,000,000 s is more milliseconds than 32 bits can hold
+        sendCommand("{\"type\":\"triggerIrrigation\",\"value\":5000000}");
+        runUntil(pumpOn, 1, 100);
+        ok = expectElapsed("5,000,000 s irrigation", runUntil(pumpOff, 60000, 6000000000ULL), 5000000000ULL, 5000120000ULL) && ok;
+
+        if (!ok)
+            printf("  FAIL: a timer misfired around the millis() wrap\n");
+        return ok;
+    }
+
+    uint32_t readVarint(const uint8_t *&p)
+    {
+        uint32_t v = 0;
+        for (int shift = 0;; shift += 7)
+        {
+            uint8_t b = *p++;
+            v |= (uint32_t)(b & 0x7F) << shift;
+            if (!(b & 0x80))
+                return v;
+        }
+    }
+
+    uint32_t readU32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+    // Decodes history batches (see sensor_history.h) and checks that the
+    // samples are evenly spaced and the temperatures survived the encoding.
+    struct HistoryCheck
+    {
+        uint32_t from = 0;
+        uint32_t samples = 0;
+        uint32_t gaps = 0;
+        uint32_t badValues = 0;
+        uint32_t lastSeconds = 0;
+        uint32_t nextSeq = 0;
+
+        void batch(const std::vector<uint8_t> &payload, uint32_t intervalSeconds)
+        {
+            const uint8_t *p = payload.data();
+            uint32_t firstSeq = readU32(p + 5);
+            uint8_t count = p[9];
+            if (p[0] != HISTORY_FORMAT_VERSION || (nextSeq && firstSeq != nextSeq))
+                gaps++;
+            nextSeq = firstSeq + count;
+            p += HISTORY_BATCH_HEADER_SIZE;
+            for (uint8_t b = 0; b < count; b++)
+            {
+                const uint8_t *end = p + 1 + p[0];
+                p++;
+                uint32_t seconds = readU32(p);
+                uint8_t probes = p[4];
+                int32_t temperature = (int16_t)(p[5] | (p[6] << 8));
+                p += 5 + 2 * probes + 1;
+                sample(seconds, temperature, intervalSeconds);
+                while (p < end)
+                {
+                    seconds += readVarint(p) >> 1;
+                    uint32_t z = readVarint(p);
+                    temperature += (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+                    sample(seconds, temperature, intervalSeconds);
+                }
+            }
+        }
+
+        void sample(uint32_t seconds, int32_t temperature, uint32_t intervalSeconds)
+        {
+            if (seconds < from)
+                return; // Taken before the outage
+            if (samples && seconds - lastSeconds != intervalSeconds)
+                gaps++;
+            if (temperature < 2000 || temperature > 2700) // The bench varies 20-27 C
+                badValues++;
+            lastSeconds = seconds;
+            samples++;
+        }
+    };
+
+    // Readings taken while the broker is unreachable must arrive, gap-free
+    // and in a handful of messages, once it is back.
+    bool checkSensorHistory()
+    {
+        constexpr uint32_t OUTAGE_SECONDS = 6 * 3600;
+        bool ok = true;
+        printf("sensor history\n");
+
+        sim::capturePublishes = true;
+        sim::published.clear();
+        sim::brokerAvailable = false;
+        HistoryCheck check;
+        check.from = (uint32_t)(sim::clockMicros / 1000000);
+        for (uint32_t s = 0; s < OUTAGE_SECONDS; s += 5)
+        {
+            sim::temperatureC[0] = 20.0f + (float)((s / 600) % 7) + 0.01f * (float)(s % 50);
+            runUntil([] { return false; }, 100, 5000);
+        }
+        sim::brokerAvailable = true;
+        runUntil([] { return false; }, 100, MQTT_BACKOFF_MAX_MS + 30000); // Retries are backed off by now
+        sim::capturePublishes = false;
+
+        uint32_t messages = 0;
+        size_t bytes = 0;
+        for (const sim::Publish &publish : sim::published)
+        {
+            if (publish.topic.size() < 8 || publish.topic.compare(publish.topic.size() - 8, 8, "/history") != 0)
+                continue;
+            check.batch(publish.payload, HISTORY_SAMPLE_MS / 1000);
+            messages++;
+            bytes += publish.payload.size();
+        }
+        sim::published.clear();
+
+        printf("  %-44s %u samples in %u messages, %zu bytes\n", "6 h broker outage", check.samples, messages, bytes);
+        ok = check.samples >= OUTAGE_SECONDS / (HISTORY_SAMPLE_MS / 1000) - (HISTORY_BLOCK_MAX_AGE_MS / HISTORY_SAMPLE_MS) &&
+             check.gaps == 0 && check.badValues == 0 && messages <= 20;
+        if (!ok)
+            printf("  FAIL: history incomplete (%u gaps, %u bad values)\n", check.gaps, check.badValues);
+        return ok;
+    }
+
+    bool endsWith(const std::string &topic, const char *suffix)
+    {
+        size_t length = strlen(suffix);
+        return topic.size() >= length && topic.compare(topic.size() - length, length, suffix) == 0;
+    }
+
+    // While the broker is away, state changes and presence must collapse to
+    // one message each and go out in order once it is back. Commands held
+    // by the broker session then run, each id acked once with the applied
+    // state, and a redelivered id is not run twice.
+    bool checkOfflineOutbox()
+    {
+        constexpr const char *COMMAND_TOPIC = "ortus/24:58:7C:00:00:01/command";
+        auto never = [] { return false; };
+        bool ok = true;
+        printf("offline outbox\n");
+
+        sim::capturePublishes = true;
+        sim::published.clear();
+        sim::brokerAvailable = false;
+        runUntil(never, 100, 1000);
+        char payload[96];
+        for (int level = 1; level <= 20; level++)
+        {
+            snprintf(payload, sizeof(payload), "{\"type\":\"setBrightness\",\"value\":%d}", level);
+            sendCommand(payload);
+            runUntil(never, 100, 1000);
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            int length = snprintf(payload, sizeof(payload), "{\"type\":\"setBrightness\",\"value\":%d,\"id\":\"cmd-%d\"}", 60 + i, i);
+            sim::deliverMqtt(COMMAND_TOPIC, (const uint8_t *)payload, length);
+        }
+        sim::deliverMqtt(COMMAND_TOPIC, (const uint8_t *)payload, strlen(payload)); // QoS 1 redelivery
+        size_t whileDown = sim::published.size();
+
+        sim::brokerAvailable = true;
+        runUntil([] { return sim::ledcDuty[0] == ActuatorEngine::pwmDuty(62); }, 100, MQTT_BACKOFF_MAX_MS);
+        runUntil(never, 100, 500);
+        sim::capturePublishes = false;
+
+        uint32_t states = 0, presences = 0, applied = 0, duplicates = 0;
+        bool onlineFirst = !sim::published.empty() && endsWith(sim::published[0].topic, "/status");
+        int snapshotBrightness = -1;
+        JsonDocument doc;
+        for (const sim::Publish &publish : sim::published)
+        {
+            bool acked = applied + duplicates > 0;
+            if (endsWith(publish.topic, "/state") && !acked)
+            {
+                states++;
+                deserializeJson(doc, publish.payload.data(), publish.payload.size());
+                snapshotBrightness = doc["brightness"] | -1;
+            }
+            else if (endsWith(publish.topic, "/presence") && !acked)
+            {
+                presences++;
+            }
+            else if (endsWith(publish.topic, "/ack"))
+            {
+                deserializeJson(doc, publish.payload.data(), publish.payload.size());
+                const char *status = doc["status"] | "";
+                char expectedId[16];
+                snprintf(expectedId, sizeof(expectedId), "cmd-%u", applied);
+                if (strcmp(status, "duplicate") == 0 && strcmp(doc["id"] | "", "cmd-2") == 0)
+                    duplicates++;
+                else if (strcmp(status, "applied") == 0 && strcmp(doc["id"] | "", expectedId) == 0 &&
+                         (doc["state"]["level"] | -1) == 60 + (int)applied)
+                    applied++;
+                else
+                    ok = false;
+            }
+        }
+        sim::published.clear();
+        printf("  %-44s %zu sent offline; %u snapshot (brightness %d), %u presence\n", "20 changes during an outage",
+               whileDown, states, snapshotBrightness, presences);
+        printf("  %-44s %u applied, %u duplicate\n", "3 queued commands + 1 redelivery", applied, duplicates);
+        ok = ok && whileDown == 0 && onlineFirst && states == 1 && snapshotBrightness == 20 && presences == 1 &&
+             applied == 3 && duplicates == 1;
+
+        // Acks go back to the WebSocket client that sent the command, still
+        // without touching the heap
+        sim::HeapStats before = sim::heapStats();
+        uint64_t bytesBefore = sim::wsBytes;
+        sendCommand("{\"type\":\"setBrightness\",\"value\":33,\"id\":\"ws-1\"}");
+        runUntil([] { return sim::ledcDuty[0] == ActuatorEngine::pwmDuty(33); }, 1, 100);
+        runUntil(never, 1, 5);
+        uint64_t allocations = sim::heapStats().allocations - before.allocations;
+        printf("  %-44s %llu allocs, %llu bytes to clients\n", "websocket command with id",
+               (unsigned long long)allocations, (unsigned long long)(sim::wsBytes - bytesBefore));
+        ok = ok && allocations == 0;
+
+        if (!ok)
+            printf("  FAIL: offline publishes or command acks went wrong\n");
+        return ok;
+    }
+
+    // A burst of changes must reach every WebSocket client rate-limited and
+    // merged rather than frame by frame, and a client whose sends block
+    // must be dropped before it can stall the loop for long.
+    bool checkWebSocketFanout()
+    {
+        constexpr uint8_t JSON_CLIENT = 1, BINARY_CLIENT = 2, SLOW_CLIENT = 3;
+        auto never = [] { return false; };
+        bool ok = true;
+        printf("websocket fan-out\n");
+
+        sim::deliverWebSocket(JSON_CLIENT, WStype_CONNECTED, (const uint8_t *)"/", 1);
+        sim::deliverWebSocket(BINARY_CLIENT, WStype_CONNECTED, (const uint8_t *)"/bin", 4);
+        sim::deliverWebSocket(SLOW_CLIENT, WStype_CONNECTED, (const uint8_t *)"/", 1);
+        sim::wsSendMicros[SLOW_CLIENT] = millisToMicros(WS_SLOW_SEND_MS) * 2;
+        runUntil(never, 100, 1000);
+
+        uint32_t jsonBefore = sim::wsFrames[JSON_CLIENT];
+        uint32_t binaryBefore = sim::wsFrames[BINARY_CLIENT];
+        uint32_t slowBefore = sim::wsFrames[SLOW_CLIENT];
+        uint64_t longestPass = 0;
+        uint64_t start = sim::clockMicros;
+        char payload[64];
+        for (int i = 0; i < 100; i++)
+        {
+            snprintf(payload, sizeof(payload), "{\"type\":\"setBrightness\",\"value\":%d}", i % 2 ? 10 : 90);
+            sendCommand(payload);
+            for (int ms = 0; ms < 20; ms++)
+            {
+                uint64_t passStart = sim::clockMicros;
+                ortus.loop();
+                longestPass = std::max<uint64_t>(longestPass, sim::clockMicros - passStart);
+                sim::advanceMillis(1);
+            }
+        }
+        uint32_t jsonFrames = sim::wsFrames[JSON_CLIENT] - jsonBefore;
+        uint32_t binaryFrames = sim::wsFrames[BINARY_CLIENT] - binaryBefore;
+        uint32_t slowFrames = sim::wsFrames[SLOW_CLIENT] - slowBefore;
+        bool slowDropped = !sim::wsConnected(SLOW_CLIENT);
+        sim::wsSendMicros[SLOW_CLIENT] = 0;
+
+        // 2 s of changes at 50 per second, plus the time the slow client blocked
+        uint32_t maxFrames = (sim::clockMicros - start) / millisToMicros(WS_SEND_INTERVAL_MS) + 1;
+        printf("  %-44s json %u, binary %u frames (max %u)\n", "100 changes in 2 s", jsonFrames, binaryFrames, maxFrames);
+        printf("  %-44s %s after %u frames, longest pass %llu ms\n", "client blocking 200 ms per send",
+               slowDropped ? "dropped" : "STILL CONNECTED", slowFrames, (unsigned long long)(longestPass / 1000));
+        ok = jsonFrames >= maxFrames / 2 && jsonFrames <= maxFrames && binaryFrames == jsonFrames && slowDropped &&
+             slowFrames <= WS_MAX_SLOW_SENDS;
+
+        sim::deliverWebSocket(JSON_CLIENT, WStype_DISCONNECTED, nullptr, 0);
+        sim::deliverWebSocket(BINARY_CLIENT, WStype_DISCONNECTED, nullptr, 0);
+        if (!ok)
+            printf("  FAIL: websocket clients were not rate-limited or the slow one was kept\n");
+        return ok;
+    }
+
+    // Reads one unsigned number following `key` in a JSON text, or -1.
+    long long jsonNumber(const std::string &json, const char *key)
+    {
+        size_t at = json.find(key);
+        return at == std::string::npos ? -1 : strtoll(json.c_str() + at + strlen(key), nullptr, 10);
+    }
+
+    // getMetrics answers the WebSocket client that asked, and the periodic
+    // report reaches the metrics topic, both with every histogram filled
+    // and within the buffer.
+    bool checkMetrics()
+    {
+        constexpr uint8_t CLIENT = 1;
+        auto never = [] { return false; };
+        printf("metrics\n");
+
+        sim::capturePublishes = true;
+        sim::captureWsFrames = true;
+        sim::published.clear();
+        sim::wsSent.clear();
+        sim::deliverWebSocket(CLIENT, WStype_CONNECTED, (const uint8_t *)"/", 1);
+        for (int i = 0; i < 10; i++)
+        {
+            sendCommand(i % 2 ? "{\"type\":\"setBrightness\",\"value\":30}" : "{\"type\":\"setBrightness\",\"value\":70}");
+            runUntil(never, 1, 50);
+        }
+        const char *request = "{\"type\":\"getMetrics\",\"id\":\"m1\"}";
+        sim::deliverWebSocket(CLIENT, WStype_TEXT, (const uint8_t *)request, strlen(request));
+        runUntil(never, 10, 100);
+
+        std::string reply;
+        bool acked = false;
+        for (const sim::WsFrame &frame : sim::wsSent)
+        {
+            std::string text(frame.payload.begin(), frame.payload.end());
+            if (frame.num == CLIENT && text.find("\"type\":\"metrics\"") != std::string::npos)
+                reply = text;
+            if (frame.num == CLIENT && text.find("\"id\":\"m1\"") != std::string::npos)
+                acked = text.find("\"applied\"") != std::string::npos;
+        }
+
+        runUntil(never, 1000, METRICS_INTERVAL_MS + 1000);
+        std::string periodic;
+        for (const sim::Publish &publish : sim::published)
+        {
+            if (endsWith(publish.topic, "/metrics"))
+                periodic.assign(publish.payload.begin(), publish.payload.end());
+        }
+        sim::capturePublishes = false;
+        sim::captureWsFrames = false;
+        sim::published.clear();
+        sim::wsSent.clear();
+        sim::deliverWebSocket(CLIENT, WStype_DISCONNECTED, nullptr, 0);
+
+        const char *histograms[] = {"\"control\":{\"n\":", "\"network\":{\"n\":", "\"ws\":{\"n\":",
+                                    "\"mqtt\":{\"n\":", "\"sensors\":{\"n\":", "\"broadcast\":{\"n\":",
+                                    "\"command\":{\"n\":"};
+        bool filled = !reply.empty();
+        for (const char *key : histograms)
+            filled = filled && jsonNumber(reply, key) > 0;
+        const long long commands = jsonNumber(reply, "\"command\":{\"n\":");
+        const long long freeHeap = jsonNumber(reply, "\"free\":");
+        const long long largest = jsonNumber(reply, "\"largest\":");
+
+        printf("  %-44s %zu bytes, %lld commands timed, acked %s\n", "getMetrics over websocket", reply.size(), commands,
+               acked ? "yes" : "no");
+        printf("  %-44s %zu bytes\n", "periodic report", periodic.size());
+        bool ok = filled && acked && commands >= 10 && freeHeap > 0 && largest > 0 && !periodic.empty() &&
+                  periodic.size() < METRICS_BUFFER_SIZE;
+        if (!ok)
+            printf("  FAIL: metrics report missing or incomplete: %s\n", reply.c_str());
+        return ok;
+    }
+
+    // BLE holds its heap only while provisioning may be needed: it comes back
+    // after a long WiFi outage or a long button press and goes again once
+    // WiFi is up. Centrals coming and going never block a pass.
+    bool checkBleProvisioning()
+    {
+        auto never = [] { return false; };
+        bool ok = true;
+        printf("ble provisioning\n");
+
+        // WiFi has been up since boot
+        const bool releasedAtStart = !sim::bleActive;
+        const uint32_t heapReleased = ESP.getFreeHeap();
+
+        sim::wifiAvailable = false;
+        runUntil(never, 1000, BLE_OUTAGE_ENABLE_MS - 10000);
+        const bool earlyStart = sim::bleActive;
+        runUntil([] { return sim::bleActive; }, 1000, 20000);
+        const bool outageStart = sim::bleActive;
+        const uint32_t heapActive = ESP.getFreeHeap();
+
+        sim::bleConnection(true);
+        runUntil(never, 10, 100);
+        const uint32_t advertised = sim::bleAdvertisingStarts;
+        sim::bleConnection(false);
+        uint64_t passStart = sim::clockMicros;
+        ortus.loop();
+        const uint64_t disconnectPass = sim::clockMicros - passStart;
+        runUntil([&] { return sim::bleAdvertisingStarts > advertised; }, 10, 2000);
+        const bool readvertised = sim::bleAdvertisingStarts > advertised;
+
+        // The same credentials again, so the rest of the bench is unaffected
+        const uint32_t writes = sim::nvsWrites;
+        sim::bleConnection(true);
+        sim::bleWrite(BLE_CHAR_SSID_UUID, DEFAULT_WIFI_SSID);
+        sim::bleWrite(BLE_CHAR_PASSWORD_UUID, DEFAULT_WIFI_PASSWORD);
+        runUntil(never, 10, 100);
+        const bool saved = sim::nvsWrites > writes;
+
+        sim::wifiAvailable = true;
+        runUntil(never, 1000, WIFI_BACKOFF_MAX_MS + BLE_RELEASE_DELAY_MS + 10000);
+        const bool heldForCentral = sim::bleActive;
+        sim::bleConnection(false);
+        runUntil(never, 1000, 2000);
+        const bool releasedAfter = !sim::bleActive;
+        const uint32_t heapAfter = ESP.getFreeHeap();
+
+        printf("  %-44s %s\n", "after boot with WiFi up", releasedAtStart ? "released" : "STILL ON");
+        printf("  %-44s %s (not before: %s)\n", "WiFi outage", outageStart ? "started" : "NOT STARTED",
+               earlyStart ? "FAIL" : "ok");
+        printf("  %-44s %llu us pass, %s\n", "central disconnects", (unsigned long long)disconnectPass,
+               readvertised ? "advertising again" : "NOT ADVERTISING");
+        printf("  %-44s %s, %s\n", "credentials written", saved ? "saved" : "NOT SAVED",
+               releasedAfter ? "released after" : "STILL ON after");
+        printf("  %-44s %u bytes\n", "heap returned", heapAfter - heapActive);
+        ok = releasedAtStart && !earlyStart && outageStart && disconnectPass < LOOP_VIRTUAL_BUDGET_US && readvertised &&
+             saved && heldForCentral && releasedAfter && heapAfter >= heapActive + sim::bleStackBytes &&
+             heapAfter + 1024 >= heapReleased;
+
+        // Button: a short press does nothing, a long one starts BLE for a while
+        sim::setInput(PIN_BUTTON_PROVISION, LOW);
+        runUntil(never, 100, BLE_BUTTON_HOLD_MS / 2);
+        sim::setInput(PIN_BUTTON_PROVISION, HIGH);
+        runUntil(never, 100, 1000);
+        const bool shortPress = sim::bleActive;
+        sim::setInput(PIN_BUTTON_PROVISION, LOW);
+        runUntil(never, 100, BLE_BUTTON_HOLD_MS + 500);
+        sim::setInput(PIN_BUTTON_PROVISION, HIGH);
+        runUntil(never, 1000, BLE_RELEASE_DELAY_MS * 2);
+        const bool longPress = sim::bleActive;
+        runUntil(never, 1000, BLE_ON_DEMAND_MS);
+        const bool expired = !sim::bleActive;
+
+        printf("  %-44s short %s, long %s, %s after the window\n", "button", shortPress ? "STARTED" : "ignored",
+               longPress ? "started" : "NOT STARTED", expired ? "released" : "STILL ON");
+        ok = ok && !shortPress && longPress && expired;
+        if (!ok)
+            printf("  FAIL: BLE was not started and released as expected\n");
+        return ok;
+    }
+
+    // Local rules act on readings without the network: the pump stops as
+    // soon as the tank reads empty, lights dim while it is hot (with
+    // hysteresis, and the state says so), and a time window ramps the light
+    // in and out on local time, daylight saving included.
+    bool checkRules()
+    {
+        auto never = [] { return false; };
+        auto pumpOn = [] { return sim::pinLevel[PIN_RELAY_IRRIGATION] == HIGH; };
+        auto pumpOff = [] { return sim::pinLevel[PIN_RELAY_IRRIGATION] == LOW; };
+        auto lightFull = [] { return sim::ledcDuty[0] == ActuatorEngine::pwmDuty(100); };
+        auto lightHalf = [] { return sim::ledcDuty[0] == ActuatorEngine::pwmDuty(50); };
+        bool ok = true;
+        printf("local rules\n");
+
+        sim::captureWsFrames = true;
+        sim::wsSent.clear();
+        auto sent = [](const char *a, const char *b) {
+            for (const sim::WsFrame &frame : sim::wsSent)
+            {
+                std::string text(frame.payload.begin(), frame.payload.end());
+                if (text.find(a) != std::string::npos && text.find(b) != std::string::npos)
+                    return true;
+            }
+            return false;
+        };
+        sendCommand("{\"type\":\"setRules\",\"id\":\"r-bad\",\"value\":[{\"when\":\"waterEmpty\",\"channel\":7}]}");
+        sendCommand("{\"type\":\"setRules\",\"id\":\"r-big\",\"value\":[{\"when\":\"waterEmpty\",\"channel\":300}]}");
+        sendCommand("{\"type\":\"setBrightness\",\"id\":\"c-big\",\"channel\":300,\"value\":10}");
+        sendCommand("{\"type\":\"setBrightness\",\"id\":\"c-neg\",\"channel\":-1,\"value\":10}");
+        sendCommand("{\"type\":\"setRules\",\"id\":\"r1\",\"value\":["
+                    "{\"when\":\"waterEmpty\"},"
+                    "{\"when\":\"temperatureAbove\",\"value\":30,\"hysteresis\":1,\"level\":50}]}");
+        runUntil(never, 10, 100);
+        const bool rejected = sent("\"r-bad\"", "rejected") && sent("\"r-big\"", "rejected");
+        const bool channelsRejected = sent("\"c-big\"", "rejected") && sent("\"c-neg\"", "rejected");
+        const bool applied = sent("\"r1\"", "applied");
+        sim::wsSent.clear();
+        Preferences stored;
+        stored.begin("ortus", true);
+        const bool persisted = stored.getBytesLength("rules") > 0;
+        stored.end();
+        printf("  %-44s %s, bad channel %s, %s\n", "setRules", applied ? "applied" : "NOT APPLIED",
+               rejected ? "rejected" : "ACCEPTED", persisted ? "stored" : "NOT STORED");
+        printf("  %-44s %s\n", "commands on channels 300 and -1", channelsRejected ? "rejected" : "ACCEPTED");
+        ok = applied && rejected && channelsRejected && persisted;
+
+        // Interlock: the tank runs dry mid-irrigation, then is refilled
+        sendCommand("{\"type\":\"triggerIrrigation\",\"value\":60}");
+        runUntil(pumpOn, 1, 100);
+        sim::setInput(PIN_SENSOR_WATER, LOW);
+        const uint64_t stopMs = runUntil(pumpOff, 1, 2000);
+        const bool heldOff = runUntil(pumpOn, 100, 10000) >= 10000;
+        sim::setInput(PIN_SENSOR_WATER, HIGH);
+        const uint64_t resumeMs = runUntil(pumpOn, 1, 2000);
+        runUntil(pumpOff, 100, 60000);
+        printf("  %-44s off after %llu ms, on again %llu ms after refill\n", "tank empty while irrigating",
+               (unsigned long long)stopMs, (unsigned long long)resumeMs);
+        ok = ok && stopMs <= WATER_DEBOUNCE_MS + 10 && heldOff && resumeMs <= WATER_DEBOUNCE_MS + 10;
+
+        // Dimming above 30 C, released only below 29 C
+        sendCommand("{\"type\":\"lightCycle\",\"value\":\"on:86400,off:1\"}");
+        runUntil(lightFull, 1, 100);
+        sim::wsSent.clear();
+        sim::temperatureC[0] = 31.0f;
+        const uint64_t dimMs = runUntil(lightHalf, 100, 2 * TEMP_POLL_MS);
+        sim::temperatureC[0] = 29.5f;
+        const bool held = runUntil(lightFull, 100, 2 * TEMP_POLL_MS) >= 2 * TEMP_POLL_MS;
+        const bool cappedShown = sent("\"lightCapped\":true", "\"brightness\":100");
+        sim::wsSent.clear();
+        sim::temperatureC[0] = 28.5f;
+        const uint64_t releaseMs = runUntil(lightFull, 100, 2 * TEMP_POLL_MS);
+        runUntil(never, 10, 100);
+        const bool releaseShown = sent("\"lightCapped\":false", "\"brightness\":100");
+        sim::captureWsFrames = false;
+        sim::wsSent.clear();
+        printf("  %-44s dimmed after %llu ms, held at 29.5 C: %s, full again after %llu ms\n", "31 C",
+               (unsigned long long)dimMs, held ? "yes" : "NO", (unsigned long long)releaseMs);
+        printf("  %-44s %s while dimmed, %s after\n", "capped in state", cappedShown ? "set" : "NOT SET",
+               releaseShown ? "cleared" : "NOT CLEARED");
+        ok = ok && lightHalf() == false && dimMs < 2 * TEMP_POLL_MS && held && releaseMs < 2 * TEMP_POLL_MS &&
+             cappedShown && releaseShown;
+
+        // 22:00-23:00 UTC with 30 minute ramps; the clock reads 22:13:20
+        sim::syncTime(1700000000);
+        sendCommand("{\"type\":\"setRules\",\"utcOffset\":0,\"value\":["
+                    "{\"when\":\"timeWindow\",\"from\":\"22:00\",\"to\":\"23:00\",\"ramp\":30,\"level\":100}]}");
+        runUntil(never, 10, PWM_DEFAULT_TRANSITION_MS + 100); // Past the fade back to full
+        const uint32_t rampDuty = sim::ledcDuty[0];
+        runUntil(never, 1000, 25 * 60 * 1000); // 22:38, 22 minutes from the end
+        const uint32_t midDuty = sim::ledcDuty[0];
+        runUntil(never, 1000, 23 * 60 * 1000); // 23:01
+        const uint32_t afterDuty = sim::ledcDuty[0];
+        sendCommand("{\"type\":\"setRules\",\"value\":[]}");
+        runUntil(never, 10, 100);
+        const uint32_t clearedDuty = sim::ledcDuty[0];
+        printf("  %-44s duty %u at 22:13, %u at 22:38, %u at 23:01, %u without rules\n", "time window with ramps",
+               rampDuty, midDuty, afterDuty, clearedDuty);
+        ok = ok && rampDuty >= ActuatorEngine::pwmDuty(43) && rampDuty <= ActuatorEngine::pwmDuty(45) &&
+             midDuty >= ActuatorEngine::pwmDuty(70) && midDuty <= ActuatorEngine::pwmDuty(75) && afterDuty == 0 &&
+             clearedDuty == ActuatorEngine::pwmDuty(100);
+
+        // Daylight saving: the clocks change at 01:00 UTC on the last
+        // Sunday of March and of October in Central Europe, and at 16:00 UTC
+        // the day before the first Sunday of October and of April in Sydney
+        TimeZone cet, sydney, bad;
+        const bool zonesParsed = parseTimeZone("CET-1CEST,M3.5.0,M10.5.0/3", cet) &&
+                                 parseTimeZone("AEST-10AEDT,M10.1.0,M4.1.0/3", sydney) &&
+                                 !parseTimeZone("CET-1CEST", bad) && !parseTimeZone("CET-1CEST,J60,J300", bad) &&
+                                 !parseTimeZone("C-1", bad) && !parseTimeZone("CET-1CEST,M13.5.0,M10.5.0", bad);
+        const bool transitions = zonesParsed && localOffset(cet, 1711846799) == 3600 &&
+                                 localOffset(cet, 1711846800) == 7200 && localOffset(cet, 1729990799) == 7200 &&
+                                 localOffset(cet, 1729990800) == 3600 && localOffset(sydney, 1728143999) == 36000 &&
+                                 localOffset(sydney, 1728144000) == 39600 && localOffset(sydney, 1712419199) == 39600 &&
+                                 localOffset(sydney, 1712419200) == 36000;
+        // 02:00-03:00 in Berlin at 00:30 UTC on 1 July, 02:30 summer time
+        sim::syncTime(1719793800);
+        sendCommand("{\"type\":\"setRules\",\"timezone\":\"CET-1CEST,M3.5.0,M10.5.0/3\",\"value\":["
+                    "{\"when\":\"timeWindow\",\"from\":\"02:00\",\"to\":\"03:00\",\"level\":50}]}");
+        runUntil(never, 10, PWM_DEFAULT_TRANSITION_MS + 100);
+        const bool summerWindow = lightHalf();
+        sendCommand("{\"type\":\"setRules\",\"value\":[]}");
+        runUntil(lightFull, 10, PWM_DEFAULT_TRANSITION_MS + 100);
+        printf("  %-44s transitions %s, window %s\n", "daylight saving", transitions ? "ok" : "WRONG",
+               summerWindow ? "on summer time" : "NOT ON SUMMER TIME");
+        ok = ok && transitions && summerWindow;
+
+        if (!ok)
+            printf("  FAIL: local rules did not act as expected\n");
+        return ok;
+    }
+
+    // Light changes fade in hardware, in steps short enough that a change
+    // arriving mid-fade takes over at once, without blocking the control
+    // task on the LEDC driver: no duty call may ever land on a running
+    // fade. A transition holds until a command sets another.
+    bool checkFades()
+    {
+        auto never = [] { return false; };
+        bool ok = true;
+        printf("light fades\n");
+
+        sendCommand("{\"type\":\"setBrightness\",\"value\":0,\"transition\":0}");
+        runUntil([] { return sim::ledcDuty[0] == 0; }, 1, PWM_DEFAULT_TRANSITION_MS + 100);
+        runUntil(never, 10, PWM_DEFAULT_TRANSITION_MS);
+
+        // 80% over 2 s, retargeted to 20% halfway with no transition given
+        sendCommand("{\"type\":\"setBrightness\",\"value\":80,\"transition\":2000}");
+        runUntil(never, 1, 1000);
+        const uint32_t halfway = sim::ledcDuty[0];
+        sendCommand("{\"type\":\"setBrightness\",\"value\":20}");
+        const uint64_t turnMs = runUntil([halfway] { return sim::ledcDuty[0] < halfway; }, 1, 1000);
+        const uint64_t reachMs = turnMs + runUntil([] { return sim::ledcDuty[0] == ActuatorEngine::pwmDuty(20); }, 1, 5000);
+        printf("  %-44s duty %u of %u at 1 s, turned after %llu ms, 20%% after %llu ms\n", "80% over 2 s, then 20%",
+               halfway, ActuatorEngine::pwmDuty(80), (unsigned long long)turnMs, (unsigned long long)reachMs);
+        ok = halfway >= ActuatorEngine::pwmDuty(80) * 45 / 100 && halfway <= ActuatorEngine::pwmDuty(80) * 55 / 100 &&
+             turnMs <= PWM_FADE_STEP_MS + 2 && reachMs >= 2000 - PWM_FADE_STEP_MS && reachMs <= 2000 + PWM_FADE_STEP_MS + 10 &&
+             sim::ledcFadeMs[0] <= PWM_FADE_STEP_MS;
+
+        // Off in the middle of a minute-long fade
+        sendCommand("{\"type\":\"setBrightness\",\"value\":100,\"transition\":60000}");
+        runUntil(never, 10, 5000);
+        const bool rising = sim::ledcDuty[0] > 0 && sim::ledcDuty[0] < ActuatorEngine::pwmDuty(100);
+        sendCommand("{\"type\":\"setBrightness\",\"value\":0,\"transition\":0}");
+        const uint64_t offMs = runUntil([] { return sim::ledcDuty[0] == 0; }, 1, 1000);
+        printf("  %-44s off after %llu ms\n", "off during a 60 s fade", (unsigned long long)offMs);
+        ok = ok && rising && offMs <= PWM_FADE_STEP_MS + 2;
+
+        // Cycle toggles fade over the cycle command's transition
+        sendCommand("{\"type\":\"lightCycle\",\"value\":\"on:10,off:10\",\"transition\":3000}");
+        const uint64_t cycleMs = runUntil([] { return sim::ledcDuty[0] == ActuatorEngine::pwmDuty(100); }, 1, 5000);
+        runUntil(never, 100, 25000 - cycleMs);
+        sendCommand("{\"type\":\"setBrightness\",\"value\":100}");
+        runUntil(never, 100, 5000);
+        printf("  %-44s %llu ms fade up, %u duty calls during a fade\n", "light cycle", (unsigned long long)cycleMs,
+               sim::ledcBlockingCalls);
+        ok = ok && cycleMs >= 3000 - PWM_FADE_STEP_MS && cycleMs <= 3000 + PWM_FADE_STEP_MS + 10 &&
+             sim::ledcDuty[0] == ActuatorEngine::pwmDuty(100) && sim::ledcBlockingCalls == 0;
+
+        if (!ok)
+            printf("  FAIL: light fades did not run as expected\n");
+        return ok;
+    }
+
+    // A batch is applied whole with one save and one state broadcast, or not
+    // at all.
+    bool checkBatches()
+    {
+        auto never = [] { return false; };
+        auto acks = [](const char *status) {
+            const std::string needle = std::string("\"status\":\"") + status + "\"";
+            unsigned count = 0;
+            for (const sim::WsFrame &frame : sim::wsSent)
+            {
+                std::string text(frame.payload.begin(), frame.payload.end());
+                if (text.find("\"type\":\"ack\"") != std::string::npos && text.find(needle) != std::string::npos)
+                    count++;
+            }
+            return count;
+        };
+        static const char *const SETUP =
+            "[{\"type\":\"setBrightness\",\"value\":40,\"id\":\"b1\"},"
+            "{\"type\":\"lightCycle\",\"value\":\"on:57600,off:28800\",\"id\":\"b2\"},"
+            "{\"type\":\"triggerIrrigation\",\"value\":30,\"id\":\"b3\"}]";
+        bool ok = true;
+        printf("command batches\n");
+
+        runUntil(never, 10, STATE_SAVE_DELAY_MS + 1000);
+        sim::captureWsFrames = true;
+        sim::capturePublishes = true;
+        sim::wsSent.clear();
+        sim::published.clear();
+        const uint32_t writesBefore = sim::nvsWrites;
+        sendCommand(SETUP);
+        runUntil(never, 10, STATE_SAVE_DELAY_MS + 1000);
+        unsigned states = 0, mqttStates = 0;
+        for (const sim::WsFrame &frame : sim::wsSent)
+            states += std::string(frame.payload.begin(), frame.payload.end()).find("\"seq\":") != std::string::npos;
+        for (const sim::Publish &publish : sim::published)
+            mqttStates += endsWith(publish.topic, "/state");
+        const unsigned applied = acks("applied");
+        const uint32_t writes = sim::nvsWrites - writesBefore;
+        printf("  %-44s %u applied, %u+%u state messages (ws+mqtt), %u flash write\n", "3-command setup", applied,
+               states, mqttStates, writes);
+        ok = applied == 3 && states == 1 && mqttStates <= 1 && writes == 1 && sim::pinLevel[PIN_RELAY_IRRIGATION] == HIGH &&
+             sim::ledcDuty[0] == ActuatorEngine::pwmDuty(100);
+
+        // An unknown channel or a network-side command sinks the whole batch
+        sim::wsSent.clear();
+        sendCommand("[{\"type\":\"setBrightness\",\"value\":10,\"id\":\"b4\"},"
+                    "{\"type\":\"triggerIrrigation\",\"value\":30,\"channel\":6,\"id\":\"b5\"}]");
+        sendCommand("[{\"type\":\"setBrightness\",\"value\":10,\"id\":\"b6\"},{\"type\":\"getMetrics\",\"id\":\"b7\"}]");
+        sendCommand(SETUP); // Redelivered
+        runUntil(never, 10, 500);
+        const unsigned rejected = acks("rejected");
+        const unsigned duplicates = acks("duplicate");
+        printf("  %-44s %u rejected, %u duplicate, duty %u\n", "bad batches and a redelivery", rejected, duplicates,
+               sim::ledcDuty[0]);
+        ok = ok && rejected == 4 && duplicates == 3 && acks("applied") == 0 &&
+             sim::ledcDuty[0] == ActuatorEngine::pwmDuty(100);
+
+        runUntil([] { return sim::pinLevel[PIN_RELAY_IRRIGATION] == LOW; }, 100, 30000);
+        sim::captureWsFrames = false;
+        sim::capturePublishes = false;
+        sim::wsSent.clear();
+        sim::published.clear();
+        if (!ok)
+            printf("  FAIL: command batches were not applied as a whole\n");
+        return ok;
+    }
+
+    // Group and farm-wide topics reach members only, and a command fanned
+    // out over several of them runs once.
+    bool checkGroups()
+    {
+        auto never = [] { return false; };
+        auto deliver = [](const char *topic, const char *json) {
+            sim::deliverMqtt(topic, (const uint8_t *)json, strlen(json));
+        };
+        auto duty = [](uint8_t level) { return [level] { return sim::ledcDuty[0] == ActuatorEngine::pwmDuty(level); }; };
+        bool ok = true;
+        printf("group addressing\n");
+
+        sendCommand("{\"type\":\"setGroups\",\"value\":[\"room-a\",\"rack_3\"]}");
+        runUntil(never, 10, 100);
+        Preferences stored;
+        stored.begin("ortus", true);
+        const bool persisted = stored.getBytesLength("groups") == 2 * GROUP_ID_SIZE;
+        stored.end();
+
+        sim::capturePublishes = true;
+        sim::published.clear();
+        const char *fanned = "{\"type\":\"setBrightness\",\"value\":30,\"transition\":0,\"id\":\"room-a-1\"}";
+        deliver("ortus/group/room-a/command", fanned);
+        deliver("ortus/group/rack_3/command", fanned);
+        deliver("ortus/all/command", fanned);
+        deliver("ortus/group/room-b/command", "{\"type\":\"setBrightness\",\"value\":70,\"transition\":0}");
+        const uint64_t appliedMs = runUntil(duty(30), 10, 5000);
+        runUntil(never, 10, 500);
+        unsigned applied = 0, duplicates = 0;
+        for (const sim::Publish &publish : sim::published)
+        {
+            if (!endsWith(publish.topic, "/ack"))
+                continue;
+            std::string text(publish.payload.begin(), publish.payload.end());
+            applied += text.find("\"applied\"") != std::string::npos;
+            duplicates += text.find("\"duplicate\"") != std::string::npos;
+        }
+        printf("  %-44s level 30 after %llu ms, %u applied, %u duplicate, other group ignored: %s\n",
+               "room-a, rack_3 and farm-wide", (unsigned long long)appliedMs, applied, duplicates,
+               duty(30)() ? "yes" : "NO");
+        ok = persisted && applied == 1 && duplicates == 2 && duty(30)();
+
+        // Moving to room-b: room-a no longer reaches the tower, binary works
+        sendCommand("{\"type\":\"setGroups\",\"value\":[\"room-b\"]}");
+        runUntil(never, 10, 100);
+        deliver("ortus/group/room-a/command", "{\"type\":\"setBrightness\",\"value\":40,\"transition\":0}");
+        const uint8_t frame[] = {BINARY_PROTOCOL_VERSION, 0, 55, CommandTrailer::Transition, 0, 0};
+        sim::deliverMqtt("ortus/group/room-b/command/bin", frame, sizeof(frame));
+        const bool moved = runUntil(duty(55), 10, 1000) < 1000;
+        sendCommand("{\"type\":\"setGroups\",\"value\":[\"bad/id\"]}");
+        sendCommand("{\"type\":\"setGroups\",\"value\":[]}");
+        deliver("ortus/group/room-b/command", "{\"type\":\"setBrightness\",\"value\":60,\"transition\":0}");
+        runUntil(never, 10, 500);
+        printf("  %-44s %s, left: %s\n", "moved to room-b", moved ? "binary applied" : "NOT APPLIED",
+               duty(55)() ? "ignored" : "STILL APPLIED");
+        ok = ok && moved && duty(55)();
+
+        sim::capturePublishes = false;
+        sim::published.clear();
+        if (!ok)
+            printf("  FAIL: group commands did not reach exactly the members\n");
+        return ok;
+    }
+
+    // The tower is found over mDNS, and with a LAN token set (the first one
+    // only over MQTT) only clients that present it get state or have their
+    // commands run. Without the
+    // broker a LAN client still has the full command, ack and state path.
+    bool checkLan()
+    {
+        constexpr uint8_t VIEWER = 1, STRANGER = 2;
+        constexpr const char *TOKEN = "k3Jx-9QmT_v2Lp8R";
+        auto never = [] { return false; };
+        auto duty = [](uint8_t level) { return [level] { return sim::ledcDuty[0] == ActuatorEngine::pwmDuty(level); }; };
+        auto connect = [](uint8_t num, const std::string &url) {
+            sim::deliverWebSocket(num, WStype_CONNECTED, (const uint8_t *)url.c_str(), url.size());
+        };
+        auto sent = [](uint8_t num, const char *needle) {
+            unsigned count = 0;
+            for (const sim::WsFrame &frame : sim::wsSent)
+                count += frame.num == num && std::string(frame.payload.begin(), frame.payload.end()).find(needle) !=
+                                                 std::string::npos;
+            return count;
+        };
+        bool ok = true;
+        printf("lan discovery and control\n");
+
+        const char *auth = sim::mdnsTxt("_ortus._tcp", "auth");
+        const char *pwm = sim::mdnsTxt("_ortus._tcp", "pwm");
+        const bool advertised = sim::mdnsHostname == "ortus-000001" && sim::mdnsServices.size() == 1 &&
+                                sim::mdnsServices[0].port == WS_SERVER_PORT && auth && !strcmp(auth, "none") &&
+                                pwm && !strcmp(pwm, "1");
+        printf("  %-44s %s.local, %u service(s), auth %s\n", "mdns", sim::mdnsHostname.c_str(),
+               (unsigned)sim::mdnsServices.size(), auth ? auth : "-");
+        ok = advertised;
+
+        // The first token comes over MQTT, not from whoever is on the LAN.
+        // Setting it drops every LAN client.
+        const std::string setToken = std::string("{\"type\":\"setLanToken\",\"value\":\"") + TOKEN + "\",\"id\":\"lan1\"}";
+        connect(STRANGER, "/");
+        sim::captureWsFrames = true;
+        sim::wsSent.clear();
+        sendCommand(setToken.c_str());
+        runUntil(never, 10, 100);
+        auth = sim::mdnsTxt("_ortus._tcp", "auth");
+        const bool lanRefused = sent(0, "\"rejected\"") == 1 && sim::wsConnected(STRANGER) && auth && !strcmp(auth, "none");
+        sim::deliverMqtt("ortus/24:58:7C:00:00:01/command", (const uint8_t *)setToken.c_str(), setToken.size());
+        runUntil(never, 10, 100);
+        auth = sim::mdnsTxt("_ortus._tcp", "auth");
+        const bool applied = lanRefused && !sim::wsConnected(0) && !sim::wsConnected(STRANGER) && auth &&
+                             !strcmp(auth, "token");
+        connect(0, std::string("/?token=") + TOKEN);
+
+        connect(STRANGER, "/");
+        connect(VIEWER, "/?token=k3Jx-9QmT_v2Lp8r");
+        const bool refused = !sim::wsConnected(STRANGER) && !sim::wsConnected(VIEWER) && sent(STRANGER, "unauthorized") == 1 &&
+                             sent(VIEWER, "unauthorized") == 1 && sent(STRANGER, "\"seq\"") == 0;
+        const char *sneaky = "{\"type\":\"setBrightness\",\"value\":5,\"transition\":0}";
+        sim::deliverWebSocket(STRANGER, WStype_TEXT, (const uint8_t *)sneaky, strlen(sneaky));
+        runUntil(never, 10, 100);
+        const bool ignored = !duty(5)();
+        connect(VIEWER, std::string("/bin?v=1&token=") + TOKEN);
+        runUntil(never, 10, 100);
+        const bool admitted = sim::wsConnected(VIEWER) && sent(VIEWER, "unauthorized") == 1 &&
+                              sim::wsSent.back().num == VIEWER && sim::wsSent.back().payload[0] == BINARY_PROTOCOL_VERSION;
+        printf("  %-44s first from the LAN: %s, set: %s, wrong/missing refused: %s, their commands ignored: %s, right one "
+               "admitted: %s\n",
+               "token", lanRefused ? "refused" : "ACCEPTED", applied ? "yes" : "NO", refused ? "yes" : "NO", ignored ? "yes" : "NO", admitted ? "yes" : "NO");
+        ok = ok && applied && refused && ignored && admitted;
+
+        // Uplink down: command, ack and state stay on the LAN
+        sim::brokerAvailable = false;
+        runUntil(never, 100, 5000);
+        sim::wsSent.clear();
+        const char *command = "{\"type\":\"setBrightness\",\"value\":35,\"transition\":0,\"id\":\"lan2\"}";
+        sim::deliverWebSocket(VIEWER, WStype_TEXT, (const uint8_t *)command, strlen(command));
+        const uint64_t start = sim::clockMicros;
+        while (!duty(35)() && sim::clockMicros - start < millisToMicros(1000))
+        {
+            ortus.loop();
+            sim::advanceMicros(LOOP_STEP_US);
+        }
+        const uint64_t latency = sim::clockMicros - start;
+        runUntil(never, 10, 100);
+        const bool answered = sent(VIEWER, "\"applied\"") == 1;
+        bool state = false;
+        for (const sim::WsFrame &frame : sim::wsSent)
+            state = state || (frame.num == VIEWER && frame.payload[0] == BINARY_PROTOCOL_VERSION);
+        printf("  %-44s applied after %.1f ms, acked: %s, state: %s\n", "broker down", latency / 1000.0,
+               answered ? "yes" : "NO", state ? "yes" : "NO");
+        ok = ok && duty(35)() && latency < millisToMicros(10) && answered && state;
+
+        sim::brokerAvailable = true;
+        sendCommand("{\"type\":\"setLanToken\",\"value\":\"\"}");
+        runUntil(never, 100, 10000);
+        Preferences stored;
+        stored.begin("ortus", true);
+        const bool cleared = !stored.isKey("lanToken") && !sim::wsConnected(VIEWER);
+        stored.end();
+        ok = ok && cleared;
+
+        sim::captureWsFrames = false;
+        sim::wsSent.clear();
+        if (!ok)
+            printf("  FAIL: LAN discovery, token checks or broker-less control went wrong\n");
+        return ok;
+    }
+
+    // Reconnecting after the broker drops must resume the TLS session
+    // instead of paying for a full handshake each time; only a broker that
+    // forgot its tickets costs a full one.
+    bool checkTlsResumption()
+    {
+        constexpr uint32_t OUTAGES = 5;
+        auto never = [] { return false; };
+        printf("tls resumption\n");
+
+        const uint32_t full = sim::tlsFullHandshakes;
+        const uint32_t resumed = sim::tlsResumedHandshakes;
+        for (uint32_t i = 0; i < OUTAGES; i++)
+        {
+            sim::brokerAvailable = false;
+            runUntil(never, 100, 2000);
+            sim::brokerAvailable = true;
+            runUntil(never, 100, 10000);
+        }
+        const uint32_t resumedCount = sim::tlsResumedHandshakes - resumed;
+        const uint32_t fullCount = sim::tlsFullHandshakes - full;
+
+        sim::brokerAvailable = false;
+        runUntil(never, 100, 2000);
+        sim::tlsBrokerTicket = 0; // Broker restarted
+        sim::brokerAvailable = true;
+        runUntil(never, 100, 10000);
+        const uint32_t afterRestart = sim::tlsFullHandshakes - full - fullCount;
+
+        printf("  %-44s %u resumed, %u full\n", "5 broker outages", resumedCount, fullCount);
+        printf("  %-44s %u full\n", "broker restart", afterRestart);
+        bool ok = resumedCount == OUTAGES && fullCount == 0 && afterRestart == 1;
+        if (!ok)
+            printf("  FAIL: reconnects did not resume the TLS session\n");
+        return ok;
+    }
+
+    // After an outage shared by the whole fleet, devices must not retry in
+    // lockstep, a busy broker must see few attempts, and its retry hint must
+    // survive a reboot.
+    bool checkReconnectBackoff()
+    {
+        constexpr int FLEET = 1000;
+        constexpr uint64_t BUCKET_US = 50000;
+        auto never = [] { return false; };
+        bool ok = true;
+        printf("reconnect backoff\n");
+
+        // First retry of each device after the broker went away at t=0
+        uint32_t buckets[MQTT_BACKOFF_BASE_MS * 1000 / BUCKET_US] = {};
+        for (int i = 0; i < FLEET; i++)
+        {
+            char id[18];
+            snprintf(id, sizeof(id), "24:58:7C:%02X:%02X:%02X", (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF);
+            ReconnectBackoff backoff(millisToMicros(MQTT_BACKOFF_BASE_MS), millisToMicros(MQTT_BACKOFF_MAX_MS));
+            backoff.begin(id, 0);
+            uint64_t at = 0;
+            while (!backoff.due(at))
+                at += 1000;
+            buckets[std::min<size_t>(at / BUCKET_US, sizeof(buckets) / sizeof(buckets[0]) - 1)]++;
+        }
+        uint32_t busiest = *std::max_element(std::begin(buckets), std::end(buckets));
+        const uint32_t even = FLEET / (sizeof(buckets) / sizeof(buckets[0]));
+        printf("  %-44s busiest 50 ms: %u (even: %u)\n", "1000 devices, first retry", busiest, even);
+        ok = ok && busiest <= even * 2;
+
+        // Broker up but refusing with "server unavailable" for 10 minutes
+        sim::brokerAvailable = false;
+        runUntil(never, 100, 1000);
+        sim::brokerConnackCode = MQTT_CONNECT_UNAVAILABLE;
+        sim::brokerAvailable = true;
+        const uint32_t connects = sim::mqttConnects;
+        runUntil(never, 100, 10 * 60 * 1000);
+        const uint32_t refused = sim::mqttConnects - connects;
+        sim::brokerConnackCode = 0;
+        uint64_t recovered = runUntil([connects, refused] { return sim::mqttConnects > connects + refused; }, 100,
+                                      MQTT_BACKOFF_MAX_MS + 1000);
+        printf("  %-44s %u attempts, back after %llu s\n", "broker busy for 10 min", refused,
+               (unsigned long long)(recovered / 1000));
+        ok = ok && refused >= 2 && refused <= 6 && recovered <= MQTT_BACKOFF_MAX_MS;
+
+        // A retained hint is remembered in flash until the broker clears it
+        constexpr const char *HINT = "90";
+        sim::deliverMqtt(MQTT_RETRY_HINT_TOPIC, (const uint8_t *)HINT, strlen(HINT));
+        runUntil(never, 100, 500);
+        Preferences preferences;
+        preferences.begin("ortus", true);
+        const uint32_t stored = preferences.getUInt("retryHint", 0);
+        sim::deliverMqtt(MQTT_RETRY_HINT_TOPIC, nullptr, 0);
+        runUntil(never, 100, 500);
+        const uint32_t cleared = preferences.getUInt("retryHint", 0);
+        printf("  %-44s %u s stored, %u s after clearing\n", "broker retry hint", stored, cleared);
+        ok = ok && stored == 90 && cleared == 0;
+
+        // Malformed or out of range hints leave the stored one alone
+        sim::deliverMqtt(MQTT_RETRY_HINT_TOPIC, (const uint8_t *)HINT, strlen(HINT));
+        for (const char *bad : {"12s", "-5", "3601", "99999999999"})
+            sim::deliverMqtt(MQTT_RETRY_HINT_TOPIC, (const uint8_t *)bad, strlen(bad));
+        runUntil(never, 100, 500);
+        const uint32_t kept = preferences.getUInt("retryHint", 0);
+        sim::deliverMqtt(MQTT_RETRY_HINT_TOPIC, nullptr, 0);
+        printf("  %-44s %u s kept\n", "invalid retry hints", kept);
+        ok = ok && kept == 90;
+
+        if (!ok)
+            printf("  FAIL: reconnects were not spread or backed off\n");
+        return ok;
+    }
+
+    struct OtaImage
+    {
+        std::vector<uint8_t> bytes;
+
+        void random(size_t length, uint32_t seed)
+        {
+            for (size_t i = 0; i < length; i++)
+            {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                bytes.push_back(i == 0 ? 0xE9 : (uint8_t)seed); // App image magic
+            }
+        }
+        void u8(uint8_t v) { bytes.push_back(v); }
+        void u32(uint32_t v)
+        {
+            for (int i = 0; i < 4; i++)
+                bytes.push_back((uint8_t)(v >> (8 * i)));
+        }
+        void append(const std::vector<uint8_t> &from, size_t offset, size_t length)
+        {
+            bytes.insert(bytes.end(), from.begin() + offset, from.begin() + offset + length);
+        }
+    };
+
+    void sha256(const std::vector<uint8_t> &bytes, uint8_t *out)
+    {
+        mbedtls_sha256_context ctx;
+        mbedtls_sha256_init(&ctx);
+        mbedtls_sha256_starts_ret(&ctx, 0);
+        mbedtls_sha256_update_ret(&ctx, bytes.data(), bytes.size());
+        mbedtls_sha256_finish_ret(&ctx, out);
+        mbedtls_sha256_free(&ctx);
+    }
+
+    struct OtaRun
+    {
+        std::vector<std::string> statuses;
+        uint32_t commandsSent = 0;
+        uint32_t commandsApplied = 0;
+        bool switched = false;
+        bool restarted = false;
+    };
+
+    // Sends an otaUpdate for the served image over MQTT (or the LAN), with
+    // `sha` and `id` if given.
+    void sendOta(const uint8_t *sha, const char *id = nullptr, bool lan = false)
+    {
+        char command[240];
+        int length = snprintf(command, sizeof(command), "{\"type\":\"otaUpdate\",\"value\":\"https://updates.example.com/ortus.bin\"");
+        if (sha)
+        {
+            length += snprintf(command + length, sizeof(command) - length, ",\"sha256\":\"");
+            for (size_t i = 0; i < SHA256_SIZE; i++)
+                length += snprintf(command + length, sizeof(command) - length, "%02x", sha[i]);
+            length += snprintf(command + length, sizeof(command) - length, "\"");
+        }
+        if (id)
+            length += snprintf(command + length, sizeof(command) - length, ",\"id\":\"%s\"", id);
+        length += snprintf(command + length, sizeof(command) - length, "}");
+        if (lan)
+            sendCommand(command);
+        else
+            sim::deliverMqtt("ortus/24:58:7C:00:00:01/command", (const uint8_t *)command, length);
+    }
+
+    // Serves `body` and sends an otaUpdate for it (with `sha` if given), then
+    // keeps changing the brightness while the update runs.
+    OtaRun runOta(const std::vector<uint8_t> &body, const uint8_t *sha)
+    {
+        OtaRun run;
+        sim::httpBody = body;
+        sim::otaPartition.clear();
+        const uint32_t switches = sim::otaBootSwitches;
+        const uint32_t restarts = sim::restarts;
+        sim::capturePublishes = true;
+        sim::published.clear();
+
+        sendOta(sha);
+
+        // The control loop has to keep up while the image streams in
+        for (int step = 0; step < 200 && sim::restarts == restarts; step++)
+        {
+            char brightness[64];
+            const int level = 10 + step % 80;
+            snprintf(brightness, sizeof(brightness), "{\"type\":\"setBrightness\",\"value\":%d,\"transition\":0}", level);
+            sendCommand(brightness);
+            run.commandsSent++;
+            runUntil([] { return false; }, 10, 50);
+            if (sim::ledcDuty[0] == ActuatorEngine::pwmDuty(level))
+                run.commandsApplied++;
+        }
+        runUntil([] { return false; }, 10, 100);
+        sim::capturePublishes = false;
+
+        for (const sim::Publish &publish : sim::published)
+        {
+            if (endsWith(publish.topic, "/ota"))
+                run.statuses.emplace_back(publish.payload.begin(), publish.payload.end());
+        }
+        sim::published.clear();
+        run.switched = sim::otaBootSwitches > switches;
+        run.restarted = sim::restarts > restarts;
+        return run;
+    }
+
+    // Updates stream in while actuators keep responding, report progress,
+    // and only a verified image becomes bootable.
+    bool checkOta()
+    {
+        constexpr size_t IMAGE_SIZE = 256 * 1024;
+        bool ok = true;
+        printf("ota\n");
+
+        // Images (and the simulated flash) stay untracked until exit, like
+        // the sample storage; they are not firmware heap
+        sim::heapAccounting = false;
+        static OtaImage current, next, delta;
+        current.random(IMAGE_SIZE, 1);
+        sim::runningImage = current.bytes;
+
+        // Next release: two patched regions and a little growth
+        next.append(current.bytes, 0, 100 * 1024);
+        next.random(2 * 1024, 2);
+        next.append(current.bytes, 102 * 1024, 98 * 1024);
+        next.random(1024, 3);
+        next.append(current.bytes, 201 * 1024, IMAGE_SIZE - 201 * 1024);
+        next.random(1024, 4);
+        uint8_t nextSha[SHA256_SIZE];
+        sha256(next.bytes, nextSha);
+
+        delta.bytes.insert(delta.bytes.end(), {'O', 'R', 'T', 'D', OTA_DELTA_VERSION, 0, 0, 0});
+        delta.u32(next.bytes.size());
+        uint8_t baseSha[SHA256_SIZE];
+        sha256(current.bytes, baseSha);
+        delta.bytes.insert(delta.bytes.end(), baseSha, baseSha + SHA256_SIZE);
+        delta.bytes.insert(delta.bytes.end(), nextSha, nextSha + SHA256_SIZE);
+        const size_t copies[][3] = {{0, 100 * 1024, 2 * 1024}, {102 * 1024, 98 * 1024, 1024}, {201 * 1024, IMAGE_SIZE - 201 * 1024, 1024}};
+        size_t at = 0;
+        for (const size_t *copy : copies)
+        {
+            delta.u8(0);
+            delta.u32(copy[0]);
+            delta.u32(copy[1]);
+            at += copy[1];
+            delta.u8(1);
+            delta.u32(copy[2]);
+            delta.append(next.bytes, at, copy[2]);
+            at += copy[2];
+        }
+        sim::httpBody.reserve(next.bytes.size());
+        sim::otaPartition.reserve(next.bytes.size());
+        sim::heapAccounting = true;
+
+        OtaRun full = runOta(next.bytes, nextSha);
+        size_t progress = 0;
+        for (const std::string &status : full.statuses)
+            progress += status.compare(0, 9, "progress:") == 0;
+        bool fullOk = full.switched && full.restarted && sim::otaPartition == next.bytes &&
+                      full.statuses.front() == "started" && full.statuses.back() == "success" && progress >= 5;
+        printf("  %-44s %s, %zu progress messages, %u/%u commands applied\n", "full image, 256 KB",
+               fullOk ? "installed" : "NOT INSTALLED", progress, full.commandsApplied, full.commandsSent);
+        ok = ok && fullOk && full.commandsApplied == full.commandsSent;
+
+        OtaRun patched = runOta(delta.bytes, nextSha);
+        bool deltaOk = patched.switched && sim::otaPartition == next.bytes && patched.statuses.back() == "success";
+        printf("  %-44s %s, %zu bytes downloaded\n", "delta image", deltaOk ? "installed" : "NOT INSTALLED",
+               delta.bytes.size());
+        ok = ok && deltaOk && delta.bytes.size() < IMAGE_SIZE / 10;
+
+        uint8_t wrongSha[SHA256_SIZE];
+        memcpy(wrongSha, nextSha, SHA256_SIZE);
+        wrongSha[0] ^= 1;
+        OtaRun corrupt = runOta(next.bytes, wrongSha);
+        printf("  %-44s %s\n", "wrong SHA-256", corrupt.statuses.back().c_str());
+        ok = ok && !corrupt.switched && !corrupt.restarted && corrupt.statuses.back() == "failed: SHA-256 mismatch";
+
+        // A delta carries its target's digest, but only the command's counts
+        OtaRun other = runOta(delta.bytes, wrongSha);
+        printf("  %-44s %s\n", "delta for another release", other.statuses.back().c_str());
+        ok = ok && !other.switched && other.statuses.back() == "failed: SHA-256 mismatch";
+
+        // Nothing vouches for an image without a digest, so it is refused
+        // before anything is downloaded
+        const uint32_t served = sim::httpRequests;
+        OtaRun bare = runOta(next.bytes, nullptr);
+        const bool refused = !bare.switched && bare.statuses.empty() && sim::httpRequests == served;
+        printf("  %-44s %s\n", "plain image without SHA-256", refused ? "refused" : "ACCEPTED");
+        ok = ok && refused;
+
+        // A second update while one runs is refused, but not remembered, so
+        // the sender can retry the same id once the first is done
+        auto acked = [](const char *id, const char *status) {
+            for (const sim::Publish &publish : sim::published)
+            {
+                const std::string text(publish.payload.begin(), publish.payload.end());
+                if (endsWith(publish.topic, "/ack") && text.find(std::string("\"") + id + "\"") != std::string::npos &&
+                    text.find(status) != std::string::npos)
+                    return true;
+            }
+            return false;
+        };
+        const uint32_t restarts = sim::restarts;
+        sim::httpBody = next.bytes;
+        sim::capturePublishes = true;
+        sim::published.clear();
+        sendOta(nextSha, "ota-1");
+        runUntil([] { return false; }, 10, 50);
+        sendOta(nextSha, "ota-2");
+        runUntil([restarts] { return sim::restarts > restarts; }, 10, 60000);
+        sendOta(nextSha, "ota-2");
+        runUntil([restarts] { return sim::restarts > restarts + 1; }, 10, 60000);
+        sim::capturePublishes = false;
+        const bool retried = acked("ota-2", "rejected") && acked("ota-2", "accepted") && !acked("ota-2", "duplicate") &&
+                             sim::restarts == restarts + 2;
+        sim::published.clear();
+        printf("  %-44s %s\n", "second update, retried after the first", retried ? "installed" : "NOT INSTALLED");
+        ok = ok && retried;
+
+        // With the broker gone, "success" waits in the outbox for the grace
+        // period; the installed image must not be overwritten meanwhile
+        sim::brokerAvailable = false;
+        runUntil([] { return false; }, 100, 5000);
+        const uint32_t switches = sim::otaBootSwitches;
+        sim::captureWsFrames = true;
+        sim::wsSent.clear();
+        sendOta(nextSha, "ota-3", true);
+        runUntil([switches] { return sim::otaBootSwitches > switches; }, 10, 60000);
+        const uint32_t requests = sim::httpRequests;
+        sendOta(nextSha, "ota-4", true);
+        runUntil([restarts] { return sim::restarts > restarts + 2; }, 10, 2 * OTA_REBOOT_GRACE_MS);
+        bool graceRefused = false;
+        for (const sim::WsFrame &frame : sim::wsSent)
+        {
+            const std::string text(frame.payload.begin(), frame.payload.end());
+            graceRefused = graceRefused || (text.find("\"ota-4\"") != std::string::npos && text.find("rejected") != std::string::npos);
+        }
+        graceRefused = graceRefused && sim::httpRequests == requests && sim::restarts == restarts + 3;
+        sim::captureWsFrames = false;
+        sim::wsSent.clear();
+        sim::brokerAvailable = true;
+        runUntil([] { return false; }, 100, 5000);
+        printf("  %-44s %s\n", "update while the last waits to restart", graceRefused ? "refused" : "ACCEPTED");
+        ok = ok && graceRefused;
+
+        sim::runningImage[1000] ^= 1; // Running something the delta was not made against
+        OtaRun stale = runOta(delta.bytes, nextSha);
+        printf("  %-44s %s\n", "delta for another image", stale.statuses.back().c_str());
+        ok = ok && !stale.switched && stale.statuses.back() == "failed: delta is for another image";
+
+        if (!ok)
+            printf("  FAIL: an update blocked the device, or a bad image was installed\n");
+        return ok;
+    }
+
+    // A cycle must keep its phase through a reboot instead of restarting
+    // in the on phase. Runs last: it leaves a second, rebooted OrtusSystem
+    // in charge of the simulated hardware.
+    bool checkCycleResume()
+    {
+        auto lightOff = [] { return sim::ledcDuty[0] == 0; };
+        auto lightOn = [] { return sim::ledcDuty[0] > 0; }; // The fade up has begun
+        bool ok = true;
+        printf("cycle resume\n");
+
+        sim::syncTime(1700000000);
+        sendCommand("{\"type\":\"lightCycle\",\"value\":\"on:60,off:60\"}");
+        runUntil(lightOn, 1, 100);
+        runUntil([] { return false; }, 100, 90000); // 30 s into the off phase
+
+        // Software reset: flash, RTC memory and the RTC timer survive
+        const uint32_t full = sim::tlsFullHandshakes;
+        const uint32_t resumed = sim::tlsResumedHandshakes;
+        static OrtusSystem rebooted;
+        sim::runningImageState = ESP_OTA_IMG_PENDING_VERIFY; // As if this reset installed an update
+        rebooted.begin();
+        const bool probation = sim::runningImageState == ESP_OTA_IMG_PENDING_VERIFY;
+        rebooted.loop();
+        bool stillOff = lightOff();
+        uint64_t untilOn = runUntil(lightOn, 100, 120000, rebooted);
+        printf("  %-44s %s, on after %llu ms\n", "rebooted 30 s into the off phase", stillOff ? "off" : "ON",
+               (unsigned long long)untilOn);
+        // Networking runs inline here, so the reconnect handshake can land
+        // inside the measured window
+        ok = ok && stillOff && untilOn >= 29000 && untilOn <= 30100 + sim::tlsResumedHandshakeMicros / 1000;
+
+        // The TLS session survives in RTC memory as well
+        printf("  %-44s %s\n", "tls after the reboot", sim::tlsFullHandshakes == full ? "resumed" : "FULL HANDSHAKE");
+        ok = ok && sim::tlsFullHandshakes == full && sim::tlsResumedHandshakes > resumed;
+
+        // Only reaching the broker ends the new image's probation
+        const bool confirmed = probation && sim::runningImageState == ESP_OTA_IMG_VALID;
+        printf("  %-44s %s\n", "updated image after the reboot", confirmed ? "confirmed" : "NOT CONFIRMED");
+        ok = ok && confirmed;
+
+        if (!ok)
+            printf("  FAIL: the cycle lost its phase over the reboot\n");
+        return ok;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t iterations = argc > 1 ? strtoull(argv[1], nullptr, 10) : DEFAULT_ITERATIONS;
+
+    reserveSamples(std::max<uint64_t>(iterations, COMMAND_SAMPLES));
+    ortus.begin();
+
+    // Bring WiFi and MQTT up (both have jittered first attempts) and attach one LAN viewer.
+    for (int i = 0; i < 30; i++)
+    {
+        ortus.loop();
+        sim::advanceMillis(1000);
+    }
+    sim::deliverWebSocket(0, WStype_CONNECTED, nullptr, 0);
+
+    bool ok = benchLoop(iterations);
+    benchCommands("websocket", false);
+    benchCommands("mqtt", true);
+    ok = checkParserAllocations() && ok;
+    ok = checkBinaryDecode() && ok;
+    ok = checkStateCoalescing() && ok;
+    ok = checkTimerWrap() && ok;
+    ok = checkSensorHistory() && ok;
+    ok = checkOfflineOutbox() && ok;
+    ok = checkWebSocketFanout() && ok;
+    ok = checkTlsResumption() && ok;
+    ok = checkReconnectBackoff() && ok;
+    ok = checkOta() && ok;
+    ok = checkMetrics() && ok;
+    ok = checkBleProvisioning() && ok;
+    ok = checkRules() && ok;
+    ok = checkFades() && ok;
+    ok = checkBatches() && ok;
+    ok = checkGroups() && ok;
+    ok = checkLan() && ok;
+    ok = checkCycleResume() && ok;
+
+    printf("heap: free %u, min free %u\n", ESP.getFreeHeap(), ESP.getMinFreeHeap());
+    return ok ? 0 : 1;
+}
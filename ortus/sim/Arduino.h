@@ -0,0 +1,240 @@
+#pragma once
+
+// Minimal Arduino core stand-in for the native simulation build.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <algorithm>
+
+#include "sim.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+
+#define IRAM_ATTR
+#define digitalPinToInterrupt(p) (p)
+
+#ifndef constrain
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#endif
+
+using std::isnan;
+
+// 32 bits wide like on the device, so they wrap (millis() after ~49.7 days).
+inline unsigned long millis() { return (uint32_t)(sim::clockMicros / 1000ULL); }
+inline unsigned long micros() { return (uint32_t)sim::clockMicros; }
+inline void delay(unsigned long ms) { sim::advanceMillis(ms); }
+inline void delayMicroseconds(unsigned int us) { sim::advanceMicros(us); }
+inline void yield() {}
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+void attachInterrupt(uint8_t pin, void (*handler)(), int mode);
+void detachInterrupt(uint8_t pin);
+
+// PSRAM is a separate heap: ps_malloc() is not counted in heap stats.
+bool psramFound();
+void *ps_malloc(size_t size);
+
+void configTime(long gmtOffset_sec, int daylightOffset_sec, const char *server1,
+                const char *server2 = nullptr, const char *server3 = nullptr);
+
+// Heap-backed like the real WString so the bench sees the same churn.
+class String
+{
+public:
+    String() {}
+    String(const char *s) : s(s ? s : "") {}
+    String(const std::string &s) : s(s) {}
+    String(char c) : s(1, c) {}
+    String(int v) : s(std::to_string(v)) {}
+    String(unsigned int v) : s(std::to_string(v)) {}
+    String(long v) : s(std::to_string(v)) {}
+    String(unsigned long v) : s(std::to_string(v)) {}
+    String(long long v) : s(std::to_string(v)) {}
+    String(unsigned long long v) : s(std::to_string(v)) {}
+    String(float v, unsigned int decimals = 2) { fromDouble(v, decimals); }
+    String(double v, unsigned int decimals = 2) { fromDouble(v, decimals); }
+
+    const char *c_str() const { return s.c_str(); }
+    unsigned int length() const { return (unsigned int)s.length(); }
+    bool isEmpty() const { return s.empty(); }
+    bool reserve(unsigned int size)
+    {
+        s.reserve(size);
+        return true;
+    }
+
+    char operator[](unsigned int i) const { return i < s.size() ? s[i] : 0; }
+    char charAt(unsigned int i) const { return (*this)[i]; }
+
+    String &operator+=(const String &rhs)
+    {
+        s += rhs.s;
+        return *this;
+    }
+    String &operator+=(const char *rhs)
+    {
+        s += rhs ? rhs : "";
+        return *this;
+    }
+    String &operator+=(char c)
+    {
+        s += c;
+        return *this;
+    }
+    bool concat(const String &rhs)
+    {
+        s += rhs.s;
+        return true;
+    }
+    bool concat(const char *rhs)
+    {
+        s += rhs ? rhs : "";
+        return true;
+    }
+    bool concat(const char *rhs, unsigned int length)
+    {
+        s.append(rhs, length);
+        return true;
+    }
+    bool concat(char c)
+    {
+        s += c;
+        return true;
+    }
+
+    bool equals(const String &rhs) const { return s == rhs.s; }
+    bool equals(const char *rhs) const { return s == (rhs ? rhs : ""); }
+    bool operator==(const String &rhs) const { return equals(rhs); }
+    bool operator==(const char *rhs) const { return equals(rhs); }
+    bool operator!=(const String &rhs) const { return !equals(rhs); }
+    bool operator!=(const char *rhs) const { return !equals(rhs); }
+    bool startsWith(const String &prefix) const { return s.compare(0, prefix.s.size(), prefix.s) == 0; }
+
+    int indexOf(char c, unsigned int from = 0) const { return pos(s.find(c, from)); }
+    int indexOf(const String &str, unsigned int from = 0) const { return pos(s.find(str.s, from)); }
+    String substring(unsigned int from) const { return from < s.size() ? String(s.substr(from)) : String(); }
+    String substring(unsigned int from, unsigned int to) const
+    {
+        if (from > to)
+            std::swap(from, to);
+        if (from >= s.size())
+            return String();
+        return String(s.substr(from, to - from));
+    }
+    long toInt() const { return atol(s.c_str()); }
+    float toFloat() const { return (float)atof(s.c_str()); }
+    void toUpperCase() { std::transform(s.begin(), s.end(), s.begin(), ::toupper); }
+    void toLowerCase() { std::transform(s.begin(), s.end(), s.begin(), ::tolower); }
+    void replace(const String &find, const String &with)
+    {
+        if (find.s.empty())
+            return;
+        size_t at = 0;
+        while ((at = s.find(find.s, at)) != std::string::npos)
+        {
+            s.replace(at, find.s.size(), with.s);
+            at += with.s.size();
+        }
+    }
+
+private:
+    std::string s;
+
+    static int pos(size_t p) { return p == std::string::npos ? -1 : (int)p; }
+    void fromDouble(double v, unsigned int decimals)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.*f", (int)decimals, v);
+        s = buf;
+    }
+};
+
+inline String operator+(const String &lhs, const String &rhs)
+{
+    String out(lhs);
+    out += rhs;
+    return out;
+}
+inline String operator+(const String &lhs, const char *rhs)
+{
+    String out(lhs);
+    out += rhs;
+    return out;
+}
+inline String operator+(const char *lhs, const String &rhs)
+{
+    String out(lhs);
+    out += rhs;
+    return out;
+}
+
+// ArduinoJson recognises the concatenation helper as a string type.
+class StringSumHelper : public String
+{
+public:
+    using String::String;
+    StringSumHelper(const String &s) : String(s) {}
+};
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+
+    size_t print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+    size_t print(const String &s) { return write((const uint8_t *)s.c_str(), s.length()); }
+    size_t print(char c) { return write((const uint8_t *)&c, 1); }
+    size_t print(int v) { return print(String(v)); }
+    size_t print(unsigned int v) { return print(String(v)); }
+    size_t print(long v) { return print(String(v)); }
+    size_t print(unsigned long v) { return print(String(v)); }
+    size_t print(double v, int decimals = 2) { return print(String(v, decimals)); }
+    size_t println() { return print("\r\n"); }
+    template <typename T>
+    size_t println(const T &v)
+    {
+        size_t n = print(v);
+        return n + println();
+    }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class HardwareSerial : public Print
+{
+public:
+    void begin(unsigned long) {}
+    operator bool() const { return true; }
+    size_t write(const uint8_t *buffer, size_t size) override;
+};
+
+extern HardwareSerial Serial;
+
+class EspClass
+{
+public:
+    uint32_t getFreeHeap();
+    uint32_t getMinFreeHeap();
+    uint32_t getMaxAllocHeap();
+    void restart();
+};
+
+extern EspClass ESP;
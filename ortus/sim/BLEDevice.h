@@ -0,0 +1,133 @@
+#pragma once
+
+// BLE stand-in. The simulation has no radio: characteristics just hold
+// values, and centrals connect and write only when the bench says so
+// (sim::bleConnection(), sim::bleWrite()).
+
+#include <Arduino.h>
+#include <string>
+#include <vector>
+
+class BLEServer;
+class BLECharacteristic;
+
+class BLEUUID
+{
+public:
+    BLEUUID() {}
+    BLEUUID(const char *uuid) : value(uuid) {}
+    BLEUUID(uint16_t uuid) : value(std::to_string(uuid)) {}
+    bool equals(const BLEUUID &other) const { return value == other.value; }
+
+private:
+    std::string value;
+};
+
+class BLEServerCallbacks
+{
+public:
+    virtual ~BLEServerCallbacks() {}
+    virtual void onConnect(BLEServer *) {}
+    virtual void onDisconnect(BLEServer *) {}
+};
+
+class BLECharacteristicCallbacks
+{
+public:
+    virtual ~BLECharacteristicCallbacks() {}
+    virtual void onWrite(BLECharacteristic *) {}
+};
+
+class BLEDescriptor
+{
+public:
+    explicit BLEDescriptor(const BLEUUID &uuid) : uuid(uuid) {}
+    virtual ~BLEDescriptor() {}
+    BLEUUID getUUID() const { return uuid; }
+
+private:
+    BLEUUID uuid;
+};
+
+class BLE2902 : public BLEDescriptor
+{
+public:
+    BLE2902() : BLEDescriptor(BLEUUID((uint16_t)0x2902)) {}
+    bool getNotifications() { return false; }
+};
+
+class BLECharacteristic
+{
+public:
+    static const uint32_t PROPERTY_READ = 1 << 0;
+    static const uint32_t PROPERTY_WRITE = 1 << 1;
+    static const uint32_t PROPERTY_NOTIFY = 1 << 2;
+
+    explicit BLECharacteristic(const char *uuid) : uuid(uuid) {}
+    ~BLECharacteristic();
+
+    void setCallbacks(BLECharacteristicCallbacks *cb) { callbacks = cb; }
+    void addDescriptor(BLEDescriptor *descriptor) { descriptors.push_back(descriptor); }
+    BLEDescriptor *getDescriptorByUUID(const BLEUUID &uuid);
+    std::string getValue() { return value; }
+    void setValue(const char *v) { value = v; }
+    void setValue(const std::string &v) { value = v; }
+    void notify() {}
+
+private:
+    friend bool sim::bleWrite(const char *, const char *);
+    std::string uuid;
+    BLECharacteristicCallbacks *callbacks = nullptr;
+    std::vector<BLEDescriptor *> descriptors;
+    std::string value;
+};
+
+class BLEService
+{
+public:
+    ~BLEService();
+    BLECharacteristic *createCharacteristic(const char *uuid, uint32_t properties);
+    void start() {}
+    void stop() {}
+
+private:
+    friend bool sim::bleWrite(const char *, const char *);
+    std::vector<BLECharacteristic *> characteristics;
+};
+
+class BLEServer
+{
+public:
+    ~BLEServer();
+    void setCallbacks(BLEServerCallbacks *cb) { callbacks = cb; }
+    BLEService *createService(const char *uuid);
+    void startAdvertising();
+    uint32_t getConnectedCount() { return 0; }
+
+private:
+    friend void sim::bleConnection(bool);
+    friend bool sim::bleWrite(const char *, const char *);
+    BLEServerCallbacks *callbacks = nullptr;
+    std::vector<BLEService *> services;
+};
+
+class BLEAdvertising
+{
+public:
+    void addServiceUUID(const char *) {}
+    void setScanResponse(bool) {}
+    void setMinPreferred(uint16_t) {}
+    void start() {}
+    void stop() {}
+};
+
+class BLEDevice
+{
+public:
+    static void init(const char *name);
+    static void deinit(bool releaseMemory = false);
+    static BLEServer *createServer();
+    static BLEAdvertising *getAdvertising();
+    static void startAdvertising();
+    static void stopAdvertising();
+};
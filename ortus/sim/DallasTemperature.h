@@ -0,0 +1,60 @@
+#pragma once
+
+#include <Arduino.h>
+#include <OneWire.h>
+
+typedef uint8_t DeviceAddress[8];
+
+#define DEVICE_DISCONNECTED_C -127
+
+// sim::temperatureSensorCount DS18B20 probes reporting sim::temperatureC[].
+// A blocking conversion advances the virtual clock by the real conversion
+// time; with setWaitForConversion(false) the result is ready that much later.
+class DallasTemperature
+{
+public:
+    explicit DallasTemperature(OneWire *) {}
+
+    void begin() {}
+    uint8_t getDeviceCount();
+    bool getAddress(uint8_t *address, uint8_t index);
+    void setResolution(uint8_t bits) { resolution = bits; }
+    void setWaitForConversion(bool wait) { waitForConversion = wait; }
+    bool getWaitForConversion() { return waitForConversion; }
+
+    struct request_t
+    {
+        bool result;
+        unsigned long timestamp;
+    };
+
+    request_t requestTemperatures();
+    bool isConversionComplete();
+    float getTempC(const uint8_t *address);
+    float getTempCByIndex(uint8_t index)
+    {
+        DeviceAddress address;
+        return getAddress(address, index) ? getTempC(address) : DEVICE_DISCONNECTED_C;
+    }
+
+    int16_t millisToWaitForConversion(uint8_t bits)
+    {
+        switch (bits)
+        {
+        case 9:
+            return 94;
+        case 10:
+            return 188;
+        case 11:
+            return 375;
+        default:
+            return 750;
+        }
+    }
+
+private:
+    uint8_t resolution = 12;
+    bool waitForConversion = true;
+    bool converting = false;
+    uint64_t conversionStartedAt = 0;
+};
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <Arduino.h>
+
+// mDNS/DNS-SD stand-in. The advertisement is recorded in sim::mdnsHostname
+// and sim::mdnsServices for the bench to check; nothing goes on a network.
+class MDNSResponder
+{
+public:
+    bool begin(const char *hostName);
+    void end();
+    void setInstanceName(String name);
+
+    // Underscores are optional, as on the ESP32 core: "ortus" is "_ortus".
+    bool addService(const char *service, const char *proto, uint16_t port);
+    // Replaces the value if `key` is already set.
+    bool addServiceTxt(const char *service, const char *proto, const char *key, const char *value);
+};
+
+extern MDNSResponder MDNS;
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+
+#define HTTP_CODE_OK 200
+#define HTTPC_ERROR_CONNECTION_REFUSED (-1)
+
+typedef enum
+{
+    HTTPC_DISABLE_FOLLOW_REDIRECTS,
+    HTTPC_STRICT_FOLLOW_REDIRECTS,
+    HTTPC_FORCE_FOLLOW_REDIRECTS
+} followRedirects_t;
+
+// Serves sim::httpBody with status sim::httpStatus for any URL while WiFi is
+// up. The body trickles in at sim::httpBytesPerSecond of virtual time.
+class HTTPClient
+{
+public:
+    bool begin(WiFiClient &client, const String &url);
+    void setFollowRedirects(followRedirects_t) {}
+    void setTimeout(uint16_t) {}
+    int GET();
+    int getSize();
+    WiFiClient *getStreamPtr();
+    void end();
+    static String errorToString(int error);
+
+private:
+    class Body : public WiFiClient
+    {
+    public:
+        uint64_t openedAt = 0;
+        size_t position = 0;
+        bool open = false;
+
+        int available() override;
+        int read() override;
+        int read(uint8_t *buf, size_t size) override;
+        uint8_t connected() override;
+        void stop() override { open = false; }
+    };
+
+    Body body;
+};
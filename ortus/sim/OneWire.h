@@ -0,0 +1,12 @@
+#pragma once
+
+#include <Arduino.h>
+
+class OneWire
+{
+public:
+    explicit OneWire(uint8_t pin) : pin(pin) {}
+
+private:
+    uint8_t pin;
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define MQTT_CONNECTION_TIMEOUT -4
+#define MQTT_CONNECTION_LOST -3
+#define MQTT_CONNECT_FAILED -2
+#define MQTT_DISCONNECTED -1
+#define MQTT_CONNECTED 0
+#define MQTT_CONNECT_BAD_PROTOCOL 1
+#define MQTT_CONNECT_BAD_CLIENT_ID 2
+#define MQTT_CONNECT_UNAVAILABLE 3
+#define MQTT_CONNECT_BAD_CREDENTIALS 4
+#define MQTT_CONNECT_UNAUTHORIZED 5
+
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char *, uint8_t *, unsigned int)> callback
+
+// Broker stand-in: connects when sim::brokerAvailable and the client can
+// open a connection to it, records publishes and
+// delivers inbound messages queued through sim::deliverMqtt().
+class PubSubClient
+{
+public:
+    explicit PubSubClient(Client &client);
+    ~PubSubClient();
+
+    PubSubClient &setServer(const char *domain, uint16_t port)
+    {
+        host = domain;
+        this->port = port;
+        return *this;
+    }
+    PubSubClient &setCallback(MQTT_CALLBACK_SIGNATURE);
+    PubSubClient &setKeepAlive(uint16_t) { return *this; }
+    PubSubClient &setSocketTimeout(uint16_t) { return *this; }
+    bool setBufferSize(uint16_t size);
+    uint16_t getBufferSize() { return bufferSize; }
+
+    // Without cleanSession the broker keeps the subscriptions and holds
+    // inbound messages across disconnects, like a persistent session.
+    bool connect(const char *id, const char *user, const char *pass,
+                 const char *willTopic, uint8_t willQos, bool willRetain, const char *willMessage,
+                 bool cleanSession);
+    bool connect(const char *id, const char *user, const char *pass,
+                 const char *willTopic, uint8_t willQos, bool willRetain, const char *willMessage)
+    {
+        return connect(id, user, pass, willTopic, willQos, willRetain, willMessage, true);
+    }
+    bool connect(const char *id, const char *user, const char *pass)
+    {
+        return connect(id, user, pass, nullptr, 0, false, nullptr);
+    }
+    void disconnect();
+
+    bool publish(const char *topic, const char *payload) { return publish(topic, payload, false); }
+    bool publish(const char *topic, const char *payload, bool retained)
+    {
+        return publish(topic, (const uint8_t *)payload, payload ? strlen(payload) : 0, retained);
+    }
+    bool publish(const char *topic, const uint8_t *payload, unsigned int length)
+    {
+        return publish(topic, payload, length, false);
+    }
+    bool publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained);
+
+    bool subscribe(const char *topic, uint8_t qos = 0);
+    bool unsubscribe(const char *topic);
+
+    bool loop();
+    bool connected() { return isConnected && sim::brokerAvailable; }
+    int state() { return connected() ? MQTT_CONNECTED : lastState; }
+
+    // Called by sim::deliverMqtt().
+    void enqueueInbound(const char *topic, const uint8_t *payload, size_t length);
+
+private:
+    struct Inbound
+    {
+        std::string topic;
+        std::vector<uint8_t> payload;
+    };
+
+    Client *client;
+    std::string host;
+    uint16_t port = 0;
+    std::function<void(char *, uint8_t *, unsigned int)> callback;
+    std::vector<std::string> subscriptions;
+    std::vector<Inbound> inbound;
+    std::vector<uint8_t> buffer;
+    uint16_t bufferSize = 256;
+    bool isConnected = false;
+    int lastState = MQTT_DISCONNECTED;
+
+    bool matches(const std::string &filter, const std::string &topic) const;
+};
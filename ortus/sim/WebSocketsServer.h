@@ -0,0 +1,68 @@
+#pragma once
+
+#include <Arduino.h>
+#include "IPAddress.h"
+#include <functional>
+
+#ifndef WEBSOCKETS_SERVER_CLIENT_MAX
+#define WEBSOCKETS_SERVER_CLIENT_MAX (5)
+#endif
+
+typedef enum
+{
+    WStype_ERROR,
+    WStype_DISCONNECTED,
+    WStype_CONNECTED,
+    WStype_TEXT,
+    WStype_BIN,
+    WStype_FRAGMENT_TEXT_START,
+    WStype_FRAGMENT_BIN_START,
+    WStype_FRAGMENT,
+    WStype_FRAGMENT_FIN,
+    WStype_PING,
+    WStype_PONG,
+} WStype_t;
+
+// LAN server stand-in: events are injected with sim::deliverWebSocket() and
+// outbound frames are only counted.
+class WebSocketsServer
+{
+public:
+    typedef std::function<void(uint8_t num, WStype_t type, uint8_t *payload, size_t length)> WebSocketServerEvent;
+
+    explicit WebSocketsServer(uint16_t port);
+    ~WebSocketsServer();
+
+    void begin() {}
+    void close() {}
+    void loop() {}
+    void onEvent(WebSocketServerEvent cbEvent) { event = cbEvent; }
+
+    bool sendTXT(uint8_t num, const uint8_t *payload, size_t length = 0);
+    bool sendTXT(uint8_t num, const char *payload, size_t length = 0)
+    {
+        return sendTXT(num, (const uint8_t *)payload, length ? length : strlen(payload));
+    }
+    bool sendTXT(uint8_t num, String &payload) { return sendTXT(num, payload.c_str(), payload.length()); }
+    bool sendBIN(uint8_t num, const uint8_t *payload, size_t length);
+
+    bool broadcastTXT(const uint8_t *payload, size_t length = 0);
+    bool broadcastTXT(const char *payload, size_t length = 0)
+    {
+        return broadcastTXT((const uint8_t *)payload, length ? length : strlen(payload));
+    }
+    bool broadcastTXT(String &payload) { return broadcastTXT(payload.c_str(), payload.length()); }
+    bool broadcastBIN(const uint8_t *payload, size_t length);
+
+    void disconnect(uint8_t num);
+    uint8_t connectedClients(bool ping = false);
+    bool clientIsConnected(uint8_t num) { return num < WEBSOCKETS_SERVER_CLIENT_MAX && clients[num]; }
+    IPAddress remoteIP(uint8_t) { return IPAddress(192, 168, 1, 20); }
+
+    // Called by sim::deliverWebSocket().
+    void inject(uint8_t num, WStype_t type, const uint8_t *payload, size_t length);
+
+private:
+    WebSocketServerEvent event;
+    bool clients[WEBSOCKETS_SERVER_CLIENT_MAX] = {};
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <Arduino.h>
+#include "IPAddress.h"
+
+typedef enum
+{
+    WL_IDLE_STATUS = 0,
+    WL_NO_SSID_AVAIL = 1,
+    WL_CONNECTED = 3,
+    WL_CONNECT_FAILED = 4,
+    WL_DISCONNECTED = 6
+} wl_status_t;
+
+typedef enum
+{
+    WIFI_OFF = 0,
+    WIFI_STA = 1
+} wifi_mode_t;
+
+class WiFiClass
+{
+public:
+    bool mode(wifi_mode_t) { return true; }
+    bool setAutoReconnect(bool) { return true; }
+    bool setSleep(bool) { return true; }
+
+    wl_status_t begin(const char *ssid, const char *pass);
+    bool disconnect(bool wifioff = false);
+    wl_status_t status();
+
+    String macAddress() { return String("24:58:7C:00:00:01"); }
+    IPAddress localIP() { return IPAddress(192, 168, 1, 50); }
+    int8_t RSSI() { return -55; }
+
+private:
+    bool started = false;
+};
+
+extern WiFiClass WiFi;
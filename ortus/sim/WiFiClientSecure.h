@@ -0,0 +1,54 @@
+#pragma once
+
+#include <Arduino.h>
+#include "IPAddress.h"
+
+// Same interface as the core's Client (minus Stream); PubSubClient only
+// ever talks to the broker through it.
+class Client
+{
+public:
+    virtual ~Client() {}
+    virtual int connect(IPAddress ip, uint16_t port) = 0;
+    virtual int connect(const char *host, uint16_t port) = 0;
+    virtual size_t write(uint8_t b) = 0;
+    virtual size_t write(const uint8_t *buf, size_t size) = 0;
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int read(uint8_t *buf, size_t size) = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+    virtual void stop() = 0;
+    virtual uint8_t connected() = 0;
+    virtual operator bool() = 0;
+};
+
+// Connects whenever the simulated broker is up; carries no data.
+class WiFiClient : public Client
+{
+public:
+    void setTimeout(uint32_t) {}
+
+    int connect(IPAddress, uint16_t) override { return open = sim::brokerAvailable; }
+    int connect(const char *, uint16_t) override { return open = sim::brokerAvailable; }
+    size_t write(uint8_t) override { return open ? 1 : 0; }
+    size_t write(const uint8_t *, size_t size) override { return open ? size : 0; }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int read(uint8_t *, size_t) override { return -1; }
+    int peek() override { return -1; }
+    void flush() override {}
+    void stop() override { open = false; }
+    uint8_t connected() override { return open; }
+    operator bool() override { return open; }
+
+private:
+    bool open = false;
+};
+
+class WiFiClientSecure : public WiFiClient
+{
+public:
+    void setInsecure() {}
+    void setCACert(const char *) {}
+};
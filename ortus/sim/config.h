@@ -0,0 +1,34 @@
+#pragma once
+
+// Configuration for the native simulation build. src/config.h is not
+// committed, so the bench uses these placeholder values instead.
+
+#include <Arduino.h>
+
+constexpr char DEFAULT_WIFI_SSID[] = "SimNetwork";
+constexpr char DEFAULT_WIFI_PASSWORD[] = "SimPassword";
+
+constexpr char MQTT_BROKER_HOST[] = "broker.sim";
+constexpr uint16_t MQTT_PORT = 8883;
+constexpr char MQTT_USERNAME[] = "ortus";
+constexpr char MQTT_PASSWORD[] = "password";
+constexpr char MQTT_ROOT_CA[] = "-----BEGIN CERTIFICATE-----\nSIM\n-----END CERTIFICATE-----\n";
+
+constexpr uint16_t WS_SERVER_PORT = 8765;
+
+constexpr uint8_t PIN_RELAY_LIGHT = 4;
+constexpr uint8_t PIN_RELAY_IRRIGATION = 5;
+constexpr uint8_t PIN_SENSOR_TEMP = 6;
+constexpr uint8_t PIN_SENSOR_WATER = 7;
+
+constexpr unsigned long PRESENCE_INTERVAL_MS = 10000;
+constexpr unsigned long TEMP_POLL_MS = 5000;
+constexpr unsigned long WATER_POLL_MS = 1000;
+constexpr float TEMP_DELTA_THRESHOLD = 0.2f;
+
+constexpr char BLE_SERVICE_UUID[] = "12345678-1234-5678-1234-56789abcdef0";
+constexpr char BLE_CHAR_SSID_UUID[] = "12345678-1234-5678-1234-56789abcdef1";
+constexpr char BLE_CHAR_PASSWORD_UUID[] = "12345678-1234-5678-1234-56789abcdef2";
+constexpr char BLE_CHAR_STATUS_UUID[] = "12345678-1234-5678-1234-56789abcdef3";
+constexpr char BLE_CHAR_MAC_UUID[] = "12345678-1234-5678-1234-56789abcdef4";
+constexpr char BLE_CHAR_COMMAND_UUID[] = "12345678-1234-5678-1234-56789abcdef5";
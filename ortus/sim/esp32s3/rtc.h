@@ -0,0 +1,9 @@
+#pragma once
+
+// RTC timer stand-in. Like the real one it keeps counting across software
+// resets, which in the simulation means a second OrtusSystem::begin().
+
+#include <stdint.h>
+#include "../sim.h"
+
+inline uint64_t esp_rtc_get_time_us() { return sim::clockMicros; }
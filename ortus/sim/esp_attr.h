@@ -0,0 +1,6 @@
+#pragma once
+
+// Linker placement attributes; plain globals on the host, so RTC memory
+// survives a simulated reboot (a second begin()) but not a new process.
+
+#define RTC_NOINIT_ATTR
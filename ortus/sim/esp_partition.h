@@ -0,0 +1,18 @@
+#pragma once
+
+// Flash partitions, reduced to the two OTA app slots. Slot 0 runs
+// sim::runningImage, slot 1 receives updates into sim::otaPartition.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef struct
+{
+    uint32_t address;
+    uint32_t size;
+    char label[17];
+} esp_partition_t;
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size);
+esp_err_t esp_partition_get_sha256(const esp_partition_t *partition, uint8_t *sha_256);
@@ -0,0 +1,9 @@
+#pragma once
+
+// ESP-IDF system stand-in. Shutdown handlers run from ESP.restart().
+
+#include "esp_err.h"
+
+typedef void (*shutdown_handler_t)(void);
+
+esp_err_t esp_register_shutdown_handler(shutdown_handler_t handler);
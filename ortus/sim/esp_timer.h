@@ -0,0 +1,8 @@
+#pragma once
+
+// esp_timer stand-in: the 64-bit boot clock is the simulation clock.
+
+#include <stdint.h>
+#include "sim.h"
+
+inline int64_t esp_timer_get_time() { return (int64_t)sim::clockMicros; }
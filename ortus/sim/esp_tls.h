@@ -0,0 +1,26 @@
+#pragma once
+
+// ESP-TLS stand-in, down to the plain TCP connect TlsClient uses. The
+// socket connects while sim::brokerAvailable; the TLS on top of it is the
+// mbedTLS stand-in.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef struct esp_tls_cfg
+{
+    bool non_block;
+    int timeout_ms;
+} esp_tls_cfg_t;
+
+typedef struct esp_tls_last_error
+{
+    esp_err_t last_error;
+    int esp_tls_error_code;
+    int esp_tls_flags;
+} esp_tls_last_error_t;
+typedef esp_tls_last_error_t *esp_tls_error_handle_t;
+
+esp_err_t esp_tls_plain_tcp_connect(const char *host, int hostlen, int port, const esp_tls_cfg_t *cfg,
+                                    esp_tls_error_handle_t error_handle, int *sockfd);
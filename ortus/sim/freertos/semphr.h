@@ -0,0 +1,37 @@
+#pragma once
+
+// Mutex stand-in. With a single thread a mutex can only be taken twice by
+// the same code path, which on the device would deadlock; that aborts here.
+
+#include "FreeRTOS.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct
+{
+    bool taken;
+} StaticSemaphore_t;
+typedef StaticSemaphore_t *SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buffer)
+{
+    buffer->taken = false;
+    return buffer;
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t)
+{
+    if (mutex->taken)
+    {
+        fprintf(stderr, "sim: mutex taken twice, this deadlocks on the device\n");
+        abort();
+    }
+    mutex->taken = true;
+    return pdTRUE;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex)
+{
+    mutex->taken = false;
+    return pdTRUE;
+}
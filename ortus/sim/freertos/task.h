@@ -0,0 +1,36 @@
+#pragma once
+
+#include "FreeRTOS.h"
+#include "../sim.h"
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t, const char *, uint32_t, void *, UBaseType_t,
+                                          TaskHandle_t *handle, BaseType_t)
+{
+    if (handle)
+        *handle = nullptr;
+    return pdFAIL;
+}
+
+inline void vTaskDelete(TaskHandle_t) {}
+inline void vTaskDelay(TickType_t ticks) { sim::advanceMillis(ticks * portTICK_PERIOD_MS); }
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return nullptr; }
+
+// Notifications: with a single thread nothing can be waiting, so a take
+// just lets the timeout elapse.
+inline BaseType_t xTaskNotifyGive(TaskHandle_t) { return pdPASS; }
+inline void vTaskNotifyGiveFromISR(TaskHandle_t, BaseType_t *higherPriorityTaskWoken)
+{
+    if (higherPriorityTaskWoken)
+        *higherPriorityTaskWoken = pdFALSE;
+}
+inline uint32_t ulTaskNotifyTake(BaseType_t, TickType_t ticks)
+{
+    if (ticks != portMAX_DELAY)
+        sim::advanceMillis(ticks * portTICK_PERIOD_MS);
+    return 0;
+}
+#define portYIELD_FROM_ISR(...) do {} while (0)
+inline BaseType_t xPortGetCoreID() { return 1; }
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+
+// Entropy stand-in; nothing in the sim needs real randomness, and leaving
+// rand() alone keeps runs reproducible.
+
+typedef struct mbedtls_entropy_context
+{
+    int unused;
+} mbedtls_entropy_context;
+
+inline void mbedtls_entropy_init(mbedtls_entropy_context *) {}
+inline void mbedtls_entropy_free(mbedtls_entropy_context *) {}
+inline int mbedtls_entropy_func(void *, unsigned char *output, size_t len)
+{
+    memset(output, 0x5A, len);
+    return 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Socket context stand-in; sockets are whatever esp_tls_plain_tcp_connect()
+// handed out and are always ready.
+
+#define MBEDTLS_ERR_NET_CONN_RESET -0x0050
+#define MBEDTLS_NET_POLL_READ 1
+#define MBEDTLS_NET_POLL_WRITE 2
+
+typedef struct mbedtls_net_context
+{
+    int fd;
+} mbedtls_net_context;
+
+inline void mbedtls_net_init(mbedtls_net_context *ctx) { ctx->fd = -1; }
+inline void mbedtls_net_free(mbedtls_net_context *ctx) { ctx->fd = -1; }
+inline int mbedtls_net_set_nonblock(mbedtls_net_context *) { return 0; }
+inline int mbedtls_net_poll(mbedtls_net_context *, uint32_t rw, uint32_t) { return (int)rw; }
+inline int mbedtls_net_send(void *, const unsigned char *, size_t len) { return (int)len; }
+inline int mbedtls_net_recv(void *, unsigned char *, size_t) { return MBEDTLS_ERR_NET_CONN_RESET; }
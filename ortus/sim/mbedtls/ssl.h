@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "ctr_drbg.h"
+#include "net_sockets.h"
+#include "x509_crt.h"
+
+// The part of mbedTLS a TLS client needs. Handshakes with the simulated
+// broker succeed while it is up and the CA chain is required and set; a
+// session is reduced to the id of the ticket the broker issued. No
+// application data flows.
+
+#define MBEDTLS_ERR_SSL_BAD_INPUT_DATA -0x7100
+#define MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL -0x6A00
+#define MBEDTLS_ERR_SSL_WANT_READ -0x6900
+#define MBEDTLS_ERR_SSL_WANT_WRITE -0x6880
+#define MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY -0x7880
+#define MBEDTLS_ERR_X509_CERT_VERIFY_FAILED -0x2700
+
+#define MBEDTLS_SSL_IS_CLIENT 0
+#define MBEDTLS_SSL_TRANSPORT_STREAM 0
+#define MBEDTLS_SSL_PRESET_DEFAULT 0
+#define MBEDTLS_SSL_VERIFY_NONE 0
+#define MBEDTLS_SSL_VERIFY_REQUIRED 2
+
+typedef struct mbedtls_ssl_session
+{
+    uint32_t ticket;
+} mbedtls_ssl_session;
+
+typedef struct mbedtls_ssl_config
+{
+    int authmode;
+    const mbedtls_x509_crt *ca_chain;
+} mbedtls_ssl_config;
+
+typedef int mbedtls_ssl_send_t(void *ctx, const unsigned char *buf, size_t len);
+typedef int mbedtls_ssl_recv_t(void *ctx, unsigned char *buf, size_t len);
+
+typedef struct mbedtls_ssl_context
+{
+    const mbedtls_ssl_config *conf;
+    uint32_t offered; // Ticket of the session passed to set_session
+    uint32_t ticket;  // Issued or resumed by the handshake
+} mbedtls_ssl_context;
+
+inline void mbedtls_ssl_session_init(mbedtls_ssl_session *session) { session->ticket = 0; }
+inline void mbedtls_ssl_session_free(mbedtls_ssl_session *session) { session->ticket = 0; }
+
+inline int mbedtls_ssl_session_save(const mbedtls_ssl_session *session, unsigned char *buf, size_t len, size_t *olen)
+{
+    *olen = sizeof(session->ticket);
+    if (len < *olen)
+        return MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL;
+    memcpy(buf, &session->ticket, sizeof(session->ticket));
+    return 0;
+}
+
+inline int mbedtls_ssl_session_load(mbedtls_ssl_session *session, const unsigned char *buf, size_t len)
+{
+    if (len != sizeof(session->ticket))
+        return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    memcpy(&session->ticket, buf, len);
+    return 0;
+}
+
+inline void mbedtls_ssl_config_init(mbedtls_ssl_config *conf) { memset(conf, 0, sizeof(*conf)); }
+inline int mbedtls_ssl_config_defaults(mbedtls_ssl_config *, int, int, int) { return 0; }
+inline void mbedtls_ssl_conf_authmode(mbedtls_ssl_config *conf, int authmode) { conf->authmode = authmode; }
+inline void mbedtls_ssl_conf_ca_chain(mbedtls_ssl_config *conf, mbedtls_x509_crt *ca_chain, void *) { conf->ca_chain = ca_chain; }
+inline void mbedtls_ssl_conf_rng(mbedtls_ssl_config *, int (*)(void *, unsigned char *, size_t), void *) {}
+
+inline void mbedtls_ssl_init(mbedtls_ssl_context *ssl) { memset(ssl, 0, sizeof(*ssl)); }
+inline void mbedtls_ssl_free(mbedtls_ssl_context *ssl) { memset(ssl, 0, sizeof(*ssl)); }
+inline int mbedtls_ssl_setup(mbedtls_ssl_context *ssl, const mbedtls_ssl_config *conf)
+{
+    ssl->conf = conf;
+    return 0;
+}
+inline int mbedtls_ssl_set_hostname(mbedtls_ssl_context *, const char *) { return 0; }
+inline void mbedtls_ssl_set_bio(mbedtls_ssl_context *, void *, mbedtls_ssl_send_t *, mbedtls_ssl_recv_t *, void *) {}
+inline int mbedtls_ssl_set_session(mbedtls_ssl_context *ssl, const mbedtls_ssl_session *session)
+{
+    ssl->offered = session->ticket;
+    return 0;
+}
+inline int mbedtls_ssl_get_session(const mbedtls_ssl_context *ssl, mbedtls_ssl_session *session)
+{
+    session->ticket = ssl->ticket;
+    return 0;
+}
+inline int mbedtls_ssl_close_notify(mbedtls_ssl_context *) { return 0; }
+
+int mbedtls_ssl_handshake(mbedtls_ssl_context *ssl);
+int mbedtls_ssl_write(mbedtls_ssl_context *ssl, const unsigned char *buf, size_t len);
+int mbedtls_ssl_read(mbedtls_ssl_context *ssl, unsigned char *buf, size_t len);
+inline size_t mbedtls_ssl_get_bytes_avail(const mbedtls_ssl_context *) { return 0; }
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+// Certificate chain stand-in: parsing accepts any non-empty PEM.
+
+#define MBEDTLS_ERR_X509_INVALID_FORMAT -0x2180
+
+typedef struct mbedtls_x509_crt
+{
+    bool parsed;
+} mbedtls_x509_crt;
+
+inline void mbedtls_x509_crt_init(mbedtls_x509_crt *crt) { crt->parsed = false; }
+inline void mbedtls_x509_crt_free(mbedtls_x509_crt *crt) { crt->parsed = false; }
+inline int mbedtls_x509_crt_parse(mbedtls_x509_crt *chain, const unsigned char *buf, size_t buflen)
+{
+    chain->parsed = buf && buflen > 1;
+    return chain->parsed ? 0 : MBEDTLS_ERR_X509_INVALID_FORMAT;
+}
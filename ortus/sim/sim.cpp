@@ -0,0 +1,1221 @@
+#include "sim.h"
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <PubSubClient.h>
+#include <WebSocketsServer.h>
+#include <ESPmDNS.h>
+#include <Preferences.h>
+#include <DallasTemperature.h>
+#include <HTTPClient.h>
+#include <BLEDevice.h>
+#include <driver/ledc.h>
+#include <esp_pm.h>
+#include <esp_system.h>
+#include <esp_sntp.h>
+#include <esp_tls.h>
+#include <mbedtls/ssl.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+
+#include <malloc.h>
+#include <stdarg.h>
+#include <map>
+
+// --- Heap accounting ---
+// glibc exposes its allocator under __libc_* so every malloc (including the
+// ones behind operator new and ArduinoJson's default allocator) is counted.
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void __libc_free(void *ptr);
+
+namespace
+{
+    sim::HeapStats heap = {0, 0, 0};
+    uint64_t liveBytes = 0;
+    uint64_t peakLiveBytes = 0;
+
+    void noteAlloc(void *ptr)
+    {
+        if (!ptr || !sim::heapAccounting)
+            return;
+        heap.allocations++;
+        size_t size = malloc_usable_size(ptr);
+        heap.bytes += size;
+        liveBytes += size;
+        if (liveBytes > peakLiveBytes)
+            peakLiveBytes = liveBytes;
+    }
+
+    void noteFree(void *ptr)
+    {
+        if (!ptr || !sim::heapAccounting)
+            return;
+        heap.frees++;
+        liveBytes -= malloc_usable_size(ptr);
+    }
+}
+
+extern "C" void *malloc(size_t size)
+{
+    void *ptr = __libc_malloc(size);
+    noteAlloc(ptr);
+    return ptr;
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+    void *ptr = __libc_calloc(n, size);
+    noteAlloc(ptr);
+    return ptr;
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    noteFree(ptr);
+    void *out = __libc_realloc(ptr, size);
+    noteAlloc(out);
+    return out;
+}
+
+extern "C" void free(void *ptr)
+{
+    noteFree(ptr);
+    __libc_free(ptr);
+}
+
+// --- Simulation state ---
+
+namespace sim
+{
+    bool heapAccounting = true;
+    uint64_t clockMicros = 0;
+    int pinLevel[PIN_COUNT] = {};
+    uint32_t ledcDuty[LEDC_CHANNELS] = {};
+    uint32_t ledcWrites = 0;
+    uint64_t ledcFadeUntil[LEDC_CHANNELS] = {};
+    uint32_t ledcFadeMs[LEDC_CHANNELS] = {};
+    uint32_t ledcBlockingCalls = 0;
+    bool psramAvailable = true;
+    bool lightSleepEnabled = false;
+    int pmLocksHeld = 0;
+    void (*pinInterrupt[PIN_COUNT])() = {};
+    int pinInterruptMode[PIN_COUNT] = {};
+    uint8_t temperatureSensorCount = 1;
+    float temperatureC[TEMP_SENSOR_SLOTS] = {21.5f, 21.5f, 21.5f, 21.5f, 21.5f, 21.5f, 21.5f, 21.5f};
+    uint32_t temperatureConversions = 0;
+    bool wifiAvailable = true;
+    bool brokerAvailable = true;
+    uint32_t mqttPublishes = 0;
+    uint64_t mqttBytes = 0;
+    uint32_t wsBroadcasts = 0;
+    uint64_t wsBytes = 0;
+    uint32_t mqttConnects = 0;
+    int brokerConnackCode = 0;
+    uint32_t tlsFullHandshakes = 0;
+    uint32_t tlsResumedHandshakes = 0;
+    uint64_t tlsFullHandshakeMicros = 800000;
+    uint64_t tlsResumedHandshakeMicros = 60000;
+    uint32_t tlsBrokerTicket = 0;
+    uint32_t wsFrames[WS_CLIENT_SLOTS] = {};
+    uint64_t wsSendMicros[WS_CLIENT_SLOTS] = {};
+    bool capturePublishes = false;
+    std::vector<Publish> published;
+    bool captureWsFrames = false;
+    std::vector<WsFrame> wsSent;
+    std::string mdnsHostname;
+    std::string mdnsInstance;
+    std::vector<MdnsService> mdnsServices;
+    std::vector<uint8_t> httpBody;
+    int httpStatus = HTTP_CODE_OK;
+    uint64_t httpBytesPerSecond = 200 * 1024;
+    uint32_t httpRequests = 0;
+    uint32_t nvsWrites = 0;
+    std::vector<uint8_t> runningImage;
+    std::vector<uint8_t> otaPartition;
+    uint32_t otaBootSwitches = 0;
+    esp_ota_img_states_t runningImageState = ESP_OTA_IMG_VALID;
+    uint32_t restarts = 0;
+    bool serialEcho = false;
+
+    PubSubClient *activeMqtt = nullptr;
+    WebSocketsServer *activeWs = nullptr;
+    std::map<std::string, std::vector<uint8_t>, std::less<>> nvs;
+    sntp_sync_time_cb_t timeSyncCallback = nullptr;
+
+    void setInput(uint8_t pin, int level)
+    {
+        if (pin >= PIN_COUNT || pinLevel[pin] == level)
+            return;
+        pinLevel[pin] = level;
+        int mode = pinInterruptMode[pin];
+        bool fire = mode == CHANGE || (mode == RISING && level == HIGH) || (mode == FALLING && level == LOW);
+        if (fire && pinInterrupt[pin])
+            pinInterrupt[pin]();
+    }
+
+    void advanceMicros(uint64_t us) { clockMicros += us; }
+    void advanceMillis(uint64_t ms) { clockMicros += ms * 1000ULL; }
+
+    void deliverMqtt(const char *topic, const uint8_t *payload, size_t length)
+    {
+        if (activeMqtt)
+            activeMqtt->enqueueInbound(topic, payload, length);
+    }
+
+    void deliverWebSocket(uint8_t num, int type, const uint8_t *payload, size_t length)
+    {
+        if (activeWs)
+            activeWs->inject(num, (WStype_t)type, payload, length);
+    }
+
+    bool wsConnected(uint8_t num)
+    {
+        return activeWs && activeWs->clientIsConnected(num);
+    }
+
+    const char *mdnsTxt(const char *type, const char *key)
+    {
+        for (const MdnsService &service : mdnsServices)
+        {
+            if (service.type != type)
+                continue;
+            for (const auto &item : service.txt)
+            {
+                if (item.first == key)
+                    return item.second.c_str();
+            }
+        }
+        return nullptr;
+    }
+
+    void syncTime(uint32_t epoch)
+    {
+        struct timeval tv = {(time_t)epoch, 0};
+        if (timeSyncCallback)
+            timeSyncCallback(&tv);
+    }
+
+    HeapStats heapStats() { return heap; }
+
+    void reset()
+    {
+        clockMicros = 0;
+        ledcWrites = 0;
+        ledcBlockingCalls = 0;
+        for (int i = 0; i < LEDC_CHANNELS; i++)
+            ledcFadeUntil[i] = 0;
+        otaBootSwitches = 0;
+        runningImageState = ESP_OTA_IMG_VALID;
+        restarts = 0;
+        temperatureConversions = 0;
+        mqttPublishes = 0;
+        mqttBytes = 0;
+        wsBroadcasts = 0;
+        wsBytes = 0;
+        mqttConnects = 0;
+        brokerConnackCode = 0;
+        tlsFullHandshakes = 0;
+        tlsResumedHandshakes = 0;
+        tlsBrokerTicket = 0;
+        memset(wsFrames, 0, sizeof(wsFrames));
+        memset(wsSendMicros, 0, sizeof(wsSendMicros));
+        published.clear();
+        wsSent.clear();
+        bleAdvertisingStarts = 0;
+        nvsWrites = 0;
+    }
+}
+
+// --- Arduino core ---
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+    if (pin < sim::PIN_COUNT && mode == INPUT_PULLUP)
+        sim::pinLevel[pin] = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+    if (pin < sim::PIN_COUNT)
+        sim::pinLevel[pin] = val;
+}
+
+int digitalRead(uint8_t pin)
+{
+    return pin < sim::PIN_COUNT ? sim::pinLevel[pin] : LOW;
+}
+
+void attachInterrupt(uint8_t pin, void (*handler)(), int mode)
+{
+    if (pin < sim::PIN_COUNT)
+    {
+        sim::pinInterrupt[pin] = handler;
+        sim::pinInterruptMode[pin] = mode;
+    }
+}
+
+void detachInterrupt(uint8_t pin)
+{
+    if (pin < sim::PIN_COUNT)
+        sim::pinInterrupt[pin] = nullptr;
+}
+
+size_t Print::printf(const char *format, ...)
+{
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (n < 0)
+        return 0;
+    return write((const uint8_t *)buf, std::min((size_t)n, sizeof(buf) - 1));
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+    if (sim::serialEcho)
+        fwrite(buffer, 1, size, stdout);
+    return size;
+}
+
+// Numbers in the ballpark of an ESP32-S3 with internal SRAM only.
+static constexpr uint32_t SIM_HEAP_TOTAL = 320 * 1024;
+
+uint32_t EspClass::getFreeHeap() { return SIM_HEAP_TOTAL - (uint32_t)std::min<uint64_t>(liveBytes, SIM_HEAP_TOTAL); }
+uint32_t EspClass::getMinFreeHeap() { return SIM_HEAP_TOTAL - (uint32_t)std::min<uint64_t>(peakLiveBytes, SIM_HEAP_TOTAL); }
+bool psramFound() { return sim::psramAvailable; }
+void *ps_malloc(size_t size) { return sim::psramAvailable ? __libc_malloc(size) : nullptr; }
+
+uint32_t EspClass::getMaxAllocHeap() { return getFreeHeap() / 2; }
+
+static shutdown_handler_t shutdownHandlers[5];
+
+void EspClass::restart()
+{
+    for (shutdown_handler_t handler : shutdownHandlers)
+    {
+        if (handler)
+            handler();
+    }
+    sim::restarts++;
+}
+
+esp_err_t esp_register_shutdown_handler(shutdown_handler_t handler)
+{
+    for (shutdown_handler_t &slot : shutdownHandlers)
+    {
+        if (slot == handler)
+            return ESP_ERR_INVALID_STATE;
+        if (!slot)
+        {
+            slot = handler;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+// --- WiFi ---
+
+wl_status_t WiFiClass::begin(const char *, const char *)
+{
+    started = true;
+    return status();
+}
+
+bool WiFiClass::disconnect(bool)
+{
+    started = false;
+    return true;
+}
+
+wl_status_t WiFiClass::status()
+{
+    return started && sim::wifiAvailable ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+// --- ESP-TLS / mbedTLS ---
+
+namespace
+{
+    uint32_t tlsTicketsIssued = 0;
+    constexpr int TLS_SOCKET_FD = 1000; // Never a real descriptor
+}
+
+esp_err_t esp_tls_plain_tcp_connect(const char *, int, int, const esp_tls_cfg_t *, esp_tls_error_handle_t, int *sockfd)
+{
+    if (!sim::brokerAvailable)
+        return ESP_FAIL;
+    *sockfd = TLS_SOCKET_FD;
+    return ESP_OK;
+}
+
+int mbedtls_ssl_handshake(mbedtls_ssl_context *ssl)
+{
+    if (!sim::brokerAvailable)
+        return MBEDTLS_ERR_NET_CONN_RESET;
+    // Like mbedTLS, refuse a server that could not be verified
+    if (ssl->conf->authmode != MBEDTLS_SSL_VERIFY_REQUIRED || !ssl->conf->ca_chain || !ssl->conf->ca_chain->parsed)
+        return MBEDTLS_ERR_X509_CERT_VERIFY_FAILED;
+
+    if (ssl->offered != 0 && ssl->offered == sim::tlsBrokerTicket)
+    {
+        sim::tlsResumedHandshakes++;
+        sim::clockMicros += sim::tlsResumedHandshakeMicros;
+    }
+    else
+    {
+        sim::tlsFullHandshakes++;
+        sim::clockMicros += sim::tlsFullHandshakeMicros;
+        sim::tlsBrokerTicket = ++tlsTicketsIssued;
+    }
+    ssl->ticket = sim::tlsBrokerTicket;
+    return 0;
+}
+
+int mbedtls_ssl_write(mbedtls_ssl_context *, const unsigned char *, size_t len)
+{
+    return sim::brokerAvailable ? (int)len : MBEDTLS_ERR_NET_CONN_RESET;
+}
+
+int mbedtls_ssl_read(mbedtls_ssl_context *, unsigned char *, size_t)
+{
+    return sim::brokerAvailable ? MBEDTLS_ERR_SSL_WANT_READ : 0;
+}
+
+// --- HTTPClient ---
+
+bool HTTPClient::begin(WiFiClient &, const String &)
+{
+    body = Body();
+    return true;
+}
+
+int HTTPClient::GET()
+{
+    if (!sim::wifiAvailable)
+        return HTTPC_ERROR_CONNECTION_REFUSED;
+    sim::httpRequests++;
+    body.openedAt = sim::clockMicros;
+    body.open = sim::httpStatus == HTTP_CODE_OK;
+    return sim::httpStatus;
+}
+
+int HTTPClient::getSize()
+{
+    return (int)sim::httpBody.size();
+}
+
+WiFiClient *HTTPClient::getStreamPtr()
+{
+    return &body;
+}
+
+void HTTPClient::end()
+{
+    body.open = false;
+}
+
+String HTTPClient::errorToString(int)
+{
+    return String("connection refused");
+}
+
+int HTTPClient::Body::available()
+{
+    if (!open || !sim::wifiAvailable)
+        return 0;
+    uint64_t arrived = (sim::clockMicros - openedAt) * sim::httpBytesPerSecond / 1000000;
+    if (arrived > sim::httpBody.size())
+        arrived = sim::httpBody.size();
+    return (int)(arrived - position);
+}
+
+int HTTPClient::Body::read()
+{
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+}
+
+int HTTPClient::Body::read(uint8_t *buf, size_t size)
+{
+    size_t n = (size_t)available();
+    if (n == 0)
+        return -1;
+    if (n > size)
+        n = size;
+    memcpy(buf, sim::httpBody.data() + position, n);
+    position += n;
+    return (int)n;
+}
+
+uint8_t HTTPClient::Body::connected()
+{
+    return open && sim::wifiAvailable;
+}
+
+// --- OTA ---
+
+namespace
+{
+    const esp_partition_t appPartitions[2] = {{0x20000, 0x300000, "app0"}, {0x320000, 0x300000, "app1"}};
+    bool otaOpen = false;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    if (partition != &appPartitions[0] || src_offset + size > partition->size)
+        return ESP_ERR_INVALID_ARG;
+    // Erased flash past the end of the image
+    for (size_t i = 0; i < size; i++)
+        ((uint8_t *)dst)[i] = src_offset + i < sim::runningImage.size() ? sim::runningImage[src_offset + i] : 0xFF;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_get_sha256(const esp_partition_t *partition, uint8_t *sha_256)
+{
+    if (partition != &appPartitions[0])
+        return ESP_ERR_INVALID_ARG;
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts_ret(&ctx, 0);
+    mbedtls_sha256_update_ret(&ctx, sim::runningImage.data(), sim::runningImage.size());
+    mbedtls_sha256_finish_ret(&ctx, sha_256);
+    mbedtls_sha256_free(&ctx);
+    return ESP_OK;
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void)
+{
+    return &appPartitions[0];
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *)
+{
+    return &appPartitions[1];
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *out_handle)
+{
+    if (partition != &appPartitions[1] || otaOpen)
+        return ESP_ERR_INVALID_ARG;
+    if (image_size < OTA_WITH_SEQUENTIAL_WRITES && image_size > partition->size)
+        return ESP_ERR_INVALID_ARG;
+    sim::otaPartition.clear();
+    otaOpen = true;
+    *out_handle = 1;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t, const void *data, size_t size)
+{
+    if (!otaOpen || sim::otaPartition.size() + size > appPartitions[1].size)
+        return ESP_ERR_INVALID_ARG;
+    // Like IDF, refuse anything that does not start like an app image
+    if (sim::otaPartition.empty() && size > 0 && ((const uint8_t *)data)[0] != 0xE9)
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    sim::otaPartition.insert(sim::otaPartition.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t)
+{
+    if (!otaOpen)
+        return ESP_ERR_INVALID_ARG;
+    otaOpen = false;
+    return sim::otaPartition.empty() ? ESP_ERR_OTA_VALIDATE_FAILED : ESP_OK;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t)
+{
+    otaOpen = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+    if (partition != &appPartitions[1] || otaOpen)
+        return ESP_ERR_INVALID_ARG;
+    sim::otaBootSwitches++;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *ota_state)
+{
+    if (partition != &appPartitions[0])
+        return ESP_ERR_NOT_SUPPORTED;
+    *ota_state = sim::runningImageState;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback(void)
+{
+    sim::runningImageState = ESP_OTA_IMG_VALID;
+    return ESP_OK;
+}
+
+// --- PubSubClient ---
+
+PubSubClient::PubSubClient(Client &client)
+    : client(&client)
+{
+    sim::activeMqtt = this;
+    buffer.resize(bufferSize);
+}
+
+PubSubClient::~PubSubClient()
+{
+    if (sim::activeMqtt == this)
+        sim::activeMqtt = nullptr;
+}
+
+PubSubClient &PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE)
+{
+    this->callback = callback;
+    return *this;
+}
+
+bool PubSubClient::setBufferSize(uint16_t size)
+{
+    bufferSize = size;
+    buffer.resize(size);
+    return true;
+}
+
+bool PubSubClient::connect(const char *, const char *, const char *, const char *, uint8_t, bool, const char *,
+                           bool cleanSession)
+{
+    isConnected = false;
+    lastState = MQTT_CONNECT_FAILED;
+    if (!sim::brokerAvailable || !client->connect(host.c_str(), port))
+        return false;
+
+    sim::mqttConnects++;
+    if (sim::brokerConnackCode != 0)
+    {
+        lastState = sim::brokerConnackCode;
+        client->stop();
+        return false;
+    }
+    isConnected = true;
+    lastState = MQTT_CONNECTED;
+    if (cleanSession)
+    {
+        subscriptions.clear();
+        inbound.clear();
+    }
+    return true;
+}
+
+void PubSubClient::disconnect()
+{
+    isConnected = false;
+    client->stop();
+    subscriptions.clear();
+}
+
+bool PubSubClient::publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained)
+{
+    if (!connected())
+        return false;
+    // Same limit as the real client: fixed header + topic + payload must fit.
+    if (5 + 2 + strlen(topic) + length > bufferSize)
+        return false;
+    sim::mqttPublishes++;
+    sim::mqttBytes += strlen(topic) + length;
+    if (sim::capturePublishes)
+        sim::published.push_back({topic, std::vector<uint8_t>(payload, payload + length), retained});
+    return true;
+}
+
+bool PubSubClient::subscribe(const char *topic, uint8_t)
+{
+    if (!connected())
+        return false;
+    for (const std::string &filter : subscriptions)
+    {
+        if (filter == topic)
+            return true;
+    }
+    subscriptions.push_back(topic);
+    return true;
+}
+
+bool PubSubClient::unsubscribe(const char *topic)
+{
+    for (size_t i = 0; i < subscriptions.size(); i++)
+    {
+        if (subscriptions[i] == topic)
+        {
+            subscriptions.erase(subscriptions.begin() + i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool PubSubClient::matches(const std::string &filter, const std::string &topic) const
+{
+    size_t f = 0, t = 0;
+    while (f < filter.size())
+    {
+        if (filter[f] == '#')
+            return true;
+        // "a/#" also matches "a"
+        if (t == topic.size() && filter.compare(f, std::string::npos, "/#") == 0)
+            return true;
+        if (filter[f] == '+')
+        {
+            while (t < topic.size() && topic[t] != '/')
+                t++;
+            f++;
+            continue;
+        }
+        if (t >= topic.size() || filter[f] != topic[t])
+            return false;
+        f++;
+        t++;
+    }
+    return t == topic.size();
+}
+
+void PubSubClient::enqueueInbound(const char *topic, const uint8_t *payload, size_t length)
+{
+    inbound.push_back({topic, std::vector<uint8_t>(payload, payload + length)});
+}
+
+bool PubSubClient::loop()
+{
+    if (!connected())
+    {
+        if (isConnected)
+            client->stop();
+        isConnected = false;
+        return false;
+    }
+
+    // Like the real client, the topic and payload are handed out of one
+    // fixed receive buffer.
+    while (!inbound.empty())
+    {
+        Inbound &msg = inbound.front();
+        bool subscribed = false;
+        for (const std::string &filter : subscriptions)
+            subscribed = subscribed || matches(filter, msg.topic);
+
+        size_t topicLen = msg.topic.size();
+        if (subscribed && callback && topicLen + 1 + msg.payload.size() <= buffer.size())
+        {
+            memcpy(buffer.data(), msg.topic.c_str(), topicLen + 1);
+            uint8_t *payload = buffer.data() + topicLen + 1;
+            memcpy(payload, msg.payload.data(), msg.payload.size());
+            callback((char *)buffer.data(), payload, (unsigned int)msg.payload.size());
+        }
+        inbound.erase(inbound.begin());
+    }
+    return true;
+}
+
+// --- WebSocketsServer ---
+
+static_assert(WEBSOCKETS_SERVER_CLIENT_MAX <= sim::WS_CLIENT_SLOTS, "sim::wsFrames is too small");
+
+WebSocketsServer::WebSocketsServer(uint16_t)
+{
+    sim::activeWs = this;
+}
+
+WebSocketsServer::~WebSocketsServer()
+{
+    if (sim::activeWs == this)
+        sim::activeWs = nullptr;
+}
+
+void WebSocketsServer::inject(uint8_t num, WStype_t type, const uint8_t *payload, size_t length)
+{
+    if (num >= WEBSOCKETS_SERVER_CLIENT_MAX)
+        return;
+    if (type == WStype_CONNECTED)
+        clients[num] = true;
+    else if (type == WStype_DISCONNECTED)
+        clients[num] = false;
+    if (event)
+        event(num, type, (uint8_t *)payload, length);
+}
+
+bool WebSocketsServer::sendTXT(uint8_t num, const uint8_t *payload, size_t length)
+{
+    if (!clientIsConnected(num))
+        return false;
+    sim::wsBroadcasts++;
+    sim::wsBytes += length;
+    sim::wsFrames[num]++;
+    if (sim::captureWsFrames && payload)
+        sim::wsSent.push_back({num, std::vector<uint8_t>(payload, payload + length)});
+    sim::clockMicros += sim::wsSendMicros[num];
+    return true;
+}
+
+bool WebSocketsServer::sendBIN(uint8_t num, const uint8_t *payload, size_t length)
+{
+    return sendTXT(num, payload, length);
+}
+
+bool WebSocketsServer::broadcastTXT(const uint8_t *, size_t length)
+{
+    for (uint8_t num = 0; num < WEBSOCKETS_SERVER_CLIENT_MAX; num++)
+        sendTXT(num, (const uint8_t *)nullptr, length);
+    return true;
+}
+
+bool WebSocketsServer::broadcastBIN(const uint8_t *payload, size_t length)
+{
+    return broadcastTXT(payload, length);
+}
+
+void WebSocketsServer::disconnect(uint8_t num)
+{
+    if (num < WEBSOCKETS_SERVER_CLIENT_MAX && clients[num])
+    {
+        clients[num] = false;
+        if (event)
+            event(num, WStype_DISCONNECTED, nullptr, 0);
+    }
+}
+
+uint8_t WebSocketsServer::connectedClients(bool)
+{
+    uint8_t n = 0;
+    for (bool c : clients)
+        n += c ? 1 : 0;
+    return n;
+}
+
+// --- mDNS ---
+
+MDNSResponder MDNS;
+
+namespace
+{
+    std::string mdnsServiceType(const char *service, const char *proto)
+    {
+        std::string type = service[0] == '_' ? service : std::string("_") + service;
+        type += proto[0] == '_' ? "." : "._";
+        return type + proto;
+    }
+}
+
+bool MDNSResponder::begin(const char *hostName)
+{
+    if (!sim::wifiAvailable || !hostName || !hostName[0])
+        return false;
+    sim::mdnsHostname = hostName;
+    return true;
+}
+
+void MDNSResponder::end()
+{
+    sim::mdnsHostname.clear();
+    sim::mdnsInstance.clear();
+    sim::mdnsServices.clear();
+}
+
+void MDNSResponder::setInstanceName(String name)
+{
+    sim::mdnsInstance = name.c_str();
+}
+
+bool MDNSResponder::addService(const char *service, const char *proto, uint16_t port)
+{
+    if (sim::mdnsHostname.empty())
+        return false;
+    const std::string type = mdnsServiceType(service, proto);
+    for (const sim::MdnsService &existing : sim::mdnsServices)
+    {
+        if (existing.type == type)
+            return false;
+    }
+    sim::mdnsServices.push_back({type, port, {}});
+    return true;
+}
+
+bool MDNSResponder::addServiceTxt(const char *service, const char *proto, const char *key, const char *value)
+{
+    const std::string type = mdnsServiceType(service, proto);
+    for (sim::MdnsService &existing : sim::mdnsServices)
+    {
+        if (existing.type != type)
+            continue;
+        for (auto &item : existing.txt)
+        {
+            if (item.first == key)
+            {
+                item.second = value;
+                return true;
+            }
+        }
+        existing.txt.emplace_back(key, value);
+        return true;
+    }
+    return false;
+}
+
+// --- Preferences ---
+// Keys are looked up through a stack buffer and existing values are
+// overwritten in place, so rewriting a key does not touch the heap.
+
+namespace
+{
+    struct NvsKey
+    {
+        char text[64];
+        NvsKey(const String &ns, const char *key) { snprintf(text, sizeof(text), "%s.%s", ns.c_str(), key); }
+    };
+}
+
+bool Preferences::begin(const char *name, bool)
+{
+    ns = name;
+    return true;
+}
+
+bool Preferences::clear()
+{
+    NvsKey prefix(ns, "");
+    size_t len = strlen(prefix.text);
+    for (auto it = sim::nvs.begin(); it != sim::nvs.end();)
+        it = it->first.compare(0, len, prefix.text) == 0 ? sim::nvs.erase(it) : std::next(it);
+    sim::nvsWrites++;
+    return true;
+}
+
+bool Preferences::remove(const char *key)
+{
+    auto it = sim::nvs.find(NvsKey(ns, key).text);
+    if (it == sim::nvs.end())
+        return false;
+    sim::nvs.erase(it);
+    sim::nvsWrites++;
+    return true;
+}
+
+bool Preferences::isKey(const char *key)
+{
+    return sim::nvs.find(NvsKey(ns, key).text) != sim::nvs.end();
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t len)
+{
+    const uint8_t *bytes = (const uint8_t *)value;
+    NvsKey k(ns, key);
+    auto it = sim::nvs.find(k.text);
+    if (it == sim::nvs.end())
+        it = sim::nvs.emplace(k.text, std::vector<uint8_t>()).first;
+    it->second.assign(bytes, bytes + len);
+    sim::nvsWrites++;
+    return len;
+}
+
+size_t Preferences::getBytesLength(const char *key)
+{
+    auto it = sim::nvs.find(NvsKey(ns, key).text);
+    return it == sim::nvs.end() ? 0 : it->second.size();
+}
+
+size_t Preferences::getBytes(const char *key, void *buf, size_t maxLen)
+{
+    auto it = sim::nvs.find(NvsKey(ns, key).text);
+    if (it == sim::nvs.end() || it->second.size() > maxLen)
+        return 0;
+    memcpy(buf, it->second.data(), it->second.size());
+    return it->second.size();
+}
+
+String Preferences::getString(const char *key, const String &defaultValue)
+{
+    auto it = sim::nvs.find(NvsKey(ns, key).text);
+    if (it == sim::nvs.end() || it->second.empty())
+        return defaultValue;
+    return String((const char *)it->second.data());
+}
+
+// --- DallasTemperature ---
+
+uint8_t DallasTemperature::getDeviceCount()
+{
+    return sim::temperatureSensorCount;
+}
+
+bool DallasTemperature::getAddress(uint8_t *address, uint8_t index)
+{
+    if (index >= sim::temperatureSensorCount)
+        return false;
+    const uint8_t rom[8] = {0x28, (uint8_t)(index + 1), 0, 0, 0, 0, 0, 0};
+    memcpy(address, rom, sizeof(rom));
+    return true;
+}
+
+DallasTemperature::request_t DallasTemperature::requestTemperatures()
+{
+    sim::temperatureConversions++;
+    conversionStartedAt = sim::clockMicros;
+    converting = true;
+    if (waitForConversion)
+        sim::advanceMillis(millisToWaitForConversion(resolution));
+    return {true, millis()};
+}
+
+bool DallasTemperature::isConversionComplete()
+{
+    return !converting || sim::clockMicros - conversionStartedAt >= 1000ULL * millisToWaitForConversion(resolution);
+}
+
+float DallasTemperature::getTempC(const uint8_t *address)
+{
+    uint8_t index = address[1] - 1;
+    if (address[0] != 0x28 || index >= sim::temperatureSensorCount)
+        return DEVICE_DISCONNECTED_C;
+    // Reading the scratchpad before the conversion is done returns the
+    // power-on value, as on the real part.
+    if (!isConversionComplete())
+        return 85.0f;
+    return sim::temperatureC[index];
+}
+
+// --- Time ---
+
+void configTime(long, int, const char *, const char *, const char *) {}
+
+void sntp_set_time_sync_notification_cb(sntp_sync_time_cb_t callback) { sim::timeSyncCallback = callback; }
+
+// --- Power management ---
+
+struct esp_pm_lock
+{
+    bool held;
+};
+
+esp_err_t esp_pm_configure(const void *config)
+{
+    sim::lightSleepEnabled = static_cast<const esp_pm_config_esp32s3_t *>(config)->light_sleep_enable;
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t, int, const char *, esp_pm_lock_handle_t *out_handle)
+{
+    static esp_pm_lock locks[4];
+    static int created = 0;
+    if (created >= 4)
+        return ESP_ERR_NOT_SUPPORTED;
+    *out_handle = &locks[created++];
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle)
+{
+    if (!handle->held)
+        sim::pmLocksHeld++;
+    handle->held = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle)
+{
+    if (!handle->held)
+        return ESP_ERR_INVALID_STATE;
+    handle->held = false;
+    sim::pmLocksHeld--;
+    return ESP_OK;
+}
+
+// --- LEDC ---
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t *conf)
+{
+    // The timer divides the 80 MHz APB clock
+    return (uint64_t)conf->freq_hz << conf->duty_resolution <= 80000000 ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t ledc_channel_config(const ledc_channel_config_t *conf)
+{
+    return ledc_set_duty(conf->speed_mode, conf->channel, conf->duty);
+}
+
+static uint32_t pendingDuty[sim::LEDC_CHANNELS] = {};
+
+static bool fadeRunning(ledc_channel_t channel)
+{
+    if (sim::clockMicros >= sim::ledcFadeUntil[channel])
+        return false;
+    sim::ledcBlockingCalls++;
+    return true;
+}
+
+esp_err_t ledc_set_duty(ledc_mode_t, ledc_channel_t channel, uint32_t duty)
+{
+    if (channel >= sim::LEDC_CHANNELS)
+        return ESP_FAIL;
+    fadeRunning(channel);
+    pendingDuty[channel] = duty;
+    return ESP_OK;
+}
+
+esp_err_t ledc_update_duty(ledc_mode_t, ledc_channel_t channel)
+{
+    if (channel >= sim::LEDC_CHANNELS)
+        return ESP_FAIL;
+    sim::ledcDuty[channel] = pendingDuty[channel];
+    sim::ledcWrites++;
+    return ESP_OK;
+}
+
+uint32_t ledc_get_duty(ledc_mode_t, ledc_channel_t channel)
+{
+    return channel < sim::LEDC_CHANNELS ? sim::ledcDuty[channel] : 0;
+}
+
+esp_err_t ledc_fade_func_install(int) { return ESP_OK; }
+
+esp_err_t ledc_set_fade_with_time(ledc_mode_t, ledc_channel_t channel, uint32_t target_duty, int max_fade_time_ms)
+{
+    if (channel >= sim::LEDC_CHANNELS || max_fade_time_ms < 0)
+        return ESP_FAIL;
+    fadeRunning(channel);
+    pendingDuty[channel] = target_duty;
+    sim::ledcFadeMs[channel] = max_fade_time_ms;
+    return ESP_OK;
+}
+
+// Jumps straight to the target; ledcFadeUntil says when it would get there
+esp_err_t ledc_fade_start(ledc_mode_t, ledc_channel_t channel, ledc_fade_mode_t)
+{
+    if (channel >= sim::LEDC_CHANNELS)
+        return ESP_FAIL;
+    sim::ledcDuty[channel] = pendingDuty[channel];
+    sim::ledcFadeUntil[channel] = sim::clockMicros + sim::ledcFadeMs[channel] * 1000ULL;
+    sim::ledcWrites++;
+    return ESP_OK;
+}
+
+// --- BLE ---
+
+namespace sim
+{
+    size_t bleStackBytes = 48 * 1024;
+    bool bleActive = false;
+    uint32_t bleAdvertisingStarts = 0;
+}
+
+namespace
+{
+    BLEServer *bleServer = nullptr;
+    BLEAdvertising bleAdvertising;
+    void *bleStack = nullptr;
+}
+
+BLECharacteristic::~BLECharacteristic()
+{
+    for (BLEDescriptor *d : descriptors)
+        delete d;
+}
+
+BLEDescriptor *BLECharacteristic::getDescriptorByUUID(const BLEUUID &uuid)
+{
+    for (BLEDescriptor *d : descriptors)
+        if (d->getUUID().equals(uuid))
+            return d;
+    return nullptr;
+}
+
+BLEService::~BLEService()
+{
+    for (BLECharacteristic *c : characteristics)
+        delete c;
+}
+
+BLECharacteristic *BLEService::createCharacteristic(const char *uuid, uint32_t)
+{
+    characteristics.push_back(new BLECharacteristic(uuid));
+    return characteristics.back();
+}
+
+BLEServer::~BLEServer()
+{
+    for (BLEService *s : services)
+        delete s;
+}
+
+BLEService *BLEServer::createService(const char *)
+{
+    services.push_back(new BLEService());
+    return services.back();
+}
+
+void BLEServer::startAdvertising()
+{
+    sim::bleAdvertisingStarts++;
+}
+
+void BLEDevice::init(const char *)
+{
+    if (!bleStack)
+        bleStack = malloc(sim::bleStackBytes);
+    sim::bleActive = true;
+}
+
+void BLEDevice::deinit(bool)
+{
+    delete bleServer;
+    bleServer = nullptr;
+    free(bleStack);
+    bleStack = nullptr;
+    sim::bleActive = false;
+}
+
+BLEServer *BLEDevice::createServer()
+{
+    if (!bleServer)
+        bleServer = new BLEServer();
+    return bleServer;
+}
+
+BLEAdvertising *BLEDevice::getAdvertising() { return &bleAdvertising; }
+void BLEDevice::startAdvertising() { sim::bleAdvertisingStarts++; }
+void BLEDevice::stopAdvertising() {}
+
+void sim::bleConnection(bool connected)
+{
+    if (!bleServer || !bleServer->callbacks)
+        return;
+    if (connected)
+        bleServer->callbacks->onConnect(bleServer);
+    else
+        bleServer->callbacks->onDisconnect(bleServer);
+}
+
+bool sim::bleWrite(const char *uuid, const char *value)
+{
+    if (!bleServer)
+        return false;
+    for (BLEService *service : bleServer->services)
+    {
+        for (BLECharacteristic *characteristic : service->characteristics)
+        {
+            if (characteristic->uuid != uuid)
+                continue;
+            characteristic->value = value;
+            if (characteristic->callbacks)
+                characteristic->callbacks->onWrite(characteristic);
+            return true;
+        }
+    }
+    return false;
+}
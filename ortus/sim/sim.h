@@ -0,0 +1,175 @@
+#pragma once
+
+// Host-side simulation controls for the `native` PlatformIO environment.
+// The stand-in headers in this directory replace the ESP32 Arduino core and
+// the networking/sensor libraries so that ortus.cpp can run on plain Linux.
+// Everything that is "hardware" lives here so the bench can drive it.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include "esp_ota_ops.h"
+
+namespace sim
+{
+    // --- Virtual clock ---
+    // millis()/micros() and esp_timer_get_time() read this instead of a
+    // hardware timer.
+    extern uint64_t clockMicros;
+    void advanceMicros(uint64_t us);
+    void advanceMillis(uint64_t ms);
+
+    // --- GPIO / LEDC ---
+    constexpr int PIN_COUNT = 64;
+    constexpr int LEDC_CHANNELS = 8;
+    extern int pinLevel[PIN_COUNT];
+    // Duty each channel is at, or fading to
+    extern uint32_t ledcDuty[LEDC_CHANNELS];
+    extern uint32_t ledcWrites;
+    // clockMicros when the running fade ends, and how long the last one was
+    extern uint64_t ledcFadeUntil[LEDC_CHANNELS];
+    extern uint32_t ledcFadeMs[LEDC_CHANNELS];
+    // Duty changes made while a fade ran; IDF 4.4 blocks them until it ends
+    extern uint32_t ledcBlockingCalls;
+    // Drive an input pin from outside; fires an attachInterrupt() handler.
+    void setInput(uint8_t pin, int level);
+
+    // --- Memory ---
+    // Whether the module has PSRAM (the S3 WROOM-2 on the tower does).
+    extern bool psramAvailable;
+
+    // --- Power management ---
+    extern bool lightSleepEnabled;
+    extern int pmLocksHeld;
+
+    // --- Sensors ---
+    // DS18B20 probes on the OneWire bus; probe i reports temperatureC[i].
+    constexpr int TEMP_SENSOR_SLOTS = 8;
+    extern uint8_t temperatureSensorCount;
+    extern float temperatureC[TEMP_SENSOR_SLOTS];
+    extern uint32_t temperatureConversions;
+
+    // --- Network ---
+    extern bool wifiAvailable;
+    extern bool brokerAvailable;
+    // Every CONNECT the broker sees; a non-zero brokerConnackCode refuses
+    // them with that CONNACK return code (3: server unavailable).
+    extern uint32_t mqttConnects;
+    extern int brokerConnackCode;
+    extern uint32_t mqttPublishes;
+    extern uint64_t mqttBytes;
+    extern uint32_t wsBroadcasts;
+    extern uint64_t wsBytes;
+    // Per WebSocket client: frames sent to it, and how long each send to it
+    // blocks on the virtual clock (a congested or half-dead client).
+    constexpr int WS_CLIENT_SLOTS = 8;
+    extern uint32_t wsFrames[WS_CLIENT_SLOTS];
+    extern uint64_t wsSendMicros[WS_CLIENT_SLOTS];
+
+    struct Publish
+    {
+        std::string topic;
+        std::vector<uint8_t> payload;
+        bool retained;
+    };
+    struct WsFrame
+    {
+        uint8_t num;
+        std::vector<uint8_t> payload;
+    };
+    // When enabled, every MQTT publish is appended to `published`, and
+    // every frame sent to a WebSocket client to `wsSent`.
+    extern bool capturePublishes;
+    extern std::vector<Publish> published;
+    extern bool captureWsFrames;
+    extern std::vector<WsFrame> wsSent;
+
+    // TLS handshakes with the broker. A full one costs tlsFullHandshakeMicros
+    // of virtual time, resuming the session from the ticket the broker last
+    // issued tlsResumedHandshakeMicros. Clearing tlsBrokerTicket makes the
+    // broker forget its tickets (restart, key rotation).
+    extern uint32_t tlsFullHandshakes;
+    extern uint32_t tlsResumedHandshakes;
+    extern uint64_t tlsFullHandshakeMicros;
+    extern uint64_t tlsResumedHandshakeMicros;
+    extern uint32_t tlsBrokerTicket;
+
+    // Deliver an inbound MQTT message to the subscribed callback.
+    void deliverMqtt(const char *topic, const uint8_t *payload, size_t length);
+    // Deliver a WebSocket event to the registered handler.
+    void deliverWebSocket(uint8_t num, int type, const uint8_t *payload, size_t length);
+    // Whether the server still has client `num` (it may have dropped it).
+    bool wsConnected(uint8_t num);
+
+    // mDNS: the hostname claimed (empty while stopped) and the services
+    // advertised, with their TXT records.
+    struct MdnsService
+    {
+        std::string type; // "_ortus._tcp"
+        uint16_t port;
+        std::vector<std::pair<std::string, std::string>> txt;
+    };
+    extern std::string mdnsHostname;
+    extern std::string mdnsInstance;
+    extern std::vector<MdnsService> mdnsServices;
+    // TXT value of `key` on service `type`, or null.
+    const char *mdnsTxt(const char *type, const char *key);
+
+    // HTTP downloads (OTA): every URL serves httpBody with httpStatus.
+    // Requests are counted in httpRequests.
+    extern std::vector<uint8_t> httpBody;
+    extern int httpStatus;
+    extern uint32_t httpRequests;
+    extern uint64_t httpBytesPerSecond;
+
+    // --- BLE ---
+    // Heap the stack holds between BLEDevice::init() and deinit().
+    extern size_t bleStackBytes;
+    extern bool bleActive;
+    extern uint32_t bleAdvertisingStarts;
+    // A central connects or disconnects; does nothing while BLE is down.
+    void bleConnection(bool connected);
+    // A central writes `value` to the characteristic `uuid`. False if BLE
+    // is down or there is no such characteristic.
+    bool bleWrite(const char *uuid, const char *value);
+
+    // --- Persistence ---
+    extern uint32_t nvsWrites;
+
+    // --- OTA ---
+    // Image in the running app slot, and the other slot updates are
+    // written to. A boot switch is counted, not carried out.
+    extern std::vector<uint8_t> runningImage;
+    extern std::vector<uint8_t> otaPartition;
+    extern uint32_t otaBootSwitches;
+    // ESP_OTA_IMG_PENDING_VERIFY right after an update, until the firmware
+    // confirms the image.
+    extern esp_ota_img_states_t runningImageState;
+    // ESP.restart() runs the shutdown handlers and returns, counted here.
+    extern uint32_t restarts;
+
+    // --- Time ---
+    // Completes an SNTP sync at Unix time `epoch`, as if an NTP reply came in.
+    void syncTime(uint32_t epoch);
+
+    // --- Console ---
+    // Serial output is discarded unless echo is enabled.
+    extern bool serialEcho;
+
+    // --- Heap accounting ---
+    // Counted by the malloc/free wrappers in sim.cpp.
+    struct HeapStats
+    {
+        uint64_t allocations;
+        uint64_t frees;
+        uint64_t bytes;
+    };
+    HeapStats heapStats();
+    // Allocations made while this is false (e.g. bench bookkeeping) are not
+    // counted. Memory allocated untracked must also be freed untracked.
+    extern bool heapAccounting;
+
+    void reset();
+}
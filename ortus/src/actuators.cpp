@@ -0,0 +1,312 @@
+#include "actuators.h"
+#include "driver/ledc.h"
+
+namespace
+{
+    constexpr ActuatorConfig LAYOUT[] = ACTUATOR_LAYOUT;
+    constexpr uint8_t LAYOUT_SIZE = sizeof(LAYOUT) / sizeof(LAYOUT[0]);
+    static_assert(LAYOUT_SIZE <= MAX_ACTUATOR_CHANNELS, "ACTUATOR_LAYOUT has too many channels");
+
+    constexpr uint32_t PWM_MAX_DUTY = (1 << PWM_RESOLUTION_BITS) - 1;
+    static_assert(PWM_FREQUENCY_HZ << PWM_RESOLUTION_BITS <= 80000000, "PWM frequency too high for the resolution");
+
+    // A hardware fade can end up to a duty step early, never late; this
+    // covers the end-of-fade interrupt.
+    constexpr uint64_t FADE_SETTLE_US = 1000;
+}
+
+ActuatorEngine::ActuatorEngine()
+{
+    uint8_t nextLedc = 0;
+    for (const ActuatorConfig &config : LAYOUT)
+    {
+        Channel &channel = channels[channelCount++];
+        channel.pin = config.pin;
+        channel.kind = config.kind;
+        channel.ledcChannel = config.kind == ActuatorKind::Pwm ? nextLedc++ : 0;
+        channel.appliedLevel = -1;
+        channel.ceiling = 100;
+        channel.transitionMs = PWM_DEFAULT_TRANSITION_MS;
+        channel.fadeFromDuty = 0;
+        channel.fadeToDuty = 0;
+        channel.fadeStartedAt = 0;
+        channel.fadeDoneAt = 0;
+        channel.fadeEndsAt = 0;
+        channel.cycleOnPhase = false;
+        channel.cycleNextToggle = 0;
+        channel.stopAt = 0;
+    }
+}
+
+void ActuatorEngine::begin(ChannelState *states)
+{
+    this->states = states;
+
+    // All PWM channels share one timer
+    ledc_timer_config_t timer = {
+        .speed_mode = LEDC_LOW_SPEED_MODE,
+        .duty_resolution = (ledc_timer_bit_t)PWM_RESOLUTION_BITS,
+        .timer_num = LEDC_TIMER_0,
+        .freq_hz = PWM_FREQUENCY_HZ,
+        .clk_cfg = LEDC_AUTO_CLK};
+    ledc_timer_config(&timer);
+    // Without the fade service levels are written directly
+    fadeInstalled = ledc_fade_func_install(0) == ESP_OK;
+
+    for (uint8_t i = 0; i < channelCount; i++)
+    {
+        Channel &channel = channels[i];
+        if (channel.kind == ActuatorKind::Pwm)
+        {
+            ledc_channel_config_t config = {
+                .gpio_num = channel.pin,
+                .speed_mode = LEDC_LOW_SPEED_MODE,
+                .channel = (ledc_channel_t)channel.ledcChannel,
+                .intr_type = LEDC_INTR_DISABLE,
+                .timer_sel = LEDC_TIMER_0,
+                .duty = 0,
+                .hpoint = 0,
+                .flags = {.output_invert = 0}};
+            ledc_channel_config(&config);
+        }
+        else
+        {
+            pinMode(channel.pin, OUTPUT);
+        }
+        channel.appliedLevel = -1; // Force the first write, which fades up from off
+    }
+}
+
+uint8_t ActuatorEngine::primary(ActuatorKind kind) const
+{
+    for (uint8_t i = 0; i < channelCount; i++)
+    {
+        if (channels[i].kind == kind)
+            return i;
+    }
+    return DEFAULT_CHANNEL;
+}
+
+void ActuatorEngine::setLevel(uint8_t index, uint8_t level)
+{
+    if (channels[index].kind == ActuatorKind::Relay)
+        level = level > 0 ? 100 : 0;
+    states[index].level = level;
+}
+
+void ActuatorEngine::setTransition(uint8_t index, uint16_t milliseconds)
+{
+    if (milliseconds == DEFAULT_TRANSITION)
+        return;
+    channels[index].transitionMs = milliseconds < MAX_TRANSITION_MS ? milliseconds : MAX_TRANSITION_MS;
+}
+
+void ActuatorEngine::pulse(uint8_t index, unsigned long seconds)
+{
+    channels[index].stopAt = monotonicMicros() + secondsToMicros(seconds);
+    states[index].level = 100;
+}
+
+void ActuatorEngine::startCycle(uint8_t index, unsigned long onSeconds, unsigned long offSeconds)
+{
+    ChannelState &state = states[index];
+    state.cycleActive = true;
+    state.cycleOnSeconds = onSeconds;
+    state.cycleOffSeconds = offSeconds;
+    resumeCycle(index, 0);
+}
+
+void ActuatorEngine::resumeCycle(uint8_t index, uint32_t position)
+{
+    Channel &channel = channels[index];
+    ChannelState &state = states[index];
+    const uint32_t period = state.cycleOnSeconds + state.cycleOffSeconds;
+    if (period == 0)
+        return;
+    position %= period;
+
+    channel.cycleOnPhase = position < state.cycleOnSeconds;
+    uint32_t remaining = (channel.cycleOnPhase ? state.cycleOnSeconds : period) - position;
+    channel.cycleNextToggle = monotonicMicros() + secondsToMicros(remaining);
+    state.level = channel.cycleOnPhase ? 100 : 0;
+}
+
+uint32_t ActuatorEngine::cyclePosition(uint8_t index) const
+{
+    const Channel &channel = channels[index];
+    const ChannelState &state = states[index];
+    const uint64_t now = monotonicMicros();
+    const uint32_t phaseEnd = channel.cycleOnPhase ? state.cycleOnSeconds : state.cycleOnSeconds + state.cycleOffSeconds;
+    // Whole seconds left, rounded up so the position never runs ahead
+    uint32_t remaining = channel.cycleNextToggle > now ? (channel.cycleNextToggle - now + 999999) / 1000000 : 0;
+    return remaining < phaseEnd ? phaseEnd - remaining : 0;
+}
+
+bool ActuatorEngine::setCeiling(uint8_t index, uint8_t ceiling)
+{
+    if (channels[index].ceiling == ceiling)
+        return false;
+    channels[index].ceiling = ceiling;
+    return true;
+}
+
+bool ActuatorEngine::update()
+{
+    const uint64_t now = monotonicMicros();
+    bool changed = false;
+
+    for (uint8_t i = 0; i < channelCount; i++)
+    {
+        Channel &channel = channels[i];
+        ChannelState &state = states[i];
+
+        if (state.cycleActive)
+        {
+            if (now >= channel.cycleNextToggle)
+            {
+                channel.cycleOnPhase = !channel.cycleOnPhase;
+                state.level = channel.cycleOnPhase ? 100 : 0;
+                unsigned long duration = channel.cycleOnPhase ? state.cycleOnSeconds : state.cycleOffSeconds;
+                // Step from the deadline, not from `now`, so a late pass
+                // does not push the whole schedule back
+                channel.cycleNextToggle += secondsToMicros(duration);
+                if (channel.cycleNextToggle <= now)
+                    channel.cycleNextToggle = now + secondsToMicros(duration);
+                changed = true;
+            }
+        }
+        else if (channel.stopAt != 0 && now >= channel.stopAt)
+        {
+            state.level = 0;
+            channel.stopAt = 0;
+            changed = true;
+        }
+
+        // A change that comes in during a fade step waits for the step to
+        // end, then fades on from wherever the light got to
+        if (channel.fadeEndsAt != 0 && now >= channel.fadeEndsAt)
+            channel.fadeEndsAt = 0;
+        const uint8_t level = state.level < channel.ceiling ? state.level : channel.ceiling;
+        if (state.capped != (level < state.level))
+        {
+            state.capped = level < state.level;
+            changed = true;
+        }
+        if (channel.fadeEndsAt != 0)
+            continue;
+        if (channel.appliedLevel != level)
+            write(channel, level, now);
+        else if (channel.fadeDoneAt != 0)
+            fadeStep(channel, now);
+    }
+    return changed;
+}
+
+bool ActuatorEngine::nextDeadline(uint64_t &at) const
+{
+    bool found = false;
+    for (uint8_t i = 0; i < channelCount; i++)
+    {
+        uint64_t deadline;
+        if (states[i].cycleActive)
+            deadline = channels[i].cycleNextToggle;
+        else if (channels[i].stopAt != 0)
+            deadline = channels[i].stopAt;
+        else
+            deadline = 0;
+        // The step end continues the fade or applies a waiting change
+        if (channels[i].fadeEndsAt != 0 && (deadline == 0 || channels[i].fadeEndsAt < deadline))
+            deadline = channels[i].fadeEndsAt;
+        if (deadline == 0)
+            continue;
+
+        if (!found || deadline < at)
+            at = deadline;
+        found = true;
+    }
+    return found;
+}
+
+bool ActuatorEngine::pwmActive() const
+{
+    for (uint8_t i = 0; i < channelCount; i++)
+    {
+        if (channels[i].kind == ActuatorKind::Pwm && (channels[i].appliedLevel > 0 || channels[i].fadeEndsAt != 0))
+            return true;
+    }
+    return false;
+}
+
+uint32_t ActuatorEngine::pwmDuty(uint8_t level)
+{
+    if (level == 0)
+        return 0;
+    if (level >= 100)
+        return PWM_MAX_DUTY;
+    const uint32_t duty = (uint32_t)lroundf(powf(level / 100.0f, PWM_GAMMA) * PWM_MAX_DUTY);
+    return duty > 0 ? duty : 1; // Any level above 0 stays lit
+}
+
+void ActuatorEngine::write(Channel &channel, uint8_t level, uint64_t now)
+{
+    const bool fade = fadeInstalled && channel.transitionMs >= PWM_MIN_TRANSITION_MS;
+    channel.appliedLevel = level;
+    if (channel.kind == ActuatorKind::Pwm)
+    {
+        const ledc_channel_t ledc = (ledc_channel_t)channel.ledcChannel;
+        const uint32_t duty = pwmDuty(level);
+        const uint32_t current = ledc_get_duty(LEDC_LOW_SPEED_MODE, ledc);
+        if (fade && duty != current)
+        {
+            // Linear in duty over the whole transition, from the current duty
+            channel.fadeFromDuty = current;
+            channel.fadeToDuty = duty;
+            channel.fadeStartedAt = now;
+            channel.fadeDoneAt = now + millisToMicros(channel.transitionMs);
+            fadeStep(channel, now);
+        }
+        else
+        {
+            channel.fadeDoneAt = 0;
+            ledc_set_duty(LEDC_LOW_SPEED_MODE, ledc, duty);
+            ledc_update_duty(LEDC_LOW_SPEED_MODE, ledc);
+        }
+    }
+    else
+    {
+        digitalWrite(channel.pin, level > 0 ? HIGH : LOW);
+    }
+}
+
+// Starts the next hardware fade toward where the whole fade should be one
+// step from now. Steps are placed by the clock, so a late one catches up.
+void ActuatorEngine::fadeStep(Channel &channel, uint64_t now)
+{
+    const ledc_channel_t ledc = (ledc_channel_t)channel.ledcChannel;
+    const uint64_t stepEnd = now + millisToMicros(PWM_FADE_STEP_MS) < channel.fadeDoneAt
+                                 ? now + millisToMicros(PWM_FADE_STEP_MS)
+                                 : channel.fadeDoneAt;
+    if (stepEnd <= now)
+    {
+        channel.fadeDoneAt = 0;
+        ledc_set_duty(LEDC_LOW_SPEED_MODE, ledc, channel.fadeToDuty);
+        ledc_update_duty(LEDC_LOW_SPEED_MODE, ledc);
+        return;
+    }
+
+    const int64_t span = (int64_t)channel.fadeToDuty - (int64_t)channel.fadeFromDuty;
+    const uint32_t duty = (uint32_t)((int64_t)channel.fadeFromDuty +
+                                     span * (int64_t)(stepEnd - channel.fadeStartedAt) /
+                                         (int64_t)(channel.fadeDoneAt - channel.fadeStartedAt));
+    if (duty != ledc_get_duty(LEDC_LOW_SPEED_MODE, ledc))
+    {
+        // The LEDC steps the duty without the CPU; rounded down so the step
+        // is not late
+        const int stepMs = (int)((stepEnd - now) / 1000);
+        ledc_set_fade_with_time(LEDC_LOW_SPEED_MODE, ledc, duty, stepMs > 0 ? stepMs : 1);
+        ledc_fade_start(LEDC_LOW_SPEED_MODE, ledc, LEDC_FADE_NO_WAIT);
+    }
+    channel.fadeEndsAt = stepEnd + FADE_SETTLE_US;
+    if (stepEnd == channel.fadeDoneAt)
+        channel.fadeDoneAt = 0;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "config.h"
+#include "types.h"
+#include "monotonic.h"
+
+enum class ActuatorKind : uint8_t
+{
+    Pwm,  // Dimmable light zone on an LEDC channel
+    Relay // Pump or other on/off load, active HIGH
+};
+
+struct ActuatorConfig
+{
+    uint8_t pin;
+    ActuatorKind kind;
+};
+
+// Channel layout, in channel-index order. Towers with more zones define
+// ACTUATOR_LAYOUT in config.h, e.g.
+//   #define ACTUATOR_LAYOUT {{4, ActuatorKind::Pwm}, {15, ActuatorKind::Pwm}, {5, ActuatorKind::Relay}}
+// The first PWM and first relay channel are the ones the legacy light and
+// irrigation commands and state fields refer to.
+#ifndef ACTUATOR_LAYOUT
+#define ACTUATOR_LAYOUT {{PIN_RELAY_LIGHT, ActuatorKind::Pwm}, {PIN_RELAY_IRRIGATION, ActuatorKind::Relay}}
+#endif
+
+// Brightness curve: duty = level^PWM_GAMMA, so equal level steps look like
+// equal steps in brightness. 1.0 keeps duty proportional to the level
+// (light output rather than perceived brightness).
+#ifndef PWM_GAMMA
+#define PWM_GAMMA 2.2f
+#endif
+
+// All PWM channels share one LEDC timer. The timer clock (80 MHz APB)
+// bounds frequency x 2^bits: 11 bits is the most 25 kHz allows.
+constexpr uint32_t PWM_FREQUENCY_HZ = 25000;
+constexpr uint8_t PWM_RESOLUTION_BITS = 11;
+// Level changes fade in hardware over the channel's transition time, which
+// stays until a command sets another; shorter than the minimum switches
+// directly. The LEDC cannot retarget a running fade without blocking until
+// it ends, so fades run in steps: a new level or cap takes over within one.
+constexpr uint16_t PWM_DEFAULT_TRANSITION_MS = 1000;
+constexpr uint16_t PWM_MIN_TRANSITION_MS = 100;
+constexpr uint16_t PWM_FADE_STEP_MS = 20;
+
+// Drives every channel from one table. Levels and cycle settings live in
+// DeviceState::channels; this keeps the per-channel timers and what was
+// last written to the hardware.
+class ActuatorEngine
+{
+public:
+    ActuatorEngine();
+
+    // Configures the outputs; `states` must hold count() entries.
+    void begin(ChannelState *states);
+
+    uint8_t count() const { return channelCount; }
+    ActuatorKind kind(uint8_t index) const { return channels[index].kind; }
+    // First channel of the given kind, or DEFAULT_CHANNEL if there is none.
+    uint8_t primary(ActuatorKind kind) const;
+
+    void setLevel(uint8_t index, uint8_t level);
+    // Fade time of the channel's later level changes, including cycle
+    // toggles and rule caps; DEFAULT_TRANSITION keeps the current one.
+    void setTransition(uint8_t index, uint16_t milliseconds);
+    // Switches the channel on and back off after `seconds`.
+    void pulse(uint8_t index, unsigned long seconds);
+    void startCycle(uint8_t index, unsigned long onSeconds, unsigned long offSeconds);
+    // Continues a configured cycle `position` seconds into its on+off
+    // period, e.g. after a reboot.
+    void resumeCycle(uint8_t index, uint32_t position);
+    // Seconds into the current on+off period of a running cycle.
+    uint32_t cyclePosition(uint8_t index) const;
+    // Caps what the channel outputs, in percent, without changing its level
+    // (local rules). Takes effect on the next update(); returns true if the
+    // cap changed.
+    bool setCeiling(uint8_t index, uint8_t ceiling);
+
+    // Advances timers and writes changed outputs. Returns true if a timer
+    // changed any channel state.
+    bool update();
+
+    // Earliest pending cycle toggle or pulse end; false if nothing is timed.
+    bool nextDeadline(uint64_t &at) const;
+    // True while any PWM channel is lit or fading (LEDC stops in light sleep).
+    bool pwmActive() const;
+
+    // LEDC duty for a level in percent, after the brightness curve.
+    static uint32_t pwmDuty(uint8_t level);
+
+private:
+    struct Channel
+    {
+        uint8_t pin;
+        ActuatorKind kind;
+        uint8_t ledcChannel;
+        int16_t appliedLevel;         // -1 forces the next write
+        uint8_t ceiling;              // Percent, 100 when unlimited
+        uint16_t transitionMs;
+        uint32_t fadeFromDuty;
+        uint32_t fadeToDuty;
+        uint64_t fadeStartedAt;
+        uint64_t fadeDoneAt;          // Whole fade, 0 when idle
+        uint64_t fadeEndsAt;          // Hardware fade step running until then, 0 when idle
+        bool cycleOnPhase;
+        uint64_t cycleNextToggle;     // monotonicMicros()
+        uint64_t stopAt;              // One-shot pulse end, 0 when idle
+    };
+
+    Channel channels[MAX_ACTUATOR_CHANNELS];
+    uint8_t channelCount = 0;
+    ChannelState *states = nullptr;
+    bool fadeInstalled = false;
+
+    void write(Channel &channel, uint8_t level, uint64_t now);
+    void fadeStep(Channel &channel, uint64_t now);
+};
@@ -0,0 +1,251 @@
+#include "binary_protocol.h"
+
+namespace
+{
+    class Writer
+    {
+    public:
+        Writer(uint8_t *out, size_t size) : out(out), size(size) {}
+
+        void u8(uint8_t v) { put(&v, 1); }
+        void u16(uint16_t v)
+        {
+            uint8_t b[2] = {(uint8_t)v, (uint8_t)(v >> 8)};
+            put(b, 2);
+        }
+        void u32(uint32_t v)
+        {
+            uint8_t b[4] = {(uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24)};
+            put(b, 4);
+        }
+
+        bool ok() const { return !overflow; }
+        size_t length() const { return pos; }
+
+    private:
+        uint8_t *out;
+        size_t size;
+        size_t pos = 0;
+        bool overflow = false;
+
+        void put(const uint8_t *bytes, size_t n)
+        {
+            if (pos + n > size)
+            {
+                overflow = true;
+                return;
+            }
+            memcpy(out + pos, bytes, n);
+            pos += n;
+        }
+    };
+
+    class Reader
+    {
+    public:
+        Reader(const uint8_t *in, size_t size) : in(in), size(size) {}
+
+        uint8_t u8()
+        {
+            uint8_t b[1] = {0};
+            get(b, 1);
+            return b[0];
+        }
+        uint16_t u16()
+        {
+            uint8_t b[2] = {0};
+            get(b, 2);
+            return (uint16_t)(b[0] | (b[1] << 8));
+        }
+        uint32_t u32()
+        {
+            uint8_t b[4] = {0};
+            get(b, 4);
+            return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+        }
+        const uint8_t *bytes(size_t n)
+        {
+            if (pos + n > size)
+            {
+                underflow = true;
+                return nullptr;
+            }
+            const uint8_t *p = in + pos;
+            pos += n;
+            return p;
+        }
+
+        size_t remaining() const { return pos < size ? size - pos : 0; }
+
+        // A frame is valid only if it was consumed exactly.
+        bool ok() const { return !underflow && pos == size; }
+
+    private:
+        const uint8_t *in;
+        size_t size;
+        size_t pos = 0;
+        bool underflow = false;
+
+        void get(uint8_t *out, size_t n)
+        {
+            const uint8_t *p = bytes(n);
+            if (p)
+                memcpy(out, p, n);
+        }
+    };
+}
+
+int16_t encodeTemperature(float c)
+{
+    if (isnan(c))
+        return INT16_MIN;
+    float scaled = roundf(c * 100.0f);
+    return (int16_t)constrain(scaled, (float)(INT16_MIN + 1), (float)INT16_MAX);
+}
+
+size_t encodeBinaryState(uint8_t *out, size_t size, BinaryStateKind kind, uint32_t seq,
+                         uint16_t fields, const DeviceState &state)
+{
+    // Channels past channelCount are never sent
+    fields &= ~(StateField::Channels & ~((1u << state.channelCount) - 1));
+
+    Writer w(out, size);
+    w.u8(BINARY_PROTOCOL_VERSION);
+    w.u8((uint8_t)kind);
+    w.u32(seq);
+    w.u16(fields);
+
+    for (uint8_t i = 0; i < state.channelCount; i++)
+    {
+        if (!(fields & StateField::channel(i)))
+            continue;
+        const ChannelState &channel = state.channels[i];
+        w.u8(channel.level);
+        w.u8((channel.cycleActive ? ChannelFlags::CycleActive : 0) | (channel.capped ? ChannelFlags::Capped : 0));
+        w.u32(channel.cycleOnSeconds);
+        w.u32(channel.cycleOffSeconds);
+    }
+    if (fields & StateField::TemperatureC)
+        w.u16((uint16_t)encodeTemperature(state.temperatureC));
+    if (fields & StateField::WaterEmpty)
+        w.u8(state.waterEmpty);
+    if (fields & StateField::Temperatures)
+    {
+        w.u8(state.temperatureSensorCount);
+        for (uint8_t i = 0; i < state.temperatureSensorCount; i++)
+            w.u16((uint16_t)encodeTemperature(state.temperaturesC[i]));
+    }
+
+    return w.ok() ? w.length() : 0;
+}
+
+bool decodeBinaryCommand(const uint8_t *payload, size_t length, DeviceCommand &cmd)
+{
+    Reader r(payload, length);
+    if (r.u8() != BINARY_PROTOCOL_VERSION)
+        return false;
+
+    uint8_t type = r.u8();
+    switch ((CommandType)type)
+    {
+    case CommandType::SetBrightness:
+        cmd.brightness = r.u8();
+        break;
+    case CommandType::TriggerIrrigation:
+        cmd.irrigationDurationSeconds = r.u32();
+        break;
+    case CommandType::IrrigationCycle:
+    case CommandType::LightCycle:
+        cmd.cycleOnSeconds = r.u32();
+        cmd.cycleOffSeconds = r.u32();
+        if (cmd.cycleOnSeconds == 0 || cmd.cycleOffSeconds == 0)
+            return false;
+        break;
+    case CommandType::OtaUpdate:
+    {
+        uint8_t urlLength = r.u8();
+        const uint8_t *url = r.bytes(urlLength);
+        static_assert(OTA_URL_MAX_LENGTH > UINT8_MAX, "a u8-sized URL must fit with its terminator");
+        if (!url || urlLength == 0)
+            return false;
+        memcpy(cmd.otaUrl, url, urlLength);
+        cmd.otaUrl[urlLength] = '\0';
+        const uint8_t *sha = r.bytes(SHA256_SIZE);
+        if (!sha)
+            return false;
+        memcpy(cmd.otaSha256, sha, SHA256_SIZE);
+        break;
+    }
+    case CommandType::SetWireFormat:
+    {
+        uint8_t format = r.u8();
+        if (format > (uint8_t)WireFormat::Binary)
+            return false;
+        cmd.wireFormat = (WireFormat)format;
+        break;
+    }
+    case CommandType::GetMetrics:
+        break;
+    case CommandType::SetRules:
+    {
+        // Checked against the channel layout when applied
+        uint8_t programLength = r.u8();
+        const uint8_t *program = r.bytes(programLength);
+        if (!program || programLength > sizeof(cmd.rules))
+            return false;
+        memcpy(cmd.rules, program, programLength);
+        cmd.rulesLength = programLength;
+        break;
+    }
+    case CommandType::SetGroups:
+    {
+        const uint8_t count = r.u8();
+        if (count > MAX_GROUPS)
+            return false;
+        for (uint8_t i = 0; i < count; i++)
+        {
+            const uint8_t idLength = r.u8();
+            const char *id = (const char *)r.bytes(idLength);
+            if (!id || !validGroupId(id, idLength))
+                return false;
+            memcpy(cmd.groups[i], id, idLength);
+            cmd.groups[i][idLength] = '\0';
+        }
+        cmd.groupCount = count;
+        break;
+    }
+    case CommandType::SetLanToken:
+    {
+        const uint8_t tokenLength = r.u8();
+        const char *token = (const char *)r.bytes(tokenLength);
+        if (!token || !validLanToken(token, tokenLength))
+            return false;
+        memcpy(cmd.lanToken, token, tokenLength);
+        cmd.lanToken[tokenLength] = '\0';
+        break;
+    }
+    default:
+        return false; // Unknown command
+    }
+
+    const uint8_t flags = r.remaining() > 0 ? r.u8() : 0;
+    if (flags & ~CommandTrailer::All)
+        return false;
+    if (flags & CommandTrailer::Channel)
+    {
+        cmd.channel = r.u8();
+        if (cmd.channel >= MAX_ACTUATOR_CHANNELS)
+            return false;
+    }
+    if (flags & CommandTrailer::Transition)
+    {
+        cmd.transitionMs = r.u16();
+        if (cmd.transitionMs > MAX_TRANSITION_MS)
+            return false;
+    }
+    if (flags & CommandTrailer::Id)
+        snprintf(cmd.id, sizeof(cmd.id), "%lu", (unsigned long)r.u32());
+
+    cmd.type = (CommandType)type;
+    return r.ok();
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "types.h"
+
+// Compact binary alternative to the JSON messages. All integers are
+// little-endian and every field has a fixed width, so encoding and decoding
+// are a handful of byte copies.
+//
+// State frame (snapshot or patch):
+//   u8  version (BINARY_PROTOCOL_VERSION)
+//   u8  kind (BinaryStateKind)
+//   u32 seq
+//   u16 fields (StateField bits)
+//   then, for each bit set in `fields`, in bit order:
+//     bits 0-7, one per actuator channel:
+//       level u8, flags u8 (ChannelFlags bits), cycleOnSeconds u32,
+//       cycleOffSeconds u32
+//     temperature i16 (hundredths of a degree C, INT16_MIN when unknown),
+//     waterEmpty u8,
+//     temperatures: u8 count, then count x i16 as above
+//
+// Command frame:
+//   u8  version
+//   u8  type (CommandType value)
+//   then by type:
+//     SetBrightness      u8 brightness
+//     TriggerIrrigation  u32 seconds
+//     IrrigationCycle    u32 onSeconds, u32 offSeconds
+//     LightCycle         u32 onSeconds, u32 offSeconds
+//     OtaUpdate          u8 length, URL bytes, 32 bytes SHA-256
+//     SetWireFormat      u8 WireFormat
+//     GetMetrics         (nothing)
+//     SetRules           u8 length, rule program (see rule_engine.h)
+//     SetGroups          u8 count, then count x (u8 length, group id)
+//     SetLanToken        u8 length, token (0 for none)
+//   then optionally u8 flags (CommandTrailer bits) and, for each bit set,
+//   in bit order:
+//     Channel     u8 channel (DeviceCommand::channel), below
+//                 MAX_ACTUATOR_CHANNELS
+//     Transition  u16 milliseconds (light commands)
+//     Id          u32 command id (acked as its decimal string)
+//   A frame with an unknown flag bit is invalid.
+
+// Version 2: per-channel actuator fields replace the fixed light/irrigation ones.
+// Version 3: the command trailer is led by a flags byte, and a channel's
+// cycleActive byte became its flags.
+constexpr uint8_t BINARY_PROTOCOL_VERSION = 3;
+constexpr size_t BINARY_CHANNEL_SIZE = 10;
+// Header, every channel, temperature, waterEmpty, temperatures
+constexpr size_t BINARY_STATE_MAX_SIZE = 8 + BINARY_CHANNEL_SIZE * MAX_ACTUATOR_CHANNELS + 2 + 1 + 1 + 2 * MAX_TEMP_SENSORS;
+
+enum class BinaryStateKind : uint8_t
+{
+  Snapshot = 1,
+  Patch = 2
+};
+
+namespace ChannelFlags
+{
+  constexpr uint8_t CycleActive = 1 << 0;
+  constexpr uint8_t Capped = 1 << 1; // A rule holds the output below `level`
+}
+
+namespace CommandTrailer
+{
+  constexpr uint8_t Channel = 1 << 0;
+  constexpr uint8_t Transition = 1 << 1;
+  constexpr uint8_t Id = 1 << 2;
+  constexpr uint8_t All = Channel | Transition | Id;
+}
+
+// Hundredths of a degree C, INT16_MIN when unknown.
+int16_t encodeTemperature(float c);
+size_t encodeBinaryState(uint8_t *out, size_t size, BinaryStateKind kind, uint32_t seq,
+                         uint16_t fields, const DeviceState &state);
+bool decodeBinaryCommand(const uint8_t *payload, size_t length, DeviceCommand &cmd);
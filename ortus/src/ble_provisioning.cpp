@@ -1,12 +1,14 @@
 #include "ble_provisioning.h"
 #include "config.h"
+#include "monotonic.h"
 #include <WiFi.h>
 
 BluetoothProvisioning::BluetoothProvisioning()
     : pServer(nullptr), pCharSSID(nullptr), pCharPassword(nullptr),
       pCharStatus(nullptr), pCharMAC(nullptr), pCharCommand(nullptr),
       pStatusDescriptor(nullptr), pMacDescriptor(nullptr),
-      deviceConnected(false), oldDeviceConnected(false),
+      started(false), wasConnected(false), advertiseAt(0),
+      pendingSSID(), pendingPassword(),
       statusNotifyPending(false), macNotifyPending(false)
 {
 }
@@ -15,6 +17,15 @@ void BluetoothProvisioning::begin(CredentialsCallback onCreds, VoidCallback onRe
 {
     onCredentials = onCreds;
     onReconnect = onRec;
+    start();
+}
+
+void BluetoothProvisioning::start()
+{
+    if (started)
+        return;
+    started = true;
+    Serial.println("[BLE] Provisioning on");
 
     BLEDevice::init("Ortus-Provisioning");
     pServer = BLEDevice::createServer();
@@ -50,21 +61,72 @@ void BluetoothProvisioning::begin(CredentialsCallback onCreds, VoidCallback onRe
     updateMACAddress();
 }
 
+// Arduino's BLE library does not free its GATT objects on deinit, so each
+// start() after a stop() leaves a few hundred bytes behind; the stack's own
+// allocations, tens of kilobytes, are returned.
+void BluetoothProvisioning::stop()
+{
+    if (!started)
+        return;
+    BLEDevice::deinit(false);
+    started = false;
+    pServer = nullptr;
+    pCharSSID = pCharPassword = pCharStatus = pCharMAC = pCharCommand = nullptr;
+    pStatusDescriptor = pMacDescriptor = nullptr;
+    deviceConnected = false;
+    wasConnected = false;
+    advertiseAt = 0;
+    statusNotifyPending = macNotifyPending = false;
+    ssidReceived = credentialsReceived = valueRejected = false;
+    // A half-written pair must not carry over into the next session
+    memset(pendingSSID, 0, sizeof(pendingSSID));
+    memset(pendingPassword, 0, sizeof(pendingPassword));
+    Serial.println("[BLE] Provisioning off, stack released");
+}
+
 void BluetoothProvisioning::loop()
 {
-    if (!deviceConnected && oldDeviceConnected)
+    if (!started)
+        return;
+
+    const bool isConnected = deviceConnected.load();
+    if (isConnected != wasConnected)
     {
-        delay(500); 
-        pServer->startAdvertising(); 
-        oldDeviceConnected = deviceConnected;
-        updateStatus("Disconnected");
+        wasConnected = isConnected;
+        if (isConnected)
+        {
+            advertiseAt = 0;
+            updateStatus("Connected");
+            updateMACAddress();
+        }
+        else
+        {
+            advertiseAt = monotonicMicros() + millisToMicros(BLE_READVERTISE_DELAY_MS);
+            updateStatus("Disconnected");
+        }
     }
-    
-    if (deviceConnected && !oldDeviceConnected)
+    if (advertiseAt && monotonicMicros() >= advertiseAt)
     {
-        oldDeviceConnected = deviceConnected;
-        updateStatus("Connected");
-        updateMACAddress();
+        advertiseAt = 0;
+        pServer->startAdvertising();
+    }
+
+    if (valueRejected.exchange(false))
+        updateStatus("Value too long");
+    if (ssidReceived.exchange(false))
+        updateStatus("SSID set");
+    if (credentialsReceived.exchange(false))
+    {
+        char ssid[BLE_SSID_SIZE];
+        char password[BLE_PASSWORD_SIZE];
+        portENTER_CRITICAL(&lock);
+        memcpy(ssid, pendingSSID, sizeof(ssid));
+        memcpy(password, pendingPassword, sizeof(password));
+        portEXIT_CRITICAL(&lock);
+
+        if (onCredentials) onCredentials(String(ssid), String(password));
+        updateStatus("Creds saved");
+        if (onReconnect) onReconnect();
     }
 
     if (statusNotifyPending && canNotify(pStatusDescriptor))
@@ -79,32 +141,36 @@ void BluetoothProvisioning::loop()
     }
 }
 
-void BluetoothProvisioning::onConnect(BLEServer *pServer)
+void BluetoothProvisioning::onConnect(BLEServer *)
 {
     deviceConnected = true;
 }
 
-void BluetoothProvisioning::onDisconnect(BLEServer *pServer)
+void BluetoothProvisioning::onDisconnect(BLEServer *)
 {
     deviceConnected = false;
 }
 
+// Runs on the BLE task: stash the value for loop().
 void BluetoothProvisioning::onWrite(BLECharacteristic *pCharacteristic)
 {
     std::string value = pCharacteristic->getValue();
-    String sValue = String(value.c_str());
 
-    if (pCharacteristic == pCharSSID)
+    if (pCharacteristic == pCharSSID || pCharacteristic == pCharPassword)
     {
-        tempSSID = sValue;
-        updateStatus("SSID set");
-    }
-    else if (pCharacteristic == pCharPassword)
-    {
-        tempPassword = sValue;
-        if (onCredentials) onCredentials(tempSSID, tempPassword);
-        updateStatus("Creds saved");
-        if (onReconnect) onReconnect();
+        const bool isSSID = pCharacteristic == pCharSSID;
+        char *target = isSSID ? pendingSSID : pendingPassword;
+        const size_t size = isSSID ? sizeof(pendingSSID) : sizeof(pendingPassword);
+        if (value.size() >= size)
+        {
+            valueRejected = true;
+            return;
+        }
+        portENTER_CRITICAL(&lock);
+        memcpy(target, value.c_str(), value.size() + 1);
+        portEXIT_CRITICAL(&lock);
+        if (isSSID) ssidReceived = true;
+        else credentialsReceived = true;
     }
     else if (pCharacteristic == pCharCommand)
     {
@@ -6,7 +6,23 @@
 #include <BLEUtils.h>
 #include <BLE2902.h>
 #include <functional>
+#include <atomic>
 
+// After a central disconnects the stack needs a moment before it can
+// advertise again.
+constexpr unsigned long BLE_READVERTISE_DELAY_MS = 500;
+// Longest SSID and WPA2 passphrase (64 hex digits), plus the terminator.
+constexpr size_t BLE_SSID_SIZE = 33;
+constexpr size_t BLE_PASSWORD_SIZE = 65;
+
+// WiFi provisioning over a GATT service. The BLE callbacks run on the stack's
+// own task and only record what happened; loop() acts on it, so callers see
+// every callback and status change on the task that calls loop(). Nothing
+// here blocks.
+//
+// The stack is one of the largest heap users and is only brought up between
+// start() and stop(). stop() returns its heap; the controller's static
+// memory is kept, since releasing it would rule out start() until a reboot.
 class BluetoothProvisioning : public BLEServerCallbacks, public BLECharacteristicCallbacks
 {
 public:
@@ -15,9 +31,16 @@ public:
 
     BluetoothProvisioning();
 
+    // Sets the callbacks and starts the stack.
     void begin(CredentialsCallback onCredentials, VoidCallback onReconnect);
+    void start();
+    void stop();
     void loop();
-    
+
+    bool active() const { return started; }
+    // A central is connected (and stop() would cut it off).
+    bool connected() const { return deviceConnected.load(); }
+
     void updateStatus(const String &status);
     void updateWiFiState(bool connected);
 
@@ -41,11 +64,19 @@ private:
     BLE2902 *pStatusDescriptor;
     BLE2902 *pMacDescriptor;
 
-    bool deviceConnected;
-    bool oldDeviceConnected;
-    String tempSSID;
-    String tempPassword;
-    
+    bool started;
+    bool wasConnected;
+    uint64_t advertiseAt; // monotonicMicros(), 0 when not waiting to
+
+    // Written by the BLE task under `lock`, picked up by loop()
+    std::atomic<bool> deviceConnected{false};
+    std::atomic<bool> ssidReceived{false};
+    std::atomic<bool> credentialsReceived{false};
+    std::atomic<bool> valueRejected{false};
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    char pendingSSID[BLE_SSID_SIZE];
+    char pendingPassword[BLE_PASSWORD_SIZE];
+
     bool statusNotifyPending;
     bool macNotifyPending;
 
@@ -0,0 +1,341 @@
+#include "command_parser.h"
+
+namespace
+{
+    struct CommandKeyword
+    {
+        const char *name;
+        CommandType type;
+    };
+
+    constexpr CommandKeyword COMMAND_KEYWORDS[] = {
+        {"setBrightness", CommandType::SetBrightness},
+        {"triggerIrrigation", CommandType::TriggerIrrigation},
+        {"irrigationCycle", CommandType::IrrigationCycle},
+        {"lightCycle", CommandType::LightCycle},
+        {"otaUpdate", CommandType::OtaUpdate},
+        {"setWireFormat", CommandType::SetWireFormat},
+        {"getMetrics", CommandType::GetMetrics},
+        {"setRules", CommandType::SetRules},
+        {"setGroups", CommandType::SetGroups},
+        {"setLanToken", CommandType::SetLanToken},
+    };
+
+    struct RuleKeyword
+    {
+        const char *name;
+        RuleKind kind;
+    };
+
+    constexpr RuleKeyword RULE_KEYWORDS[] = {
+        {"waterEmpty", RuleKind::WaterEmpty},
+        {"temperatureAbove", RuleKind::TemperatureAbove},
+        {"temperatureBelow", RuleKind::TemperatureBelow},
+        {"timeWindow", RuleKind::TimeWindow},
+    };
+
+    constexpr long MAX_UTC_OFFSET_MINUTES = 14 * 60;
+
+    bool lookupCommand(const char *name, CommandType &type)
+    {
+        for (const CommandKeyword &keyword : COMMAND_KEYWORDS)
+        {
+            if (keyword.name[0] == name[0] && strcmp(keyword.name, name) == 0)
+            {
+                type = keyword.type;
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+CommandParser::CommandParser()
+    : doc(&arena)
+{
+}
+
+bool CommandParser::parse(const uint8_t *payload, size_t length, DeviceCommand &cmd)
+{
+    return load(payload, length) == 1 && !doc.is<JsonArrayConst>() && command(0, cmd);
+}
+
+size_t CommandParser::load(const uint8_t *payload, size_t length)
+{
+    // Drop the previous command's document before reusing the arena.
+    doc.clear();
+    arena.reset();
+
+    DeserializationError error = deserializeJson(doc, payload, length);
+    if (error)
+    {
+        Serial.print("[Command] JSON Error: ");
+        Serial.println(error.c_str());
+        return 0;
+    }
+
+    if (!doc.is<JsonArrayConst>())
+        return 1;
+    const size_t count = doc.size();
+    return count <= MAX_BATCH_COMMANDS ? count : 0;
+}
+
+bool CommandParser::command(size_t index, DeviceCommand &cmd)
+{
+    JsonVariantConst root = doc.as<JsonVariantConst>();
+    JsonVariantConst entry = root.is<JsonArrayConst>() ? root[index] : root;
+
+    // Supports strictly { "type": "...", "value": ..., "channel": n, "id": "..." },
+    // where "channel" and "id" are optional. The id is read first so even a
+    // rejected command can be acked.
+    if (!parseId(entry["id"], cmd.id, sizeof(cmd.id)))
+        return false;
+
+    const char *type = entry["type"] | "";
+    if (!lookupCommand(type, cmd.type))
+        return false; // Unknown command
+
+    JsonVariantConst value = entry["value"];
+    if (!parseChannel(entry["channel"], cmd.channel))
+        return false;
+    if (!entry["transition"].isNull())
+    {
+        const long transition = entry["transition"] | -1L;
+        if (transition < 0 || transition > MAX_TRANSITION_MS)
+            return false;
+        cmd.transitionMs = (uint16_t)transition;
+    }
+
+    switch (cmd.type)
+    {
+    case CommandType::SetBrightness:
+        if (value.isNull())
+            return false;
+        cmd.brightness = value.as<int>();
+        return true;
+
+    case CommandType::TriggerIrrigation:
+        cmd.irrigationDurationSeconds = value.isNull() ? 60 : value.as<unsigned long>();
+        return true;
+
+    case CommandType::IrrigationCycle:
+    case CommandType::LightCycle:
+        return parseCycle(value | "", cmd.cycleOnSeconds, cmd.cycleOffSeconds);
+
+    case CommandType::OtaUpdate:
+    {
+        const char *url = value | "";
+        size_t urlLength = strlen(url);
+        if (urlLength == 0 || urlLength >= sizeof(cmd.otaUrl))
+            return false;
+        memcpy(cmd.otaUrl, url, urlLength + 1);
+
+        // "sha256": 64 hex digits. Required: the download itself is not
+        // authenticated, so this is what vouches for the image
+        const char *sha = entry["sha256"] | "";
+        if (strlen(sha) != SHA256_SIZE * 2)
+            return false;
+        for (size_t i = 0; i < SHA256_SIZE * 2; i++)
+        {
+            char c = sha[i] | 0x20;
+            int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+            if (digit < 0)
+                return false;
+            cmd.otaSha256[i / 2] = (uint8_t)(cmd.otaSha256[i / 2] << 4 | digit);
+        }
+        return true;
+    }
+
+    case CommandType::SetWireFormat:
+    {
+        const char *format = value | "";
+        if (strcmp(format, "json") == 0)
+            cmd.wireFormat = WireFormat::Json;
+        else if (strcmp(format, "binary") == 0)
+            cmd.wireFormat = WireFormat::Binary;
+        else
+            return false;
+        return true;
+    }
+
+    case CommandType::GetMetrics:
+        return true;
+
+    case CommandType::SetRules:
+    {
+        // A POSIX TZ string follows daylight saving; a bare offset does not
+        TimeZone zone;
+        const long utcOffset = entry["utcOffset"] | 0L;
+        if (!entry["timezone"].isNull())
+        {
+            if (!parseTimeZone(entry["timezone"] | "", zone))
+                return false;
+        }
+        else if (utcOffset >= -MAX_UTC_OFFSET_MINUTES && utcOffset <= MAX_UTC_OFFSET_MINUTES)
+            zone.utcOffset = (int16_t)utcOffset;
+        else
+            return false;
+        return parseRules(value, zone, cmd);
+    }
+
+    case CommandType::SetGroups:
+        return parseGroups(value, cmd);
+
+    case CommandType::SetLanToken:
+    {
+        const char *token = value | "";
+        const size_t tokenLength = strlen(token);
+        if (!value.is<const char *>() || !validLanToken(token, tokenLength))
+            return false;
+        memcpy(cmd.lanToken, token, tokenLength + 1);
+        return true;
+    }
+    }
+    return false;
+}
+
+// Strings are copied as they are, integers in decimal. A missing id is
+// empty; one that does not fit is an error.
+bool CommandParser::parseId(JsonVariantConst value, char *id, size_t size)
+{
+    id[0] = '\0';
+    if (value.isNull())
+        return true;
+    if (value.is<uint32_t>())
+    {
+        snprintf(id, size, "%lu", (unsigned long)value.as<uint32_t>());
+        return true;
+    }
+
+    const char *text = value.as<const char *>();
+    size_t length = text ? strlen(text) : 0;
+    if (length == 0 || length >= size)
+        return false;
+    memcpy(id, text, length + 1);
+    return true;
+}
+
+// An absent channel is the default; anything but a channel number is an
+// error.
+bool CommandParser::parseChannel(JsonVariantConst value, uint8_t &channel)
+{
+    channel = DEFAULT_CHANNEL;
+    if (value.isNull())
+        return true;
+    if (!value.is<uint8_t>() || value.as<uint8_t>() >= MAX_ACTUATOR_CHANNELS)
+        return false;
+    channel = value.as<uint8_t>();
+    return true;
+}
+
+// Parse format: "on:120,off:600"
+bool CommandParser::parseCycle(const char *value, unsigned long &onSeconds, unsigned long &offSeconds)
+{
+    const char *on = strstr(value, "on:");
+    const char *off = strstr(value, "off:");
+    if (!on || !off || !strchr(value, ','))
+        return false;
+
+    onSeconds = strtoul(on + 3, nullptr, 10);
+    offSeconds = strtoul(off + 4, nullptr, 10);
+    return onSeconds > 0 && offSeconds > 0;
+}
+
+// ["room-a", "rack-3"]; empty leaves every group
+bool CommandParser::parseGroups(JsonVariantConst value, DeviceCommand &cmd)
+{
+    if (!value.is<JsonArrayConst>() || value.size() > MAX_GROUPS)
+        return false;
+
+    for (JsonVariantConst entry : value.as<JsonArrayConst>())
+    {
+        const char *id = entry | "";
+        const size_t length = strlen(id);
+        if (!validGroupId(id, length))
+            return false;
+        memcpy(cmd.groups[cmd.groupCount++], id, length + 1);
+    }
+    return true;
+}
+
+bool CommandParser::parseRules(JsonVariantConst value, const TimeZone &zone, DeviceCommand &cmd)
+{
+    if (!value.is<JsonArrayConst>() || value.size() > MAX_RULES)
+        return false;
+
+    Rule rules[MAX_RULES];
+    uint8_t count = 0;
+    for (JsonVariantConst entry : value.as<JsonArrayConst>())
+    {
+        if (!parseRule(entry, rules[count++]))
+            return false;
+    }
+    cmd.rulesLength = encodeRules(rules, count, zone, cmd.rules, sizeof(cmd.rules));
+    return cmd.rulesLength > 0;
+}
+
+bool CommandParser::parseRule(JsonVariantConst value, Rule &rule)
+{
+    const char *when = value["when"] | "";
+    bool known = false;
+    for (const RuleKeyword &keyword : RULE_KEYWORDS)
+    {
+        if (strcmp(keyword.name, when) == 0)
+        {
+            rule.kind = keyword.kind;
+            known = true;
+        }
+    }
+    const long level = value["level"] | 0L;
+    if (!known || level < 0 || level > 100)
+        return false;
+    if (!parseChannel(value["channel"], rule.channel))
+        return false;
+    rule.level = (uint8_t)level;
+
+    switch (rule.kind)
+    {
+    case RuleKind::WaterEmpty:
+        return true;
+
+    case RuleKind::TemperatureAbove:
+    case RuleKind::TemperatureBelow:
+    {
+        const float threshold = value["value"] | NAN;
+        const float hysteresis = value["hysteresis"] | 0.5f;
+        const long probe = value["probe"] | 0L;
+        if (!(threshold > -100 && threshold < 200) || !(hysteresis >= 0 && hysteresis < 50) || probe < 0 ||
+            probe >= MAX_TEMP_SENSORS)
+            return false;
+        rule.a = (int16_t)lroundf(threshold * 100);
+        rule.b = (int16_t)lroundf(hysteresis * 100);
+        rule.probe = (uint8_t)probe;
+        return true;
+    }
+
+    case RuleKind::TimeWindow:
+    {
+        const long ramp = value["ramp"] | 0L;
+        if (ramp < 0 || ramp > 12 * 60)
+            return false;
+        rule.ramp = (uint16_t)ramp;
+        return parseTimeOfDay(value["from"] | "", rule.a) && parseTimeOfDay(value["to"] | "", rule.b);
+    }
+    }
+    return false;
+}
+
+// "HH:MM", 24-hour
+bool CommandParser::parseTimeOfDay(const char *value, int16_t &minutes)
+{
+    char *end;
+    const unsigned long hours = strtoul(value, &end, 10);
+    if (end == value || *end != ':' || hours > 23)
+        return false;
+    const char *minutePart = end + 1;
+    const unsigned long mins = strtoul(minutePart, &end, 10);
+    if (end == minutePart || *end != '\0' || mins > 59)
+        return false;
+    minutes = (int16_t)(hours * 60 + mins);
+    return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#include "types.h"
+#include "json_arena.h"
+#include "rule_engine.h"
+
+// ArduinoJson's first variant pool is 1 KB on 32-bit targets (4 KB on the
+// 64-bit native build); the rest is headroom for strings such as OTA URLs.
+constexpr size_t COMMAND_ARENA_SIZE = 4096 * (sizeof(void *) / 4);
+
+// Parses { "type": "...", "value": ..., "channel": n, "id": "..." } payloads
+// into a DeviceCommand. "channel" and "id" are optional, as is "transition",
+// the light fade time in milliseconds (setBrightness and lightCycle), which
+// holds for the channel's later changes until another is given. A channel
+// that is not a channel number is rejected. otaUpdate must carry
+// "sha256", the hex digest of the image. setRules takes its time zone as
+// "timezone", a POSIX TZ string such as "CET-1CEST,M3.5.0,M10.5.0/3", or
+// as a fixed "utcOffset" in minutes, and compiles its rule list into a
+// rule program (see rule_engine.h); each rule is
+//   { "when": "waterEmpty" | "temperatureAbove" | "temperatureBelow" | "timeWindow",
+//     "channel": n, "level": percent,
+//     "value": degrees C, "hysteresis": degrees C (default 0.5), "probe": n,
+//     "from": "HH:MM", "to": "HH:MM", "ramp": minutes }
+// with only the fields of its kind; "channel" is optional and "level"
+// defaults to 0. setGroups takes the array of group ids to belong to,
+// setLanToken the token LAN WebSocket clients must present ("" for none;
+// the first one must come over MQTT).
+//
+// A JSON array of up to MAX_BATCH_COMMANDS such objects is a batch.
+class CommandParser
+{
+public:
+    CommandParser();
+
+    // A single command; false for anything else, batches included.
+    bool parse(const uint8_t *payload, size_t length, DeviceCommand &cmd);
+
+    // Reads a payload holding a command or a batch. Returns the number of
+    // commands (1 for a lone object), 0 if it is not JSON or the batch is
+    // empty or too long. command() then parses them one by one; like
+    // parse(), it fills in the id even for a command it rejects.
+    size_t load(const uint8_t *payload, size_t length);
+    bool command(size_t index, DeviceCommand &cmd);
+
+private:
+    JsonArena<COMMAND_ARENA_SIZE> arena;
+    JsonDocument doc;
+
+    static bool parseId(JsonVariantConst value, char *id, size_t size);
+    static bool parseChannel(JsonVariantConst value, uint8_t &channel);
+    static bool parseCycle(const char *value, unsigned long &onSeconds, unsigned long &offSeconds);
+    static bool parseGroups(JsonVariantConst value, DeviceCommand &cmd);
+    static bool parseRules(JsonVariantConst value, const TimeZone &zone, DeviceCommand &cmd);
+    static bool parseRule(JsonVariantConst value, Rule &rule);
+    static bool parseTimeOfDay(const char *value, int16_t &minutes);
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Min-heap of job deadlines on the monotonicMicros() clock. Each of the
+// JobCount jobs (ids 0..JobCount-1) is either idle or scheduled once;
+// rescheduling moves it. schedule(), cancel() and popDue() are
+// O(log JobCount), peeking the next deadline is O(1).
+template <size_t JobCount>
+class DeadlineScheduler
+{
+public:
+    DeadlineScheduler()
+    {
+        for (size_t i = 0; i < JobCount; i++)
+            position[i] = IDLE;
+    }
+
+    void schedule(uint8_t job, uint64_t at)
+    {
+        deadline[job] = at;
+        if (position[job] == IDLE)
+        {
+            position[job] = size;
+            heap[size++] = job;
+            siftUp(position[job]);
+        }
+        else
+        {
+            siftUp(position[job]);
+            siftDown(position[job]);
+        }
+    }
+
+    void cancel(uint8_t job)
+    {
+        if (position[job] != IDLE)
+            removeAt(position[job]);
+    }
+
+    bool scheduled(uint8_t job) const { return position[job] != IDLE; }
+    bool empty() const { return size == 0; }
+
+    // Earliest deadline; only valid when !empty().
+    uint64_t next() const { return deadline[heap[0]]; }
+
+    // Removes and returns the earliest job if it is due at `now`.
+    bool popDue(uint64_t now, uint8_t &job)
+    {
+        if (size == 0 || now < deadline[heap[0]])
+            return false;
+        job = heap[0];
+        removeAt(0);
+        return true;
+    }
+
+private:
+    static constexpr uint8_t IDLE = 0xFF;
+    static_assert(JobCount < IDLE, "Too many jobs");
+
+    uint64_t deadline[JobCount];
+    uint8_t heap[JobCount];
+    uint8_t position[JobCount];
+    uint8_t size = 0;
+
+    bool less(uint8_t i, uint8_t j) const { return deadline[heap[i]] < deadline[heap[j]]; }
+
+    void swap(uint8_t i, uint8_t j)
+    {
+        uint8_t job = heap[i];
+        heap[i] = heap[j];
+        heap[j] = job;
+        position[heap[i]] = i;
+        position[heap[j]] = j;
+    }
+
+    void siftUp(uint8_t i)
+    {
+        while (i > 0)
+        {
+            uint8_t parent = (i - 1) / 2;
+            if (!less(i, parent))
+                break;
+            swap(i, parent);
+            i = parent;
+        }
+    }
+
+    void siftDown(uint8_t i)
+    {
+        for (;;)
+        {
+            uint8_t smallest = i;
+            uint8_t left = 2 * i + 1;
+            uint8_t right = left + 1;
+            if (left < size && less(left, smallest))
+                smallest = left;
+            if (right < size && less(right, smallest))
+                smallest = right;
+            if (smallest == i)
+                break;
+            swap(i, smallest);
+            i = smallest;
+        }
+    }
+
+    void removeAt(uint8_t i)
+    {
+        position[heap[i]] = IDLE;
+        if (i != --size)
+        {
+            uint8_t moved = heap[size];
+            heap[i] = moved;
+            position[moved] = i;
+            siftUp(i);
+            siftDown(position[moved]);
+        }
+    }
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Bump allocator over a fixed buffer for ArduinoJson documents. Everything
+// is released at once with reset(), so building or parsing a document never
+// touches the heap. Allocation fails (ArduinoJson reports NoMemory /
+// overflowed()) when the buffer is exhausted.
+template <size_t Size>
+class JsonArena : public ArduinoJson::Allocator
+{
+public:
+    void *allocate(size_t size) override
+    {
+        const size_t total = HEADER_SIZE + align(size);
+        if (total > Size - top)
+            return nullptr;
+
+        header(top)->size = size;
+        lastOffset = top;
+        top += total;
+        return buffer + lastOffset + HEADER_SIZE;
+    }
+
+    void deallocate(void *ptr) override
+    {
+        // Only the most recent block can be given back; the rest goes on reset().
+        if (isLast(ptr))
+        {
+            top = lastOffset;
+            lastOffset = NONE;
+        }
+    }
+
+    void *reallocate(void *ptr, size_t newSize) override
+    {
+        if (!ptr)
+            return allocate(newSize);
+
+        const size_t oldSize = header(offsetOf(ptr))->size;
+
+        // Grow or shrink the most recent block in place.
+        if (isLast(ptr))
+        {
+            if (HEADER_SIZE + align(newSize) > Size - lastOffset)
+                return nullptr;
+            header(lastOffset)->size = newSize;
+            top = lastOffset + HEADER_SIZE + align(newSize);
+            return ptr;
+        }
+
+        void *moved = allocate(newSize);
+        if (moved)
+            memcpy(moved, ptr, oldSize < newSize ? oldSize : newSize);
+        return moved;
+    }
+
+    void reset()
+    {
+        top = 0;
+        lastOffset = NONE;
+    }
+
+    size_t used() const { return top; }
+
+private:
+    struct Header
+    {
+        size_t size;
+    };
+
+    static constexpr size_t NONE = SIZE_MAX;
+    static constexpr size_t ALIGNMENT = alignof(max_align_t);
+    static constexpr size_t align(size_t n) { return (n + ALIGNMENT - 1) & ~(ALIGNMENT - 1); }
+    static constexpr size_t HEADER_SIZE = (sizeof(Header) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+    alignas(ALIGNMENT) uint8_t buffer[Size];
+    size_t top = 0;
+    size_t lastOffset = NONE;
+
+    Header *header(size_t offset) { return reinterpret_cast<Header *>(buffer + offset); }
+    size_t offsetOf(void *ptr) const { return static_cast<uint8_t *>(ptr) - buffer - HEADER_SIZE; }
+    bool isLast(void *ptr) const { return ptr && lastOffset != NONE && offsetOf(ptr) == lastOffset; }
+};
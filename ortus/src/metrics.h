@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Durations in microseconds, counted into fixed log2 buckets: bucket 0
+// holds samples below 2 us, bucket i those in [2^i, 2^(i+1)) us, and the
+// last one everything from 2^(HISTOGRAM_BUCKETS - 1) us (~0.5 s) up.
+// Counts run since boot; consumers diff two readings for a window.
+constexpr uint8_t HISTOGRAM_BUCKETS = 20;
+
+// One task records, any task may read. A reader can catch a sample half
+// recorded (count bumped, bucket not yet), which diagnostics can live with.
+class Histogram
+{
+public:
+    void record(uint64_t micros)
+    {
+        const uint32_t us = micros > UINT32_MAX ? UINT32_MAX : (uint32_t)micros;
+        uint8_t bucket = 31 - __builtin_clz(us | 1);
+        if (bucket >= HISTOGRAM_BUCKETS)
+            bucket = HISTOGRAM_BUCKETS - 1;
+        buckets[bucket]++;
+        samples++;
+        if (us > longest)
+            longest = us;
+    }
+
+    uint32_t count() const { return samples; }
+    uint32_t maxMicros() const { return longest; }
+
+    // Writes {"n":count,"max":us,"b":[bucket counts]}, leaving out trailing
+    // empty buckets. Returns the length, or 0 if `size` is too small.
+    size_t toJson(char *out, size_t size) const
+    {
+        uint8_t used = HISTOGRAM_BUCKETS;
+        while (used > 0 && buckets[used - 1] == 0)
+            used--;
+
+        size_t n = snprintf(out, size, "{\"n\":%u,\"max\":%u,\"b\":[", (unsigned)samples, (unsigned)longest);
+        for (uint8_t i = 0; i < used && n < size; i++)
+            n += snprintf(out + n, size - n, i ? ",%u" : "%u", (unsigned)buckets[i]);
+        if (n < size)
+            n += snprintf(out + n, size - n, "]}");
+        return n < size ? n : 0;
+    }
+
+private:
+    uint32_t buckets[HISTOGRAM_BUCKETS] = {};
+    uint32_t samples = 0;
+    uint32_t longest = 0;
+};
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+#include <esp_timer.h>
+
+// The one time base for scheduling: microseconds since boot from the 64-bit
+// esp_timer. Unlike the 32-bit millis(), which wraps after ~49.7 days, it
+// never wraps in practice, so deadlines can be compared with plain < and >=.
+// Convert durations with the helpers below so the multiply is done in 64 bits.
+inline uint64_t monotonicMicros() { return (uint64_t)esp_timer_get_time(); }
+
+constexpr uint64_t millisToMicros(uint64_t ms) { return ms * 1000ULL; }
+constexpr uint64_t secondsToMicros(uint64_t seconds) { return seconds * 1000000ULL; }
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Messages that only matter in their latest version. Queuing one with a key
+// replaces the entry already waiting under that key, in place.
+enum class OutboxKey : uint8_t
+{
+    None = 0,
+    State,
+    Presence,
+    OtaProgress
+};
+
+// Bounded FIFO of MQTT publishes waiting for the broker, so nothing is lost
+// while the connection is down and nothing overtakes what is already
+// waiting once it is back. Network task only. Payloads are copied in;
+// topics are not and must outlive the entry.
+template <size_t Capacity, size_t PayloadSize>
+class MqttOutbox
+{
+public:
+    struct Entry
+    {
+        const char *topic;
+        uint16_t length;
+        bool retained;
+        OutboxKey key;
+        uint8_t payload[PayloadSize];
+    };
+
+    // Returns false (and counts a drop) if the payload is too large or the
+    // outbox is full with nothing to coalesce into.
+    bool push(const char *topic, const uint8_t *payload, size_t length, bool retained, OutboxKey key)
+    {
+        Entry *entry = key != OutboxKey::None ? find(key) : nullptr;
+        if (length > PayloadSize || (!entry && count == Capacity))
+        {
+            dropped++;
+            return false;
+        }
+        if (!entry)
+            entry = &entries[(head + count++) % Capacity];
+
+        entry->topic = topic;
+        entry->length = (uint16_t)length;
+        entry->retained = retained;
+        entry->key = key;
+        memcpy(entry->payload, payload, length);
+        return true;
+    }
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    const Entry &front() const { return entries[head]; }
+
+    void pop()
+    {
+        head = (head + 1) % Capacity;
+        count--;
+    }
+
+    uint32_t droppedCount() const { return dropped; }
+
+private:
+    Entry entries[Capacity];
+    size_t head = 0;
+    size_t count = 0;
+    uint32_t dropped = 0;
+
+    Entry *find(OutboxKey key)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            Entry &entry = entries[(head + i) % Capacity];
+            if (entry.key == key)
+                return &entry;
+        }
+        return nullptr;
+    }
+};
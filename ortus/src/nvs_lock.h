@@ -0,0 +1,29 @@
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// The control and network tasks share one Preferences handle, which is not
+// safe to use from both at once. Every access once the tasks run holds
+// this for its duration:
+//   { NvsLock lock; preferences.putUChar("key", value); }
+// It is not recursive, so nothing that takes it may call another function
+// that does.
+class NvsLock
+{
+public:
+    NvsLock() { xSemaphoreTake(mutex(), portMAX_DELAY); }
+    ~NvsLock() { xSemaphoreGive(mutex()); }
+    NvsLock(const NvsLock &) = delete;
+    NvsLock &operator=(const NvsLock &) = delete;
+
+private:
+    static SemaphoreHandle_t mutex()
+    {
+        // First used during boot, before the network task starts
+        static StaticSemaphore_t buffer;
+        static SemaphoreHandle_t handle = xSemaphoreCreateMutexStatic(&buffer);
+        return handle;
+    }
+};
@@ -1,14 +1,17 @@
 #include "ortus.h"
+#include "nvs_lock.h"
 #include <ArduinoJson.h>
-#include "driver/ledc.h"
 
 OrtusSystem *OrtusSystem::instance = nullptr;
 
 OrtusSystem::OrtusSystem()
-    : mqttClient(wifiClient),
+    : mqttClient(tlsClient),
       wsServer(WS_SERVER_PORT),
       oneWire(PIN_SENSOR_TEMP),
-      sensors(&oneWire)
+      sensors(&oneWire),
+      txDoc(&txArena),
+      wifiBackoff(millisToMicros(WIFI_BACKOFF_BASE_MS), millisToMicros(WIFI_BACKOFF_MAX_MS)),
+      mqttBackoff(millisToMicros(MQTT_BACKOFF_BASE_MS), millisToMicros(MQTT_BACKOFF_MAX_MS))
 {
     instance = this;
 }
@@ -23,42 +26,32 @@ void OrtusSystem::begin()
 
     Serial.println("\n[System] Ortus Starting...");
 
+    controlTaskHandle = xTaskGetCurrentTaskHandle();
+    setupPowerManagement();
+
     // Hardware Setup
-    pinMode(PIN_RELAY_IRRIGATION, OUTPUT);
     pinMode(PIN_SENSOR_WATER, INPUT_PULLUP);
+    pinMode(PIN_BUTTON_PROVISION, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(PIN_SENSOR_WATER), onWaterPinChange, CHANGE);
+    setupActuators();
 
-    // Initial relay state (Active HIGH assumed from original code)
-    digitalWrite(PIN_RELAY_IRRIGATION, HIGH);
-
-    // Setup LEDC PWM for light dimming
-    ledc_timer_config_t timer = {
-        .speed_mode = LEDC_LOW_SPEED_MODE,
-        .duty_resolution = LEDC_TIMER_8_BIT,
-        .timer_num = LEDC_TIMER_0,
-        .freq_hz = 25000,
-        .clk_cfg = LEDC_AUTO_CLK};
-    ledc_timer_config(&timer);
-
-    ledc_channel_config_t channel = {
-        .gpio_num = PIN_RELAY_LIGHT,
-        .speed_mode = LEDC_LOW_SPEED_MODE,
-        .channel = LEDC_CHANNEL_0,
-        .timer_sel = LEDC_TIMER_0,
-        .duty = 0,
-        .hpoint = 0};
-    ledc_channel_config(&channel);
-
-    sensors.begin();
-    sensors.setResolution(12);
+    setupSensors();
+    history.begin(HISTORY_PSRAM_BLOCKS, HISTORY_RAM_BLOCKS);
 
     // Load Data
     preferences.begin("ortus", false);
     loadCredentials();
     loadState();
+    rules.begin(preferences, actuators);
+    applyRules();
 
     // Apply initial state
-    appliedBrightness = -1; // Force update
     updateActuators();
+    scheduler.schedule(JOB_TEMP_POLL, monotonicMicros() + millisToMicros(TEMP_POLL_MS));
+    scheduler.schedule(JOB_WATER_POLL, monotonicMicros() + millisToMicros(WATER_POLL_MS));
+    scheduler.schedule(JOB_CYCLE_CHECKPOINT, monotonicMicros() + millisToMicros(CYCLE_CHECKPOINT_INTERVAL_MS));
+    scheduler.schedule(JOB_HISTORY_SAMPLE, monotonicMicros() + millisToMicros(HISTORY_SAMPLE_MS));
+    lastBroadcastState = currentState; // Baseline for the first snapshot
 
     // Network Setup
     setupWiFi();
@@ -67,7 +60,7 @@ void OrtusSystem::begin()
     wsServer.begin();
     wsServer.onEvent(webSocketEvent);
 
-    // BLE Setup
+    // BLE Setup. Released by manageBle() once WiFi is up.
     ble.begin(
         [this](String s, String p)
         { saveCredentials(s, p); },
@@ -75,39 +68,222 @@ void OrtusSystem::begin()
         {
             Serial.println("[System] Credentials updated via BLE. Reconnecting...");
             WiFi.disconnect(true);
-            lastWifiAttempt = 0; // Force immediate retry
+            wifiBackoff.down(monotonicMicros());
+            wifiBackoff.retryNow(); // New credentials are worth trying at once
         });
 
-    Serial.println("[System] Boot complete.");
-
     if (WiFi.status() != WL_CONNECTED)
     {
         ble.updateWiFiState(false);
     }
+
+    // Networking from here on runs on its own core so a slow TLS handshake
+    // or broker stall cannot delay actuator timing.
+    if (xTaskCreatePinnedToCore(networkTask, "ortus-net", NETWORK_TASK_STACK_SIZE, this,
+                                NETWORK_TASK_PRIORITY, &networkTaskHandle, NETWORK_TASK_CORE) != pdPASS)
+    {
+        networkTaskHandle = nullptr;
+        Serial.println("[System] Network task unavailable, running networking inline");
+    }
+
+    Serial.println("[System] Boot complete.");
 }
 
 void OrtusSystem::loop()
 {
+    // Without a network task both halves share the Arduino loop.
+    if (!networkTaskHandle)
+        networkLoop();
+    controlLoop();
+}
+
+// --- Tasks ---
+
+void OrtusSystem::networkTask(void *arg)
+{
+    OrtusSystem *self = static_cast<OrtusSystem *>(arg);
+    for (;;)
+    {
+        self->networkLoop();
+        // Sockets have to be polled; a state hand-off wakes us early
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(self->networkPollMs()));
+    }
+}
+
+unsigned long OrtusSystem::networkPollMs()
+{
+    const bool busy = wsServer.connectedClients() > 0 || ble.active() ||
+                      ota.phase() != OtaUpdater::Phase::Idle || !outbox.empty();
+    return busy ? NETWORK_POLL_MS : NETWORK_IDLE_POLL_MS;
+}
+
+void OrtusSystem::networkLoop()
+{
+    const uint64_t started = monotonicMicros();
     ble.loop();
+    const uint64_t wsStarted = monotonicMicros();
     wsServer.loop();
+    metrics.ws.record(monotonicMicros() - wsStarted);
 
     connectWiFi(); // Manage connection
+    manageBle();
 
     if (wifiConnected)
     {
         connectMQTT();
+        const uint64_t mqttStarted = monotonicMicros();
         mqttClient.loop();
+        metrics.mqtt.record(monotonicMicros() - mqttStarted);
+        if (mqttClient.connected())
+        {
+            flushOutbox();
+            if (outbox.empty())
+                uploadHistory(); // Behind anything already waiting
+        }
 
         // Periodic Presence
-        if (millis() - lastPresence > PRESENCE_INTERVAL_MS)
+        if (monotonicMicros() - lastPresence > millisToMicros(PRESENCE_INTERVAL_MS))
         {
             publishPresence();
-            lastPresence = millis();
+            lastPresence = monotonicMicros();
         }
+        if (monotonicMicros() - lastMetrics > millisToMicros(METRICS_INTERVAL_MS))
+        {
+            publishMetrics(ORIGIN_MQTT);
+            lastMetrics = monotonicMicros();
+        }
+
+        // Keep the retained snapshot from drifting too far behind the patches
+        if (snapshotStale && monotonicMicros() - lastSnapshot > millisToMicros(STATE_SNAPSHOT_INTERVAL_MS))
+            publishSnapshot();
     }
 
-    updateSensors();
-    updateActuators();
+    ota.loop();
+    reportOta();
+
+    drainStateQueue();
+    drainAckQueue();
+    flushWebSockets(); // Messages held back by the rate limit
+    metrics.network.record(monotonicMicros() - started);
+}
+
+void OrtusSystem::controlLoop()
+{
+    const uint64_t started = monotonicMicros();
+    // Read in place; a batch is queued whole, so all of it is here
+    while (const DeviceCommand *cmd = commandQueue.peek(0))
+    {
+        const size_t count = cmd->batchSize > 1 ? cmd->batchSize : 1;
+        if (count == 1)
+            handleCommand(*cmd);
+        else
+            handleBatch(count);
+        commandQueue.drop(count);
+    }
+
+    uint64_t now = monotonicMicros();
+
+    // Float switch moved: read it once it has stopped bouncing
+    if (waterPinChanged.exchange(false))
+        scheduler.schedule(JOB_WATER_POLL, now + millisToMicros(WATER_DEBOUNCE_MS));
+
+    if (timeSynced.exchange(false))
+        alignCycles();
+
+    uint8_t job;
+    while (scheduler.popDue(now, job))
+    {
+        const uint64_t jobStarted = monotonicMicros();
+        runJob(job, now);
+        if (job == JOB_TEMP_POLL || job == JOB_TEMP_READ || job == JOB_WATER_POLL)
+            metrics.sensors.record(monotonicMicros() - jobStarted);
+    }
+
+    // Hand the latest state to the network task; retried next pass if full
+    if (statePending)
+    {
+        statePending = !stateQueue.push(currentState);
+        if (!statePending && networkTaskHandle)
+            xTaskNotifyGive(networkTaskHandle);
+    }
+    metrics.control.record(monotonicMicros() - started);
+
+    // Inline networking needs polling; otherwise sleep until there is work
+    if (networkTaskHandle)
+        waitForWork();
+}
+
+void OrtusSystem::runJob(uint8_t job, uint64_t now)
+{
+    switch (job)
+    {
+    case JOB_TEMP_POLL:
+        scheduler.schedule(JOB_TEMP_POLL, now + millisToMicros(TEMP_POLL_MS));
+        pollTemperature(now);
+        break;
+
+    case JOB_TEMP_READ:
+        // One probe per pass so no pass waits on the bus for long
+        readTemperatureSensor(tempReadIndex++);
+        if (tempReadIndex < tempSensorCount)
+            scheduler.schedule(JOB_TEMP_READ, now + millisToMicros(1));
+        else
+            applyRules();
+        break;
+
+    case JOB_WATER_POLL:
+        scheduler.schedule(JOB_WATER_POLL, now + millisToMicros(WATER_POLL_MS));
+        pollWaterLevel();
+        applyRules();
+        break;
+
+    case JOB_ACTUATORS:
+        updateActuators();
+        break;
+
+    case JOB_SAVE_STATE:
+        stateStore.flush();
+        break;
+
+    case JOB_CYCLE_CHECKPOINT:
+        scheduler.schedule(JOB_CYCLE_CHECKPOINT, now + millisToMicros(CYCLE_CHECKPOINT_INTERVAL_MS));
+        saveState(); // Writes only if an unanchored cycle moved on
+        break;
+
+    case JOB_HISTORY_SAMPLE:
+        scheduler.schedule(JOB_HISTORY_SAMPLE, now + millisToMicros(HISTORY_SAMPLE_MS));
+        recordHistory();
+        history.closeIfOlder((uint32_t)(now / 1000000), HISTORY_BLOCK_MAX_AGE_MS / 1000);
+        break;
+
+    case JOB_RULES:
+        applyRules(); // Re-arms itself while time rules exist
+        break;
+    }
+}
+
+// Blocks the control task until the earliest job is due or a command or
+// GPIO interrupt notifies it. With automatic light sleep configured the
+// chip sleeps through the wait whenever the network task is idle too.
+void OrtusSystem::waitForWork()
+{
+    unsigned long waitMs = CONTROL_MAX_WAIT_MS;
+    if (statePending)
+    {
+        waitMs = 1;
+    }
+    else if (!scheduler.empty())
+    {
+        uint64_t now = monotonicMicros();
+        uint64_t next = scheduler.next();
+        if (next <= now)
+            waitMs = 0;
+        else if ((next - now + 999) / 1000 < waitMs)
+            waitMs = (next - now + 999) / 1000; // Round up so the job is due on wake
+    }
+
+    if (waitMs > 0)
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(waitMs));
 }
 
 // --- WiFi ---
@@ -117,6 +293,29 @@ void OrtusSystem::setupWiFi()
     WiFi.mode(WIFI_STA);
     WiFi.setAutoReconnect(true);
     macAddress = WiFi.macAddress();
+    wifiBackoff.begin(macAddress.c_str(), monotonicMicros());
+
+    // SNTP polls in the background once WiFi is up
+    sntp_set_time_sync_notification_cb(onTimeSync);
+    configTime(0, 0, NTP_SERVER);
+    setupTopics();
+}
+
+void OrtusSystem::setupTopics()
+{
+    snprintf(topics.clientId, sizeof(topics.clientId), "Ortus-%s", macAddress.c_str());
+    snprintf(topics.status, sizeof(topics.status), "ortus/%s/status", macAddress.c_str());
+    snprintf(topics.command, sizeof(topics.command), "ortus/%s/command", macAddress.c_str());
+    snprintf(topics.commandBin, sizeof(topics.commandBin), "ortus/%s/command/bin", macAddress.c_str());
+    snprintf(topics.state, sizeof(topics.state), "ortus/%s/state", macAddress.c_str());
+    snprintf(topics.statePatch, sizeof(topics.statePatch), "ortus/%s/state/patch", macAddress.c_str());
+    snprintf(topics.stateBin, sizeof(topics.stateBin), "ortus/%s/state/bin", macAddress.c_str());
+    snprintf(topics.statePatchBin, sizeof(topics.statePatchBin), "ortus/%s/state/patch/bin", macAddress.c_str());
+    snprintf(topics.presence, sizeof(topics.presence), "ortus/%s/presence", macAddress.c_str());
+    snprintf(topics.ota, sizeof(topics.ota), "ortus/%s/ota", macAddress.c_str());
+    snprintf(topics.history, sizeof(topics.history), "ortus/%s/history", macAddress.c_str());
+    snprintf(topics.ack, sizeof(topics.ack), "ortus/%s/ack", macAddress.c_str());
+    snprintf(topics.metrics, sizeof(topics.metrics), "ortus/%s/metrics", macAddress.c_str());
 }
 
 void OrtusSystem::connectWiFi()
@@ -126,8 +325,12 @@ void OrtusSystem::connectWiFi()
         if (!wifiConnected)
         {
             wifiConnected = true;
+            wifiBackoff.up(monotonicMicros());
+            if (bleReleaseAt < monotonicMicros() + millisToMicros(BLE_RELEASE_DELAY_MS))
+                bleReleaseAt = monotonicMicros() + millisToMicros(BLE_RELEASE_DELAY_MS);
             Serial.println("[WiFi] Connected! IP: " + WiFi.localIP().toString());
             ble.updateWiFiState(true);
+            startMdns();
             publishPresence(); // Immediate presence on connect
         }
         return;
@@ -136,28 +339,73 @@ void OrtusSystem::connectWiFi()
     if (wifiConnected)
     {
         wifiConnected = false;
+        wifiDownSince = monotonicMicros();
+        wifiBackoff.down(monotonicMicros());
+        mqttBackoff.down(monotonicMicros());
         ble.updateWiFiState(false);
     }
 
     if (wifiSSID.isEmpty())
         return; // No credentials
 
-    if (millis() - lastWifiAttempt > 10000)
+    if (wifiBackoff.due(monotonicMicros()))
     {
-        lastWifiAttempt = millis();
+        wifiBackoff.attempt(monotonicMicros());
         Serial.println("[WiFi] Connecting to " + wifiSSID + "...");
         WiFi.begin(wifiSSID.c_str(), wifiPass.c_str());
     }
 }
 
+// Network task. Starts and stops BLE provisioning; see BLE_RELEASE_DELAY_MS.
+void OrtusSystem::manageBle()
+{
+    const uint64_t now = monotonicMicros();
+
+    bool wanted = false;
+    if (digitalRead(PIN_BUTTON_PROVISION) == LOW)
+    {
+        if (!buttonPressed)
+            buttonPressedAt = now;
+        buttonPressed = true;
+        if (now - buttonPressedAt >= millisToMicros(BLE_BUTTON_HOLD_MS))
+        {
+            wanted = true;
+            bleReleaseAt = now + millisToMicros(BLE_ON_DEMAND_MS);
+        }
+    }
+    else
+    {
+        buttonPressed = false;
+    }
+    if (!wifiConnected && now - wifiDownSince >= millisToMicros(BLE_OUTAGE_ENABLE_MS))
+        wanted = true;
+
+    if (wanted && !ble.active())
+    {
+        ble.start();
+        ble.updateWiFiState(wifiConnected);
+    }
+    else if (!wanted && ble.active() && wifiConnected && !ble.connected() && now >= bleReleaseAt)
+    {
+        ble.stop();
+    }
+}
+
 // --- MQTT ---
 
 void OrtusSystem::setupMQTT()
 {
-    wifiClient.setInsecure(); // For HiveMQ or similar without cert validation
+    tlsClient.begin(MQTT_ROOT_CA);
     mqttClient.setServer(MQTT_BROKER_HOST, MQTT_PORT);
     mqttClient.setCallback(mqttCallback);
-    mqttClient.setBufferSize(1024); // Increase buffer for JSON
+    mqttClient.setBufferSize(MQTT_BUFFER_SIZE); // Increase buffer for JSON
+
+    // Kept across power cuts: a fleet rebooting together is when it matters
+    retryHintSeconds = preferences.getUInt("retryHint", 0);
+    if (retryHintSeconds > MQTT_RETRY_HINT_MAX_S)
+        retryHintSeconds = 0;
+    mqttBackoff.setHint(secondsToMicros(retryHintSeconds));
+    mqttBackoff.begin(macAddress.c_str(), monotonicMicros());
 }
 
 void OrtusSystem::connectMQTT()
@@ -165,436 +413,1526 @@ void OrtusSystem::connectMQTT()
     if (mqttClient.connected())
         return;
 
-    static unsigned long lastMqttAttempt = 0;
-    if (millis() - lastMqttAttempt < 5000)
+    mqttBackoff.down(monotonicMicros());
+    if (!mqttBackoff.due(monotonicMicros()))
         return;
-    lastMqttAttempt = millis();
+    mqttBackoff.attempt(monotonicMicros());
 
     Serial.print("[MQTT] Connecting...");
-    String clientId = "Ortus-" + macAddress;
-    String lwtTopic = "ortus/" + macAddress + "/status";
 
-    if (mqttClient.connect(clientId.c_str(), MQTT_USERNAME, MQTT_PASSWORD, lwtTopic.c_str(), 1, true, "offline"))
+    // A persistent session (cleanSession false) makes the broker hold QoS 1
+    // commands while we are offline and hand them over on reconnect
+    if (mqttClient.connect(topics.clientId, MQTT_USERNAME, MQTT_PASSWORD, topics.status, 1, true, "offline", false))
     {
         Serial.println("Connected");
+        mqttBackoff.up(monotonicMicros());
+        OtaUpdater::confirmRunning(); // An updated image has proven it can reach home
 
         // Publish online status (retained)
-        mqttClient.publish(lwtTopic.c_str(), "online", true);
-
-        // Subscribe to unified command topic
-        String cmdTopic = "ortus/" + macAddress + "/command";
-        mqttClient.subscribe(cmdTopic.c_str());
-
-        broadcastState(true);
+        mqttClient.publish(topics.status, "online", true);
+
+        // Subscribe to unified command topic (JSON and binary)
+        mqttClient.subscribe(topics.command, 1);
+        mqttClient.subscribe(topics.commandBin, 1);
+        mqttClient.subscribe(MQTT_RETRY_HINT_TOPIC);
+        char filter[MQTT_TOPIC_SIZE];
+        snprintf(filter, sizeof(filter), "%s/command/#", MQTT_BROADCAST_TOPIC);
+        mqttClient.subscribe(filter, 1);
+        subscribeGroups(true);
+
+        publishSnapshot(); // Replaces a snapshot queued while offline
+        flushOutbox();
     }
     else
     {
         Serial.print("Failed, rc=");
         Serial.println(mqttClient.state());
+        mqttBackoff.failed(monotonicMicros(), mqttClient.state() == MQTT_CONNECT_UNAVAILABLE);
     }
 }
 
-void OrtusSystem::mqttCallback(char *topic, uint8_t *payload, unsigned int length)
+// Retained by the backend while the broker is overloaded: the least time
+// in seconds to spread reconnects over. Empty or 0 clears it. Anything but
+// decimal digits up to MQTT_RETRY_HINT_MAX_S is ignored, so a stray
+// publish cannot park the device for long or corrupt what is in flash.
+void OrtusSystem::applyRetryHint(const uint8_t *payload, unsigned int length)
 {
-    if (instance)
-        instance->onMqttMessage(topic, payload, length);
-}
+    uint32_t seconds = 0;
+    for (unsigned int i = 0; i < length; i++)
+    {
+        if (!isdigit(payload[i]) || seconds > MQTT_RETRY_HINT_MAX_S)
+        {
+            Serial.println("[MQTT] Ignoring invalid broker retry hint");
+            return;
+        }
+        seconds = seconds * 10 + (payload[i] - '0');
+    }
+    if (seconds > MQTT_RETRY_HINT_MAX_S)
+    {
+        Serial.println("[MQTT] Ignoring invalid broker retry hint");
+        return;
+    }
 
-void OrtusSystem::onMqttMessage(char *topic, uint8_t *payload, unsigned int length)
-{
-    // MQTT now uses the exact same JSON format as WebSockets
-    processRawCommand(payload, length);
+    mqttBackoff.setHint(secondsToMicros(seconds));
+    if (seconds != retryHintSeconds)
+    {
+        retryHintSeconds = seconds;
+        {
+            NvsLock lock;
+            preferences.putUInt("retryHint", seconds);
+        }
+        Serial.printf("[MQTT] Broker retry hint %u s\n", (unsigned)seconds);
+    }
 }
 
-// --- WebSocket ---
-
-void OrtusSystem::webSocketEvent(uint8_t num, WStype_t type, uint8_t *payload, size_t length)
+void OrtusSystem::mqttCallback(char *topic, uint8_t *payload, unsigned int length)
 {
     if (instance)
-        instance->onWebSocketMessage(num, type, payload, length);
+        instance->onMqttMessage(topic, payload, length);
 }
 
-void OrtusSystem::onWebSocketMessage(uint8_t num, WStype_t type, uint8_t *payload, size_t length)
+void OrtusSystem::onMqttMessage(char *topic, uint8_t *payload, unsigned int length)
 {
-    if (type == WStype_TEXT)
+    if (strcmp(topic, MQTT_RETRY_HINT_TOPIC) == 0)
     {
-        processRawCommand(payload, length);
-    }
-    else if (type == WStype_CONNECTED)
-    {
-        // Send current state on connect
-        broadcastState(true);
+        applyRetryHint(payload, length);
+        return;
     }
-}
 
-// --- Logic ---
+    // MQTT now uses the exact same formats as WebSockets
+    WireFormat format;
+    if (commandTopic(topic, format))
+        processRawCommand(payload, length, format);
+}
 
-void OrtusSystem::processRawCommand(const uint8_t *payload, size_t length)
+// Whether `topic` is one of this tower's command topics, and in which
+// format. Group topics count only while the tower is a member: the
+// persistent session can keep a left group's subscription alive.
+bool OrtusSystem::commandTopic(const char *topic, WireFormat &format) const
 {
-    JsonDocument doc;
-    DeserializationError error = deserializeJson(doc, payload, length);
-
-    if (error)
+    if (strcmp(topic, topics.command) == 0 || strcmp(topic, topics.commandBin) == 0)
     {
-        Serial.println("[Command] JSON Error");
-        return;
+        format = strcmp(topic, topics.commandBin) == 0 ? WireFormat::Binary : WireFormat::Json;
+        return true;
     }
 
-    DeviceCommand cmd;
-    String type = doc["type"] | "";
-
-    // Unified command parsing
-    // Supports strictly { "type": "...", "value": ... }
-    if (type == "setBrightness")
-    {
-        cmd.type = CommandType::SetBrightness;
-        if (!doc["value"].isNull())
-            cmd.brightness = doc["value"];
-        else
-            return;
-    }
-    else if (type == "triggerIrrigation")
-    {
-        cmd.type = CommandType::TriggerIrrigation;
-        if (!doc["value"].isNull())
-            cmd.irrigationDurationSeconds = doc["value"];
-        else
-            cmd.irrigationDurationSeconds = 60; // Default
-    }
-    else if (type == "irrigationCycle")
+    const char *suffix;
+    const size_t groupPrefixLength = strlen(MQTT_GROUP_TOPIC_PREFIX);
+    const size_t broadcastLength = strlen(MQTT_BROADCAST_TOPIC);
+    if (strncmp(topic, MQTT_GROUP_TOPIC_PREFIX, groupPrefixLength) == 0)
     {
-        cmd.type = CommandType::IrrigationCycle;
-        String value = doc["value"] | "";
-        // Parse format: "on:120,off:600"
-        int onIdx = value.indexOf("on:");
-        int offIdx = value.indexOf("off:");
-        if (onIdx < 0 || offIdx < 0)
-            return;
-        int commaIdx = value.indexOf(',');
-        if (commaIdx < 0)
-            return;
-        cmd.irrigationCycleOnSeconds = value.substring(onIdx + 3, commaIdx).toInt();
-        cmd.irrigationCycleOffSeconds = value.substring(offIdx + 4).toInt();
-        if (cmd.irrigationCycleOnSeconds == 0 || cmd.irrigationCycleOffSeconds == 0)
-            return;
+        const char *id = topic + groupPrefixLength;
+        suffix = strchr(id, '/');
+        bool member = false;
+        for (uint8_t i = 0; suffix && i < groupCount && !member; i++)
+            member = strlen(groups[i]) == (size_t)(suffix - id) && memcmp(groups[i], id, suffix - id) == 0;
+        if (!member)
+            return false;
     }
-    else if (type == "lightCycle")
+    else if (strncmp(topic, MQTT_BROADCAST_TOPIC, broadcastLength) == 0)
     {
-        cmd.type = CommandType::LightCycle;
-        String value = doc["value"] | "";
-        // Parse format: "on:120,off:600"
-        int onIdx = value.indexOf("on:");
-        int offIdx = value.indexOf("off:");
-        if (onIdx < 0 || offIdx < 0)
-            return;
-        int commaIdx = value.indexOf(',');
-        if (commaIdx < 0)
-            return;
-        cmd.lightCycleOnSeconds = value.substring(onIdx + 3, commaIdx).toInt();
-        cmd.lightCycleOffSeconds = value.substring(offIdx + 4).toInt();
-        if (cmd.lightCycleOnSeconds == 0 || cmd.lightCycleOffSeconds == 0)
-            return;
+        suffix = topic + broadcastLength;
     }
-    else if (type == "otaUpdate")
+    else
     {
-        cmd.type = CommandType::OtaUpdate;
-        cmd.otaUrl = doc["value"] | "";
-        if (cmd.otaUrl.isEmpty())
-            return;
+        return false;
     }
+
+    if (strcmp(suffix, "/command") == 0)
+        format = WireFormat::Json;
+    else if (strcmp(suffix, "/command/bin") == 0)
+        format = WireFormat::Binary;
     else
+        return false;
+    return true;
+}
+
+// Network task. Subscribes to, or leaves, the command topics of every group.
+void OrtusSystem::subscribeGroups(bool join)
+{
+    if (!mqttClient.connected())
+        return;
+    char filter[MQTT_TOPIC_SIZE];
+    for (uint8_t i = 0; i < groupCount; i++)
     {
-        return; // Unknown command
+        snprintf(filter, sizeof(filter), "%s%s/command/#", MQTT_GROUP_TOPIC_PREFIX, groups[i]);
+        if (join)
+            mqttClient.subscribe(filter, 1);
+        else
+            mqttClient.unsubscribe(filter);
     }
-
-    handleCommand(cmd);
 }
 
-void OrtusSystem::handleCommand(const DeviceCommand &cmd)
+void OrtusSystem::setGroups(const DeviceCommand &cmd)
 {
-    if (cmd.type == CommandType::SetBrightness)
+    subscribeGroups(false);
+    memcpy(groups, cmd.groups, sizeof(groups));
+    groupCount = cmd.groupCount;
+    subscribeGroups(true);
+
     {
-        int b = constrain(cmd.brightness, 0, 100);
-        if (currentState.brightness != b)
-        {
-            currentState.brightness = b;
-            saveState();
-            updateActuators();
-            broadcastState();
-        }
+        NvsLock lock;
+        if (groupCount > 0)
+            preferences.putBytes("groups", groups, groupCount * GROUP_ID_SIZE);
+        else
+            preferences.remove("groups");
     }
-    else if (cmd.type == CommandType::TriggerIrrigation)
+    Serial.printf("[MQTT] Member of %u group(s)\n", (unsigned)groupCount);
+}
+
+void OrtusSystem::loadGroups()
+{
+    const size_t length = preferences.getBytesLength("groups");
+    if (length == 0 || length % GROUP_ID_SIZE != 0 || length > sizeof(groups) ||
+        preferences.getBytes("groups", groups, length) != length)
+        return;
+
+    groupCount = length / GROUP_ID_SIZE;
+    for (uint8_t i = 0; i < groupCount; i++)
     {
-        if (cmd.irrigationDurationSeconds > 0)
+        if (!validGroupId(groups[i], strnlen(groups[i], GROUP_ID_SIZE)))
         {
-            irrigationStopAt = millis() + (cmd.irrigationDurationSeconds * 1000);
-            currentState.irrigationActive = true;
-            updateActuators();
-            broadcastState();
+            Serial.println("[MQTT] Stored groups are corrupt, ignoring them");
+            memset(groups, 0, sizeof(groups));
+            groupCount = 0;
+            return;
         }
     }
-    else if (cmd.type == CommandType::IrrigationCycle)
+}
+
+// --- LAN ---
+
+// Network task. The responder follows WiFi through reconnects by itself, so
+// it is started once, on the first connection.
+void OrtusSystem::startMdns()
+{
+    if (mdnsStarted)
+        return;
+
+    // "24:58:7C:AB:CD:EF" -> "ortus-abcdef"
+    char suffix[7] = {};
+    size_t n = 0;
+    for (size_t i = macAddress.length(); i-- > 0 && n < 6;)
     {
-        currentState.irrigationCycleActive = true;
-        currentState.irrigationCycleOnSeconds = cmd.irrigationCycleOnSeconds;
-        currentState.irrigationCycleOffSeconds = cmd.irrigationCycleOffSeconds;
-        irrigationCycleIsOnPhase = true;
-        irrigationCycleNextToggle = millis() + (cmd.irrigationCycleOnSeconds * 1000);
-        currentState.irrigationActive = true;
-        saveState();
-        updateActuators();
-        broadcastState();
+        const char c = macAddress[i];
+        if (c != ':')
+            suffix[5 - n++] = (char)tolower((unsigned char)c);
     }
-    else if (cmd.type == CommandType::LightCycle)
+    snprintf(hostname, sizeof(hostname), "%s%s", MDNS_HOST_PREFIX, suffix);
+    if (!MDNS.begin(hostname))
     {
-        currentState.lightCycleActive = true;
-        currentState.lightCycleOnSeconds = cmd.lightCycleOnSeconds;
-        currentState.lightCycleOffSeconds = cmd.lightCycleOffSeconds;
-        lightCycleIsOnPhase = true;
-        lightCycleNextToggle = millis() + (cmd.lightCycleOnSeconds * 1000);
-        currentState.brightness = 100;
-        appliedBrightness = -1; // Force PWM update
-        saveState();
-        updateActuators();
-        broadcastState();
+        Serial.println("[mDNS] Failed to start");
+        hostname[0] = '\0';
+        return;
     }
-    else if (cmd.type == CommandType::OtaUpdate)
+    mdnsStarted = true;
+    MDNS.setInstanceName(String("Ortus ") + suffix);
+    MDNS.addService(MDNS_SERVICE, "tcp", WS_SERVER_PORT);
+
+    uint8_t pwm = 0;
+    uint8_t relay = 0;
+    for (uint8_t i = 0; i < actuators.count(); i++)
     {
-        performOtaUpdate(cmd.otaUrl);
+        if (actuators.kind(i) == ActuatorKind::Pwm)
+            pwm++;
+        else
+            relay++;
     }
+    MDNS.addServiceTxt(MDNS_SERVICE, "tcp", "mac", macAddress.c_str());
+    MDNS.addServiceTxt(MDNS_SERVICE, "tcp", "proto", String(BINARY_PROTOCOL_VERSION).c_str());
+    MDNS.addServiceTxt(MDNS_SERVICE, "tcp", "bin", WS_BINARY_PATH);
+    MDNS.addServiceTxt(MDNS_SERVICE, "tcp", "auth", lanToken[0] ? "token" : "none");
+    MDNS.addServiceTxt(MDNS_SERVICE, "tcp", "pwm", String(pwm).c_str());
+    MDNS.addServiceTxt(MDNS_SERVICE, "tcp", "relay", String(relay).c_str());
+    Serial.printf("[mDNS] Advertising %s.local\n", hostname);
 }
 
-void OrtusSystem::updateActuators()
+// Network task. Every other WebSocket client has to connect again with the
+// new token; the one that sent it keeps its connection. The first token
+// comes over MQTT; after that, LAN clients holding it may change it.
+void OrtusSystem::setLanToken(const DeviceCommand &cmd)
 {
-    // Light Cycle
-    if (currentState.lightCycleActive && millis() >= lightCycleNextToggle)
+    memcpy(lanToken, cmd.lanToken, sizeof(lanToken));
+    const size_t length = strlen(lanToken);
     {
-        lightCycleIsOnPhase = !lightCycleIsOnPhase;
-        currentState.brightness = lightCycleIsOnPhase ? 100 : 0;
-        appliedBrightness = -1; // Force PWM update
-        unsigned long duration = lightCycleIsOnPhase
-            ? currentState.lightCycleOnSeconds
-            : currentState.lightCycleOffSeconds;
-        lightCycleNextToggle = millis() + (duration * 1000);
-        broadcastState();
+        NvsLock lock;
+        if (length > 0)
+            preferences.putBytes("lanToken", lanToken, length);
+        else
+            preferences.remove("lanToken");
     }
+    if (mdnsStarted)
+        MDNS.addServiceTxt(MDNS_SERVICE, "tcp", "auth", length > 0 ? "token" : "none");
 
-    // Light (PWM dimming via LEDC)
-    if (appliedBrightness != currentState.brightness)
+    for (uint8_t num = 0; num < WEBSOCKETS_SERVER_CLIENT_MAX; num++)
     {
-        appliedBrightness = currentState.brightness;
-        int duty = (constrain(appliedBrightness, 0, 100) * 255) / 100;
-        ledc_set_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, duty);
-        ledc_update_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0);
+        if (num != cmd.origin && wsClients[num].connected)
+        {
+            wsServer.disconnect(num);
+            wsClients[num] = WsClient();
+        }
     }
+    Serial.println(length > 0 ? "[WS] LAN token set" : "[WS] LAN token cleared, clients need none");
+}
 
-    // Irrigation Cycle
-    if (currentState.irrigationCycleActive && millis() >= irrigationCycleNextToggle)
+void OrtusSystem::loadLanToken()
+{
+    const size_t length = preferences.getBytesLength("lanToken");
+    if (length == 0)
+        return;
+    if (length >= sizeof(lanToken) || preferences.getBytes("lanToken", lanToken, length) != length ||
+        !validLanToken(lanToken, length))
     {
-        irrigationCycleIsOnPhase = !irrigationCycleIsOnPhase;
-        currentState.irrigationActive = irrigationCycleIsOnPhase;
-        unsigned long duration = irrigationCycleIsOnPhase
-            ? currentState.irrigationCycleOnSeconds
-            : currentState.irrigationCycleOffSeconds;
-        irrigationCycleNextToggle = millis() + (duration * 1000);
-        broadcastState();
+        // Failing closed would lock the LAN out for good; MQTT can set a new one
+        Serial.println("[WS] Stored LAN token is corrupt, ignoring it");
+        memset(lanToken, 0, sizeof(lanToken));
+        return;
     }
+    lanToken[length] = '\0';
+}
 
-    // Irrigation (one-shot timer)
-    if (!currentState.irrigationCycleActive && currentState.irrigationActive)
+namespace
+{
+    // Compares in time that depends only on the expected token's length.
+    bool sameToken(const char *expected, const char *given, size_t givenLength)
     {
-        if (millis() >= irrigationStopAt)
-        {
-            currentState.irrigationActive = false;
-            irrigationStopAt = 0;
-            broadcastState();
-        }
+        const size_t length = strlen(expected);
+        uint8_t diff = givenLength != length;
+        for (size_t i = 0; i < length; i++)
+            diff |= (uint8_t)expected[i] ^ (uint8_t)(i < givenLength ? given[i] : 0);
+        return diff == 0;
     }
-    digitalWrite(PIN_RELAY_IRRIGATION, currentState.irrigationActive ? HIGH : LOW);
 }
 
-void OrtusSystem::updateSensors()
+// Network task. `url` is the request path, e.g. "/bin?token=...". Sets the
+// client up if it may connect; otherwise tells it why and drops it.
+bool OrtusSystem::acceptClient(uint8_t num, const uint8_t *url, size_t length)
 {
-    unsigned long now = millis();
+    const char *path = (const char *)url;
+    const char *query = path ? (const char *)memchr(path, '?', length) : nullptr;
+    const size_t pathLength = query ? query - path : length;
 
-    // Temperature
-    if (now - lastTempPoll > TEMP_POLL_MS)
+    if (lanToken[0])
     {
-        lastTempPoll = now;
-        sensors.requestTemperatures();
-        float t = sensors.getTempCByIndex(0);
-        if (t > -50 && t < 150) // Basic validation
+        const char *given = nullptr;
+        size_t givenLength = 0;
+        const char *end = path + length;
+        for (const char *param = query; param && param < end;)
         {
-            if (isnan(currentState.temperatureC) || fabs(t - currentState.temperatureC) > TEMP_DELTA_THRESHOLD)
+            param++; // '?' or '&'
+            const char *next = (const char *)memchr(param, '&', end - param);
+            const char *paramEnd = next ? next : end;
+            if (paramEnd - param > 6 && memcmp(param, "token=", 6) == 0)
             {
-                currentState.temperatureC = t;
-                broadcastState();
+                given = param + 6;
+                givenLength = paramEnd - given;
             }
+            param = next;
         }
-    }
-
-    // Water Level
-    if (now - lastWaterPoll > WATER_POLL_MS)
-    {
-        lastWaterPoll = now;
-        int val = digitalRead(PIN_SENSOR_WATER);
-
-        // Previous analog logic: > 1.5V = Not Empty, < 1.5V = Empty.
-        // Mapping to digital: HIGH (Pullup) = Not Empty, LOW (Grounded) = Empty.
-        bool empty = (val == LOW);
-
-        if (empty != currentState.waterEmpty)
+        if (!given || !sameToken(lanToken, given, givenLength))
         {
-            currentState.waterEmpty = empty;
-            broadcastState();
+            Serial.printf("[WS] Client %u rejected, wrong or missing token\n", num);
+            wsServer.sendTXT(num, "{\"type\":\"error\",\"error\":\"unauthorized\"}");
+            wsServer.disconnect(num);
+            wsClients[num] = WsClient();
+            return false;
         }
     }
+
+    WsClient &client = wsClients[num];
+    client = WsClient();
+    client.connected = true;
+    client.binary = pathLength == strlen(WS_BINARY_PATH) && memcmp(path, WS_BINARY_PATH, pathLength) == 0;
+    return true;
 }
 
-void OrtusSystem::broadcastState(bool force)
+// --- WebSocket ---
+
+void OrtusSystem::webSocketEvent(uint8_t num, WStype_t type, uint8_t *payload, size_t length)
 {
-    if (!force && currentState == lastBroadcastState)
-        return;
-    lastBroadcastState = currentState;
+    if (instance)
+        instance->onWebSocketMessage(num, type, payload, length);
+}
 
-    JsonDocument doc;
-    doc["brightness"] = currentState.brightness;
-    doc["irrigationActive"] = currentState.irrigationActive;
-    doc["irrigationCycleActive"] = currentState.irrigationCycleActive;
-    if (currentState.irrigationCycleActive)
+void OrtusSystem::onWebSocketMessage(uint8_t num, WStype_t type, uint8_t *payload, size_t length)
+{
+    // Frames from a client that was turned away are dropped
+    if (type == WStype_TEXT)
     {
-        doc["irrigationCycleOnSeconds"] = currentState.irrigationCycleOnSeconds;
-        doc["irrigationCycleOffSeconds"] = currentState.irrigationCycleOffSeconds;
+        if (wsClients[num].connected)
+            processRawCommand(payload, length, WireFormat::Json, num);
     }
-    doc["lightCycleActive"] = currentState.lightCycleActive;
-    if (currentState.lightCycleActive)
+    else if (type == WStype_BIN)
     {
-        doc["lightCycleOnSeconds"] = currentState.lightCycleOnSeconds;
-        doc["lightCycleOffSeconds"] = currentState.lightCycleOffSeconds;
+        if (wsClients[num].connected)
+            processRawCommand(payload, length, WireFormat::Binary, num);
     }
-    doc["temperature"] = currentState.temperatureC;
-    doc["waterEmpty"] = currentState.waterEmpty;
-
-    String json;
-    serializeJson(doc, json);
+    else if (type == WStype_CONNECTED)
+    {
+        // The payload is the request URL
+        if (!acceptClient(num, payload, length))
+            return;
 
-    // MQTT: Publish full state as JSON
-    if (mqttClient.connected())
+        // Send the full state to the new client only
+        wsClients[num].snapshotPending = true;
+        drainStateQueue();
+        flushWebSockets();
+    }
+    else if (type == WStype_DISCONNECTED)
     {
-        String topic = "ortus/" + macAddress + "/state";
-        mqttClient.publish(topic.c_str(), json.c_str(), true);
+        wsClients[num] = WsClient();
     }
-
-    // WebSocket: Same JSON
-    wsServer.broadcastTXT(json);
-}
-
-void OrtusSystem::publishPresence()
-{
-    if (!mqttClient.connected())
-        return;
-
-    JsonDocument doc;
-    doc["ip"] = WiFi.localIP().toString();
-    doc["mac"] = macAddress;
-    doc["uptime"] = millis() / 1000;
-
-    String json;
-    serializeJson(doc, json);
-
-    String topic = "ortus/" + macAddress + "/presence";
-    mqttClient.publish(topic.c_str(), json.c_str());
 }
 
-// --- Persistence ---
+// --- Logic ---
 
-void OrtusSystem::loadState()
+namespace
 {
-    currentState.brightness = preferences.getInt("brightness", 0);
-    currentState.irrigationCycleActive = preferences.getBool("cycleActive", false);
-    currentState.irrigationCycleOnSeconds = preferences.getULong("cycleOn", 0);
-    currentState.irrigationCycleOffSeconds = preferences.getULong("cycleOff", 0);
-    if (currentState.irrigationCycleActive)
+    CommandAck makeAck(const DeviceCommand &cmd, AckStatus status)
     {
-        irrigationCycleIsOnPhase = true;
-        currentState.irrigationActive = true;
-        irrigationCycleNextToggle = millis() + (currentState.irrigationCycleOnSeconds * 1000);
+        CommandAck ack;
+        memcpy(ack.id, cmd.id, sizeof(ack.id));
+        ack.origin = cmd.origin;
+        ack.status = status;
+        return ack;
     }
-    currentState.lightCycleActive = preferences.getBool("lCycleActive", false);
-    currentState.lightCycleOnSeconds = preferences.getULong("lCycleOn", 0);
-    currentState.lightCycleOffSeconds = preferences.getULong("lCycleOff", 0);
-    if (currentState.lightCycleActive)
+
+    // Handled by the network task rather than queued
+    bool networkCommand(CommandType type)
     {
-        lightCycleIsOnPhase = true;
-        currentState.brightness = 100;
-        appliedBrightness = -1;
-        lightCycleNextToggle = millis() + (currentState.lightCycleOnSeconds * 1000);
+        return type == CommandType::OtaUpdate || type == CommandType::SetWireFormat || type == CommandType::GetMetrics ||
+               type == CommandType::SetGroups || type == CommandType::SetLanToken;
     }
-}
-
-void OrtusSystem::saveState()
-{
-    preferences.putInt("brightness", currentState.brightness);
-    preferences.putBool("cycleActive", currentState.irrigationCycleActive);
-    preferences.putULong("cycleOn", currentState.irrigationCycleOnSeconds);
-    preferences.putULong("cycleOff", currentState.irrigationCycleOffSeconds);
-    preferences.putBool("lCycleActive", currentState.lightCycleActive);
-    preferences.putULong("lCycleOn", currentState.lightCycleOnSeconds);
-    preferences.putULong("lCycleOff", currentState.lightCycleOffSeconds);
-}
-
-void OrtusSystem::loadCredentials()
-{
-    wifiSSID = preferences.getString("ssid", DEFAULT_WIFI_SSID);
-    wifiPass = preferences.getString("pass", DEFAULT_WIFI_PASSWORD);
-}
 
-void OrtusSystem::saveCredentials(String s, String p)
-{
-    preferences.putString("ssid", s);
-    preferences.putString("pass", p);
-    wifiSSID = s;
-    wifiPass = p;
-    Serial.println("[System] Credentials saved.");
+    // What a command leaves to do once it (or its batch) has been applied
+    namespace CommandEffect
+    {
+        constexpr uint8_t Save = 1 << 0;
+        constexpr uint8_t Outputs = 1 << 1;
+        // Reached the actuators; timed once finishCommands() has run
+        constexpr uint8_t Timed = 1 << 2;
+    }
 }
 
-void OrtusSystem::performOtaUpdate(const String &url)
+// Runs on the network task. Network-side commands are handled here, the
+// rest is queued for the control task. Commands with an id are acked to
+// where they came from, and a repeated id is acked but not run again.
+void OrtusSystem::processRawCommand(const uint8_t *payload, size_t length, WireFormat format, uint8_t origin)
 {
-    Serial.println("[OTA] Starting update from: " + url);
-
-    // Publish status so the app knows we're updating
-    if (mqttClient.connected())
+    DeviceCommand cmd;
+    cmd.origin = origin;
+    cmd.receivedAt = monotonicMicros();
+    bool ok;
+    if (format == WireFormat::Binary)
     {
-        String topic = "ortus/" + macAddress + "/ota";
-        mqttClient.publish(topic.c_str(), "started");
+        ok = decodeBinaryCommand(payload, length, cmd);
     }
+    else
+    {
+        const size_t count = commandParser.load(payload, length);
+        if (count > 1)
+        {
+            processBatch(count, origin, cmd.receivedAt);
+            return;
+        }
+        ok = count == 1 && commandParser.command(0, cmd);
+    }
+    if (!ok)
+    {
+        if (format == WireFormat::Binary)
+            Serial.println("[Command] Invalid binary frame");
+        sendAck(makeAck(cmd, AckStatus::Rejected));
+        return;
+    }
+
+    if (cmd.id[0] && seenCommand(cmd.id))
+    {
+        sendAck(makeAck(cmd, AckStatus::Duplicate));
+        return;
+    }
+
+    if (cmd.type == CommandType::OtaUpdate)
+    {
+        if (ota.start(cmd.otaUrl, cmd.otaSha256))
+        {
+            rememberCommand(cmd.id);
+            sendAck(makeAck(cmd, AckStatus::Accepted));
+            otaReported = 0;
+            publishOtaStatus("started", OutboxKey::None);
+        }
+        else
+        {
+            // One update at a time. Not remembered, so the sender may retry it
+            sendAck(makeAck(cmd, AckStatus::Rejected));
+        }
+    }
+    else if (cmd.type == CommandType::SetWireFormat)
+    {
+        rememberCommand(cmd.id);
+        if (mqttWireFormat != cmd.wireFormat)
+        {
+            // Clear the retained snapshot in the old format, so nothing
+            // reads it as current
+            const char *stale = mqttWireFormat == WireFormat::Binary ? topics.stateBin : topics.state;
+            publishMqtt(stale, (const uint8_t *)"", 0, true, OutboxKey::None);
+            mqttWireFormat = cmd.wireFormat;
+            {
+                NvsLock lock;
+                preferences.putUChar("wireFormat", (uint8_t)mqttWireFormat);
+            }
+            publishSnapshot(); // Retained state in the new format
+        }
+        sendAck(makeAck(cmd, AckStatus::Applied));
+    }
+    else if (cmd.type == CommandType::GetMetrics)
+    {
+        rememberCommand(cmd.id);
+        publishMetrics(origin);
+        sendAck(makeAck(cmd, AckStatus::Applied));
+    }
+    else if (cmd.type == CommandType::SetGroups)
+    {
+        rememberCommand(cmd.id);
+        setGroups(cmd);
+        sendAck(makeAck(cmd, AckStatus::Applied));
+    }
+    else if (cmd.type == CommandType::SetLanToken && cmd.origin != ORIGIN_MQTT && !lanToken[0])
+    {
+        // An open LAN must not let whoever comes first lock the others out
+        Serial.println("[WS] The first LAN token must come over MQTT");
+        sendAck(makeAck(cmd, AckStatus::Rejected));
+    }
+    else if (cmd.type == CommandType::SetLanToken)
+    {
+        rememberCommand(cmd.id);
+        sendAck(makeAck(cmd, AckStatus::Applied)); // Before the other clients go
+        setLanToken(cmd);
+    }
+    else if (!commandQueue.push(cmd))
+    {
+        // Not remembered, so the sender may retry it
+        Serial.println("[Command] Queue full, dropped");
+        sendAck(makeAck(cmd, AckStatus::Rejected));
+    }
+    else
+    {
+        rememberCommand(cmd.id);
+        if (networkTaskHandle)
+            xTaskNotifyGive(controlTaskHandle);
+    }
+}
+
+// Network task. A batch is all or nothing: it is queued in one go only if
+// every command parses, none is a network-side one, none was seen before
+// and the queue has room for all; otherwise every command with an id is
+// acked with the reason and none runs.
+void OrtusSystem::processBatch(size_t count, uint8_t origin, uint64_t receivedAt)
+{
+    bool rejected = false;
+    bool duplicate = false;
+    for (size_t i = 0; i < count && !rejected; i++)
+    {
+        DeviceCommand *cmd = commandQueue.slot(i);
+        if (!cmd)
+        {
+            Serial.println("[Command] Queue full, batch dropped");
+            rejected = true;
+            break;
+        }
+        *cmd = DeviceCommand();
+        cmd->origin = origin;
+        cmd->receivedAt = receivedAt;
+        cmd->batchSize = i == 0 ? count : 0;
+        if (!commandParser.command(i, *cmd) || networkCommand(cmd->type))
+            rejected = true;
+        else if (cmd->id[0] && seenCommand(cmd->id))
+            duplicate = true;
+    }
+
+    if (rejected || duplicate)
+    {
+        // Not remembered, so a rejected batch may be sent again
+        for (size_t i = 0; i < count; i++)
+        {
+            DeviceCommand cmd;
+            cmd.origin = origin;
+            commandParser.command(i, cmd);
+            sendAck(makeAck(cmd, rejected ? AckStatus::Rejected : AckStatus::Duplicate));
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        rememberCommand(commandQueue.slot(i)->id);
+    commandQueue.commit(count);
+    if (networkTaskHandle)
+        xTaskNotifyGive(controlTaskHandle);
+}
+
+namespace
+{
+    // FNV-1a; 0 marks an empty slot
+    uint32_t hashCommandId(const char *id)
+    {
+        uint32_t hash = 2166136261u;
+        for (; *id; id++)
+            hash = (hash ^ (uint8_t)*id) * 16777619u;
+        return hash ? hash : 1;
+    }
+}
+
+bool OrtusSystem::seenCommand(const char *id) const
+{
+    const uint32_t hash = hashCommandId(id);
+    for (uint32_t recent : recentCommandIds)
+    {
+        if (recent == hash)
+            return true;
+    }
+    return false;
+}
+
+void OrtusSystem::rememberCommand(const char *id)
+{
+    if (!id[0])
+        return;
+    recentCommandIds[recentCommandNext] = hashCommandId(id);
+    recentCommandNext = (recentCommandNext + 1) % RECENT_COMMAND_IDS;
+}
+
+// Runs on the control task.
+void OrtusSystem::handleCommand(const DeviceCommand &cmd)
+{
+    const uint8_t effects = applyCommand(cmd);
+    finishCommands(effects);
+    if (effects & CommandEffect::Timed)
+        metrics.command.record(monotonicMicros() - cmd.receivedAt);
+}
+
+// Control task. Every command of the batch is checked before any is
+// applied; then they run in order, followed by a single state save,
+// actuator pass and state broadcast.
+void OrtusSystem::handleBatch(size_t count)
+{
+    bool valid = true;
+    for (size_t i = 0; i < count && valid; i++)
+        valid = commandValid(*commandQueue.peek(i));
+    if (!valid)
+    {
+        Serial.println("[Command] Batch rejected");
+        for (size_t i = 0; i < count; i++)
+            acknowledge(*commandQueue.peek(i), AckStatus::Rejected, DEFAULT_CHANNEL);
+        return;
+    }
+
+    uint8_t effects[MAX_BATCH_COMMANDS];
+    uint8_t combined = 0;
+    for (size_t i = 0; i < count; i++)
+        combined |= effects[i] = applyCommand(*commandQueue.peek(i));
+    finishCommands(combined);
+    const uint64_t now = monotonicMicros();
+    for (size_t i = 0; i < count; i++)
+    {
+        if (effects[i] & CommandEffect::Timed)
+            metrics.command.record(now - commandQueue.peek(i)->receivedAt);
+    }
+}
+
+bool OrtusSystem::commandValid(const DeviceCommand &cmd)
+{
+    if (cmd.type == CommandType::SetRules)
+        return rules.check(cmd.rules, cmd.rulesLength);
+    return resolveChannel(cmd.channel, commandKind(cmd.type)) != DEFAULT_CHANNEL;
+}
+
+ActuatorKind OrtusSystem::commandKind(CommandType type)
+{
+    return type == CommandType::SetBrightness || type == CommandType::LightCycle ? ActuatorKind::Pwm
+                                                                                : ActuatorKind::Relay;
+}
+
+// Applies one command to the state and acks it. Returns the CommandEffect
+// bits of what finishCommands() still has to do.
+uint8_t OrtusSystem::applyCommand(const DeviceCommand &cmd)
+{
+    if (cmd.type == CommandType::SetRules)
+    {
+        acknowledge(cmd, replaceRules(cmd) ? AckStatus::Applied : AckStatus::Rejected, DEFAULT_CHANNEL);
+        return 0;
+    }
+
+    // Commands without a channel address the first light or pump
+    const ActuatorKind kind = commandKind(cmd.type);
+    uint8_t channel = resolveChannel(cmd.channel, kind);
+    if (channel == DEFAULT_CHANNEL)
+    {
+        Serial.println("[Command] No such channel");
+        acknowledge(cmd, AckStatus::Rejected, DEFAULT_CHANNEL);
+        return 0;
+    }
+
+    if (kind == ActuatorKind::Pwm)
+        actuators.setTransition(channel, cmd.transitionMs);
+
+    uint8_t effects = CommandEffect::Timed;
+    if (cmd.type == CommandType::SetBrightness)
+    {
+        uint8_t level = constrain(cmd.brightness, 0, 100);
+        if (currentState.channels[channel].level != level)
+        {
+            actuators.setLevel(channel, level);
+            effects |= CommandEffect::Save | CommandEffect::Outputs;
+        }
+    }
+    else if (cmd.type == CommandType::TriggerIrrigation)
+    {
+        if (cmd.irrigationDurationSeconds > 0)
+        {
+            actuators.pulse(channel, cmd.irrigationDurationSeconds);
+            effects |= CommandEffect::Outputs;
+        }
+    }
+    else if (cmd.type == CommandType::IrrigationCycle || cmd.type == CommandType::LightCycle)
+    {
+        actuators.startCycle(channel, cmd.cycleOnSeconds, cmd.cycleOffSeconds);
+        currentState.channels[channel].cycleAnchor = epochNow();
+        effects |= CommandEffect::Save | CommandEffect::Outputs;
+    }
+    acknowledge(cmd, AckStatus::Applied, channel);
+    return effects;
+}
+
+void OrtusSystem::finishCommands(uint8_t effects)
+{
+    if (effects & CommandEffect::Save)
+        saveState();
+    if (effects & CommandEffect::Outputs)
+    {
+        updateActuators();
+        notifyStateChanged();
+    }
+}
+
+// Control task. Hands the answer to a command with an id to the network
+// task, together with the channel's state after the command.
+void OrtusSystem::acknowledge(const DeviceCommand &cmd, AckStatus status, uint8_t channel)
+{
+    if (!cmd.id[0])
+        return;
+
+    CommandAck ack = makeAck(cmd, status);
+    ack.channel = channel;
+    if (channel != DEFAULT_CHANNEL)
+        ack.state = currentState.channels[channel];
+    if (!ackQueue.push(ack))
+        Serial.println("[Command] Ack queue full, dropped");
+    else if (networkTaskHandle)
+        xTaskNotifyGive(networkTaskHandle);
+}
+
+// --- Rules ---
+
+bool OrtusSystem::replaceRules(const DeviceCommand &cmd)
+{
+    if (!rules.replace(cmd.rules, cmd.rulesLength))
+    {
+        Serial.println("[Rules] Invalid rules");
+        return false;
+    }
+    applyRules();
+    return true;
+}
+
+// Control task. Turns the rules' verdict on the current state into output
+// caps. Runs after every sensor reading, so an interlock such as "pump off
+// when the tank is empty" acts within one control pass of the reading.
+void OrtusSystem::applyRules()
+{
+    uint8_t ceilings[MAX_ACTUATOR_CHANNELS];
+    const uint16_t inForce = rules.evaluate(currentState, epochNow(), ceilings);
+    bool changed = false;
+    for (uint8_t i = 0; i < actuators.count(); i++)
+        changed = actuators.setCeiling(i, ceilings[i]) || changed;
+    if (changed)
+        updateActuators();
+    if (inForce != rulesInForce.exchange(inForce))
+        Serial.printf("[Rules] In force: 0x%04x\n", (unsigned)inForce);
+
+    if (!rules.usesClock())
+        scheduler.cancel(JOB_RULES);
+    else if (!scheduler.scheduled(JOB_RULES))
+        scheduler.schedule(JOB_RULES, monotonicMicros() + millisToMicros(RULES_CLOCK_TICK_MS));
+}
+
+uint8_t OrtusSystem::resolveChannel(uint8_t channel, ActuatorKind kind)
+{
+    if (channel == DEFAULT_CHANNEL)
+        return actuators.primary(kind);
+    return channel < actuators.count() ? channel : DEFAULT_CHANNEL;
+}
+
+// Automatic light sleep whenever both tasks are blocked. Takes effect only
+// if the IDF build has power management and tickless idle enabled.
+void OrtusSystem::setupPowerManagement()
+{
+    esp_pm_config_esp32s3_t config = {
+        .max_freq_mhz = 240,
+        .min_freq_mhz = 40,
+        .light_sleep_enable = true};
+    esp_err_t err = esp_pm_configure(&config);
+    if (err != ESP_OK)
+    {
+        Serial.print("[Power] Light sleep unavailable: ");
+        Serial.println(esp_err_to_name(err));
+        return;
+    }
+    esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "ortus-pwm", &pwmSleepLock);
+}
+
+void OrtusSystem::setupActuators()
+{
+    actuators.begin(currentState.channels);
+    currentState.channelCount = actuators.count();
+}
+
+// Walks every channel once: cycle phases, pulse timeouts, output writes.
+// Then re-arms JOB_ACTUATORS for the next toggle or pulse end.
+void OrtusSystem::updateActuators()
+{
+    if (actuators.update())
+        notifyStateChanged();
+
+    uint64_t next;
+    if (actuators.nextDeadline(next))
+        scheduler.schedule(JOB_ACTUATORS, next);
+    else
+        scheduler.cancel(JOB_ACTUATORS);
+
+    // Lit PWM channels keep the chip out of light sleep
+    bool lit = actuators.pwmActive();
+    if (pwmSleepLock && lit != pwmSleepLockHeld)
+    {
+        if (lit)
+            esp_pm_lock_acquire(pwmSleepLock);
+        else
+            esp_pm_lock_release(pwmSleepLock);
+        pwmSleepLockHeld = lit;
+    }
+}
+
+// --- Sensors ---
+
+void OrtusSystem::setupSensors()
+{
+    sensors.begin();
+    sensors.setResolution(TEMP_RESOLUTION_BITS);
+    // Conversions run in the background; JOB_TEMP_READ collects them
+    sensors.setWaitForConversion(false);
+    tempConversionMicros = millisToMicros(sensors.millisToWaitForConversion(TEMP_RESOLUTION_BITS));
+
+    tempSensorCount = 0;
+    uint8_t found = sensors.getDeviceCount();
+    for (uint8_t i = 0; i < found && tempSensorCount < MAX_TEMP_SENSORS; i++)
+    {
+        if (sensors.getAddress(tempSensors[tempSensorCount], i))
+            tempSensorCount++;
+    }
+
+    if (currentState.temperatureSensorCount != tempSensorCount)
+    {
+        currentState.temperatureSensorCount = tempSensorCount;
+        notifyStateChanged();
+    }
+    Serial.print("[Sensors] Temperature probes: ");
+    Serial.println(tempSensorCount);
+}
+
+void OrtusSystem::readTemperatureSensor(uint8_t index)
+{
+    float t = sensors.getTempC(tempSensors[index]);
+    if (!(t > -50 && t < 150)) // Basic validation, also drops disconnected probes
+    {
+        tempReadings[index] = NAN;
+        return;
+    }
+    tempReadings[index] = t;
+
+    float &stored = currentState.temperaturesC[index];
+    if (isnan(stored) || fabs(t - stored) > TEMP_DELTA_THRESHOLD)
+    {
+        stored = t;
+        if (index == 0)
+            currentState.temperatureC = t;
+        notifyStateChanged();
+    }
+}
+
+// Starts a conversion on every probe at once; JOB_TEMP_READ collects the
+// results once the conversion time has passed.
+void OrtusSystem::pollTemperature(uint64_t now)
+{
+    if (tempSensorCount == 0)
+        setupSensors(); // Probe may have been plugged in since boot
+    if (tempSensorCount == 0)
+        return;
+
+    sensors.requestTemperatures();
+    tempReadIndex = 0;
+    scheduler.schedule(JOB_TEMP_READ, now + tempConversionMicros);
+}
+
+void OrtusSystem::pollWaterLevel()
+{
+    int val = digitalRead(PIN_SENSOR_WATER);
+
+    // Previous analog logic: > 1.5V = Not Empty, < 1.5V = Empty.
+    // Mapping to digital: HIGH (Pullup) = Not Empty, LOW (Grounded) = Empty.
+    bool empty = (val == LOW);
+
+    if (empty != currentState.waterEmpty)
+    {
+        currentState.waterEmpty = empty;
+        notifyStateChanged();
+        recordHistory();
+    }
+}
+
+// --- History ---
+
+void OrtusSystem::recordHistory()
+{
+    history.record((uint32_t)(monotonicMicros() / 1000000), tempReadings, tempSensorCount, currentState.waterEmpty);
+}
+
+// Network task. One batch per pass, so a backlog after an outage drains
+// over a few passes instead of stalling the socket loop.
+void OrtusSystem::uploadHistory()
+{
+    uint32_t endSeq;
+    size_t length = history.encodeBatch(historyBatch, sizeof(historyBatch), bootEpoch.load(), endSeq);
+    if (length > 0 && mqttClient.publish(topics.history, historyBatch, length, false))
+        history.release(endSeq);
+}
+
+void IRAM_ATTR OrtusSystem::onWaterPinChange()
+{
+    if (!instance)
+        return;
+    instance->waterPinChanged = true;
+    if (instance->controlTaskHandle)
+    {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(instance->controlTaskHandle, &woken);
+        if (woken)
+            portYIELD_FROM_ISR();
+    }
+}
+
+// --- State ---
+
+// Control task: mark currentState for hand-off at the end of controlLoop().
+// Several changes in one pass go out as a single state.
+void OrtusSystem::notifyStateChanged()
+{
+    statePending = true;
+}
+
+// Network task: publish the newest state the control task produced.
+// Intermediate states are skipped; the patch covers everything that changed.
+void OrtusSystem::drainStateQueue()
+{
+    DeviceState state;
+    bool received = false;
+    while (stateQueue.pop(state))
+        received = true;
+    if (received)
+        broadcastState(state);
+}
+
+// Sends only the fields that changed since the last broadcast as a patch.
+// Receivers apply patches on top of the last snapshot and use "seq" to
+// detect gaps.
+void OrtusSystem::broadcastState(const DeviceState &state)
+{
+    uint16_t dirty = dirtyFields(lastBroadcastState, state);
+    if (dirty == 0)
+        return;
+    const uint64_t started = monotonicMicros();
+    lastBroadcastState = state;
+    stateSeq++;
+
+    // A patch only applies on top of what subscribers already have, so while
+    // MQTT is down or backed up the outbox holds one snapshot instead
+    if (mqttClient.connected() && outbox.empty())
+    {
+        publishState(dirty, false);
+        snapshotStale = true;
+    }
+    else
+    {
+        publishState(StateField::All, true);
+        snapshotStale = false;
+    }
+
+    for (WsClient &client : wsClients)
+    {
+        if (client.connected)
+            client.pendingFields |= dirty;
+    }
+    flushWebSockets();
+    metrics.broadcast.record(monotonicMicros() - started);
+}
+
+// Full retained state for MQTT subscribers that join later. Queued while
+// the broker is unreachable.
+void OrtusSystem::publishSnapshot()
+{
+    drainStateQueue(); // Flush pending changes so the snapshot matches seq
+    publishState(StateField::All, true);
+    snapshotStale = false;
+    lastSnapshot = monotonicMicros();
+}
+
+// MQTT side of a state message, in the format chosen with setWireFormat.
+// Snapshots are retained.
+void OrtusSystem::publishState(uint16_t fields, bool snapshot)
+{
+    const bool binary = mqttWireFormat == WireFormat::Binary;
+    size_t length = encodeState(mqttWireFormat, fields, snapshot);
+    if (length == 0)
+        return;
+
+    const char *topic = binary ? (snapshot ? topics.stateBin : topics.statePatchBin)
+                               : (snapshot ? topics.state : topics.statePatch);
+    // Only the newest snapshot is worth keeping; patches depend on every
+    // earlier one
+    publishMqtt(topic, binary ? txBinary : (const uint8_t *)txBuffer, length, snapshot,
+                snapshot ? OutboxKey::State : OutboxKey::None);
+}
+
+// Sends every WebSocket client the fields that changed since its previous
+// message, at most once per WS_SEND_INTERVAL_MS. A client that falls behind
+// gets one merged patch (whose seq may skip), never a backlog. Clients
+// waiting for the same fields share one encoding.
+void OrtusSystem::flushWebSockets()
+{
+    const uint64_t now = monotonicMicros();
+    for (uint8_t num = 0; num < WEBSOCKETS_SERVER_CLIENT_MAX; num++)
+    {
+        WsClient &client = wsClients[num];
+        if (!client.connected || (!client.snapshotPending && client.pendingFields == 0))
+            continue;
+        if (!client.snapshotPending && now - client.lastSend < millisToMicros(WS_SEND_INTERVAL_MS))
+            continue;
+
+        const bool snapshot = client.snapshotPending;
+        const uint16_t fields = snapshot ? StateField::All : client.pendingFields;
+        client.snapshotPending = false;
+        client.pendingFields = 0;
+        client.lastSend = now;
+
+        size_t length = encodeState(client.binary ? WireFormat::Binary : WireFormat::Json, fields, snapshot);
+        if (length > 0)
+            sendToClient(num, client.binary ? txBinary : (const uint8_t *)txBuffer, length, client.binary);
+    }
+}
+
+// The WebSockets library writes synchronously, so a congested or half-dead
+// client blocks this task for as long as each send takes. One that keeps
+// doing so, or whose send fails, is disconnected instead.
+bool OrtusSystem::sendToClient(uint8_t num, const uint8_t *payload, size_t length, bool binary)
+{
+    WsClient &client = wsClients[num];
+    const uint64_t start = monotonicMicros();
+    bool sent = binary ? wsServer.sendBIN(num, payload, length) : wsServer.sendTXT(num, payload, length);
+    bool slow = monotonicMicros() - start >= millisToMicros(WS_SLOW_SEND_MS);
+    client.slowSends = slow ? client.slowSends + 1 : 0;
+    if (sent && client.slowSends < WS_MAX_SLOW_SENDS)
+        return true;
+
+    Serial.printf("[WS] Client %u is not keeping up, disconnecting\n", num);
+    wsServer.disconnect(num);
+    client = WsClient();
+    return false;
+}
+
+// Encodes lastBroadcastState into txBinary or txBuffer, unless that buffer
+// already holds the same message. Returns 0 if it did not fit.
+size_t OrtusSystem::encodeState(WireFormat format, uint16_t fields, bool snapshot)
+{
+    EncodedState &encoded = format == WireFormat::Binary ? encodedBinary : encodedJson;
+    if (encoded.length > 0 && encoded.seq == stateSeq && encoded.fields == fields && encoded.snapshot == snapshot)
+        return encoded.length;
+
+    size_t length;
+    if (format == WireFormat::Binary)
+        length = encodeBinaryState(txBinary, sizeof(txBinary), snapshot ? BinaryStateKind::Snapshot : BinaryStateKind::Patch,
+                                   stateSeq, fields, lastBroadcastState);
+    else
+        length = serializeState(snapshot ? "state" : "patch", fields);
+    encoded = {stateSeq, fields, snapshot, length};
+    return length;
+}
+
+namespace
+{
+    // JSON names of one actuator channel's fields
+    struct ChannelKeys
+    {
+        const char *level;
+        const char *cycleActive;
+        const char *cycleOnSeconds;
+        const char *cycleOffSeconds;
+        const char *capped;
+        bool levelAsBool;
+    };
+
+    constexpr ChannelKeys LIGHT_KEYS = {"brightness", "lightCycleActive", "lightCycleOnSeconds", "lightCycleOffSeconds", "lightCapped", false};
+    constexpr ChannelKeys PUMP_KEYS = {"irrigationActive", "irrigationCycleActive", "irrigationCycleOnSeconds", "irrigationCycleOffSeconds", "irrigationCapped", true};
+    constexpr ChannelKeys CHANNEL_KEYS = {"level", "cycleActive", "cycleOnSeconds", "cycleOffSeconds", "capped", false};
+
+    // Cycle timing is only written while a cycle runs. The level is the
+    // commanded one; "capped" says a rule holds the output below it.
+    void writeChannel(JsonObject out, const ChannelKeys &keys, const ChannelState &channel)
+    {
+        if (keys.levelAsBool)
+            out[keys.level] = channel.level > 0;
+        else
+            out[keys.level] = channel.level;
+        out[keys.cycleActive] = channel.cycleActive;
+        out[keys.capped] = channel.capped;
+        if (channel.cycleActive)
+        {
+            out[keys.cycleOnSeconds] = channel.cycleOnSeconds;
+            out[keys.cycleOffSeconds] = channel.cycleOffSeconds;
+        }
+    }
+}
+
+// Serializes the selected fields of lastBroadcastState into txBuffer. A
+// selected channel is always written whole, so patches can be merged by
+// OR-ing their field masks.
+size_t OrtusSystem::serializeState(const char *type, uint16_t fields)
+{
+    const DeviceState &state = lastBroadcastState;
+    const bool full = fields == StateField::All;
+
+    txDoc.clear();
+    txArena.reset();
+    txDoc["type"] = type;
+    txDoc["seq"] = stateSeq;
+    // The first light and pump keep their original field names; any other
+    // channel is listed under "channels".
+    JsonObject root = txDoc.as<JsonObject>();
+    const uint8_t light = actuators.primary(ActuatorKind::Pwm);
+    const uint8_t pump = actuators.primary(ActuatorKind::Relay);
+    JsonArray channels;
+    for (uint8_t i = 0; i < state.channelCount; i++)
+    {
+        if (!(fields & StateField::channel(i)))
+            continue;
+        if (i == light)
+        {
+            writeChannel(root, LIGHT_KEYS, state.channels[i]);
+        }
+        else if (i == pump)
+        {
+            writeChannel(root, PUMP_KEYS, state.channels[i]);
+        }
+        else
+        {
+            if (channels.isNull())
+                channels = txDoc["channels"].to<JsonArray>();
+            JsonObject entry = channels.add<JsonObject>();
+            entry["channel"] = i;
+            writeChannel(entry, CHANNEL_KEYS, state.channels[i]);
+        }
+    }
+    if (fields & StateField::TemperatureC)
+        txDoc["temperature"] = state.temperatureC;
+    if (fields & StateField::WaterEmpty)
+        txDoc["waterEmpty"] = state.waterEmpty;
+    if ((fields & StateField::Temperatures) && (!full || state.temperatureSensorCount > 1))
+    {
+        JsonArray temperatures = txDoc["temperatures"].to<JsonArray>();
+        for (uint8_t i = 0; i < state.temperatureSensorCount; i++)
+            temperatures.add(state.temperaturesC[i]);
+    }
+
+    return serializeTx();
+}
+
+void OrtusSystem::publishPresence()
+{
+    IPAddress ip = WiFi.localIP();
+    char ipText[16];
+    snprintf(ipText, sizeof(ipText), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+
+    txDoc.clear();
+    txArena.reset();
+    txDoc["ip"] = ipText;
+    txDoc["mac"] = macAddress.c_str();
+    if (hostname[0])
+        txDoc["host"] = (const char *)hostname;
+    txDoc["lanAuth"] = lanToken[0] != '\0';
+    txDoc["uptime"] = monotonicMicros() / secondsToMicros(1);
+    txDoc["rules"] = rulesInForce.load();
+    // Channel kinds in index order, to map binary state frames
+    JsonArray kinds = txDoc["channels"].to<JsonArray>();
+    for (uint8_t i = 0; i < actuators.count(); i++)
+        kinds.add(actuators.kind(i) == ActuatorKind::Pwm ? "pwm" : "relay");
+    JsonArray memberOf = txDoc["groups"].to<JsonArray>();
+    for (uint8_t i = 0; i < groupCount; i++)
+        memberOf.add((const char *)groups[i]);
+
+    const uint64_t now = monotonicMicros();
+    const struct
+    {
+        const char *key;
+        const ReconnectBackoff &backoff;
+    } links[] = {{"wifi", wifiBackoff}, {"mqtt", mqttBackoff}};
+    for (const auto &link : links)
+    {
+        JsonObject entry = txDoc[link.key].to<JsonObject>();
+        entry["attempts"] = link.backoff.counters().attempts;
+        entry["failures"] = link.backoff.counters().failures;
+        entry["offline"] = link.backoff.offlineMicros(now) / secondsToMicros(1);
+    }
+
+    size_t length = serializeTx();
+    if (length > 0)
+        publishMqtt(topics.presence, (const uint8_t *)txBuffer, length, false, OutboxKey::Presence);
+}
+
+// Network task. Periodic reports go to ortus/<mac>/metrics only when they
+// can be sent right away: a stale one is not worth an outbox slot. A
+// getMetrics from a WebSocket client is answered to that client.
+void OrtusSystem::publishMetrics(uint8_t origin)
+{
+    size_t length = serializeMetrics();
+    if (length == 0)
+        return;
+    if (origin == ORIGIN_MQTT)
+    {
+        if (mqttClient.connected() && outbox.empty())
+            mqttClient.publish(topics.metrics, (const uint8_t *)metricsBuffer, length, false);
+    }
+    else if (origin < WEBSOCKETS_SERVER_CLIENT_MAX && wsClients[origin].connected)
+    {
+        sendToClient(origin, (const uint8_t *)metricsBuffer, length, false);
+    }
+}
+
+// Writes the metrics report into metricsBuffer:
+//   { "type": "metrics", "uptime": s,
+//     "heap": { "free": b, "min": b, "largest": b },
+//     "queues": { "command": [depth, peak], "state": [...], "ack": [...],
+//                 "outbox": [depth, dropped] },
+//     "historyDropped": blocks,
+//     "us": { "control": {"n": count, "max": us, "b": [...]}, "network": ...,
+//             "ws": ..., "mqtt": ..., "sensors": ..., "broadcast": ...,
+//             "command": ... } }
+// "b" holds the log2 bucket counts of a Histogram. Histograms and peaks run
+// since boot. Written by hand: the histograms alone outgrow the tx arena.
+// Returns 0 if the report did not fit.
+size_t OrtusSystem::serializeMetrics()
+{
+    char *out = metricsBuffer;
+    const size_t size = sizeof(metricsBuffer);
+    size_t n = snprintf(out, size,
+                        "{\"type\":\"metrics\",\"uptime\":%lu,"
+                        "\"heap\":{\"free\":%u,\"min\":%u,\"largest\":%u},"
+                        "\"queues\":{\"command\":[%u,%u],\"state\":[%u,%u],\"ack\":[%u,%u],\"outbox\":[%u,%u]},"
+                        "\"historyDropped\":%u,\"us\":{",
+                        (unsigned long)(monotonicMicros() / secondsToMicros(1)),
+                        (unsigned)ESP.getFreeHeap(), (unsigned)ESP.getMinFreeHeap(), (unsigned)ESP.getMaxAllocHeap(),
+                        (unsigned)commandQueue.size(), (unsigned)commandQueue.peak(),
+                        (unsigned)stateQueue.size(), (unsigned)stateQueue.peak(),
+                        (unsigned)ackQueue.size(), (unsigned)ackQueue.peak(),
+                        (unsigned)outbox.size(), (unsigned)outbox.droppedCount(),
+                        (unsigned)history.droppedBlocks());
+
+    const struct
+    {
+        const char *key;
+        const Histogram &histogram;
+    } histograms[] = {{"control", metrics.control}, {"network", metrics.network}, {"ws", metrics.ws},
+                      {"mqtt", metrics.mqtt}, {"sensors", metrics.sensors}, {"broadcast", metrics.broadcast},
+                      {"command", metrics.command}};
+    for (size_t i = 0; i < sizeof(histograms) / sizeof(histograms[0]) && n < size; i++)
+    {
+        n += snprintf(out + n, size - n, i ? ",\"%s\":" : "\"%s\":", histograms[i].key);
+        size_t length = n < size ? histograms[i].histogram.toJson(out + n, size - n) : 0;
+        n = length ? n + length : size;
+    }
+    if (n < size)
+        n += snprintf(out + n, size - n, "}}");
+    if (n >= size)
+    {
+        Serial.println("[Metrics] Buffer too small");
+        return 0;
+    }
+    return n;
+}
+
+namespace
+{
+    constexpr const char *ACK_STATUS_NAMES[] = {"applied", "accepted", "rejected", "duplicate"};
+}
+
+// Network task. MQTT commands are acked on ortus/<mac>/ack, WebSocket ones
+// to the client that sent them:
+//   { "type": "ack", "id": "...", "status": "applied",
+//     "channel": n, "state": { "level": ..., "cycleActive": ..., ... } }
+// "channel" and "state" are only present when a channel was addressed.
+void OrtusSystem::sendAck(const CommandAck &ack)
+{
+    if (!ack.id[0])
+        return;
 
-    WiFiClientSecure otaClient;
-    otaClient.setInsecure(); // Skip cert validation (same as your MQTT client)
-
-    httpUpdate.setFollowRedirects(HTTPC_FORCE_FOLLOW_REDIRECTS);
-    t_httpUpdate_return ret = httpUpdate.update(otaClient, url);
-
-    // If we get here, the update failed (success would reboot automatically)
-    String error;
-    switch (ret)
+    txDoc.clear();
+    txArena.reset();
+    txDoc["type"] = "ack";
+    txDoc["id"] = (const char *)ack.id;
+    txDoc["status"] = ACK_STATUS_NAMES[(uint8_t)ack.status];
+    if (ack.channel != DEFAULT_CHANNEL)
     {
-    case HTTP_UPDATE_FAILED:
-        error = httpUpdate.getLastErrorString();
-        Serial.println("[OTA] Failed: " + error);
+        txDoc["channel"] = ack.channel;
+        writeChannel(txDoc["state"].to<JsonObject>(), CHANNEL_KEYS, ack.state);
+    }
+
+    size_t length = serializeTx();
+    if (length == 0)
+        return;
+    if (ack.origin == ORIGIN_MQTT)
+        publishMqtt(topics.ack, (const uint8_t *)txBuffer, length, false, OutboxKey::None);
+    else if (ack.origin < WEBSOCKETS_SERVER_CLIENT_MAX && wsClients[ack.origin].connected)
+        sendToClient(ack.origin, (const uint8_t *)txBuffer, length, false);
+}
+
+void OrtusSystem::drainAckQueue()
+{
+    CommandAck ack;
+    while (ackQueue.pop(ack))
+        sendAck(ack);
+}
+
+// Network task. Publishes right away while connected and nothing is
+// waiting; otherwise queues behind what is, so messages keep their order.
+bool OrtusSystem::publishMqtt(const char *topic, const uint8_t *payload, size_t length, bool retained, OutboxKey key)
+{
+    if (outbox.empty() && mqttClient.connected() && mqttClient.publish(topic, payload, length, retained))
+        return true;
+    if (outbox.push(topic, payload, length, retained, key))
+        return true;
+    Serial.println("[MQTT] Outbox full, dropped");
+    return false;
+}
+
+// Network task. Sends queued publishes oldest first and stops at the first
+// one the client does not take; it is retried on a later pass.
+void OrtusSystem::flushOutbox()
+{
+    for (size_t sent = 0; sent < OUTBOX_FLUSH_PER_PASS && !outbox.empty(); sent++)
+    {
+        const auto &entry = outbox.front();
+        if (!mqttClient.publish(entry.topic, entry.payload, entry.length, entry.retained))
+            return;
+        outbox.pop();
+    }
+}
+
+// Serializes txDoc into txBuffer. Returns 0 if the document did not fit.
+size_t OrtusSystem::serializeTx()
+{
+    encodedJson.length = 0; // txBuffer is about to change
+    if (txDoc.overflowed())
+    {
+        Serial.println("[State] Tx arena exhausted");
+        return 0;
+    }
+
+    size_t length = serializeJson(txDoc, txBuffer, sizeof(txBuffer));
+    if (length >= sizeof(txBuffer) - 1)
+    {
+        Serial.println("[State] Tx buffer too small");
+        return 0;
+    }
+    return length;
+}
+
+// --- Persistence ---
+
+namespace
+{
+    // Seconds into a cycle's on+off period at Unix time `epoch`.
+    uint32_t cyclePositionAt(const ChannelState &channel, uint32_t epoch)
+    {
+        const uint32_t period = channel.cycleOnSeconds + channel.cycleOffSeconds;
+        if (period == 0)
+            return 0;
+        if (epoch >= channel.cycleAnchor)
+            return (epoch - channel.cycleAnchor) % period;
+        return (period - (channel.cycleAnchor - epoch) % period) % period; // Clock stepped back
+    }
+}
+
+void OrtusSystem::loadState()
+{
+    CycleResume resume;
+    stateStore.begin(preferences, actuators);
+    stateStore.load(currentState, resume);
+    if (resume.epoch)
+        bootEpoch = resume.epoch - (uint32_t)(monotonicMicros() / 1000000);
+
+    // Pick cycles up where they were instead of restarting them
+    for (uint8_t i = 0; i < actuators.count(); i++)
+    {
+        const ChannelState &channel = currentState.channels[i];
+        if (!channel.cycleActive)
+            continue;
+        actuators.resumeCycle(i, resume.epoch && channel.cycleAnchor
+                                     ? cyclePositionAt(channel, resume.epoch)
+                                     : resume.positions[i]);
+    }
+    saveState(); // Migrates older layouts
+
+    mqttWireFormat = preferences.getUChar("wireFormat", 0) == (uint8_t)WireFormat::Binary
+                         ? WireFormat::Binary
+                         : WireFormat::Json;
+    loadGroups();
+    loadLanToken();
+
+    // Pending state still reaches flash on esp_restart() (OTA, crash
+    // handler reboots); a brownout reset gives no such chance, which the
+    // short save delay bounds.
+    esp_register_shutdown_handler(onShutdown);
+}
+
+// Control task. Coalesces: the write happens once JOB_SAVE_STATE is due.
+void OrtusSystem::saveState()
+{
+    if (stateStore.stage(currentState, epochNow()) && !scheduler.scheduled(JOB_SAVE_STATE))
+        scheduler.schedule(JOB_SAVE_STATE, monotonicMicros() + millisToMicros(STATE_SAVE_DELAY_MS));
+}
+
+void OrtusSystem::onShutdown()
+{
+    if (instance)
+        instance->stateStore.flush();
+}
+
+// --- Time ---
+
+uint32_t OrtusSystem::epochNow() const
+{
+    const uint32_t boot = bootEpoch.load();
+    return boot ? boot + (uint32_t)(monotonicMicros() / 1000000) : 0;
+}
+
+// Runs on the lwIP task after every SNTP sync (hourly by default).
+void OrtusSystem::onTimeSync(struct timeval *tv)
+{
+    if (!instance)
+        return;
+    instance->bootEpoch = (uint32_t)tv->tv_sec - (uint32_t)(monotonicMicros() / 1000000);
+    instance->timeSynced = true;
+    if (instance->controlTaskHandle)
+        xTaskNotifyGive(instance->controlTaskHandle);
+}
+
+// Control task. Puts anchored cycles back in phase with real time and
+// anchors cycles that were started before the clock was known.
+void OrtusSystem::alignCycles()
+{
+    const uint32_t now = epochNow();
+    bool anchored = false;
+    for (uint8_t i = 0; i < actuators.count(); i++)
+    {
+        ChannelState &channel = currentState.channels[i];
+        if (!channel.cycleActive)
+            continue;
+        if (channel.cycleAnchor)
+        {
+            actuators.resumeCycle(i, cyclePositionAt(channel, now));
+        }
+        else
+        {
+            channel.cycleAnchor = now - actuators.cyclePosition(i);
+            anchored = true;
+        }
+    }
+    updateActuators();
+    applyRules(); // Time rules apply from now on
+    notifyStateChanged();
+    if (anchored)
+        saveState();
+}
+
+void OrtusSystem::loadCredentials()
+{
+    wifiSSID = preferences.getString("ssid", DEFAULT_WIFI_SSID);
+    wifiPass = preferences.getString("pass", DEFAULT_WIFI_PASSWORD);
+}
+
+void OrtusSystem::saveCredentials(String s, String p)
+{
+    {
+        NvsLock lock;
+        preferences.putString("ssid", s);
+        preferences.putString("pass", p);
+    }
+    wifiSSID = s;
+    wifiPass = p;
+    Serial.println("[System] Credentials saved.");
+}
+
+// Network task. Turns the updater's progress into status messages on the
+// ota topic: "started", "progress: <percent>", "success", "failed: <why>".
+void OrtusSystem::reportOta()
+{
+    switch (ota.phase())
+    {
+    case OtaUpdater::Phase::Running:
+        if (ota.percent() >= otaReported + OTA_PROGRESS_STEP)
+        {
+            otaReported = ota.percent() - ota.percent() % OTA_PROGRESS_STEP;
+            char status[16];
+            snprintf(status, sizeof(status), "progress: %u", (unsigned)otaReported);
+            publishOtaStatus(status, OutboxKey::OtaProgress);
+        }
         break;
-    case HTTP_UPDATE_NO_UPDATES:
-        error = "No update available";
-        Serial.println("[OTA] " + error);
+
+    case OtaUpdater::Phase::Succeeded:
+        if (!otaRebootAt)
+        {
+            publishOtaStatus("success", OutboxKey::None);
+            otaRebootAt = monotonicMicros() + millisToMicros(OTA_REBOOT_GRACE_MS);
+        }
+        else if (outbox.empty() || monotonicMicros() >= otaRebootAt)
+        {
+            Serial.println("[OTA] Restarting into the new image");
+            ota.clear();
+            otaRebootAt = 0;
+            ESP.restart();
+        }
         break;
-    default:
-        error = "Unknown error";
+
+    case OtaUpdater::Phase::Failed:
+    {
+        char status[64];
+        snprintf(status, sizeof(status), "failed: %s", ota.error());
+        publishOtaStatus(status, OutboxKey::None);
+        ota.clear();
         break;
     }
 
-    if (mqttClient.connected())
-    {
-        String topic = "ortus/" + macAddress + "/ota";
-        mqttClient.publish(topic.c_str(), ("failed: " + error).c_str());
+    case OtaUpdater::Phase::Idle:
+        break;
     }
 }
+
+void OrtusSystem::publishOtaStatus(const char *status, OutboxKey key)
+{
+    publishMqtt(topics.ota, (const uint8_t *)status, strlen(status), false, key);
+}
@@ -5,15 +5,157 @@
 #include <WiFiClientSecure.h>
 #include <PubSubClient.h>
 #include <WebSocketsServer.h>
+#include <ESPmDNS.h>
 #include <Preferences.h>
 #include <OneWire.h>
 #include <DallasTemperature.h>
 
-#include <HTTPUpdate.h>
+#include <esp_pm.h>
+#include <esp_system.h>
+#include <esp_sntp.h>
+#include <atomic>
 
 #include "config.h"
 #include "types.h"
+#include "command_parser.h"
+#include "json_arena.h"
+#include "binary_protocol.h"
+#include "actuators.h"
+#include "spsc_queue.h"
+#include "mqtt_outbox.h"
+#include "deadline_scheduler.h"
+#include "monotonic.h"
+#include "state_store.h"
+#include "sensor_history.h"
 #include "ble_provisioning.h"
+#include "tls_client.h"
+#include "reconnect_backoff.h"
+#include "ota_updater.h"
+#include "metrics.h"
+#include "rule_engine.h"
+
+// Longest MQTT topic we build: "ortus/" + MAC + "/" + suffix.
+constexpr size_t MQTT_TOPIC_SIZE = 48;
+// Largest MQTT packet, header and topic included.
+constexpr uint16_t MQTT_BUFFER_SIZE = 1536;
+// Serialized state/presence payload; must stay below the MQTT buffer size.
+constexpr size_t TX_BUFFER_SIZE = 512;
+constexpr size_t TX_ARENA_SIZE = 2048 * (sizeof(void *) / 4);
+// Patches are not retained; refresh the retained full state this often
+// while patches have gone out since the last snapshot.
+constexpr unsigned long STATE_SNAPSHOT_INTERVAL_MS = 60000;
+// DS18B20 resolution. A 12-bit conversion takes ~750 ms and runs in the
+// background while the loop keeps going.
+constexpr uint8_t TEMP_RESOLUTION_BITS = 12;
+// A float switch edge is read once the pin has been quiet this long.
+constexpr unsigned long WATER_DEBOUNCE_MS = 50;
+// State changes are written to flash at most this long after the first
+// one, so a burst of commands (e.g. a brightness slider) costs one write.
+constexpr unsigned long STATE_SAVE_DELAY_MS = 5000;
+// Without SNTP time a cycle's position is checkpointed to flash this often,
+// bounding how much of its phase a power cut loses. Cycles started while
+// the clock is synced are anchored to Unix time and need no checkpoints.
+constexpr unsigned long CYCLE_CHECKPOINT_INTERVAL_MS = 15 * 60 * 1000UL;
+constexpr const char *NTP_SERVER = "pool.ntp.org";
+// Sensor history: one sample this often plus one per float switch change.
+// At ~2 bytes per sample and probe, PSRAM holds weeks of samples and the
+// internal RAM fallback most of a day.
+constexpr unsigned long HISTORY_SAMPLE_MS = 30000;
+constexpr size_t HISTORY_PSRAM_BLOCKS = 2048;
+constexpr size_t HISTORY_RAM_BLOCKS = 64;
+// A block is uploaded once full or this old.
+constexpr unsigned long HISTORY_BLOCK_MAX_AGE_MS = 30 * 60 * 1000UL;
+// One upload message; must fit the MQTT buffer with the topic.
+constexpr size_t HISTORY_BATCH_SIZE = 768;
+// Publishes held while MQTT is down or backed up. State and presence
+// coalesce to one entry each, so the rest is room for acks and OTA status.
+constexpr size_t OUTBOX_SIZE = 8;
+// Queued publishes sent per network pass, so a backlog cannot hold off
+// reading the socket.
+constexpr size_t OUTBOX_FLUSH_PER_PASS = 4;
+// Reconnect backoff windows; see ReconnectBackoff. The broker can raise the
+// MQTT floor with a retained hint (seconds) on MQTT_RETRY_HINT_TOPIC. The
+// broker ACL must keep devices from publishing there; a hint above the
+// maximum or that is not a plain number is ignored.
+constexpr unsigned long WIFI_BACKOFF_BASE_MS = 2000;
+constexpr unsigned long WIFI_BACKOFF_MAX_MS = 2 * 60 * 1000UL;
+constexpr unsigned long MQTT_BACKOFF_BASE_MS = 1000;
+constexpr unsigned long MQTT_BACKOFF_MAX_MS = 5 * 60 * 1000UL;
+constexpr uint32_t MQTT_RETRY_HINT_MAX_S = 3600;
+constexpr const char *MQTT_RETRY_HINT_TOPIC = "ortus/broker/retry";
+// Fleet addressing: members of a group also take commands on
+// ortus/group/<id>/command, and every tower on ortus/all/command (both with
+// /bin for binary frames). A command that reaches a tower on several of its
+// topics runs once if it carries an id.
+constexpr const char *MQTT_GROUP_TOPIC_PREFIX = "ortus/group/";
+constexpr const char *MQTT_BROADCAST_TOPIC = "ortus/all";
+// LAN discovery: once WiFi is up the tower answers to MDNS_HOST_PREFIX + the
+// last six hex digits of its MAC (".local") and advertises the WebSocket
+// server as _ortus._tcp, with TXT records for what a client needs to talk
+// to it without the broker:
+//   mac     MAC address, as in the MQTT topics
+//   proto   BINARY_PROTOCOL_VERSION
+//   bin     path that selects binary state frames
+//   auth    "token" when clients must add ?token=<lanToken> to the URL,
+//           "none" while no token is set
+//   pwm, relay  channel counts
+constexpr const char *MDNS_HOST_PREFIX = "ortus-";
+constexpr const char *MDNS_SERVICE = "ortus";
+constexpr const char *WS_BINARY_PATH = "/bin";
+// OTA progress goes out in steps of this many percent.
+constexpr uint8_t OTA_PROGRESS_STEP = 10;
+// After a successful update, longest wait for the "success" message to
+// reach the broker before restarting into the new image.
+constexpr unsigned long OTA_REBOOT_GRACE_MS = 3000;
+// BLE provisioning only holds its heap while it may be needed. It is
+// released once WiFi has been up for BLE_RELEASE_DELAY_MS (time for the app
+// to read the result) with no central connected, and comes back after a
+// WiFi outage of BLE_OUTAGE_ENABLE_MS or when PIN_BUTTON_PROVISION is held
+// low for BLE_BUTTON_HOLD_MS. Brought back by the button it stays up for
+// BLE_ON_DEMAND_MS even while WiFi is connected.
+constexpr unsigned long BLE_RELEASE_DELAY_MS = 30000;
+constexpr unsigned long BLE_OUTAGE_ENABLE_MS = 5 * 60 * 1000UL;
+constexpr unsigned long BLE_BUTTON_HOLD_MS = 3000;
+constexpr unsigned long BLE_ON_DEMAND_MS = 5 * 60 * 1000UL;
+// BOOT button of the S3 DevKitC; a strapping pin, free once booted.
+constexpr uint8_t PIN_BUTTON_PROVISION = 0;
+// Timing histograms, heap and queue depths go out on ortus/<mac>/metrics
+// this often, and to anyone who sends getMetrics. The report is larger
+// than a state message and has a buffer of its own; it must fit the MQTT
+// buffer with the topic.
+constexpr unsigned long METRICS_INTERVAL_MS = 60000;
+constexpr size_t METRICS_BUFFER_SIZE = 1408;
+// Time-of-day rules are re-evaluated this often; sensor rules run on every
+// reading.
+constexpr unsigned long RULES_CLOCK_TICK_MS = 10000;
+// Recent command ids remembered to drop redeliveries.
+constexpr size_t RECENT_COMMAND_IDS = 16;
+// Longest the control task sleeps without a deadline or event.
+constexpr unsigned long CONTROL_MAX_WAIT_MS = 1000;
+// Network task socket polling period while anything beyond MQTT is live
+// (WebSocket clients, BLE, OTA, a backlog to send).
+constexpr unsigned long NETWORK_POLL_MS = 10;
+// Polling period otherwise. Long enough for light sleep to start between
+// polls; incoming MQTT already waits for the next DTIM beacon.
+constexpr unsigned long NETWORK_IDLE_POLL_MS = 100;
+// Networking runs pinned to the core the WiFi stack lives on; the control
+// loop stays on the Arduino loop task (ARDUINO_RUNNING_CORE).
+constexpr BaseType_t NETWORK_TASK_CORE = 0;
+constexpr uint32_t NETWORK_TASK_STACK_SIZE = 8192;
+constexpr UBaseType_t NETWORK_TASK_PRIORITY = 1;
+// Queue slots between the two tasks (one slot is always kept free).
+constexpr size_t COMMAND_QUEUE_SIZE = 8;
+constexpr size_t STATE_QUEUE_SIZE = 4;
+constexpr size_t ACK_QUEUE_SIZE = 8;
+static_assert(COMMAND_QUEUE_SIZE > MAX_BATCH_COMMANDS && ACK_QUEUE_SIZE > MAX_BATCH_COMMANDS,
+              "A whole batch and its acks must fit in the queues");
+// WebSocket clients get at most one state message per interval; changes in
+// between are merged into the next one.
+constexpr unsigned long WS_SEND_INTERVAL_MS = 100;
+// A send that blocks this long counts against the client; that many in a
+// row and it is disconnected.
+constexpr unsigned long WS_SLOW_SEND_MS = 100;
+constexpr uint8_t WS_MAX_SLOW_SENDS = 3;
 
 class OrtusSystem
 {
@@ -24,62 +166,258 @@ public:
     void loop();
 
 private:
+    // --- Tasks ---
+    // networkLoop() owns WiFi, MQTT, WebSocket and BLE; controlLoop() owns
+    // sensors and actuators. They only share the queues below.
+    static void networkTask(void *arg);
+    void networkLoop();
+    unsigned long networkPollMs();
+    void controlLoop();
+    void waitForWork();
+
+    // Control task jobs, run by `scheduler` when their deadline passes
+    enum Job : uint8_t
+    {
+        JOB_TEMP_POLL,
+        JOB_TEMP_READ,
+        JOB_WATER_POLL,
+        JOB_ACTUATORS,
+        JOB_SAVE_STATE,
+        JOB_CYCLE_CHECKPOINT,
+        JOB_HISTORY_SAMPLE,
+        JOB_RULES,
+        JOB_COUNT
+    };
+    void runJob(uint8_t job, uint64_t now);
+
     // --- Subsystems ---
     void setupWiFi();
     void connectWiFi();
+    void manageBle();
     void setupMQTT();
     void connectMQTT();
+    void applyRetryHint(const uint8_t *payload, unsigned int length);
     void setupSensors();
     void setupActuators();
+    void setupPowerManagement();
     
+    void setupTopics();
+
     // --- Logic ---
     void handleCommand(const DeviceCommand &cmd);
-    void updateSensors();
+    void handleBatch(size_t count);
+    bool commandValid(const DeviceCommand &cmd);
+    static ActuatorKind commandKind(CommandType type);
+    uint8_t applyCommand(const DeviceCommand &cmd);
+    void finishCommands(uint8_t effects);
+    void acknowledge(const DeviceCommand &cmd, AckStatus status, uint8_t channel);
+    uint8_t resolveChannel(uint8_t channel, ActuatorKind kind);
+    void pollTemperature(uint64_t now);
+    void pollWaterLevel();
+    void readTemperatureSensor(uint8_t index);
+    void recordHistory();
+    void uploadHistory();
     void updateActuators();
-    void broadcastState(bool force = false);
+    void applyRules();
+    bool replaceRules(const DeviceCommand &cmd);
+    void alignCycles();
+    uint32_t epochNow() const;
+    void notifyStateChanged();
+    void drainStateQueue();
+    void broadcastState(const DeviceState &state);
+    void publishSnapshot();
+    void publishState(uint16_t fields, bool snapshot);
+    void flushWebSockets();
+    bool sendToClient(uint8_t num, const uint8_t *payload, size_t length, bool binary);
+    size_t encodeState(WireFormat format, uint16_t fields, bool snapshot);
     void publishPresence();
+    void publishMetrics(uint8_t origin);
+    size_t serializeMetrics();
+    bool publishMqtt(const char *topic, const uint8_t *payload, size_t length, bool retained, OutboxKey key);
+    void flushOutbox();
+    void drainAckQueue();
+    void sendAck(const CommandAck &ack);
+    bool seenCommand(const char *id) const;
+    void rememberCommand(const char *id);
+    bool commandTopic(const char *topic, WireFormat &format) const;
+    void subscribeGroups(bool join);
+    void setGroups(const DeviceCommand &cmd);
+    void loadGroups();
+    void startMdns();
+    void setLanToken(const DeviceCommand &cmd);
+    void loadLanToken();
+    bool acceptClient(uint8_t num, const uint8_t *url, size_t length);
     
     // --- State & Storage ---
     void loadState();
     void saveState();
     void loadCredentials();
     void saveCredentials(String ssid, String pass);
-    void processRawCommand(const uint8_t *payload, size_t length);
-    void performOtaUpdate(const String &url);
+    void processBatch(size_t count, uint8_t origin, uint64_t receivedAt);
+    void processRawCommand(const uint8_t *payload, size_t length, WireFormat format = WireFormat::Json,
+                           uint8_t origin = ORIGIN_MQTT);
+    void reportOta();
+    void publishOtaStatus(const char *status, OutboxKey key);
+    size_t serializeState(const char *type, uint16_t fields);
+    size_t serializeTx();
 
     // --- Callbacks ---
     static void mqttCallback(char *topic, uint8_t *payload, unsigned int length);
     static void webSocketEvent(uint8_t num, WStype_t type, uint8_t *payload, size_t length);
+    static void onWaterPinChange();
+    static void onShutdown();
+    static void onTimeSync(struct timeval *tv);
     void onMqttMessage(char *topic, uint8_t *payload, unsigned int length);
     void onWebSocketMessage(uint8_t num, WStype_t type, uint8_t *payload, size_t length);
 
     // --- Members ---
-    WiFiClientSecure wifiClient;
+    TlsClient tlsClient;
     PubSubClient mqttClient;
     WebSocketsServer wsServer;
     Preferences preferences;
+    StateStore stateStore;
     OneWire oneWire;
     DallasTemperature sensors;
     BluetoothProvisioning ble;
+    CommandParser commandParser;
 
     String wifiSSID;
     String wifiPass;
     String macAddress;
 
+    // Built once per boot in setupTopics()
+    struct
+    {
+        char clientId[MQTT_TOPIC_SIZE];
+        char status[MQTT_TOPIC_SIZE];
+        char command[MQTT_TOPIC_SIZE];
+        char commandBin[MQTT_TOPIC_SIZE];
+        char state[MQTT_TOPIC_SIZE];
+        char statePatch[MQTT_TOPIC_SIZE];
+        char stateBin[MQTT_TOPIC_SIZE];
+        char statePatchBin[MQTT_TOPIC_SIZE];
+        char presence[MQTT_TOPIC_SIZE];
+        char ota[MQTT_TOPIC_SIZE];
+        char history[MQTT_TOPIC_SIZE];
+        char ack[MQTT_TOPIC_SIZE];
+        char metrics[MQTT_TOPIC_SIZE];
+    } topics;
+
+    // Outbound message scratch space shared by MQTT and WebSocket sends
+    JsonArena<TX_ARENA_SIZE> txArena;
+    JsonDocument txDoc;
+    char txBuffer[TX_BUFFER_SIZE];
+    uint8_t txBinary[BINARY_STATE_MAX_SIZE];
+    uint8_t historyBatch[HISTORY_BATCH_SIZE];
+    char metricsBuffer[METRICS_BUFFER_SIZE];
+
+    // What txBuffer and txBinary hold, so every consumer of a state message
+    // shares one encoding of it. length 0 means nothing reusable.
+    struct EncodedState
+    {
+        uint32_t seq;
+        uint16_t fields;
+        bool snapshot;
+        size_t length;
+    };
+    EncodedState encodedJson = {};
+    EncodedState encodedBinary = {};
+
+    // State encoding per consumer: MQTT is switched with setWireFormat,
+    // WebSocket clients opt in by connecting to "/bin".
+    WireFormat mqttWireFormat = WireFormat::Json;
+
+    // Network task. Group membership, persisted as "groups".
+    char groups[MAX_GROUPS][GROUP_ID_SIZE] = {};
+    uint8_t groupCount = 0;
+
+    // Network task. Token WebSocket clients must present, persisted as
+    // "lanToken"; empty leaves the LAN open.
+    char lanToken[LAN_TOKEN_SIZE] = {};
+    char hostname[16] = {};
+    bool mdnsStarted = false;
+
+    // Network task. Each WebSocket client only ever has the latest state
+    // waiting: the fields changed since its last message.
+    struct WsClient
+    {
+        bool connected = false; // And past the token check
+        bool binary = false;
+        bool snapshotPending = false;
+        uint16_t pendingFields = 0;
+        uint8_t slowSends = 0; // In a row
+        uint64_t lastSend = 0;
+    };
+    WsClient wsClients[WEBSOCKETS_SERVER_CLIENT_MAX];
+
+    // network -> control
+    SpscQueue<DeviceCommand, COMMAND_QUEUE_SIZE> commandQueue;
+    // control -> network
+    SpscQueue<DeviceState, STATE_QUEUE_SIZE> stateQueue;
+    SpscQueue<CommandAck, ACK_QUEUE_SIZE> ackQueue;
+    TaskHandle_t networkTaskHandle = nullptr;
+    TaskHandle_t controlTaskHandle = nullptr;
+    std::atomic<bool> waterPinChanged{false};
+    // Unix time at monotonicMicros() == 0, 0 until SNTP or an RTC
+    // checkpoint provides it. Set from the SNTP callback.
+    std::atomic<uint32_t> bootEpoch{0};
+    std::atomic<bool> timeSynced{false};
+    // One bit per local rule currently capping its channel (presence)
+    std::atomic<uint16_t> rulesInForce{0};
+
+    // Control task (the channel layout is also read by the network task)
+    ActuatorEngine actuators;
     DeviceState currentState;
+    bool statePending = false;
+    DeadlineScheduler<JOB_COUNT> scheduler;
+    RuleEngine rules;
+    esp_pm_lock_handle_t pwmSleepLock = nullptr;
+    bool pwmSleepLockHeld = false;
+
+    // Network task
     DeviceState lastBroadcastState;
-    
-    unsigned long lastWifiAttempt = 0;
-    unsigned long lastPresence = 0;
-    unsigned long lastTempPoll = 0;
-    unsigned long lastWaterPoll = 0;
-    unsigned long irrigationStopAt = 0;
-    unsigned long irrigationCycleNextToggle = 0;
-    bool irrigationCycleIsOnPhase = false;
-    unsigned long lightCycleNextToggle = 0;
-    bool lightCycleIsOnPhase = false;
-
-    int appliedBrightness = -1;
+    uint32_t stateSeq = 0;
+    bool snapshotStale = false;
+    uint64_t lastSnapshot = 0;
+    MqttOutbox<OUTBOX_SIZE, TX_BUFFER_SIZE> outbox;
+    // Hashes of the latest command ids, oldest overwritten first
+    uint32_t recentCommandIds[RECENT_COMMAND_IDS] = {};
+    uint8_t recentCommandNext = 0;
+    OtaUpdater ota;
+    uint8_t otaReported = 0;
+    uint64_t otaRebootAt = 0;
+    ReconnectBackoff wifiBackoff;
+    ReconnectBackoff mqttBackoff;
+    uint32_t retryHintSeconds = 0;
+    uint64_t wifiDownSince = 0;
+    uint64_t bleReleaseAt = 0;
+    uint64_t buttonPressedAt = 0;
+    bool buttonPressed = false;
+
+    // Each histogram is recorded by one task: control, sensors and command
+    // (arrival to actuation) by the control task, the rest by the network
+    // task. serializeMetrics() reads them all from the network task.
+    struct
+    {
+        Histogram control;
+        Histogram network;
+        Histogram ws;
+        Histogram mqtt;
+        Histogram sensors;
+        Histogram broadcast;
+        Histogram command;
+    } metrics;
+
+    // Timestamps below are monotonicMicros()
+    uint64_t lastPresence = 0;
+    uint64_t lastMetrics = 0;
+    DeviceAddress tempSensors[MAX_TEMP_SENSORS];
+    // Latest reading per probe, unfiltered, for the history
+    float tempReadings[MAX_TEMP_SENSORS] = {NAN, NAN, NAN, NAN};
+    SensorHistory history;
+    uint8_t tempSensorCount = 0;
+    uint64_t tempConversionMicros = 0;
+    uint8_t tempReadIndex = 0;
     bool wifiConnected = false;
     
     static OrtusSystem* instance;
@@ -0,0 +1,351 @@
+#include "ota_updater.h"
+#include "monotonic.h"
+
+namespace
+{
+    constexpr uint8_t APP_IMAGE_MAGIC = 0xE9;
+    constexpr uint8_t DELTA_OP_COPY = 0;
+    constexpr uint8_t DELTA_OP_INSERT = 1;
+
+    uint32_t getU32(const uint8_t *in)
+    {
+        return (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+    }
+}
+
+// The core marks a new image valid right at boot unless told to leave it
+// to the application; confirmRunning() does that once the image works.
+extern "C" bool verifyRollbackLater()
+{
+    return true;
+}
+
+bool OtaUpdater::start(const char *url, const uint8_t *sha256)
+{
+    // A finished update waits for its restart; writing another image now
+    // would overwrite the partition it boots from
+    const Phase phase = state.load();
+    if (phase != Phase::Idle && phase != Phase::Failed)
+        return false;
+
+    strncpy(this->url, url, sizeof(this->url) - 1);
+    this->url[sizeof(this->url) - 1] = '\0';
+    memcpy(expected, sha256, SHA256_SIZE);
+
+    buffer = (uint8_t *)malloc(2 * OTA_CHUNK_SIZE);
+    if (!buffer)
+    {
+        failure = "out of memory";
+        state = Phase::Failed;
+        return true;
+    }
+    stream = nullptr;
+    total = received = written = 0;
+    stage = Stage::Detect;
+    headerLength = 0;
+    insertLeft = 0;
+    writing = false;
+    failure = "";
+    progress = 0;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+    state = Phase::Running;
+
+    // Without a task the network loop steps the download itself
+    steppedHere = xTaskCreatePinnedToCore(run, "ortus-ota", OTA_TASK_STACK_SIZE, this, OTA_TASK_PRIORITY, nullptr,
+                                          OTA_TASK_CORE) != pdPASS;
+    return true;
+}
+
+void OtaUpdater::confirmRunning()
+{
+    const esp_partition_t *partition = esp_ota_get_running_partition();
+    esp_ota_img_states_t image;
+    if (partition && esp_ota_get_state_partition(partition, &image) == ESP_OK &&
+        image == ESP_OTA_IMG_PENDING_VERIFY && esp_ota_mark_app_valid_cancel_rollback() == ESP_OK)
+        Serial.println("[OTA] New image confirmed");
+}
+
+void OtaUpdater::loop()
+{
+    if (steppedHere && state.load() == Phase::Running)
+        step();
+}
+
+void OtaUpdater::clear()
+{
+    if (state.load() != Phase::Running)
+        state = Phase::Idle;
+}
+
+void OtaUpdater::run(void *arg)
+{
+    OtaUpdater *self = static_cast<OtaUpdater *>(arg);
+    // The final phase is the last thing step() stores; past it the updater
+    // belongs to the network task again, which may start the next update
+    while (self->step())
+        vTaskDelay(1); // Low priority, but let the network task in between chunks
+    vTaskDelete(nullptr);
+}
+
+// One chunk of work; false once the update has finished either way.
+bool OtaUpdater::step()
+{
+    if (!stream)
+        return open();
+
+    int available = stream->available();
+    if (available <= 0)
+    {
+        if (!stream->connected())
+            return fail("connection lost");
+        if (monotonicMicros() - lastData > millisToMicros(OTA_STALL_TIMEOUT_MS))
+            return fail("download stalled");
+        return true;
+    }
+
+    int n = stream->read(buffer, available < (int)OTA_CHUNK_SIZE ? available : OTA_CHUNK_SIZE);
+    if (n <= 0)
+        return true;
+    if (received + n > total)
+        return fail("image longer than announced");
+    received += n;
+    lastData = monotonicMicros();
+    if (!consume(buffer, n))
+        return false;
+
+    progress = (uint8_t)((uint64_t)received * 100 / total);
+    return received < total || finish();
+}
+
+bool OtaUpdater::open()
+{
+    Serial.print("[OTA] Downloading ");
+    Serial.println(url);
+
+    // Not authenticated: the command's SHA-256 vouches for the image
+    client.setInsecure();
+    http.setFollowRedirects(HTTPC_FORCE_FOLLOW_REDIRECTS);
+    if (!http.begin(client, url))
+        return fail("invalid URL");
+
+    int status = http.GET();
+    if (status != HTTP_CODE_OK)
+    {
+        Serial.printf("[OTA] HTTP %d\n", status);
+        return fail(status < 0 ? "connection failed" : "HTTP error");
+    }
+    // Chunked bodies are not decoded; progress needs the length anyway
+    int size = http.getSize();
+    if (size <= 0)
+        return fail("no content length");
+
+    total = size;
+    stream = http.getStreamPtr();
+    lastData = monotonicMicros();
+    running = esp_ota_get_running_partition();
+    target = esp_ota_get_next_update_partition(nullptr);
+    if (!running || !target)
+        return fail("no OTA partition");
+    return true;
+}
+
+bool OtaUpdater::consume(const uint8_t *data, size_t length)
+{
+    while (length > 0)
+    {
+        switch (stage)
+        {
+        case Stage::Detect:
+            if (data[0] == APP_IMAGE_MAGIC)
+            {
+                stage = Stage::Plain;
+                if (!beginWrite(total))
+                    return false;
+            }
+            else if (data[0] == 'O')
+            {
+                stage = Stage::DeltaHeader;
+            }
+            else
+            {
+                return fail("unknown image format");
+            }
+            break;
+
+        case Stage::Plain:
+            return emit(data, length);
+
+        case Stage::DeltaHeader:
+        {
+            size_t take = length < DELTA_HEADER_SIZE - headerLength ? length : DELTA_HEADER_SIZE - headerLength;
+            memcpy(header + headerLength, data, take);
+            headerLength += take;
+            data += take;
+            length -= take;
+            if (headerLength < DELTA_HEADER_SIZE)
+                break;
+
+            if (memcmp(header, "ORTD", 4) != 0 || header[4] != OTA_DELTA_VERSION)
+                return fail("unsupported delta");
+            uint8_t base[SHA256_SIZE];
+            if (esp_partition_get_sha256(running, base) != ESP_OK || memcmp(base, header + 12, SHA256_SIZE) != 0)
+                return fail("delta is for another image");
+            if (memcmp(header + 44, expected, SHA256_SIZE) != 0)
+                return fail("SHA-256 mismatch");
+            deltaSize = getU32(header + 8);
+            headerLength = 0;
+            stage = Stage::DeltaOp;
+            if (!beginWrite(deltaSize))
+                return false;
+            break;
+        }
+
+        case Stage::DeltaOp:
+        {
+            // Opcode first, then its fixed-size arguments
+            header[headerLength++] = *data++;
+            length--;
+            const uint8_t op = header[0];
+            const size_t opSize = op == DELTA_OP_COPY ? 9 : op == DELTA_OP_INSERT ? 5 : 0;
+            if (opSize == 0)
+                return fail("corrupt delta");
+            if (headerLength < opSize)
+                break;
+
+            headerLength = 0;
+            if (op == DELTA_OP_COPY)
+            {
+                if (!copyRunning(getU32(header + 1), getU32(header + 5)))
+                    return false;
+            }
+            else
+            {
+                insertLeft = getU32(header + 1);
+                if (insertLeft > 0)
+                    stage = Stage::DeltaInsert;
+            }
+            break;
+        }
+
+        case Stage::DeltaInsert:
+        {
+            size_t take = length < insertLeft ? length : insertLeft;
+            if (!emit(data, take))
+                return false;
+            data += take;
+            length -= take;
+            insertLeft -= take;
+            if (insertLeft == 0)
+                stage = Stage::DeltaOp;
+            break;
+        }
+        }
+    }
+    return true;
+}
+
+bool OtaUpdater::beginWrite(size_t size)
+{
+    if (size > target->size)
+        return fail("image too large");
+#ifdef OTA_WITH_SEQUENTIAL_WRITES
+    // Erases sector by sector as it goes instead of the whole image up
+    // front, which would hold the flash (and the other core) for seconds
+    size = OTA_WITH_SEQUENTIAL_WRITES;
+#endif
+    esp_err_t err = esp_ota_begin(target, size, &handle);
+    if (err != ESP_OK)
+    {
+        Serial.printf("[OTA] Begin failed: %s\n", esp_err_to_name(err));
+        return fail("cannot write partition");
+    }
+    writing = true;
+    return true;
+}
+
+bool OtaUpdater::emit(const uint8_t *data, size_t length)
+{
+    if (written + length > target->size)
+        return fail("image too large");
+    esp_err_t err = esp_ota_write(handle, data, length);
+    if (err != ESP_OK)
+    {
+        Serial.printf("[OTA] Write failed: %s\n", esp_err_to_name(err));
+        return fail("write failed");
+    }
+    mbedtls_sha256_update_ret(&sha, data, length);
+    written += length;
+    return true;
+}
+
+bool OtaUpdater::copyRunning(uint32_t offset, uint32_t length)
+{
+    if ((uint64_t)offset + length > running->size)
+        return fail("corrupt delta");
+
+    uint8_t *scratch = buffer + OTA_CHUNK_SIZE;
+    while (length > 0)
+    {
+        size_t piece = length < OTA_CHUNK_SIZE ? length : OTA_CHUNK_SIZE;
+        if (esp_partition_read(running, offset, scratch, piece) != ESP_OK)
+            return fail("read failed");
+        if (!emit(scratch, piece))
+            return false;
+        offset += piece;
+        length -= piece;
+    }
+    return true;
+}
+
+bool OtaUpdater::finish()
+{
+    if (stage == Stage::DeltaHeader || stage == Stage::DeltaInsert || headerLength != 0 ||
+        (stage == Stage::DeltaOp && written != deltaSize))
+        return fail("truncated image");
+
+    uint8_t digest[SHA256_SIZE];
+    mbedtls_sha256_finish_ret(&sha, digest);
+    if (memcmp(digest, expected, SHA256_SIZE) != 0)
+        return fail("SHA-256 mismatch");
+
+    // esp_ota_end() also validates the image itself
+    writing = false;
+    esp_err_t err = esp_ota_end(handle);
+    if (err == ESP_OK)
+        err = esp_ota_set_boot_partition(target);
+    if (err != ESP_OK)
+    {
+        Serial.printf("[OTA] Activation failed: %s\n", esp_err_to_name(err));
+        return fail("image rejected");
+    }
+
+    Serial.printf("[OTA] %u bytes written and verified\n", (unsigned)written);
+    close();
+    state = Phase::Succeeded;
+    return false;
+}
+
+bool OtaUpdater::fail(const char *reason)
+{
+    Serial.print("[OTA] Failed: ");
+    Serial.println(reason);
+    if (writing)
+    {
+        esp_ota_abort(handle);
+        writing = false;
+    }
+    close();
+    failure = reason;
+    state = Phase::Failed;
+    return false;
+}
+
+void OtaUpdater::close()
+{
+    mbedtls_sha256_free(&sha);
+    stream = nullptr;
+    http.end();
+    free(buffer);
+    buffer = nullptr;
+}
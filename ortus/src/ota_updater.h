@@ -0,0 +1,126 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+#include <HTTPClient.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+#include <atomic>
+
+#include "types.h"
+
+// Bytes pulled off the download per step.
+constexpr size_t OTA_CHUNK_SIZE = 4096;
+// A download that delivers nothing for this long is abandoned.
+constexpr unsigned long OTA_STALL_TIMEOUT_MS = 30000;
+// Own task next to the network task; the HTTPS handshake needs the stack.
+constexpr uint32_t OTA_TASK_STACK_SIZE = 10240;
+constexpr UBaseType_t OTA_TASK_PRIORITY = 1;
+constexpr BaseType_t OTA_TASK_CORE = 0;
+
+// Image streams are told apart by their first byte:
+//   0xE9  an application image, written as is
+//   'O'   a delta against the running image:
+//     char[4] "ORTD", u8 version (OTA_DELTA_VERSION), u8[3] reserved,
+//     u32 size of the resulting image,
+//     u8[32] SHA-256 of the running image (esp_partition_get_sha256()),
+//     u8[32] SHA-256 of the resulting image,
+//     then operations up to the end of the stream:
+//       u8 0 (copy),   u32 offset, u32 length: bytes of the running image
+//       u8 1 (insert), u32 length, then that many literal bytes
+//     Integers are little-endian.
+// Whatever the format, the SHA-256 of the written image must match the one
+// the command carried before the new partition is made bootable; a delta
+// building anything else is refused as soon as its header is in. The
+// download itself is not authenticated, so that digest is what vouches for
+// the image.
+//
+// The new image boots on probation (with the core's app rollback): unless
+// confirmRunning() marks it valid, the next reset goes back to the old one.
+constexpr uint8_t OTA_DELTA_VERSION = 1;
+
+// Downloads an update into the inactive app partition on a task of its
+// own, so the control loop and the network keep running meanwhile.
+// start(), loop() and clear() belong to the network task; phase() and
+// percent() may be read from anywhere.
+class OtaUpdater
+{
+public:
+    enum class Phase : uint8_t
+    {
+        Idle,
+        Running,
+        Succeeded, // The new image boots on the next restart
+        Failed
+    };
+
+    // False unless Idle or Failed: while an update runs, or one has
+    // succeeded and waits for the restart. `sha256` (SHA256_SIZE bytes) is
+    // the digest the written image must have.
+    bool start(const char *url, const uint8_t *sha256);
+    // Without a task of its own (native build) the update advances here,
+    // one chunk per call.
+    void loop();
+    // Back to Idle once a result has been reported.
+    void clear();
+
+    Phase phase() const { return state.load(); }
+
+    // Marks the running image valid if it is still on probation after an
+    // update; called once it has shown it works (reached the broker).
+    static void confirmRunning();
+    uint8_t percent() const { return progress.load(); }
+    // Why the update failed; valid while phase() is Failed.
+    const char *error() const { return failure; }
+
+private:
+    enum class Stage : uint8_t
+    {
+        Detect,
+        DeltaHeader,
+        DeltaOp,
+        DeltaInsert,
+        Plain
+    };
+    static constexpr size_t DELTA_HEADER_SIZE = 76;
+
+    std::atomic<Phase> state{Phase::Idle};
+    std::atomic<uint8_t> progress{0};
+    const char *failure = "";
+    bool steppedHere = false; // No task of its own; network task only
+
+    char url[OTA_URL_MAX_LENGTH] = {};
+    uint8_t expected[SHA256_SIZE] = {};
+
+    WiFiClientSecure client;
+    HTTPClient http;
+    WiFiClient *stream = nullptr;
+    uint8_t *buffer = nullptr; // Download chunk, then scratch for copies
+    size_t total = 0;
+    size_t received = 0;
+    uint64_t lastData = 0;
+
+    const esp_partition_t *running = nullptr;
+    const esp_partition_t *target = nullptr;
+    esp_ota_handle_t handle = 0;
+    bool writing = false;
+    size_t written = 0;
+    mbedtls_sha256_context sha;
+
+    Stage stage = Stage::Detect;
+    uint8_t header[DELTA_HEADER_SIZE];
+    size_t headerLength = 0;
+    uint32_t deltaSize = 0;
+    uint32_t insertLeft = 0;
+
+    static void run(void *arg);
+    bool step();
+    bool open();
+    bool consume(const uint8_t *data, size_t length);
+    bool beginWrite(size_t size);
+    bool emit(const uint8_t *data, size_t length);
+    bool copyRunning(uint32_t offset, uint32_t length);
+    bool finish();
+    bool fail(const char *reason);
+    void close();
+};
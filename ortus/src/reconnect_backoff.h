@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Retry schedule for one link (WiFi, MQTT). Each failed attempt doubles the
+// retry window from `base` up to `max`, and the next attempt is drawn from
+// the upper half of it. The first attempt after the link drops is drawn from
+// anywhere in the base window. Draws come from a PRNG seeded with the device
+// id, so a fleet that lost the network together does not retry in lockstep.
+// A server hint raises the window floor. Times are monotonicMicros().
+class ReconnectBackoff
+{
+public:
+    ReconnectBackoff(uint64_t baseMicros, uint64_t maxMicros) : base(baseMicros), max(maxMicros) {}
+
+    // Seeds the jitter and starts out offline, first attempt jittered.
+    void begin(const char *deviceId, uint64_t now)
+    {
+        uint32_t hash = 2166136261u; // FNV-1a
+        for (; *deviceId; deviceId++)
+            hash = (hash ^ (uint8_t)*deviceId) * 16777619u;
+        rng = hash ? hash : 1;
+        online = true;
+        down(now);
+    }
+
+    bool due(uint64_t now) const { return !online && now >= nextAttempt; }
+
+    // An attempt starts now. The next one is scheduled as if it fails; an
+    // attempt still open when the next one starts counts as failed.
+    void attempt(uint64_t now)
+    {
+        if (pending)
+            stats.failures++;
+        pending = true;
+        stats.attempts++;
+        schedule(now);
+    }
+
+    // The attempt failed outright. A busy server skips straight to the
+    // longest window instead of climbing towards it.
+    void failed(uint64_t now, bool serverBusy)
+    {
+        pending = false;
+        stats.failures++;
+        if (serverBusy)
+        {
+            streak = MAX_STREAK;
+            schedule(now);
+        }
+    }
+
+    void up(uint64_t now)
+    {
+        if (online)
+            return;
+        online = true;
+        pending = false;
+        streak = 0;
+        stats.connects++;
+        stats.offlineMicros += now - offlineSince;
+    }
+
+    void down(uint64_t now)
+    {
+        if (!online)
+            return;
+        online = false;
+        offlineSince = now;
+        nextAttempt = now + random(window());
+    }
+
+    // Next attempt as soon as possible (e.g. new credentials).
+    void retryNow() { nextAttempt = 0; }
+
+    // Minimum retry window, 0 for none.
+    void setHint(uint64_t micros) { hint = micros; }
+
+    struct Stats
+    {
+        uint32_t attempts = 0;
+        uint32_t failures = 0;
+        uint32_t connects = 0;
+        uint64_t offlineMicros = 0; // Finished outages only
+    };
+    const Stats &counters() const { return stats; }
+    // Including the outage in progress.
+    uint64_t offlineMicros(uint64_t now) const { return stats.offlineMicros + (online ? 0 : now - offlineSince); }
+
+private:
+    static constexpr uint8_t MAX_STREAK = 20;
+
+    uint64_t base;
+    uint64_t max;
+    uint64_t hint = 0;
+    uint64_t nextAttempt = 0;
+    uint64_t offlineSince = 0;
+    uint32_t rng = 1;
+    uint8_t streak = 0;
+    bool online = false;
+    bool pending = false;
+    Stats stats;
+
+    uint64_t window() const
+    {
+        uint64_t w = streak >= MAX_STREAK || (base << streak) > max ? max : base << streak;
+        return w > hint ? w : hint;
+    }
+
+    void schedule(uint64_t now)
+    {
+        const uint64_t w = window();
+        nextAttempt = now + w / 2 + random(w / 2 + 1);
+        if (streak < MAX_STREAK)
+            streak++;
+    }
+
+    // xorshift32; uniform enough for spreading retries
+    uint64_t random(uint64_t bound)
+    {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        return bound ? rng % bound : 0;
+    }
+};
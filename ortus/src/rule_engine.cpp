@@ -0,0 +1,442 @@
+#include "rule_engine.h"
+#include "nvs_lock.h"
+#include "crc32.h"
+
+namespace
+{
+    constexpr const char *RULES_KEY = "rules";
+    constexpr size_t HEADER_SIZE = 16;
+    constexpr size_t V1_HEADER_SIZE = 4;
+    constexpr size_t RULE_SIZE = 10;
+    static_assert(RULE_PROGRAM_MAX_SIZE == HEADER_SIZE + MAX_RULES * RULE_SIZE, "RULE_PROGRAM_MAX_SIZE is out of date");
+
+    constexpr uint32_t MINUTES_PER_DAY = 24 * 60;
+    constexpr int32_t SECONDS_PER_DAY = 24 * 60 * 60;
+    // POSIX allows transition times from -167 to 167 hours
+    constexpr int16_t MAX_TRANSITION_MINUTES = 167 * 60;
+
+    void putU16(uint8_t *out, uint16_t v)
+    {
+        out[0] = (uint8_t)v;
+        out[1] = (uint8_t)(v >> 8);
+    }
+
+    uint16_t getU16(const uint8_t *in)
+    {
+        return (uint16_t)(in[0] | in[1] << 8);
+    }
+
+    bool validTransition(const DstTransition &transition)
+    {
+        return transition.month >= 1 && transition.month <= 12 && transition.week >= 1 && transition.week <= 5 &&
+               transition.weekday <= 6 && transition.minute >= -MAX_TRANSITION_MINUTES &&
+               transition.minute <= MAX_TRANSITION_MINUTES;
+    }
+
+    void putTransition(uint8_t *out, const DstTransition &transition)
+    {
+        out[0] = transition.month;
+        out[1] = transition.week;
+        out[2] = transition.weekday;
+        putU16(out + 3, (uint16_t)transition.minute);
+    }
+
+    bool getTransition(const uint8_t *in, DstTransition &transition)
+    {
+        transition.month = in[0];
+        transition.week = in[1];
+        transition.weekday = in[2];
+        transition.minute = (int16_t)getU16(in + 3);
+        return validTransition(transition);
+    }
+
+    // Days since 1970-01-01 of a proleptic Gregorian date, and the year of
+    // such a day (Howard Hinnant's civil calendar algorithms)
+    int32_t daysFromCivil(int32_t year, uint32_t month, uint32_t day)
+    {
+        year -= month <= 2;
+        const int32_t era = (year >= 0 ? year : year - 399) / 400;
+        const uint32_t yearOfEra = (uint32_t)(year - era * 400);
+        const uint32_t dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+        const uint32_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+        return era * 146097 + (int32_t)dayOfEra - 719468;
+    }
+
+    int32_t civilYear(int32_t days)
+    {
+        days += 719468;
+        const int32_t era = (days >= 0 ? days : days - 146096) / 146097;
+        const uint32_t dayOfEra = (uint32_t)(days - era * 146097);
+        const uint32_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+        const uint32_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+        const uint32_t shiftedMonth = (5 * dayOfYear + 2) / 153; // 0 is March
+        return (int32_t)yearOfEra + era * 400 + (shiftedMonth >= 10);
+    }
+
+    // Seconds since the epoch, on the local clock, of a transition in `year`
+    int64_t transitionTime(int32_t year, const DstTransition &transition)
+    {
+        const int32_t first = daysFromCivil(year, transition.month, 1);
+        const int32_t next = transition.month == 12 ? daysFromCivil(year + 1, 1, 1)
+                                                    : daysFromCivil(year, transition.month + 1, 1);
+        const int32_t firstWeekday = ((first % 7) + 7 + 4) % 7; // 1970-01-01 was a Thursday
+        int32_t day = first + (transition.weekday - firstWeekday + 7) % 7 + (transition.week - 1) * 7;
+        if (day >= next) // Week 5 is the last one, which may be the fourth
+            day -= 7;
+        return (int64_t)day * SECONDS_PER_DAY + transition.minute * 60;
+    }
+
+    // POSIX TZ pieces. Names are three or more letters, or anything in <>.
+    bool skipZoneName(const char *&p)
+    {
+        const char *start = p;
+        if (*p == '<')
+        {
+            while (*p && *p != '>')
+                p++;
+            if (*p != '>' || p - start < 4)
+                return false;
+            p++;
+            return true;
+        }
+        while (isalpha((unsigned char)*p))
+            p++;
+        return p - start >= 3;
+    }
+
+    // [+-]hh[:mm], as minutes
+    bool parseClock(const char *&p, int32_t maxHours, int32_t &minutes)
+    {
+        int32_t sign = 1;
+        if (*p == '+' || *p == '-')
+            sign = *p++ == '-' ? -1 : 1;
+        if (!isdigit((unsigned char)*p))
+            return false;
+        int32_t hours = 0;
+        while (isdigit((unsigned char)*p) && hours <= maxHours)
+            hours = hours * 10 + (*p++ - '0');
+        int32_t mins = 0;
+        if (*p == ':')
+        {
+            p++;
+            if (!isdigit((unsigned char)p[0]) || !isdigit((unsigned char)p[1]))
+                return false;
+            mins = (p[0] - '0') * 10 + (p[1] - '0');
+            p += 2;
+        }
+        if (hours > maxHours || mins > 59)
+            return false;
+        minutes = sign * (hours * 60 + mins);
+        return true;
+    }
+
+    // Mm.w.d[/time]; the time defaults to 02:00
+    bool parseTransition(const char *&p, DstTransition &transition)
+    {
+        if (*p++ != 'M' || !isdigit((unsigned char)*p))
+            return false;
+        char *end;
+        const unsigned long month = strtoul(p, &end, 10);
+        if (end == p || *end != '.' || !isdigit((unsigned char)end[1]) || end[2] != '.' ||
+            !isdigit((unsigned char)end[3]))
+            return false;
+        transition.month = (uint8_t)(month <= 12 ? month : 0);
+        transition.week = (uint8_t)(end[1] - '0');
+        transition.weekday = (uint8_t)(end[3] - '0');
+        p = end + 4;
+
+        int32_t minute = 2 * 60;
+        if (*p == '/' && !parseClock(++p, MAX_TRANSITION_MINUTES / 60, minute))
+            return false;
+        transition.minute = (int16_t)minute;
+        return validTransition(transition);
+    }
+}
+
+bool parseTimeZone(const char *posix, TimeZone &zone)
+{
+    const char *p = posix;
+    int32_t west;
+    if (!skipZoneName(p) || !parseClock(p, 24, west))
+        return false;
+    zone = TimeZone();
+    zone.utcOffset = (int16_t)-west;
+    if (*p == '\0')
+        return true;
+
+    // Daylight saving: an hour ahead unless it gives its own offset
+    if (!skipZoneName(p))
+        return false;
+    int32_t dstWest = west - 60;
+    if (*p != ',' && !parseClock(p, 24, dstWest))
+        return false;
+    zone.dstShift = (int16_t)(west - dstWest);
+    if (zone.dstShift == 0 || *p++ != ',' || !parseTransition(p, zone.dstStart) || *p++ != ',' ||
+        !parseTransition(p, zone.dstEnd))
+        return false;
+    return *p == '\0';
+}
+
+int32_t localOffset(const TimeZone &zone, uint32_t epoch)
+{
+    const int32_t standard = zone.utcOffset * 60;
+    if (zone.dstShift == 0)
+        return standard;
+
+    // Each change happens at the local time in effect before it
+    const int32_t daylight = standard + zone.dstShift * 60;
+    const int32_t year = civilYear((int32_t)(((int64_t)epoch + standard) / SECONDS_PER_DAY));
+    const int64_t start = transitionTime(year, zone.dstStart) - standard;
+    const int64_t end = transitionTime(year, zone.dstEnd) - daylight;
+    const bool saving = start < end ? (epoch >= start && epoch < end) // Northern hemisphere
+                                    : (epoch >= start || epoch < end);
+    return saving ? daylight : standard;
+}
+
+size_t encodeRules(const Rule *rules, uint8_t count, const TimeZone &zone, uint8_t *out, size_t size)
+{
+    const size_t length = HEADER_SIZE + count * RULE_SIZE;
+    if (count > MAX_RULES || length > size)
+        return 0;
+
+    out[0] = RULES_VERSION;
+    putU16(out + 1, (uint16_t)zone.utcOffset);
+    putU16(out + 3, (uint16_t)zone.dstShift);
+    putTransition(out + 5, zone.dstStart);
+    putTransition(out + 10, zone.dstEnd);
+    out[15] = count;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint8_t *entry = out + HEADER_SIZE + i * RULE_SIZE;
+        entry[0] = (uint8_t)rules[i].kind;
+        entry[1] = rules[i].channel;
+        entry[2] = rules[i].level;
+        entry[3] = rules[i].probe;
+        putU16(entry + 4, (uint16_t)rules[i].a);
+        putU16(entry + 6, (uint16_t)rules[i].b);
+        putU16(entry + 8, rules[i].ramp);
+    }
+    return length;
+}
+
+bool decodeRules(const uint8_t *program, size_t length, Rule *rules, uint8_t &count, TimeZone &zone)
+{
+    zone = TimeZone();
+    size_t header;
+    if (length >= V1_HEADER_SIZE && program[0] == 1)
+    {
+        header = V1_HEADER_SIZE;
+        zone.utcOffset = (int16_t)getU16(program + 1);
+    }
+    else if (length >= HEADER_SIZE && program[0] == RULES_VERSION)
+    {
+        header = HEADER_SIZE;
+        zone.utcOffset = (int16_t)getU16(program + 1);
+        zone.dstShift = (int16_t)getU16(program + 3);
+        if (zone.dstShift != 0 &&
+            (!getTransition(program + 5, zone.dstStart) || !getTransition(program + 10, zone.dstEnd)))
+            return false;
+    }
+    else
+        return false;
+
+    count = program[header - 1];
+    if (count > MAX_RULES || length != header + count * RULE_SIZE)
+        return false;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        const uint8_t *entry = program + header + i * RULE_SIZE;
+        Rule &rule = rules[i];
+        rule.kind = (RuleKind)entry[0];
+        rule.channel = entry[1];
+        rule.level = entry[2];
+        rule.probe = entry[3];
+        rule.a = (int16_t)getU16(entry + 4);
+        rule.b = (int16_t)getU16(entry + 6);
+        rule.ramp = getU16(entry + 8);
+
+        if (rule.level > 100)
+            return false;
+        switch (rule.kind)
+        {
+        case RuleKind::WaterEmpty:
+            break;
+        case RuleKind::TemperatureAbove:
+        case RuleKind::TemperatureBelow:
+            if (rule.probe >= MAX_TEMP_SENSORS || rule.b < 0)
+                return false;
+            break;
+        case RuleKind::TimeWindow:
+            if (rule.a < 0 || rule.a >= (int16_t)MINUTES_PER_DAY || rule.b < 0 || rule.b >= (int16_t)MINUTES_PER_DAY)
+                return false;
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+void RuleEngine::begin(Preferences &preferences, const ActuatorEngine &actuators)
+{
+    this->preferences = &preferences;
+    this->actuators = &actuators;
+
+    // Program, then its CRC-32
+    uint8_t stored[RULE_PROGRAM_MAX_SIZE + 4];
+    const size_t length = preferences.getBytesLength(RULES_KEY);
+    if (length == 0)
+        return;
+    if (length < 4 || length > sizeof(stored) || preferences.getBytes(RULES_KEY, stored, length) != length)
+    {
+        Serial.println("[Rules] Stored rules are corrupt, ignoring them");
+        return;
+    }
+
+    uint32_t crc;
+    memcpy(&crc, stored + length - 4, 4);
+    if (crc != crc32(stored, length - 4) || !load(stored, length - 4))
+    {
+        Serial.println("[Rules] Stored rules are corrupt, ignoring them");
+        return;
+    }
+    Serial.printf("[Rules] %u loaded\n", (unsigned)ruleCount);
+}
+
+bool RuleEngine::replace(const uint8_t *program, size_t length)
+{
+    if (length > RULE_PROGRAM_MAX_SIZE || !load(program, length))
+        return false;
+
+    uint8_t stored[RULE_PROGRAM_MAX_SIZE + 4];
+    memcpy(stored, program, length);
+    const uint32_t crc = crc32(program, length);
+    memcpy(stored + length, &crc, 4);
+    {
+        NvsLock lock;
+        preferences->putBytes(RULES_KEY, stored, length + 4);
+    }
+    Serial.printf("[Rules] %u stored\n", (unsigned)ruleCount);
+    return true;
+}
+
+bool RuleEngine::check(const uint8_t *program, size_t length) const
+{
+    Rule resolved[MAX_RULES];
+    uint8_t count;
+    TimeZone checked;
+    return length <= RULE_PROGRAM_MAX_SIZE && resolve(program, length, resolved, count, checked);
+}
+
+// Decodes the program, resolves default channels and checks the rest
+// against the layout.
+bool RuleEngine::resolve(const uint8_t *program, size_t length, Rule *resolved, uint8_t &count, TimeZone &zone) const
+{
+    if (!decodeRules(program, length, resolved, count, zone))
+        return false;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        Rule &rule = resolved[i];
+        if (rule.channel == DEFAULT_CHANNEL)
+            rule.channel = actuators->primary(rule.kind == RuleKind::WaterEmpty ? ActuatorKind::Relay : ActuatorKind::Pwm);
+        if (rule.channel >= actuators->count())
+            return false;
+    }
+    return true;
+}
+
+bool RuleEngine::load(const uint8_t *program, size_t length)
+{
+    Rule loaded[MAX_RULES];
+    uint8_t count;
+    TimeZone loadedZone;
+    if (!resolve(program, length, loaded, count, loadedZone))
+        return false;
+
+    memcpy(rules, loaded, sizeof(loaded));
+    ruleCount = count;
+    zone = loadedZone;
+    holding = 0;
+    return true;
+}
+
+bool RuleEngine::usesClock() const
+{
+    for (uint8_t i = 0; i < ruleCount; i++)
+    {
+        if (rules[i].kind == RuleKind::TimeWindow)
+            return true;
+    }
+    return false;
+}
+
+uint16_t RuleEngine::evaluate(const DeviceState &state, uint32_t epoch, uint8_t *ceilings)
+{
+    memset(ceilings, 100, MAX_ACTUATOR_CHANNELS);
+
+    uint16_t capping = 0;
+    for (uint8_t i = 0; i < ruleCount; i++)
+    {
+        const Rule &rule = rules[i];
+        const uint16_t bit = 1 << i;
+        uint8_t cap = 100;
+
+        switch (rule.kind)
+        {
+        case RuleKind::WaterEmpty:
+            if (state.waterEmpty)
+                cap = rule.level;
+            break;
+
+        case RuleKind::TemperatureAbove:
+        case RuleKind::TemperatureBelow:
+        {
+            const float c = rule.probe < state.temperatureSensorCount ? state.temperaturesC[rule.probe] : NAN;
+            if (isnan(c))
+            {
+                holding &= ~bit; // A lost probe releases the rule
+                break;
+            }
+            // Past the threshold to engage; back past it by the hysteresis to release
+            const int32_t reading = (int32_t)lroundf(c * 100);
+            const int32_t margin = (holding & bit) ? rule.b : 0;
+            const bool past = rule.kind == RuleKind::TemperatureAbove ? reading > rule.a - margin
+                                                                      : reading < rule.a + margin;
+            holding = past ? holding | bit : holding & ~bit;
+            if (past)
+                cap = rule.level;
+            break;
+        }
+
+        case RuleKind::TimeWindow:
+            if (epoch)
+                cap = windowCap(rule, epoch);
+            break;
+        }
+
+        if (cap < ceilings[rule.channel])
+            ceilings[rule.channel] = cap;
+        if (cap < 100)
+            capping |= bit;
+    }
+    return capping;
+}
+
+uint8_t RuleEngine::windowCap(const Rule &rule, uint32_t epoch) const
+{
+    const uint32_t day = MINUTES_PER_DAY * 60;
+    const uint32_t local = (uint32_t)(((int64_t)epoch + localOffset(zone, epoch)) % day);
+    const uint32_t from = (uint32_t)rule.a * 60;
+    const uint32_t length = ((uint32_t)rule.b * 60 + day - from) % day; // Seconds; from == to is empty
+    const uint32_t into = (local + day - from) % day;
+    if (into >= length)
+        return 0;
+
+    // Linear from 0 at either edge up to `level` after `ramp` minutes
+    const uint32_t ramp = (uint32_t)rule.ramp * 60;
+    const uint32_t edge = into < length - into ? into : length - into;
+    if (ramp == 0 || edge >= ramp)
+        return rule.level;
+    return (uint8_t)(rule.level * edge / ramp);
+}
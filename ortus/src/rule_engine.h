@@ -0,0 +1,125 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Preferences.h>
+
+#include "types.h"
+#include "actuators.h"
+
+// Local rules limit what the channels output, so interlocks hold without
+// the network. A rule in force caps its channel at `level` percent; with
+// several in force the lowest cap wins. Commanded levels are kept as they
+// are (and stay in the state), so a channel picks up where it was once its
+// rules let go.
+//
+//   WaterEmpty        in force while the float switch reads empty
+//   TemperatureAbove  in force above `threshold` (probe `probe`), until the
+//                     reading drops `hysteresis` below it again
+//   TemperatureBelow  the same, mirrored
+//   TimeWindow        daily window from `from` to `to` (minutes after local
+//                     midnight; it may wrap): capped at `level`, ramping up
+//                     from 0 over the first `ramp` minutes and back down over
+//                     the last; 0 outside. Needs the clock; not in force
+//                     while the time is unknown. Local time follows the
+//                     program's TimeZone, daylight saving included.
+//
+// Stored and sent as a program:
+//   u8  version (RULES_VERSION)
+//   i16 utcOffset, standard time in minutes east of UTC
+//   i16 dstShift, minutes added during daylight saving (0: none)
+//   dstStart, then dstEnd: u8 month, u8 week, u8 weekday, i16 minute
+//   u8  count (at most MAX_RULES)
+//   count x:
+//     u8 kind (RuleKind), u8 channel (DEFAULT_CHANNEL: the first relay for
+//     WaterEmpty, the first light otherwise), u8 level,
+//     u8 probe, i16 threshold and i16 hysteresis (hundredths of a degree C)
+//     or u16 from and u16 to, u16 ramp (minutes)
+// Integers are little-endian. Version 1 programs (i16 utcOffset, u8 count,
+// then the rules) are still read from flash.
+constexpr uint8_t RULES_VERSION = 2;
+
+enum class RuleKind : uint8_t
+{
+    WaterEmpty = 1,
+    TemperatureAbove = 2,
+    TemperatureBelow = 3,
+    TimeWindow = 4
+};
+
+struct Rule
+{
+    RuleKind kind = RuleKind::WaterEmpty;
+    uint8_t channel = DEFAULT_CHANNEL;
+    uint8_t level = 0;
+    uint8_t probe = 0;
+    int16_t a = 0; // threshold or from
+    int16_t b = 0; // hysteresis or to
+    uint16_t ramp = 0;
+};
+
+// A yearly daylight saving change, as POSIX TZ "Mm.w.d/time": weekday
+// `weekday` (0 is Sunday) of week `week` (1-5, 5 being the last) of
+// `month` (1-12), at `minute` of local time that day (may fall outside
+// 0-1439 to reach a neighbouring day).
+struct DstTransition
+{
+    uint8_t month = 0;
+    uint8_t week = 0;
+    uint8_t weekday = 0;
+    int16_t minute = 0;
+};
+
+struct TimeZone
+{
+    int16_t utcOffset = 0; // Standard time, minutes east of UTC
+    int16_t dstShift = 0;  // Added between dstStart and dstEnd; 0 for none
+    DstTransition dstStart;
+    DstTransition dstEnd;
+};
+
+// Reads a POSIX TZ string such as "CET-1CEST,M3.5.0,M10.5.0/3". A zone
+// with daylight saving must give both transitions, in the Mm.w.d form.
+bool parseTimeZone(const char *posix, TimeZone &zone);
+// Seconds east of UTC in effect at Unix time `epoch`.
+int32_t localOffset(const TimeZone &zone, uint32_t epoch);
+
+// Returns the encoded length, 0 if `size` is too small.
+size_t encodeRules(const Rule *rules, uint8_t count, const TimeZone &zone, uint8_t *out, size_t size);
+// False if the program is malformed; channels are not checked.
+bool decodeRules(const uint8_t *program, size_t length, Rule *rules, uint8_t &count, TimeZone &zone);
+
+// Control task only.
+class RuleEngine
+{
+public:
+    // Loads the stored program; `preferences` must already be open.
+    void begin(Preferences &preferences, const ActuatorEngine &actuators);
+
+    // Validates and stores a new program, replacing every rule. False (and
+    // nothing changed) if it is malformed or names a channel that does not
+    // exist.
+    bool replace(const uint8_t *program, size_t length);
+    // Whether replace() would take the program.
+    bool check(const uint8_t *program, size_t length) const;
+
+    uint8_t count() const { return ruleCount; }
+    // Whether any rule depends on the time of day.
+    bool usesClock() const;
+
+    // Fills `ceilings` (one per channel, 100 when unlimited) for `state` at
+    // Unix time `epoch` (0 when unknown). Returns one bit per rule that
+    // currently caps its channel below 100.
+    uint16_t evaluate(const DeviceState &state, uint32_t epoch, uint8_t *ceilings);
+
+private:
+    Preferences *preferences = nullptr;
+    const ActuatorEngine *actuators = nullptr;
+    Rule rules[MAX_RULES];
+    uint8_t ruleCount = 0;
+    TimeZone zone;
+    uint16_t holding = 0; // Temperature rules past their threshold
+
+    bool load(const uint8_t *program, size_t length);
+    bool resolve(const uint8_t *program, size_t length, Rule *resolved, uint8_t &count, TimeZone &zone) const;
+    uint8_t windowCap(const Rule &rule, uint32_t epoch) const;
+};
@@ -0,0 +1,183 @@
+#include "sensor_history.h"
+#include "binary_protocol.h"
+
+namespace
+{
+    constexpr size_t KEYFRAME_MAX_SIZE = 4 + 1 + 2 * MAX_TEMP_SENSORS + 1;
+    constexpr size_t RECORD_MAX_SIZE = 5 + 5 * MAX_TEMP_SENSORS;
+    static_assert(KEYFRAME_MAX_SIZE + RECORD_MAX_SIZE <= HISTORY_BLOCK_SIZE, "Block too small");
+
+    size_t putVarint(uint8_t *out, uint32_t v)
+    {
+        size_t n = 0;
+        while (v >= 0x80)
+        {
+            out[n++] = (uint8_t)(v | 0x80);
+            v >>= 7;
+        }
+        out[n++] = (uint8_t)v;
+        return n;
+    }
+
+    uint32_t zigzag(int32_t v) { return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31); }
+
+    void putU32(uint8_t *out, uint32_t v)
+    {
+        out[0] = (uint8_t)v;
+        out[1] = (uint8_t)(v >> 8);
+        out[2] = (uint8_t)(v >> 16);
+        out[3] = (uint8_t)(v >> 24);
+    }
+}
+
+void SensorHistory::begin(size_t psramBlocks, size_t ramBlocks)
+{
+    const char *where = "PSRAM";
+    if (psramFound())
+    {
+        blocks = (uint8_t *)ps_malloc(psramBlocks * HISTORY_BLOCK_SIZE);
+        capacity = psramBlocks;
+    }
+    if (!blocks)
+    {
+        where = "RAM";
+        blocks = (uint8_t *)malloc(ramBlocks * HISTORY_BLOCK_SIZE);
+        capacity = ramBlocks;
+    }
+    lengths = blocks ? (uint8_t *)calloc(capacity, 1) : nullptr;
+    if (!lengths)
+    {
+        free(blocks);
+        blocks = nullptr;
+        capacity = 0;
+        Serial.println("[History] No memory, history disabled");
+        return;
+    }
+
+    Serial.printf("[History] %u blocks in %s\n", (unsigned)capacity, where);
+}
+
+void SensorHistory::record(uint32_t seconds, const float *temperaturesC, uint8_t sensorCount, bool waterEmpty)
+{
+    if (capacity == 0)
+        return;
+
+    int16_t temperatures[MAX_TEMP_SENSORS];
+    const uint8_t count = sensorCount < MAX_TEMP_SENSORS ? sensorCount : MAX_TEMP_SENSORS;
+    for (uint8_t i = 0; i < count; i++)
+        temperatures[i] = encodeTemperature(temperaturesC[i]);
+
+    // A new probe layout needs a new keyframe
+    if (!open || count != lastCount || seconds < lastSeconds)
+    {
+        if (open)
+            closeBlock();
+        startBlock(seconds, temperatures, count, waterEmpty);
+        return;
+    }
+
+    uint8_t record[RECORD_MAX_SIZE];
+    size_t n = putVarint(record, ((seconds - lastSeconds) << 1) | (waterEmpty != lastWater ? 1 : 0));
+    for (uint8_t i = 0; i < count; i++)
+        n += putVarint(record + n, zigzag((int32_t)temperatures[i] - lastTemperatures[i]));
+
+    uint8_t &used = lengths[openSeq % capacity];
+    if (used + n > HISTORY_BLOCK_SIZE)
+    {
+        closeBlock();
+        startBlock(seconds, temperatures, count, waterEmpty);
+        return;
+    }
+    memcpy(block(openSeq) + used, record, n);
+    used += n;
+
+    lastSeconds = seconds;
+    memcpy(lastTemperatures, temperatures, count * sizeof(int16_t));
+    lastWater = waterEmpty;
+}
+
+void SensorHistory::closeIfOlder(uint32_t seconds, uint32_t maxAgeSeconds)
+{
+    if (open && seconds - openedAt >= maxAgeSeconds)
+        closeBlock();
+}
+
+void SensorHistory::startBlock(uint32_t seconds, const int16_t *temperatures, uint8_t count, bool waterEmpty)
+{
+    // The open block takes the slot of the oldest one once the ring is full
+    portENTER_CRITICAL(&lock);
+    if (openSeq - firstSeq >= capacity)
+    {
+        dropped += openSeq - firstSeq - capacity + 1;
+        firstSeq = openSeq - capacity + 1;
+    }
+    portEXIT_CRITICAL(&lock);
+
+    uint8_t *out = block(openSeq);
+    size_t n = 0;
+    putU32(out, seconds);
+    n += 4;
+    out[n++] = count;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        out[n++] = (uint8_t)temperatures[i];
+        out[n++] = (uint8_t)((uint16_t)temperatures[i] >> 8);
+    }
+    out[n++] = waterEmpty;
+    lengths[openSeq % capacity] = n;
+
+    open = true;
+    openedAt = seconds;
+    lastSeconds = seconds;
+    lastCount = count;
+    memcpy(lastTemperatures, temperatures, count * sizeof(int16_t));
+    lastWater = waterEmpty;
+}
+
+void SensorHistory::closeBlock()
+{
+    portENTER_CRITICAL(&lock);
+    openSeq++;
+    portEXIT_CRITICAL(&lock);
+    open = false;
+}
+
+size_t SensorHistory::encodeBatch(uint8_t *out, size_t size, uint32_t bootEpoch, uint32_t &endSeq)
+{
+    if (capacity == 0 || size < HISTORY_BATCH_HEADER_SIZE)
+        return 0;
+
+    size_t pos = HISTORY_BATCH_HEADER_SIZE;
+    uint8_t count = 0;
+    portENTER_CRITICAL(&lock);
+    const uint32_t first = firstSeq;
+    uint32_t seq = first;
+    for (; seq != openSeq && count < UINT8_MAX; seq++, count++)
+    {
+        const uint8_t length = lengths[seq % capacity];
+        if (pos + 1 + length > size)
+            break;
+        out[pos++] = length;
+        memcpy(out + pos, block(seq), length);
+        pos += length;
+    }
+    portEXIT_CRITICAL(&lock);
+
+    if (count == 0)
+        return 0;
+    out[0] = HISTORY_FORMAT_VERSION;
+    putU32(out + 1, bootEpoch);
+    putU32(out + 5, first);
+    out[9] = count;
+    endSeq = seq;
+    return pos;
+}
+
+void SensorHistory::release(uint32_t endSeq)
+{
+    portENTER_CRITICAL(&lock);
+    // Blocks may have been dropped while the batch was in flight
+    if ((int32_t)(endSeq - firstSeq) > 0)
+        firstSeq = endSeq;
+    portEXIT_CRITICAL(&lock);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "types.h"
+
+// Ring of sensor samples kept on the device so readings taken while MQTT
+// is down still reach the backend. Samples are packed into fixed-size
+// blocks; the ring holds whole blocks and drops the oldest when full.
+//
+// Block (HISTORY_BLOCK_SIZE bytes at most, all integers little-endian):
+//   keyframe: u32 seconds since boot, u8 probe count,
+//             count x i16 temperature (see encodeTemperature()), u8 waterEmpty
+//   then records, each relative to the previous sample:
+//     varint (elapsed seconds << 1 | water level flipped),
+//     count x zigzag varint temperature delta
+//
+// Upload batch (ortus/<mac>/history):
+//   u8  HISTORY_FORMAT_VERSION
+//   u32 Unix time at boot, 0 if unknown (sample time = this + seconds)
+//   u32 sequence number of the first block; blocks are consecutive
+//   u8  block count, then per block: u8 length, block bytes
+constexpr uint8_t HISTORY_FORMAT_VERSION = 1;
+constexpr size_t HISTORY_BLOCK_SIZE = 128;
+constexpr size_t HISTORY_BATCH_HEADER_SIZE = 10;
+
+class SensorHistory
+{
+public:
+    // Allocates room for `psramBlocks` blocks in PSRAM, or `ramBlocks` in
+    // internal RAM on modules without it.
+    void begin(size_t psramBlocks, size_t ramBlocks);
+
+    // Control task. Appends a sample taken `seconds` after boot.
+    void record(uint32_t seconds, const float *temperaturesC, uint8_t sensorCount, bool waterEmpty);
+    // Control task. Makes the open block uploadable once it spans
+    // `maxAgeSeconds`, so quiet periods still reach the backend.
+    void closeIfOlder(uint32_t seconds, uint32_t maxAgeSeconds);
+
+    // Network task. Encodes the oldest finished blocks that fit in `size`
+    // bytes; returns the length (0 if there is nothing to send) and sets
+    // `endSeq` to pass to release() once the batch is delivered.
+    size_t encodeBatch(uint8_t *out, size_t size, uint32_t bootEpoch, uint32_t &endSeq);
+    // Network task. Forgets every block before `endSeq`.
+    void release(uint32_t endSeq);
+
+    uint32_t droppedBlocks() const { return dropped; }
+
+private:
+    static_assert(HISTORY_BLOCK_SIZE <= 255, "Block lengths are sent as u8");
+
+    uint8_t *blocks = nullptr;     // capacity x HISTORY_BLOCK_SIZE
+    uint8_t *lengths = nullptr;    // Used bytes per block
+    uint32_t capacity = 0;
+    // Block sequence numbers; block `seq` lives at index seq % capacity.
+    // [firstSeq, openSeq) are finished, openSeq is being written.
+    uint32_t firstSeq = 0;
+    uint32_t openSeq = 0;
+    uint32_t dropped = 0;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+    // Writer state for the open block (control task only)
+    bool open = false;
+    uint32_t openedAt = 0;
+    uint32_t lastSeconds = 0;
+    uint8_t lastCount = 0;
+    int16_t lastTemperatures[MAX_TEMP_SENSORS];
+    bool lastWater = false;
+
+    void startBlock(uint32_t seconds, const int16_t *temperatures, uint8_t count, bool waterEmpty);
+    void closeBlock();
+    uint8_t *block(uint32_t seq) { return blocks + (size_t)(seq % capacity) * HISTORY_BLOCK_SIZE; }
+};
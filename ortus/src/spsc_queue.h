@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+// Lock-free single-producer/single-consumer ring buffer. Exactly one task
+// may call push(), slot() and commit(), and exactly one (other) task pop(),
+// peek() and drop(). Holds up to Capacity - 1 items; Capacity must be a
+// power of two.
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    // Returns false (and drops nothing) when the queue is full.
+    bool push(const T &item)
+    {
+        const size_t head = this->head.load(std::memory_order_relaxed);
+        const size_t next = (head + 1) & (Capacity - 1);
+        if (next == tail.load(std::memory_order_acquire))
+            return false;
+        items[head] = item;
+        this->head.store(next, std::memory_order_release);
+        const size_t depth = (next - tail.load(std::memory_order_relaxed)) & (Capacity - 1);
+        if (depth > deepest.load(std::memory_order_relaxed))
+            deepest.store(depth, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Fills items in place and hands them over together: slot(i) is the
+    // i-th free slot (nullptr past the free space), and commit(n) makes the
+    // first n visible to the consumer at once.
+    T *slot(size_t index)
+    {
+        const size_t head = this->head.load(std::memory_order_relaxed);
+        const size_t free = (tail.load(std::memory_order_acquire) - head - 1) & (Capacity - 1);
+        return index < free ? &items[(head + index) & (Capacity - 1)] : nullptr;
+    }
+
+    void commit(size_t count)
+    {
+        const size_t next = (this->head.load(std::memory_order_relaxed) + count) & (Capacity - 1);
+        this->head.store(next, std::memory_order_release);
+        const size_t depth = (next - tail.load(std::memory_order_relaxed)) & (Capacity - 1);
+        if (depth > deepest.load(std::memory_order_relaxed))
+            deepest.store(depth, std::memory_order_relaxed);
+    }
+
+    bool pop(T &item)
+    {
+        const size_t tail = this->tail.load(std::memory_order_relaxed);
+        if (tail == head.load(std::memory_order_acquire))
+            return false;
+        item = items[tail];
+        this->tail.store((tail + 1) & (Capacity - 1), std::memory_order_release);
+        return true;
+    }
+
+    // The i-th queued item, read in place until drop(); nullptr if fewer
+    // are queued.
+    const T *peek(size_t index) const
+    {
+        const size_t tail = this->tail.load(std::memory_order_relaxed);
+        const size_t queued = (head.load(std::memory_order_acquire) - tail) & (Capacity - 1);
+        return index < queued ? &items[(tail + index) & (Capacity - 1)] : nullptr;
+    }
+
+    void drop(size_t count)
+    {
+        this->tail.store((this->tail.load(std::memory_order_relaxed) + count) & (Capacity - 1),
+                         std::memory_order_release);
+    }
+
+    bool empty() const { return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire); }
+
+    // For diagnostics from any task: items queued now (approximate) and the
+    // most ever queued at once.
+    size_t size() const
+    {
+        return (head.load(std::memory_order_relaxed) - tail.load(std::memory_order_relaxed)) & (Capacity - 1);
+    }
+    size_t peak() const { return deepest.load(std::memory_order_relaxed); }
+
+private:
+    T items[Capacity];
+    std::atomic<size_t> head{0};
+    std::atomic<size_t> tail{0};
+    std::atomic<size_t> deepest{0}; // Written by the producer only
+};
@@ -0,0 +1,270 @@
+#include "state_store.h"
+#include "crc32.h"
+#include "monotonic.h"
+#include "nvs_lock.h"
+#include <esp_attr.h>
+#include <esp32s3/rtc.h>
+
+namespace
+{
+    constexpr const char *BLOB_KEY = "state";
+
+    // Keys of the one-record-per-field layout used before the blob
+    constexpr const char *LEGACY_KEYS[] = {
+        "brightness", "lCycleActive", "lCycleOn", "lCycleOff", "cycleActive", "cycleOn", "cycleOff"};
+
+    constexpr uint32_t CHECKPOINT_MAGIC = 0x4F525443; // "ORTC"
+
+    // Blob layout 1, before cycles kept their phase
+    struct ChannelV1
+    {
+        uint8_t level;
+        uint8_t cycleActive;
+        uint32_t cycleOnSeconds;
+        uint32_t cycleOffSeconds;
+    };
+
+    struct BlobV1
+    {
+        uint8_t version;
+        uint8_t channelCount;
+        ChannelV1 channels[MAX_ACTUATOR_CHANNELS];
+        uint32_t crc;
+    };
+
+    void channelKey(char *key, size_t size, uint8_t index)
+    {
+        snprintf(key, size, "ch%u", index);
+    }
+}
+
+RTC_NOINIT_ATTR StateStore::Checkpoint StateStore::checkpoint;
+
+void StateStore::begin(Preferences &preferences, const ActuatorEngine &actuators)
+{
+    this->preferences = &preferences;
+    this->actuators = &actuators;
+    lock = xSemaphoreCreateMutexStatic(&lockBuffer);
+    // Blobs are compared bytewise, padding included
+    memset(&staged, 0, sizeof(staged));
+    memset(&stored, 0, sizeof(stored));
+}
+
+void StateStore::load(DeviceState &state, CycleResume &resume)
+{
+    Blob blob;
+    if (loadBlob(blob))
+        decode(blob, state, resume);
+    else if (loadLegacy(state))
+        Serial.println("[Store] Migrating per-key state to blob");
+
+    // Also newer than flash if a save was still pending at the reset
+    if (loadCheckpoint(state, resume))
+        Serial.println("[Store] Resumed from RTC checkpoint");
+}
+
+bool StateStore::loadBlob(Blob &blob)
+{
+    const size_t length = preferences->getBytesLength(BLOB_KEY);
+    if (length == sizeof(Blob))
+    {
+        preferences->getBytes(BLOB_KEY, &blob, sizeof(blob));
+        if (blob.version == VERSION && blob.crc == crc32((const uint8_t *)&blob, offsetof(Blob, crc)))
+        {
+            memcpy(&stored, &blob, sizeof(blob));
+            return true;
+        }
+    }
+    else if (length == sizeof(BlobV1))
+    {
+        // Converted but not marked as stored, so the next flush rewrites it
+        BlobV1 old;
+        preferences->getBytes(BLOB_KEY, &old, sizeof(old));
+        if (old.version == 1 && old.crc == crc32((const uint8_t *)&old, offsetof(BlobV1, crc)))
+        {
+            memset(&blob, 0, sizeof(blob));
+            blob.version = VERSION;
+            blob.channelCount = old.channelCount;
+            for (uint8_t i = 0; i < old.channelCount && i < MAX_ACTUATOR_CHANNELS; i++)
+            {
+                blob.channels[i].level = old.channels[i].level;
+                blob.channels[i].cycleActive = old.channels[i].cycleActive;
+                blob.channels[i].cycleOnSeconds = old.channels[i].cycleOnSeconds;
+                blob.channels[i].cycleOffSeconds = old.channels[i].cycleOffSeconds;
+            }
+            return true;
+        }
+    }
+    else if (length == 0)
+    {
+        return false;
+    }
+
+    Serial.println("[Store] Stored state is corrupt, ignoring it");
+    return false;
+}
+
+bool StateStore::loadCheckpoint(DeviceState &state, CycleResume &resume)
+{
+    // RTC memory holds garbage after power-on
+    const uint64_t now = esp_rtc_get_time_us();
+    if (checkpoint.magic != CHECKPOINT_MAGIC ||
+        checkpoint.crc != crc32((const uint8_t *)&checkpoint, offsetof(Checkpoint, crc)) ||
+        checkpoint.blob.channelCount != actuators->count() || now < checkpoint.savedAt)
+        return false;
+
+    decode(checkpoint.blob, state, resume);
+    const uint32_t elapsed = (now - checkpoint.savedAt) / 1000000;
+    for (uint8_t i = 0; i < actuators->count(); i++)
+        resume.positions[i] = checkpoint.positions[i] + elapsed;
+    resume.epoch = checkpoint.epoch ? checkpoint.epoch + elapsed : 0;
+    return true;
+}
+
+void StateStore::decode(const Blob &blob, DeviceState &state, CycleResume &resume) const
+{
+    uint8_t count = blob.channelCount < actuators->count() ? blob.channelCount : actuators->count();
+    for (uint8_t i = 0; i < count; i++)
+    {
+        ChannelState &channel = state.channels[i];
+        channel.level = blob.channels[i].level;
+        channel.cycleActive = blob.channels[i].cycleActive;
+        channel.cycleOnSeconds = blob.channels[i].cycleOnSeconds;
+        channel.cycleOffSeconds = blob.channels[i].cycleOffSeconds;
+        channel.cycleAnchor = blob.channels[i].cycleAnchor;
+        resume.positions[i] = blob.channels[i].cyclePosition;
+    }
+}
+
+bool StateStore::loadLegacy(DeviceState &state)
+{
+    const uint8_t light = actuators->primary(ActuatorKind::Pwm);
+    const uint8_t pump = actuators->primary(ActuatorKind::Relay);
+    bool found = false;
+    for (uint8_t i = 0; i < actuators->count(); i++)
+    {
+        ChannelState &channel = state.channels[i];
+        char key[8];
+        channelKey(key, sizeof(key), i);
+
+        ChannelV1 record; // "ch<i>" records share the layout 1 channel
+        if (preferences->getBytes(key, &record, sizeof(record)) == sizeof(record))
+        {
+            channel.level = record.level;
+            channel.cycleActive = record.cycleActive;
+            channel.cycleOnSeconds = record.cycleOnSeconds;
+            channel.cycleOffSeconds = record.cycleOffSeconds;
+            found = true;
+        }
+        else if (i == light && preferences->isKey("brightness"))
+        {
+            channel.level = preferences->getInt("brightness", 0);
+            channel.cycleActive = preferences->getBool("lCycleActive", false);
+            channel.cycleOnSeconds = preferences->getULong("lCycleOn", 0);
+            channel.cycleOffSeconds = preferences->getULong("lCycleOff", 0);
+            found = true;
+        }
+        else if (i == pump && preferences->isKey("cycleActive"))
+        {
+            channel.cycleActive = preferences->getBool("cycleActive", false);
+            channel.cycleOnSeconds = preferences->getULong("cycleOn", 0);
+            channel.cycleOffSeconds = preferences->getULong("cycleOff", 0);
+            found = true;
+        }
+    }
+    return found;
+}
+
+void StateStore::encode(const DeviceState &state, Blob &blob) const
+{
+    memset(&blob, 0, sizeof(blob));
+    blob.version = VERSION;
+    blob.channelCount = actuators->count();
+    for (uint8_t i = 0; i < blob.channelCount; i++)
+    {
+        const ChannelState &channel = state.channels[i];
+        Channel &out = blob.channels[i];
+        // Cycle phases come back from the anchor after boot, so toggles
+        // never need a write
+        if (actuators->kind(i) == ActuatorKind::Pwm && !channel.cycleActive)
+            out.level = channel.level;
+        out.cycleActive = channel.cycleActive;
+        out.cycleOnSeconds = channel.cycleOnSeconds;
+        out.cycleOffSeconds = channel.cycleOffSeconds;
+        if (channel.cycleActive)
+        {
+            out.cycleAnchor = channel.cycleAnchor;
+            if (channel.cycleAnchor == 0)
+                out.cyclePosition = actuators->cyclePosition(i);
+        }
+    }
+    blob.crc = crc32((const uint8_t *)&blob, offsetof(Blob, crc));
+}
+
+bool StateStore::stage(const DeviceState &state, uint32_t epoch)
+{
+    Blob blob;
+    encode(state, blob);
+    xSemaphoreTake(lock, portMAX_DELAY);
+    memcpy(&staged, &blob, sizeof(blob));
+
+    // RAM only, so this is cheap enough for every change
+    Checkpoint next;
+    memset(&next, 0, sizeof(next));
+    next.magic = CHECKPOINT_MAGIC;
+    // Taken back to the start of the current second, which is when `epoch`
+    // (whole seconds of monotonicMicros()) ticked over, so the elapsed time
+    // added on resume cannot come out a second short
+    next.savedAt = esp_rtc_get_time_us() - monotonicMicros() % 1000000;
+    next.epoch = epoch;
+    for (uint8_t i = 0; i < actuators->count(); i++)
+        next.positions[i] = state.channels[i].cycleActive ? actuators->cyclePosition(i) : 0;
+    memcpy(&next.blob, &blob, sizeof(blob));
+    next.crc = crc32((const uint8_t *)&next, offsetof(Checkpoint, crc));
+    memcpy(&checkpoint, &next, sizeof(next));
+
+    const bool due = memcmp(&blob, &stored, sizeof(blob)) != 0;
+    xSemaphoreGive(lock);
+    return due;
+}
+
+void StateStore::flush()
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    write();
+    xSemaphoreGive(lock);
+}
+
+void StateStore::write()
+{
+    // Nothing staged yet, or flash already matches
+    if (staged.version != VERSION || memcmp(&staged, &stored, sizeof(staged)) == 0)
+        return;
+
+    NvsLock nvs;
+    if (preferences->putBytes(BLOB_KEY, &staged, sizeof(staged)) != sizeof(staged))
+    {
+        Serial.println("[Store] Failed to write state");
+        return;
+    }
+    bool migrated = stored.version == 0;
+    memcpy(&stored, &staged, sizeof(staged));
+
+    // The blob supersedes the old records; drop them so a damaged blob can
+    // never fall back to stale values
+    if (migrated)
+    {
+        for (const char *key : LEGACY_KEYS)
+        {
+            if (preferences->isKey(key))
+                preferences->remove(key);
+        }
+        for (uint8_t i = 0; i < MAX_ACTUATOR_CHANNELS; i++)
+        {
+            char key[8];
+            channelKey(key, sizeof(key), i);
+            if (preferences->isKey(key))
+                preferences->remove(key);
+        }
+    }
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "types.h"
+#include "actuators.h"
+
+// Where running cycles were when the state was last saved, as recovered by
+// StateStore::load().
+struct CycleResume
+{
+    // Unix time now, 0 if unknown. Only an RTC checkpoint can provide it
+    // before SNTP syncs.
+    uint32_t epoch = 0;
+    // Seconds into each channel's on+off period
+    uint32_t positions[MAX_ACTUATOR_CHANNELS] = {};
+};
+
+// Persists the channel part of DeviceState as one versioned, CRC-checked
+// NVS blob. stage() only records what should be on flash; flush() writes
+// it, and only if it differs from what was last written, so a burst of
+// commands costs one flash write and unchanged state costs none.
+//
+// Every stage() also leaves a checkpoint in RTC memory, which survives
+// software resets (OTA, panics, watchdog) but not power loss, so a warm
+// boot resumes from the latest state and exact cycle positions.
+class StateStore
+{
+public:
+    // `preferences` must already be open on the device namespace.
+    void begin(Preferences &preferences, const ActuatorEngine &actuators);
+
+    // Fills the persisted fields of `state` from the RTC checkpoint or flash,
+    // falling back to the per-key records of older firmware. Leaves `state`
+    // untouched if none exists.
+    void load(DeviceState &state, CycleResume &resume);
+
+    // Control task. Records the persisted part of `state`; `epoch` is the
+    // current Unix time or 0. Returns true if flash is now out of date and
+    // a flush() is due.
+    bool stage(const DeviceState &state, uint32_t epoch);
+
+    // Writes the staged state if it is newer than flash. Safe to call from
+    // any task, including the shutdown handler: stage() and flush() hold
+    // `lock` throughout, so two flushes cannot interleave.
+    void flush();
+
+private:
+    static constexpr uint8_t VERSION = 2;
+
+    struct Channel
+    {
+        uint8_t level; // PWM channels outside a cycle only; relays boot off
+        uint8_t cycleActive;
+        uint32_t cycleOnSeconds;
+        uint32_t cycleOffSeconds;
+        uint32_t cycleAnchor;
+        // Position when there is no anchor; refreshed by the periodic
+        // checkpoint so a cold boot without SNTP loses little of the phase
+        uint32_t cyclePosition;
+    };
+
+    struct Blob
+    {
+        uint8_t version;
+        uint8_t channelCount;
+        Channel channels[MAX_ACTUATOR_CHANNELS];
+        uint32_t crc; // CRC-32 of everything above
+    };
+
+    // RTC memory copy of the latest staged state
+    struct Checkpoint
+    {
+        uint32_t magic;
+        uint64_t savedAt; // esp_rtc_get_time_us(), keeps counting across resets
+        uint32_t epoch;   // Unix time at savedAt, 0 if unknown
+        uint32_t positions[MAX_ACTUATOR_CHANNELS];
+        Blob blob;
+        uint32_t crc;
+    };
+    static Checkpoint checkpoint;
+
+    Preferences *preferences = nullptr;
+    const ActuatorEngine *actuators = nullptr;
+    Blob staged;
+    Blob stored; // Last blob read from or written to flash
+    StaticSemaphore_t lockBuffer;
+    SemaphoreHandle_t lock = nullptr;
+
+    // flush() with `lock` held
+    void write();
+    void encode(const DeviceState &state, Blob &blob) const;
+    void decode(const Blob &blob, DeviceState &state, CycleResume &resume) const;
+    bool loadBlob(Blob &blob);
+    bool loadCheckpoint(DeviceState &state, CycleResume &resume);
+    bool loadLegacy(DeviceState &state);
+};
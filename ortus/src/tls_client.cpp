@@ -0,0 +1,229 @@
+#include "tls_client.h"
+#include "crc32.h"
+#include <esp_attr.h>
+
+namespace
+{
+    constexpr uint32_t SESSION_MAGIC = 0x4F525453; // "ORTS"
+}
+
+RTC_NOINIT_ATTR TlsClient::SavedSession TlsClient::saved;
+
+void TlsClient::begin(const char *caPem)
+{
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&drbg);
+    mbedtls_x509_crt_init(&ca);
+    mbedtls_ssl_config_init(&conf);
+    mbedtls_ssl_session_init(&session);
+
+    // Parsed once here; every connection verifies against this chain
+    if (mbedtls_x509_crt_parse(&ca, (const unsigned char *)caPem, strlen(caPem) + 1) != 0)
+    {
+        Serial.println("[TLS] Invalid CA certificate");
+        return;
+    }
+    if (mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, nullptr, 0) != 0 ||
+        mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT) != 0)
+    {
+        Serial.println("[TLS] Setup failed");
+        return;
+    }
+    mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    mbedtls_ssl_conf_ca_chain(&conf, &ca, nullptr);
+    mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &drbg);
+    configured = true;
+    restoreSession();
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port)
+{
+    return connect(ip.toString().c_str(), port);
+}
+
+int TlsClient::connect(const char *host, uint16_t port)
+{
+    stop();
+    if (!configured)
+        return 0;
+
+    // ESP-TLS only resolves and connects the socket (bounded by the
+    // timeout); the handshake is ours
+    const unsigned long started = millis();
+    esp_tls_cfg_t cfg = {};
+    cfg.timeout_ms = TLS_CONNECT_TIMEOUT_MS;
+    esp_tls_last_error_t error = {};
+    int fd = -1;
+    if (esp_tls_plain_tcp_connect(host, strlen(host), port, &cfg, &error, &fd) != ESP_OK)
+    {
+        Serial.println("[TLS] Connection failed");
+        return 0;
+    }
+    mbedtls_net_init(&net);
+    net.fd = fd;
+    mbedtls_net_set_nonblock(&net);
+
+    mbedtls_ssl_init(&ssl);
+    if (!handshake(host, started))
+    {
+        Serial.println("[TLS] Handshake failed");
+        mbedtls_ssl_free(&ssl);
+        mbedtls_net_free(&net);
+        return 0;
+    }
+    open = true;
+    Serial.printf("[TLS] Connected in %lu ms%s\n", millis() - started, haveSession ? " (session offered)" : "");
+    keepSession();
+    return 1;
+}
+
+bool TlsClient::handshake(const char *host, unsigned long started)
+{
+    if (mbedtls_ssl_setup(&ssl, &conf) != 0 || mbedtls_ssl_set_hostname(&ssl, host) != 0)
+        return false;
+    // A session the broker no longer knows just costs a full handshake
+    if (haveSession)
+        mbedtls_ssl_set_session(&ssl, &session);
+    mbedtls_ssl_set_bio(&ssl, &net, mbedtls_net_send, mbedtls_net_recv, nullptr);
+
+    int ret;
+    while ((ret = mbedtls_ssl_handshake(&ssl)) != 0)
+    {
+        const long left = TLS_CONNECT_TIMEOUT_MS - (long)(millis() - started);
+        if (!retry(ret) || left <= 0)
+            return false;
+        // Sleep until the socket is ready rather than spinning
+        const uint32_t wanted = ret == MBEDTLS_ERR_SSL_WANT_READ ? MBEDTLS_NET_POLL_READ : MBEDTLS_NET_POLL_WRITE;
+        if (mbedtls_net_poll(&net, wanted, (uint32_t)left) < 0)
+            return false;
+    }
+    return true;
+}
+
+void TlsClient::keepSession()
+{
+    mbedtls_ssl_session_free(&session);
+    mbedtls_ssl_session_init(&session);
+    haveSession = mbedtls_ssl_get_session(&ssl, &session) == 0;
+    if (!haveSession)
+        return;
+
+    size_t length = 0;
+    if (mbedtls_ssl_session_save(&session, saved.data, sizeof(saved.data), &length) != 0)
+    {
+        saved.magic = 0;
+        return;
+    }
+    saved.magic = SESSION_MAGIC;
+    saved.length = length;
+    saved.crc = crc32(saved.data, length);
+}
+
+void TlsClient::restoreSession()
+{
+    // RTC memory holds garbage after power-on
+    if (haveSession || saved.magic != SESSION_MAGIC || saved.length > sizeof(saved.data) ||
+        saved.crc != crc32(saved.data, saved.length))
+        return;
+
+    if (mbedtls_ssl_session_load(&session, saved.data, saved.length) != 0)
+    {
+        mbedtls_ssl_session_free(&session);
+        mbedtls_ssl_session_init(&session);
+        saved.magic = 0;
+        return;
+    }
+    haveSession = true;
+    Serial.println("[TLS] Restored session from RTC");
+}
+
+void TlsClient::stop()
+{
+    if (open)
+    {
+        mbedtls_ssl_close_notify(&ssl); // Best effort; the socket is non-blocking
+        mbedtls_ssl_free(&ssl);
+        mbedtls_net_free(&net);
+        open = false;
+    }
+    peeked = -1;
+}
+
+size_t TlsClient::write(const uint8_t *buf, size_t size)
+{
+    size_t sent = 0;
+    const unsigned long started = millis();
+    while (open && sent < size)
+    {
+        int n = mbedtls_ssl_write(&ssl, buf + sent, size - sent);
+        if (n > 0)
+        {
+            sent += n;
+        }
+        else if (retry(n))
+        {
+            if (millis() - started > TLS_WRITE_TIMEOUT_MS)
+                break;
+            delay(1);
+        }
+        else
+        {
+            stop();
+        }
+    }
+    return sent;
+}
+
+// Pulls one byte off the connection into `peeked` when nothing is buffered,
+// so available() also sees records that have not been decrypted yet.
+int TlsClient::fill()
+{
+    if (!open || peeked >= 0)
+        return peeked;
+
+    uint8_t b;
+    int n = mbedtls_ssl_read(&ssl, &b, 1);
+    if (n == 1)
+        peeked = b;
+    else if (!retry(n))
+        stop(); // 0 or close_notify is a clean close by the peer
+    return peeked;
+}
+
+int TlsClient::available()
+{
+    if (fill() < 0)
+        return 0;
+    return 1 + (int)mbedtls_ssl_get_bytes_avail(&ssl);
+}
+
+int TlsClient::peek()
+{
+    return fill();
+}
+
+int TlsClient::read()
+{
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+}
+
+int TlsClient::read(uint8_t *buf, size_t size)
+{
+    if (fill() < 0 || size == 0)
+        return -1;
+
+    buf[0] = (uint8_t)peeked;
+    peeked = -1;
+    size_t got = 1;
+    if (got < size)
+    {
+        int n = mbedtls_ssl_read(&ssl, buf + got, size - got);
+        if (n > 0)
+            got += n;
+        else if (!retry(n))
+            stop();
+    }
+    return got;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+#include <esp_tls.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+
+// Largest serialized session kept in RTC memory. mbedTLS keeps the peer
+// certificate in the session by default, so this is mostly the broker cert.
+constexpr size_t TLS_SESSION_SAVE_SIZE = 2048;
+constexpr int TLS_CONNECT_TIMEOUT_MS = 10000;
+constexpr unsigned long TLS_WRITE_TIMEOUT_MS = 5000;
+
+// MQTT transport over mbedTLS. Unlike WiFiClientSecure it keeps the TLS
+// session of the last connection and offers it on the next one, so a
+// reconnect is an abbreviated handshake (no certificate exchange, no key
+// agreement). The session is also kept in RTC memory for warm resets.
+// mbedTLS is driven directly rather than through ESP-TLS, whose session
+// API needs CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS, which the prebuilt
+// Arduino core does not enable. The configuration and the parsed CA are
+// set up once and shared by every connection.
+class TlsClient : public Client
+{
+public:
+    // `caPem` must be NUL-terminated and outlive the client (in flash).
+    void begin(const char *caPem);
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char *host, uint16_t port) override;
+    size_t write(uint8_t b) override { return write(&b, 1); }
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t *buf, size_t size) override;
+    int peek() override;
+    void flush() override {}
+    void stop() override;
+    uint8_t connected() override { return open; }
+    operator bool() override { return open; }
+
+private:
+    struct SavedSession
+    {
+        uint32_t magic;
+        uint32_t length;
+        uint8_t data[TLS_SESSION_SAVE_SIZE];
+        uint32_t crc;
+    };
+    static SavedSession saved;
+
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_x509_crt ca;
+    mbedtls_ssl_config conf;
+    mbedtls_ssl_context ssl;
+    mbedtls_net_context net;
+    mbedtls_ssl_session session; // Offered on the next connect when `haveSession`
+    bool configured = false;
+    bool haveSession = false;
+    bool open = false;
+    int peeked = -1;
+
+    bool handshake(const char *host, unsigned long started);
+    void keepSession();
+    void restoreSession();
+    int fill();
+    bool retry(int ret) const { return ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE; }
+};
@@ -3,58 +3,198 @@
 #include <Arduino.h>
 #include <math.h>
 
-enum class CommandType
+constexpr size_t OTA_URL_MAX_LENGTH = 256;
+constexpr size_t SHA256_SIZE = 32;
+// DS18B20 probes read from the OneWire bus; extra probes are ignored.
+constexpr uint8_t MAX_TEMP_SENSORS = 4;
+// Light zones and pumps; one LEDC channel per PWM output on the S3.
+constexpr uint8_t MAX_ACTUATOR_CHANNELS = 8;
+// DeviceCommand::channel when the command did not name one.
+constexpr uint8_t DEFAULT_CHANNEL = 0xFF;
+// Light fade times; DeviceCommand::transitionMs when the command did not
+// set one.
+constexpr uint16_t MAX_TRANSITION_MS = 60000;
+constexpr uint16_t DEFAULT_TRANSITION = 0xFFFF;
+// Client-chosen command id, e.g. a UUID, including the terminator.
+constexpr size_t COMMAND_ID_SIZE = 40;
+// DeviceCommand::origin of commands that arrived over MQTT.
+constexpr uint8_t ORIGIN_MQTT = 0xFF;
+// Local rules and the size of their encoded program (see rule_engine.h).
+constexpr uint8_t MAX_RULES = 16;
+constexpr size_t RULE_PROGRAM_MAX_SIZE = 16 + MAX_RULES * 10;
+// Commands in one batch (a JSON array), applied together or not at all.
+constexpr uint8_t MAX_BATCH_COMMANDS = 7;
+// Groups a tower can belong to; ids are letters, digits, '-' and '_',
+// including the terminator.
+constexpr uint8_t MAX_GROUPS = 4;
+constexpr size_t GROUP_ID_SIZE = 24;
+// Token LAN WebSocket clients present; URL-safe characters, including the
+// terminator.
+constexpr size_t LAN_TOKEN_MIN_LENGTH = 16;
+constexpr size_t LAN_TOKEN_SIZE = 65;
+
+// Values are also the command codes of the binary protocol; append only.
+enum class CommandType : uint8_t
+{
+  SetBrightness = 0,
+  TriggerIrrigation = 1,
+  IrrigationCycle = 2,
+  LightCycle = 3,
+  OtaUpdate = 4,
+  SetWireFormat = 5,
+  GetMetrics = 6,
+  SetRules = 7,
+  SetGroups = 8,
+  SetLanToken = 9
+};
+
+enum class WireFormat : uint8_t
+{
+  Json = 0,
+  Binary = 1
+};
+
+struct ChannelState
 {
-  SetBrightness,
-  TriggerIrrigation,
-  IrrigationCycle,
-  LightCycle,
-  OtaUpdate
+  uint8_t level = 0; // Percent; relays are either 0 or 100
+  bool cycleActive = false;
+  unsigned long cycleOnSeconds = 0;
+  unsigned long cycleOffSeconds = 0;
+  // Unix time some on phase of the running cycle began, 0 if the clock was
+  // unknown. Persisted to keep the phase across reboots; not broadcast.
+  uint32_t cycleAnchor = 0;
+  // A rule holds the output below `level`. Broadcast, not persisted.
+  bool capped = false;
 };
 
 struct DeviceState
 {
-  int brightness = 0;
-  bool irrigationActive = false;
-  bool irrigationCycleActive = false;
-  unsigned long irrigationCycleOnSeconds = 0;
-  unsigned long irrigationCycleOffSeconds = 0;
-  bool lightCycleActive = false;
-  unsigned long lightCycleOnSeconds = 0;
-  unsigned long lightCycleOffSeconds = 0;
-  float temperatureC = NAN;
+  uint8_t channelCount = 0;
+  ChannelState channels[MAX_ACTUATOR_CHANNELS];
+  float temperatureC = NAN; // First probe, kept for single-sensor clients
+  uint8_t temperatureSensorCount = 0;
+  float temperaturesC[MAX_TEMP_SENSORS] = {NAN, NAN, NAN, NAN};
   bool waterEmpty = false;
 };
 
 struct DeviceCommand
 {
   CommandType type = CommandType::SetBrightness;
+  uint8_t channel = DEFAULT_CHANNEL;
   int brightness = 0;
   unsigned long irrigationDurationSeconds = 0;
-  unsigned long irrigationCycleOnSeconds = 0;
-  unsigned long irrigationCycleOffSeconds = 0;
-  unsigned long lightCycleOnSeconds = 0;
-  unsigned long lightCycleOffSeconds = 0;
-  String otaUrl;
+  unsigned long cycleOnSeconds = 0;
+  unsigned long cycleOffSeconds = 0;
+  uint16_t transitionMs = DEFAULT_TRANSITION; // Light fade time
+  char otaUrl[OTA_URL_MAX_LENGTH] = {};
+  // Expected digest of the image the update ends up writing
+  uint8_t otaSha256[SHA256_SIZE] = {};
+  WireFormat wireFormat = WireFormat::Json;
+  uint8_t rules[RULE_PROGRAM_MAX_SIZE] = {};
+  uint8_t rulesLength = 0;
+  char groups[MAX_GROUPS][GROUP_ID_SIZE] = {};
+  uint8_t groupCount = 0;
+  char lanToken[LAN_TOKEN_SIZE] = {}; // Empty opens the LAN again
+  // Empty unless the sender wants an ack
+  char id[COMMAND_ID_SIZE] = {};
+  uint8_t origin = ORIGIN_MQTT; // Otherwise the WebSocket client number
+  uint64_t receivedAt = 0;      // monotonicMicros() when it arrived
+  // The first command of a batch holds its size and the rest follow it in
+  // the queue with 0; a lone command is a batch of 1
+  uint8_t batchSize = 1;
 };
 
-inline bool operator==(const DeviceState &lhs, const DeviceState &rhs)
+enum class AckStatus : uint8_t
 {
-  const bool tempsEqual = isnan(lhs.temperatureC) ? isnan(rhs.temperatureC) : fabs(lhs.temperatureC - rhs.temperatureC) < 0.01f;
+  Applied,   // Executed; the ack carries the channel's resulting state
+  Accepted,  // Started but finishes later (OTA)
+  Rejected,  // Invalid, unknown channel, or no room to queue it
+  Duplicate  // Id seen recently; not executed again
+};
 
-  return lhs.brightness == rhs.brightness &&
-         lhs.irrigationActive == rhs.irrigationActive &&
-         lhs.irrigationCycleActive == rhs.irrigationCycleActive &&
-         lhs.irrigationCycleOnSeconds == rhs.irrigationCycleOnSeconds &&
-         lhs.irrigationCycleOffSeconds == rhs.irrigationCycleOffSeconds &&
-         lhs.lightCycleActive == rhs.lightCycleActive &&
-         lhs.lightCycleOnSeconds == rhs.lightCycleOnSeconds &&
-         lhs.lightCycleOffSeconds == rhs.lightCycleOffSeconds &&
-         lhs.waterEmpty == rhs.waterEmpty &&
-         tempsEqual;
+// Control -> network answer to a DeviceCommand that carried an id.
+struct CommandAck
+{
+  char id[COMMAND_ID_SIZE] = {};
+  uint8_t origin = ORIGIN_MQTT;
+  AckStatus status = AckStatus::Applied;
+  uint8_t channel = DEFAULT_CHANNEL; // DEFAULT_CHANNEL when there is no state
+  ChannelState state;
+};
+
+// One bit per DeviceState field, used to send only what changed.
+namespace StateField
+{
+  // Bits 0-7: one per actuator channel
+  constexpr uint16_t channel(uint8_t index) { return 1 << index; }
+  constexpr uint16_t Channels = (1 << MAX_ACTUATOR_CHANNELS) - 1;
+  constexpr uint16_t TemperatureC = 1 << 8;
+  constexpr uint16_t WaterEmpty = 1 << 9;
+  constexpr uint16_t Temperatures = 1 << 10;
+  constexpr uint16_t All = (1 << 11) - 1;
 }
 
-inline bool operator!=(const DeviceState &lhs, const DeviceState &rhs)
+static_assert(MAX_ACTUATOR_CHANNELS <= 8, "StateField reserves 8 channel bits");
+
+inline bool validGroupId(const char *id, size_t length)
 {
-  return !(lhs == rhs);
+  if (length == 0 || length >= GROUP_ID_SIZE)
+    return false;
+  for (size_t i = 0; i < length; i++)
+  {
+    if (!isalnum((unsigned char)id[i]) && id[i] != '-' && id[i] != '_')
+      return false;
+  }
+  return true;
+}
+
+// Empty (no token) or LAN_TOKEN_MIN_LENGTH and up of URL-unreserved
+// characters, so it can be passed in a query string as is.
+inline bool validLanToken(const char *token, size_t length)
+{
+  if (length == 0)
+    return true;
+  if (length < LAN_TOKEN_MIN_LENGTH || length >= LAN_TOKEN_SIZE)
+    return false;
+  for (size_t i = 0; i < length; i++)
+  {
+    const char c = token[i];
+    if (!isalnum((unsigned char)c) && c != '-' && c != '_' && c != '.' && c != '~')
+      return false;
+  }
+  return true;
+}
+
+inline bool sameTemperature(float lhs, float rhs)
+{
+  return isnan(lhs) ? isnan(rhs) : fabs(lhs - rhs) < 0.01f;
+}
+
+inline bool sameChannel(const ChannelState &lhs, const ChannelState &rhs)
+{
+  return lhs.level == rhs.level && lhs.cycleActive == rhs.cycleActive &&
+         lhs.cycleOnSeconds == rhs.cycleOnSeconds && lhs.cycleOffSeconds == rhs.cycleOffSeconds &&
+         lhs.capped == rhs.capped;
+}
+
+// Returns the StateField bits of every field that differs between the two states.
+inline uint16_t dirtyFields(const DeviceState &lhs, const DeviceState &rhs)
+{
+  bool temperaturesEqual = lhs.temperatureSensorCount == rhs.temperatureSensorCount;
+  for (uint8_t i = 0; temperaturesEqual && i < lhs.temperatureSensorCount; i++)
+    temperaturesEqual = sameTemperature(lhs.temperaturesC[i], rhs.temperaturesC[i]);
+
+  uint16_t dirty = 0;
+  for (uint8_t i = 0; i < rhs.channelCount; i++)
+  {
+    if (i >= lhs.channelCount || !sameChannel(lhs.channels[i], rhs.channels[i]))
+      dirty |= StateField::channel(i);
+  }
+  if (!sameTemperature(lhs.temperatureC, rhs.temperatureC))
+    dirty |= StateField::TemperatureC;
+  if (lhs.waterEmpty != rhs.waterEmpty)
+    dirty |= StateField::WaterEmpty;
+  if (!temperaturesEqual)
+    dirty |= StateField::Temperatures;
+  return dirty;
 }
@@ -9,7 +9,14 @@ const MQTT_CONFIG = {
     password: process.env.MQTT_PASSWORD!,
   },
   // Unified Subscription
-  subscriptions: ["ortus/+/presence", "ortus/+/state", "ortus/+/status"],
+  subscriptions: [
+    "ortus/+/presence",
+    "ortus/+/state",
+    "ortus/+/state/patch",
+    "ortus/+/state/bin",
+    "ortus/+/state/patch/bin",
+    "ortus/+/status",
+  ],
 };
 
 export const mqttClient: MqttClient = mqtt.connect(
@@ -43,9 +50,13 @@ const presenceSchema = z.object({
   ip: z.string().optional(),
   mac: z.string(),
   uptime: z.number().optional(),
+  channels: z.array(z.string()).optional(),
 });
 
+// Full snapshots arrive on ortus/{mac}/state, changed fields only on
+// ortus/{mac}/state/patch. Both share this schema.
 const stateSchema = z.object({
+  seq: z.number().optional(),
   brightness: z.number().optional(),
   irrigationActive: z.boolean().optional(),
   fanActive: z.boolean().optional(),
@@ -56,15 +67,56 @@ const stateSchema = z.object({
 type PresencePayload = z.infer<typeof presenceSchema>;
 type StatePayload = z.infer<typeof stateSchema>;
 
+// Binary state frames, sent instead of JSON once a device is switched to
+// the binary wire format (see ortus/src/binary_protocol.h). Channels carry
+// no names, so they are mapped like the JSON names: the first "pwm"
+// channel is the brightness, the first "relay" one irrigation. The kinds
+// come from the device's presence; until then the stock layout is assumed.
+const BINARY_PROTOCOL_VERSION = 3;
+const BINARY_CHANNEL_SIZE = 10;
+const FIELD_TEMPERATURE = 1 << 8;
+const FIELD_WATER_EMPTY = 1 << 9;
+const TEMPERATURE_UNKNOWN = -32768;
+const DEFAULT_CHANNEL_KINDS = ["pwm", "relay"];
+const channelKinds = new Map<string, string[]>();
+
+function decodeBinaryState(frame: Buffer, kinds: string[]): StatePayload | undefined {
+  if (frame.length < 8 || frame[0] !== BINARY_PROTOCOL_VERSION) return undefined;
+  const fields = frame.readUInt16LE(6);
+  const state: StatePayload = { seq: frame.readUInt32LE(2) };
+  let at = 8;
+  try {
+    for (let i = 0; i < 8; i++) {
+      if (!(fields & (1 << i))) continue;
+      const level = frame.readUInt8(at);
+      at += BINARY_CHANNEL_SIZE;
+      if (i === kinds.indexOf("pwm")) state.brightness = level;
+      else if (i === kinds.indexOf("relay")) state.irrigationActive = level > 0;
+    }
+    if (fields & FIELD_TEMPERATURE) {
+      const hundredths = frame.readInt16LE(at);
+      at += 2;
+      state.temperature = hundredths === TEMPERATURE_UNKNOWN ? null : hundredths / 100;
+    }
+    if (fields & FIELD_WATER_EMPTY) {
+      state.waterEmpty = frame.readUInt8(at) !== 0;
+    }
+  } catch {
+    return undefined; // Truncated
+  }
+  return state;
+}
+
 mqttClient.on("message", async (topic, payload) => {
   try {
     const raw = payload.toString();
     const parts = topic.split("/");
-    // Expected topic: ortus/{mac}/{type}
-    if (parts.length !== 3 || parts[0] !== "ortus") return;
+    // Expected topic: ortus/{mac}/{type}, or ortus/{mac}/state/patch, each
+    // state topic also with /bin
+    if (parts.length < 3 || parts.length > 5 || parts[0] !== "ortus") return;
 
     const mac = parts[1];
-    const type = parts[2];
+    const type = parts.slice(2).join("/");
 
     if (type === "status") {
       const isOnline = raw === "online";
@@ -81,6 +133,7 @@ mqttClient.on("message", async (topic, payload) => {
     else if (type === "presence") {
       const data = safeJSON<PresencePayload>(raw);
       if (!data) return;
+      if (data.channels) channelKinds.set(mac, data.channels);
       
       await db.updateTable("devices")
         .set({
@@ -93,8 +146,11 @@ mqttClient.on("message", async (topic, payload) => {
         
       console.log(`[Presence] ${mac} is online at ${data.ip}`);
     } 
-    else if (type === "state") {
-      const data = safeJSON<StatePayload>(raw);
+    else if (type === "state" || type === "state/patch" || type === "state/bin" || type === "state/patch/bin") {
+      // An empty retained message clears the snapshot in the format not in use
+      const data = type.endsWith("/bin")
+        ? decodeBinaryState(payload, channelKinds.get(mac) ?? DEFAULT_CHANNEL_KINDS)
+        : safeJSON<StatePayload>(raw);
       if (!data) return;
 
       // Update Timeseries & Notifications